@@ -39,11 +39,13 @@
 #include <atalk/fce_api.h>
 #include <atalk/globals.h>
 #include <atalk/netatalk_conf.h>
+#include <atalk/afpstats.h>
 
 #include "switch.h"
 #include "auth.h"
 #include "fork.h"
 #include "dircache.h"
+#include "shmcache.h"
 
 #ifndef SOL_TCP
 #define SOL_TCP IPPROTO_TCP
@@ -73,11 +75,43 @@ typedef struct {
 static rc_elem_t replaycache[REPLAYCACHE_SIZE];
 
 static sigjmp_buf recon_jmp;
+
+/*!
+ * Pass the statistics recorded since the last update to the master ("stats socket")
+ *
+ * @param obj    (r) handle
+ * @param force  (r) send now, else only after AFPSTATS_INTERVAL seconds
+ */
+static void afp_dsi_stats(AFPObj *obj, int force)
+{
+    static off_t read_count, write_count;
+    static unsigned long long dc_lookups, dc_hits;
+    unsigned long long lookups, hits;
+    DSI *dsi = obj->dsi;
+
+    if (!afpstats_enabled || obj->ipc_fd == -1 || (!force && !afpstats_due()))
+        return;
+
+    afpstats_count(AFPSTATS_RECEIVED, dsi->read_count - read_count);
+    afpstats_count(AFPSTATS_SENT, dsi->write_count - write_count);
+    read_count = dsi->read_count;
+    write_count = dsi->write_count;
+
+    dircache_counters(&lookups, &hits);
+    afpstats_count(AFPSTATS_DC_LOOKUPS, lookups - dc_lookups);
+    afpstats_count(AFPSTATS_DC_HITS, hits - dc_hits);
+    dc_lookups = lookups;
+    dc_hits = hits;
+
+    afpstats_send(obj->ipc_fd);
+}
+
 static void afp_dsi_close(AFPObj *obj)
 {
     DSI *dsi = obj->dsi;
     sigset_t sigs;
     
+    afp_dsi_stats(obj, 1);
     close(obj->ipc_fd);
     obj->ipc_fd = -1;
 
@@ -104,6 +138,7 @@ static void afp_dsi_close(AFPObj *obj)
     LOG(log_note, logtype_afpd, "AFP statistics: %.2f KB read, %.2f KB written",
         dsi->read_count/1024.0, dsi->write_count/1024.0);
     log_dircache_stat();
+    log_shmcache_stat();
 
     dsi_close(dsi);
 }
@@ -454,6 +489,7 @@ void afp_over_dsi(AFPObj *obj)
     int rc_idx;
     uint32_t err, cmd;
     uint8_t function;
+    struct timespec start;
 
     AFPobj = obj;
     obj->exit = afp_dsi_die;
@@ -463,7 +499,8 @@ void afp_over_dsi(AFPObj *obj)
 
     afp_over_dsi_sighandlers(obj);
 
-    if (dircache_init(obj->options.dircachesize) != 0)
+    if (dircache_init(obj->options.dircachesize, obj->options.dircachefiles,
+                      obj->options.flags & OPTION_DCNOTIFY, obj->options.dircacheneg) != 0)
         afp_dsi_die(EXITERR_SYS);
 
     /* set TCP snd/rcv buf */
@@ -557,6 +594,7 @@ void afp_over_dsi(AFPObj *obj)
 
             dircache_dump();
             uuidcache_dump();
+            dsi_buffer_dump(dsi);
 
             if (debugging) {
                 if (obj->options.logconfig)
@@ -623,14 +661,19 @@ void afp_over_dsi(AFPObj *obj)
 
                     LOG(log_debug, logtype_afpd, "<== Start AFP command: %s", AfpNum2name(function));
 
+                    if (afpstats_enabled)
+                        afpstats_start(&start);
                     err = (*afp_switch[function])(obj,
                                                   (char *)dsi->commands, dsi->cmdlen,
                                                   (char *)&dsi->data, &dsi->datalen);
+                    if (afpstats_enabled)
+                        afpstats_record(function, &start);
 
                     LOG(log_debug, logtype_afpd, "==> Finished AFP command: %s -> %s",
                         AfpNum2name(function), AfpErr2name(err));
 
                     dir_free_invalid_q();
+                    dircache_next_command();
 
                     dsi->flags &= ~DSI_RUNNING;
 
@@ -664,9 +707,13 @@ void afp_over_dsi(AFPObj *obj)
 
                 LOG(log_debug, logtype_afpd, "<== Start AFP command: %s", AfpNum2name(function));
 
+                if (afpstats_enabled)
+                    afpstats_start(&start);
                 err = (*afp_switch[function])(obj,
                                               (char *)dsi->commands, dsi->cmdlen,
                                               (char *)&dsi->data, &dsi->datalen);
+                if (afpstats_enabled)
+                    afpstats_record(function, &start);
 
                 LOG(log_debug, logtype_afpd, "==> Finished AFP command: %s -> %s",
                     AfpNum2name(function), AfpErr2name(err));
@@ -700,6 +747,7 @@ void afp_over_dsi(AFPObj *obj)
         pending_request(dsi);
 
         fce_pending_events(obj);
+        afp_dsi_stats(obj, 0);
     }
 
     /* error */
@@ -464,6 +464,60 @@ static int rslt_add (const AFPObj *obj, struct vol *vol, struct path *path, char
 #define VETO_STR \
         "./../.AppleDouble/.AppleDB/Network Trash Folder/TheVolumeSettingsFolder/TheFindByContentFolder/.AppleDesktop/.Parent/"
 
+/*!
+ * Read ahead the next entries of a directory and look up the CNIDs of the
+ * subdirectories that dir_add() will need with one request, then go back
+ *
+ * @returns number of entries read ahead
+ */
+static int prefetch_subdirs(struct vol *vol, struct dir *dir, DIR *dp)
+{
+    static char names[CNID_BATCH_MAX][MAXNAMLEN + 1];
+    static struct stat st[CNID_BATCH_MAX];
+    struct cnid_batch batch[CNID_BATCH_MAX];
+    struct dirent *de;
+    size_t len;
+    long loc;
+    int i, n = 0;
+
+    if (vol->v_cdb == NULL || vol->v_cdb->cnid_lookup_batch == NULL)
+        return CNID_BATCH_MAX;
+
+    loc = telldir(dp);
+    for (i = 0; i < CNID_BATCH_MAX && (de = readdir(dp)) != NULL; i++) {
+        if (!check_dirent(vol, de->d_name))
+            continue;
+#ifdef DT_DIR
+        if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+            continue;
+#endif
+        if ((len = strlen(de->d_name)) > MAXNAMLEN
+            || ostat(de->d_name, &st[n], vol_syml_opt(vol)) != 0
+            || !S_ISDIR(st[n].st_mode))
+            continue;
+        memcpy(names[n], de->d_name, len + 1);
+        batch[n].st = &st[n];
+        batch[n].name = names[n];
+        batch[n].len = len;
+        n++;
+    }
+    seekdir(dp, loc);
+
+    if (n)
+        prefetch_ids(vol, dir, batch, n);
+    return i;
+}
+
+/* readdir() with the read ahead above every CNID_BATCH_MAX entries */
+static struct dirent *next_dirent(struct vol *vol, struct dir *dir, DIR *dp, int *ahead)
+{
+    if (*ahead == 0)
+        *ahead = prefetch_subdirs(vol, dir, dp);
+    if (*ahead > 0)
+        (*ahead)--;
+    return readdir(dp);
+}
+
 /*!
  * This function performs a filesystem search
  *
@@ -504,6 +558,7 @@ static int catsearch(const AFPObj *obj,
     int cwd = -1;
     int error;
     int unlen;
+    int ahead;
 
 	if (*pos != 0 && *pos != cur_pos) {
 		result = AFPERR_CATCHNG;
@@ -571,7 +626,8 @@ static int catsearch(const AFPObj *obj,
 		}
 
 		
-		while ((entry = readdir(dirpos)) != NULL) {
+		ahead = 0;
+		while ((entry = next_dirent(vol, currentdir, dirpos, &ahead)) != NULL) {
 			(*pos)++;
 
 			if (!check_dirent(vol, entry->d_name))
@@ -674,6 +730,7 @@ catsearch_pause:
 
 catsearch_end: /* Exiting catsearch: error condition */
 	*rsize = rrbuf - rbuf;
+    prefetch_ids_reset();
     if (cwd != -1) {
         if ((fchdir(cwd)) != 0) {
             LOG(log_debug, logtype_afpd, "error chdiring back: %s", strerror(errno));        
@@ -22,6 +22,11 @@
 #include <errno.h>
 #include <assert.h>
 #include <time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#endif
 
 #include <atalk/util.h>
 #include <atalk/cnid.h>
@@ -32,10 +37,11 @@
 #include <atalk/bstrlib.h>
 #include <atalk/bstradd.h>
 #include <atalk/globals.h>
+#include <atalk/slab.h>
 
 #include "dircache.h"
 #include "directory.h"
-#include "hash.h"
+#include "rhash.h"
 
 
 /*
@@ -69,7 +75,7 @@
  *   (8) finally added to the cache with dircache_add()
  * (2) of course does contain the steps 6,7 and 8.
  *
- * The dircache is a LRU cache, whenever it fills up we call dircache_evict internally which removes
+ * Whenever the cache fills up we call dircache_evict internally which removes
  * DIRCACHE_FREE_QUANTUM elements from the cache.
  *
  * There is only one cache for all volumes, so of course we use the volume id in hashing calculations.
@@ -94,9 +100,62 @@
  * It is a hashtable which we use to store "struct dir"s in. If the cache get full, oldest
  * entries are evicted in chunks of DIRCACHE_FREE.
  *
+ * All hashtables are open addressing tables (cf rhash.c) that start small and grow
+ * incrementally with the cache.
+ *
  * We have/need two indexes:
  * - a DID/name index on the main dircache, another hashtable
- * - a queue index on the dircache, for evicting the oldest entries
+ * - a queue index on the dircache, for evicting entries
+ *
+ * Replacement policy
+ * ==================
+ *
+ * A plain LRU is flushed by every crawl of a large tree (FPCatSearch, Spotlight, backups),
+ * so we use 2Q, separately for directories and files, which each get their share of the
+ * cache size ("dircache files" sets the percentage for files):
+ * - new entries go to the "in" queue, a FIFO of at most a quarter of the budget
+ * - entries evicted from the "in" queue leave their CNID in a "ghost" queue of half the
+ *   budget, that costs a few bytes per entry
+ * - an entry that is added again while its ghost is still around goes to the "main"
+ *   queue, a LRU where hits move the entry to the tail
+ * Entries that are only ever seen once by a scan thus pass through the "in" queue without
+ * touching the directories the user is actually working in.
+ *
+ * Invalidation by inotify
+ * =======================
+ *
+ * With "dircache notify" cache hits don't stat the entry. Instead directories that are
+ * the parent of a looked up entry get an inotify watch and the events are read once per
+ * AFP command, before the first lookup:
+ * - every entry has a sequence number from a counter that is incremented whenever an
+ *   entry is added or validated by stat, or a watch is added
+ * - an entry is trusted if its number is larger than that of its parents watch and
+ *   the same holds for its parent and so on up to the volume root, so renaming a
+ *   directory invalidates everything below it
+ * - an event for a name in a watched directory sets the number of the entry to 0,
+ *   which makes the next lookup fall back to stat, an overflow of the event queue
+ *   invalidates all entries
+ * Directories on network and cluster filesystems (NFS, SMB, FUSE, ...), where changes
+ * by other clients don't generate events, never get a watch and use the stat path.
+ *
+ * Missing names
+ * =============
+ *
+ * Clients probe many names that don't exist (.DS_Store, ._ files, temporary names), each
+ * costing a failed stat in cname(). With "dircache negative" such names are remembered in
+ * a LRU of limited size, keyed by volume, parent DID and name. An entry is used when
+ * - the parent is watched and unchanged ("dircache notify"), events for the name remove
+ *   the entry, or
+ * - the parent has been checked with stat in the same AFP command, which happens for every
+ *   directory found in the dircache, and its ctime is still the one stored in the entry
+ * Entries are also removed when the name is added to the dircache.
+ *
+ * Memory
+ * ======
+ *
+ * struct dir (with inline storage for short names, cf dir_new()) and the ghosts come from
+ * slabs and the hashtables store pointers in their slots, so filling and evicting the
+ * cache doesn't churn and fragment the heap of long running sessions.
  *
  * Debugging
  * =========
@@ -111,7 +170,7 @@
 /*****************************
  *       the dircache        */
 
-static hash_t       *dircache;        /* The actual cache */
+static rhash_t      *dircache;        /* The actual cache */
 static unsigned int dircache_maxsize; /* cache maximum size */
 
 static struct dircache_stat {
@@ -122,13 +181,20 @@ static struct dircache_stat {
     unsigned long long removed;
     unsigned long long expunged;
     unsigned long long evicted;
+    unsigned long long ghosthits;
+    unsigned long long unchecked;     /* hits without stat, "dircache notify" */
+    unsigned long long events;
+    unsigned long long overflows;
+    unsigned long long neghits;       /* names known to be missing, "dircache negative" */
+    unsigned long long negadded;
+    unsigned long long negstale;
 } dircache_stat;
 
 /* FNV 1a */
-static hash_val_t hash_vid_did(const void *key)
+static uint32_t hash_vid_did(const void *key)
 {
     const struct dir *k = (const struct dir *)key;
-    hash_val_t hash = 2166136261;
+    uint32_t hash = 2166136261U;
 
     hash ^= k->d_vid >> 8;
     hash *= 16777619;
@@ -158,7 +224,7 @@ static int hash_comp_vid_did(const void *key1, const void *key2)
 /**************************************************
  * DID/name index on dircache (another hashtable) */
 
-static hash_t *index_didname;
+static rhash_t *index_didname;
 
 #undef get16bits
 #if (defined(__GNUC__) && defined(__i386__)) || defined(__WATCOMC__)    \
@@ -171,13 +237,13 @@ static hash_t *index_didname;
                       +(uint32_t)(((const uint8_t *)(d))[0]) )
 #endif
 
-static hash_val_t hash_didname(const void *p)
+static uint32_t hash_didname(const void *p)
 {
     const struct dir *key = (const struct dir *)p;
     const unsigned char *data = key->d_u_name->data;
     int len = key->d_u_name->slen;
-    hash_val_t hash = key->d_pdid + key->d_vid;
-    hash_val_t tmp;
+    uint32_t hash = key->d_pdid + key->d_vid;
+    uint32_t tmp;
 
     int rem = len & 3;
     len >>= 2;
@@ -231,52 +297,480 @@ static int hash_comp_didname(const void *k1, const void *k2)
 /***************************
  * queue index on dircache */
 
-static q_t *index_queue;    /* the index itself */
-static unsigned long queue_count;
+#define DCQ_IN   0                  /* FIFO of entries seen once */
+#define DCQ_MAIN 1                  /* LRU of entries seen again */
+
+struct dcclass {
+    const char    *name;
+    q_t           *queue[2];
+    unsigned long count[2];
+    unsigned long maxsize;          /* budget for this class */
+    q_t           *ghostq;          /* FIFO of struct dcghost */
+    unsigned long ghostcount;
+};
+
+/* CNID of an entry recently evicted from the "in" queue */
+struct dcghost {
+    cnid_t         did;
+    uint16_t       vid;
+    qnode_t        *qidx_node;
+    struct dcclass *class;
+};
+
+static struct dcclass dcdirs = { "dirs" }, dcfiles = { "files" };
+static unsigned long queue_count;   /* entries in all queues */
+static rhash_t *index_ghost;
+static slab_t ghostslab;
+
+#define DCCLASS(dir) (((dir)->d_flags & DIRF_ISFILE) ? &dcfiles : &dcdirs)
+
+static uint32_t hash_ghost(const void *key)
+{
+    const struct dcghost *k = key;
+    struct dir d;
+
+    d.d_vid = k->vid;
+    d.d_did = k->did;
+    return hash_vid_did(&d);
+}
+
+static int hash_comp_ghost(const void *key1, const void *key2)
+{
+    const struct dcghost *k1 = key1;
+    const struct dcghost *k2 = key2;
+
+    return !(k1->did == k2->did && k1->vid == k2->vid);
+}
+
+/* move a queued node to the tail of a queue */
+static void requeue(q_t *q, qnode_t *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+
+    node->next = q;
+    node->prev = q->prev;
+    q->prev->next = node;
+    q->prev = node;
+}
+
+static void ghost_remove(struct dcghost *ghost)
+{
+    dequeue(ghost->qidx_node->prev);
+    ghost->class->ghostcount--;
+    rhash_remove(index_ghost, ghost);
+    slab_free(&ghostslab, ghost);
+}
+
+/*!
+ * @brief Remember the CNID of an entry evicted from the "in" queue
+ */
+static void ghost_add(struct dcclass *class, const struct dir *dir)
+{
+    struct dcghost *ghost;
+
+    while (class->ghostcount >= class->maxsize / 2) {
+        ghost = class->ghostq->next->data;
+        ghost_remove(ghost);
+    }
+
+    if ((ghost = slab_alloc(&ghostslab)) == NULL)
+        return;
+    ghost->vid = dir->d_vid;
+    ghost->did = dir->d_did;
+    ghost->class = class;
+    if (rhash_lookup(index_ghost, ghost) || (ghost->qidx_node = enqueue(class->ghostq, ghost)) == NULL) {
+        slab_free(&ghostslab, ghost);
+        return;
+    }
+    if (rhash_insert(index_ghost, ghost) != 0) {
+        dequeue(ghost->qidx_node->prev);
+        slab_free(&ghostslab, ghost);
+        return;
+    }
+    class->ghostcount++;
+}
+
+/*!
+ * @brief Check and forget whether a CNID was evicted from the "in" queue recently
+ */
+static int ghost_hit(const struct dir *dir)
+{
+    struct dcghost key, *ghost;
+
+    key.vid = dir->d_vid;
+    key.did = dir->d_did;
+    if ((ghost = rhash_lookup(index_ghost, &key)) == NULL)
+        return 0;
+    ghost_remove(ghost);
+    return 1;
+}
+
+/*!
+ * @brief Count a cache hit, hits in the "main" queue move the entry to its tail
+ */
+static void dircache_hit(struct dir *dir)
+{
+    dircache_stat.hits++;
+    if (dir->dcache_queue == DCQ_MAIN)
+        requeue(DCCLASS(dir)->queue[DCQ_MAIN], dir->qidx_node);
+}
 
 /*!
- * @brief Remove a fixed number of (oldest) entries from the cache and indexes
+ * @brief Remove a fixed number of entries from one class of the cache and indexes
  *
- * The default is to remove the 256 oldest entries from the cache.
- * 1. Get the oldest entry
+ * The default is to remove 256 entries. Entries are taken from the head of the
+ * "in" queue while it's larger than a quarter of the budget, then from the head of
+ * the "main" queue.
+ * 1. Get the next entry
  * 2. If it's in use ie open forks reference it or it's curdir requeue it,
  *    dont remove it
- * 3. Remove the dir from the main cache and the didname index
- * 4. Free the struct dir structure and all its members
+ * 3. Remember the CNID of entries from the "in" queue
+ * 4. Remove the dir from the main cache and the indexes
+ * 5. Free the struct dir structure and all its members
  */
-static void dircache_evict(void)
+static void dircache_evict(struct dcclass *class)
 {
     int i = DIRCACHE_FREE_QUANTUM;
+    int q;
     struct dir *dir;
 
-    LOG(log_debug, logtype_afpd, "dircache: {starting cache eviction}");
+    LOG(log_debug, logtype_afpd, "dircache: {starting cache eviction of %s}", class->name);
+
+    if (i > class->maxsize / 8)
+        i = class->maxsize / 8 + 1;
+    dircache_stat.evicted += i;
 
     while (i--) {
-        if ((dir = (struct dir *)dequeue(index_queue)) == NULL) { /* 1 */
+        if (class->count[DCQ_IN] > class->maxsize / 4 || class->count[DCQ_MAIN] == 0)
+            q = DCQ_IN;
+        else
+            q = DCQ_MAIN;
+
+        if (class->queue[q]->next == class->queue[q]) { /* 1 */
             dircache_dump();
             AFP_PANIC("dircache_evict");
         }
-        queue_count--;
+        dir = class->queue[q]->next->data;
 
         if (curdir == dir) {                          /* 2 */
-            if ((dir->qidx_node = enqueue(index_queue, dir)) == NULL) {
-                dircache_dump();
-                AFP_PANIC("dircache_evict");
-            }
-            queue_count++;
+            requeue(class->queue[q], dir->qidx_node);
             continue;
         }
 
-        dircache_remove(NULL, dir, DIRCACHE | DIDNAME_INDEX); /* 3 */
-        dir_free(dir);                                        /* 4 */
+        if (q == DCQ_IN)                              /* 3 */
+            ghost_add(class, dir);
+        dircache_remove(NULL, dir, DIRCACHE_ALL);     /* 4 */
+        dir_free(dir);                                /* 5 */
     }
 
-    AFP_ASSERT(queue_count == dircache->hash_nodecount);
-    dircache_stat.evicted += DIRCACHE_FREE_QUANTUM;
+    AFP_ASSERT(queue_count == rhash_count(dircache));
     LOG(log_debug, logtype_afpd, "dircache: {finished cache eviction}");
 }
 
 
+/******************************************
+ * missing names ("dircache negative") */
+
+/* a name that didn't exist in a directory */
+struct dcneg {
+    cnid_t            did;          /* parent DID */
+    uint16_t          vid;
+    time_t            ctime;        /* parent ctime, 0 if only valid with "dircache notify" */
+    unsigned long     seq;          /* when the entry was added */
+    qnode_t           *qidx_node;
+    struct tagbstring uname;
+    char              name[DIRCACHE_NEG_NAMELEN + 1];
+};
+
+static rhash_t       *index_neg;
+static q_t           *negq;         /* LRU of struct dcneg */
+static unsigned long neg_count, neg_maxsize;
+static slab_t        negslab;
+
+static uint32_t hash_neg(const void *key)
+{
+    const struct dcneg *k = key;
+    struct dir d;
+
+    d.d_vid = k->vid;
+    d.d_pdid = k->did;
+    d.d_u_name = (bstring)&k->uname;
+    return hash_didname(&d);
+}
+
+static int hash_comp_neg(const void *key1, const void *key2)
+{
+    const struct dcneg *k1 = key1;
+    const struct dcneg *k2 = key2;
+
+    return !(k1->did == k2->did && k1->vid == k2->vid && bstrcmp(&k1->uname, &k2->uname) == 0);
+}
+
+static void neg_remove(struct dcneg *neg)
+{
+    dequeue(neg->qidx_node->prev);
+    rhash_remove(index_neg, neg);
+    slab_free(&negslab, neg);
+    neg_count--;
+}
+
+/*!
+ * @brief Forget that a name is missing, called when it's created
+ */
+static void neg_forget(uint16_t vid, cnid_t did, const_bstring uname)
+{
+    struct dcneg key, *neg;
+
+    if (index_neg == NULL || neg_count == 0)
+        return;
+    key.vid = vid;
+    key.did = did;
+    key.uname = *uname;
+    if ((neg = rhash_lookup(index_neg, &key)))
+        neg_remove(neg);
+}
+
+
+/********************************
+ * inotify ("dircache notify") */
+
+static unsigned long notify_seq;      /* sequence counter */
+static unsigned long command_seq;     /* value of notify_seq when the AFP command started */
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define NOTIFY_MASK (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                     | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+static int           notify_fd = -1;
+static unsigned long notify_floor;    /* entries with a number up to this are invalid */
+static int           notify_read;     /* events have been read in this AFP command */
+static int           notify_full;     /* we ran out of inotify watches */
+static unsigned long notify_watches;
+static rhash_t       *index_wd;       /* watched directories by watch descriptor */
+
+/* filesystems where changes by other clients don't generate events */
+static const uint32_t notify_badfs[] = {
+    0x6969,                     /* NFS */
+    0x517b,                     /* SMB */
+    0xff534d42,                 /* CIFS */
+    0xfe534d42,                 /* SMB2 */
+    0x65735546,                 /* FUSE */
+    0x00c36400,                 /* Ceph */
+    0x5346414f,                 /* AFS */
+    0x73757245,                 /* Coda */
+    0x01021997,                 /* 9P */
+    0x01161970,                 /* GFS2 */
+    0x7461636f,                 /* OCFS2 */
+    0
+};
+
+static uint32_t hash_wd(const void *key)
+{
+    return (uint32_t)((const struct dir *)key)->dcache_wd * 2654435761U;
+}
+
+static int hash_comp_wd(const void *key1, const void *key2)
+{
+    return ((const struct dir *)key1)->dcache_wd != ((const struct dir *)key2)->dcache_wd;
+}
+
+/*!
+ * @brief Add an inotify watch to a directory, sets dcache_wd to -1 if that's not possible
+ */
+static void notify_watch(struct dir *dir)
+{
+    struct statfs sfs;
+    int wd, i;
+
+    dir->dcache_wd = -1;
+    if (notify_full || (dir->d_flags & DIRF_ISFILE))
+        return;
+
+    if (statfs(cfrombstr(dir->d_fullpath), &sfs) != 0)
+        return;
+    for (i = 0; notify_badfs[i]; i++) {
+        if ((uint32_t)sfs.f_type == notify_badfs[i])
+            return;
+    }
+
+    if ((wd = inotify_add_watch(notify_fd, cfrombstr(dir->d_fullpath), NOTIFY_MASK)) == -1) {
+        if (errno == ENOSPC) {
+            LOG(log_warning, logtype_afpd, "dircache notify: out of inotify watches (%lu), "
+                "check fs.inotify.max_user_watches", notify_watches);
+            notify_full = 1;
+        }
+        return;
+    }
+
+    /* the same directory is watched for another entry */
+    dir->dcache_wd = wd;
+    if (rhash_lookup(index_wd, dir)) {
+        dir->dcache_wd = -1;
+        return;
+    }
+    if (rhash_insert(index_wd, dir) != 0) {
+        inotify_rm_watch(notify_fd, wd);
+        dir->dcache_wd = -1;
+        return;
+    }
+    dir->dcache_wseq = ++notify_seq;
+    notify_watches++;
+}
+
+/*!
+ * @brief Invalidate cache entries affected by an event
+ */
+static void notify_event(const struct inotify_event *ev)
+{
+    struct dir key, *dir, *cdir;
+    static_bstring uname;
+
+    dircache_stat.events++;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        LOG(log_debug, logtype_afpd, "dircache notify: event queue overflow");
+        dircache_stat.overflows++;
+        notify_floor = ++notify_seq;
+        return;
+    }
+
+    key.dcache_wd = ev->wd;
+    if ((dir = rhash_lookup(index_wd, &key)) == NULL)
+        return;
+
+    if (ev->mask & IN_IGNORED) {
+        /* the watch is gone, the directory was deleted or its filesystem unmounted */
+        rhash_remove(index_wd, dir);
+        notify_watches--;
+        notify_full = 0;
+        dir->dcache_wd = -1;
+        dir->dcache_seq = 0;
+        return;
+    }
+
+    if (ev->len == 0 || ev->name[0] == 0) {
+        /* the directory itself */
+        if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+            dir->dcache_seq = 0;
+        if (ev->mask & IN_ATTRIB)
+            dir->d_rights_cache = 0xffffffff;
+        return;
+    }
+
+    btfromcstr(uname, ev->name);
+    neg_forget(dir->d_vid, dir->d_did, &uname);
+    key.d_vid = dir->d_vid;
+    key.d_pdid = dir->d_did;
+    key.d_u_name = &uname;
+    if ((cdir = rhash_lookup(index_didname, &key))) {
+        LOG(log_debug, logtype_afpd, "dircache notify(did:%u,\"%s\"): {changed}",
+            ntohl(dir->d_did), ev->name);
+        cdir->dcache_seq = 0;
+        if (ev->mask & IN_ATTRIB)
+            cdir->d_rights_cache = 0xffffffff;
+    }
+}
+
+/*!
+ * @brief Read all pending events
+ */
+static void notify_drain(void)
+{
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+
+    notify_read = 1;
+    while ((len = read(notify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            notify_event(ev);
+        }
+    }
+}
+
+/*!
+ * @brief Check whether a cache entry can be used without stat
+ *
+ * Walks up to the volume root, adding watches to parents that don't have one yet,
+ * so the next lookup can trust the entry once it has been validated by stat.
+ *
+ * @param vol      (r) volume
+ * @param dir      (r) cache entry
+ * @param parent   (r) parent directory if known, else NULL
+ *
+ * @returns 1 if the entry is valid, 0 if it must be checked with stat
+ */
+static int notify_trusted(const struct vol *vol, const struct dir *dir, struct dir *parent)
+{
+    struct dir key;
+    int trusted = 1;
+    int depth;
+
+    if (notify_fd == -1)
+        return 0;
+    if (!notify_read)
+        notify_drain();
+
+    for (depth = 0; depth < 256; depth++) {
+        if (parent == NULL) {
+            if (dir->d_pdid == DIRDID_ROOT) {
+                parent = vol->v_root;
+            } else {
+                key.d_vid = dir->d_vid;
+                key.d_did = dir->d_pdid;
+                if ((parent = rhash_lookup(dircache, &key)) == NULL)
+                    return 0;
+            }
+        }
+        if (parent->dcache_wd == 0)
+            notify_watch(parent);
+        if (dir->dcache_seq <= notify_floor
+            || parent->dcache_wd < 0
+            || dir->dcache_seq <= parent->dcache_wseq)
+            trusted = 0;
+        if (parent == vol->v_root)
+            return trusted;
+        dir = parent;
+        parent = NULL;
+    }
+    return 0;
+}
+
+#else /* !HAVE_SYS_INOTIFY_H */
+#define notify_trusted(vol, dir, parent) 0
+#endif /* HAVE_SYS_INOTIFY_H */
+
+#define NEG_CTIME  1                /* the parent has been checked with stat in this command */
+#define NEG_NOTIFY 2                /* the parent is watched and unchanged */
+
+/*!
+ * @brief Check how negative entries of a directory can be validated
+ *
+ * @returns NEG_NOTIFY, NEG_CTIME or 0 if the directory state is unknown
+ */
+static int neg_parent(const struct vol *vol, struct dir *dir)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    if (notify_fd != -1) {
+        if (!notify_read)
+            notify_drain();
+        if (dir->dcache_wd == 0)
+            notify_watch(dir);
+        if (dir->dcache_wd > 0 && (dir == vol->v_root || notify_trusted(vol, dir, NULL)))
+            return NEG_NOTIFY;
+    }
+#endif
+    /* the volume root isn't in the cache and never checked */
+    if (dir != vol->v_root && dir->dcache_seq > command_seq)
+        return NEG_CTIME;
+    return 0;
+}
+
+
 /********************************************************
  * Interface
  ********************************************************/
@@ -285,7 +779,8 @@ static void dircache_evict(void)
  * @brief Search the dircache via a CNID for a directory
  *
  * Found cache entries are expunged if both the parent directory st_ctime and the objects
- * st_ctime are modified.
+ * st_ctime are modified. With "dircache notify" entries that are known to be unchanged
+ * are returned without stat.
  * This func builds on the fact, that all our code only ever needs to and does search
  * the dircache by CNID expecting directories to be returned, but not files.
  * Thus
@@ -304,7 +799,6 @@ struct dir *dircache_search_by_did(const struct vol *vol, cnid_t cnid)
     struct dir *cdir = NULL;
     struct dir key;
     struct stat st;
-    hnode_t *hn;
 
     AFP_ASSERT(vol);
     AFP_ASSERT(ntohl(cnid) >= CNID_START);
@@ -312,8 +806,7 @@ struct dir *dircache_search_by_did(const struct vol *vol, cnid_t cnid)
     dircache_stat.lookups++;
     key.d_vid = vol->v_vid;
     key.d_did = cnid;
-    if ((hn = hash_lookup(dircache, &key)))
-        cdir = hnode_get(hn);
+    cdir = rhash_lookup(dircache, &key);
 
     if (cdir) {
         if (cdir->d_flags & DIRF_ISFILE) { /* (1) */
@@ -324,6 +817,13 @@ struct dir *dircache_search_by_did(const struct vol *vol, cnid_t cnid)
             return NULL;        /* (1b) */
 
         }
+        if (notify_trusted(vol, cdir, NULL)) {
+            LOG(log_debug, logtype_afpd, "dircache(cnid:%u): {cached, unchanged: path:\"%s\"}",
+                ntohl(cnid), cfrombstr(cdir->d_fullpath));
+            dircache_stat.unchecked++;
+            dircache_hit(cdir);
+            return cdir;
+        }
         if (lstat(cfrombstr(cdir->d_fullpath), &st) != 0) {
             LOG(log_debug, logtype_afpd, "dircache(cnid:%u): {missing:\"%s\"}",
                 ntohl(cnid), cfrombstr(cdir->d_fullpath));
@@ -340,7 +840,8 @@ struct dir *dircache_search_by_did(const struct vol *vol, cnid_t cnid)
         }
         LOG(log_debug, logtype_afpd, "dircache(cnid:%u): {cached: path:\"%s\"}",
             ntohl(cnid), cfrombstr(cdir->d_fullpath));
-        dircache_stat.hits++;
+        cdir->dcache_seq = ++notify_seq;
+        dircache_hit(cdir);
     } else {
         LOG(log_debug, logtype_afpd, "dircache(cnid:%u): {not in cache}", ntohl(cnid));
         dircache_stat.misses++;
@@ -353,7 +854,8 @@ struct dir *dircache_search_by_did(const struct vol *vol, cnid_t cnid)
  * @brief Search the cache via did/name hashtable
  *
  * Found cache entries are expunged if both the parent directory st_ctime and the objects
- * st_ctime are modified.
+ * st_ctime are modified. With "dircache notify" entries that are known to be unchanged
+ * are returned without stat.
  *
  * @param vol      (r) volume
  * @param dir      (r) directory
@@ -370,8 +872,6 @@ struct dir *dircache_search_by_name(const struct vol *vol,
     struct dir *cdir = NULL;
     struct dir key;
     struct stat st;
-
-    hnode_t *hn;
     static_bstring uname = {-1, len, (unsigned char *)name};
 
     AFP_ASSERT(vol);
@@ -389,11 +889,15 @@ struct dir *dircache_search_by_name(const struct vol *vol,
         key.d_pdid = dir->d_did;
         key.d_u_name = &uname;
 
-        if ((hn = hash_lookup(index_didname, &key)))
-            cdir = hnode_get(hn);
+        cdir = rhash_lookup(index_didname, &key);
     }
 
-    if (cdir) {
+    if (cdir && notify_trusted(vol, cdir, (struct dir *)dir)) {
+        LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {found in cache, unchanged}",
+            ntohl(dir->d_did), name);
+        dircache_stat.unchecked++;
+        dircache_hit(cdir);
+    } else if (cdir) {
         if (lstat(cfrombstr(cdir->d_fullpath), &st) != 0) {
             LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {missing:\"%s\"}",
                 ntohl(dir->d_did), name, cfrombstr(cdir->d_fullpath));
@@ -412,7 +916,8 @@ struct dir *dircache_search_by_name(const struct vol *vol,
         }
         LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {found in cache}",
             ntohl(dir->d_did), name);
-        dircache_stat.hits++;
+        cdir->dcache_seq = ++notify_seq;
+        dircache_hit(cdir);
     } else {
         LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {not in cache}",
             ntohl(dir->d_did), name);
@@ -422,6 +927,128 @@ struct dir *dircache_search_by_name(const struct vol *vol,
     return cdir;
 }
 
+/*!
+ * @brief Search the cache for a name that is known to be missing
+ *
+ * A name is known to be missing if the parent directory hasn't changed since the
+ * name was added, either according to inotify or to the parent's ctime which the
+ * dircache has checked with stat in this AFP command. Stale entries are removed.
+ *
+ * @param vol      (r) volume
+ * @param dir      (r) directory
+ * @param name     (r) name (server side encoding)
+ * @param len      (r) strlen of name
+ *
+ * @returns 1 if the name is known to be missing, else 0
+ */
+int dircache_search_negative(const struct vol *vol, struct dir *dir, char *name, int len)
+{
+    struct dcneg key, *neg;
+    int mode, valid = 0;
+
+    if (index_neg == NULL || neg_count == 0 || len > DIRCACHE_NEG_NAMELEN
+        || dir->d_did == DIRDID_ROOT_PARENT)
+        return 0;
+
+    /* first, as reading inotify events may remove entries */
+    if ((mode = neg_parent(vol, dir)) == 0)
+        return 0;
+
+    key.vid = vol->v_vid;
+    key.did = dir->d_did;
+    key.uname.mlen = -1;
+    key.uname.slen = len;
+    key.uname.data = (unsigned char *)name;
+    if ((neg = rhash_lookup(index_neg, &key)) == NULL)
+        return 0;
+
+    switch (mode) {
+#ifdef HAVE_SYS_INOTIFY_H
+    case NEG_NOTIFY:
+        valid = neg->seq > notify_floor && neg->seq > dir->dcache_wseq;
+        break;
+#endif
+    case NEG_CTIME:
+        valid = neg->ctime != 0 && neg->ctime == dir->dcache_ctime;
+        break;
+    }
+
+    if (!valid) {
+        LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {negative entry stale}",
+            ntohl(dir->d_did), name);
+        neg_remove(neg);
+        dircache_stat.negstale++;
+        return 0;
+    }
+
+    LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {known to be missing}",
+        ntohl(dir->d_did), name);
+    requeue(negq, neg->qidx_node);
+    dircache_stat.neghits++;
+    return 1;
+}
+
+/*!
+ * @brief Remember that a name doesn't exist in a directory
+ *
+ * Only done if the parent can be validated later, cf dircache_search_negative(). The
+ * parent's ctime is only stored if it's at least two seconds old, otherwise a change in
+ * the same second wouldn't change it.
+ *
+ * @param vol      (r) volume
+ * @param dir      (r) directory
+ * @param name     (r) name (server side encoding) that lstat failed for with ENOENT
+ * @param len      (r) strlen of name
+ */
+void dircache_add_negative(const struct vol *vol, struct dir *dir, char *name, int len)
+{
+    struct dcneg *neg;
+    int mode;
+
+    if (index_neg == NULL || len == 0 || len > DIRCACHE_NEG_NAMELEN
+        || dir->d_did == DIRDID_ROOT_PARENT)
+        return;
+    /* creating the target of a dangling symlink doesn't touch the directory */
+    if (vol->v_flags & AFPVOL_FOLLOWSYM)
+        return;
+    if ((mode = neg_parent(vol, dir)) == 0)
+        return;
+
+    if ((neg = slab_alloc(&negslab)) == NULL)
+        return;
+    neg->vid = vol->v_vid;
+    neg->did = dir->d_did;
+    memcpy(neg->name, name, len);
+    neg->name[len] = 0;
+    neg->uname.mlen = -1;
+    neg->uname.slen = len;
+    neg->uname.data = (unsigned char *)neg->name;
+    neg->ctime = 0;
+    if (dir != vol->v_root && dir->dcache_seq > command_seq && dir->dcache_ctime < time(NULL) - 1)
+        neg->ctime = dir->dcache_ctime;
+    if (mode == NEG_CTIME && neg->ctime == 0) {
+        slab_free(&negslab, neg);
+        return;
+    }
+    neg->seq = ++notify_seq;
+
+    neg_forget(neg->vid, neg->did, &neg->uname);
+    while (neg_count >= neg_maxsize)
+        neg_remove(negq->next->data);
+
+    if ((neg->qidx_node = enqueue(negq, neg)) == NULL) {
+        slab_free(&negslab, neg);
+        return;
+    }
+    if (rhash_insert(index_neg, neg) != 0) {
+        dequeue(neg->qidx_node->prev);
+        slab_free(&negslab, neg);
+        return;
+    }
+    neg_count++;
+    dircache_stat.negadded++;
+}
+
 /*!
  * @brief create struct dir from struct path
  *
@@ -434,19 +1061,19 @@ struct dir *dircache_search_by_name(const struct vol *vol,
 int dircache_add(const struct vol *vol,
                  struct dir *dir)
 {
-    struct dir key;
-    hnode_t *hn;
+    struct dir key, *cdir;
+    struct dcclass *class = DCCLASS(dir);
 
     AFP_ASSERT(dir);
     AFP_ASSERT(ntohl(dir->d_pdid) >= 2);
     AFP_ASSERT(ntohl(dir->d_did) >= CNID_START);
     AFP_ASSERT(dir->d_u_name);
     AFP_ASSERT(dir->d_vid);
-    AFP_ASSERT(dircache->hash_nodecount <= dircache_maxsize);
+    AFP_ASSERT(rhash_count(dircache) <= dircache_maxsize);
 
-    /* Check if cache is full */
-    if (dircache->hash_nodecount == dircache_maxsize)
-        dircache_evict();
+    /* Check if the budget of this class is used up */
+    if (class->count[DCQ_IN] + class->count[DCQ_MAIN] >= class->maxsize)
+        dircache_evict(class);
 
     /* 
      * Make sure we don't add duplicates
@@ -455,46 +1082,56 @@ int dircache_add(const struct vol *vol,
     /* Search primary cache by CNID */
     key.d_vid = dir->d_vid;
     key.d_did = dir->d_did;
-    if ((hn = hash_lookup(dircache, &key))) {
+    if ((cdir = rhash_lookup(dircache, &key))) {
         /* Found an entry with the same CNID, delete it */
-        dir_remove(vol, hnode_get(hn));
+        dir_remove(vol, cdir);
         dircache_stat.expunged++;
     }
     key.d_vid = vol->v_vid;
     key.d_pdid = dir->d_pdid;
     key.d_u_name = dir->d_u_name;
-    if ((hn = hash_lookup(index_didname, &key))) {
+    if ((cdir = rhash_lookup(index_didname, &key))) {
         /* Found an entry with the same DID/name, delete it */
-        dir_remove(vol, hnode_get(hn));
+        dir_remove(vol, cdir);
         dircache_stat.expunged++;
     }
 
+    /* The name exists now */
+    neg_forget(dir->d_vid, dir->d_pdid, dir->d_u_name);
+
     /* Add it to the main dircache */
-    if (hash_alloc_insert(dircache, dir, dir) == 0) {
+    if (rhash_insert(dircache, dir) != 0) {
         dircache_dump();
         exit(EXITERR_SYS);
     }
 
     /* Add it to the did/name index */
-    if (hash_alloc_insert(index_didname, dir, dir) == 0) {
+    if (rhash_insert(index_didname, dir) != 0) {
         dircache_dump();
         exit(EXITERR_SYS);
     }
 
-    /* Add it to the fifo queue index */
-    if ((dir->qidx_node = enqueue(index_queue, dir)) == NULL) {
+    /* Add it to the queue index, to the "main" queue if we evicted it recently */
+    dir->dcache_queue = DCQ_IN;
+    if (ghost_hit(dir)) {
+        dircache_stat.ghosthits++;
+        dir->dcache_queue = DCQ_MAIN;
+    }
+    if ((dir->qidx_node = enqueue(class->queue[dir->dcache_queue], dir)) == NULL) {
         dircache_dump();
         exit(EXITERR_SYS);
     } else {
+        class->count[dir->dcache_queue]++;
         queue_count++;
     }
 
+    dir->dcache_seq = ++notify_seq;
     dircache_stat.added++;
     LOG(log_debug, logtype_afpd, "dircache(did:%u,'%s'): {added}",
         ntohl(dir->d_did), cfrombstr(dir->d_u_name));
 
-   AFP_ASSERT(queue_count == index_didname->hash_nodecount 
-           && queue_count == dircache->hash_nodecount);
+   AFP_ASSERT(queue_count == rhash_count(index_didname)
+           && queue_count == rhash_count(dircache));
 
     return 0;
 }
@@ -507,43 +1144,83 @@ int dircache_add(const struct vol *vol,
   */
 void dircache_remove(const struct vol *vol _U_, struct dir *dir, int flags)
 {
-    hnode_t *hn;
-
     AFP_ASSERT(dir);
     AFP_ASSERT((flags & ~(QUEUE_INDEX | DIDNAME_INDEX | DIRCACHE)) == 0);
 
     if (flags & QUEUE_INDEX) {
         /* remove it from the queue index */
         dequeue(dir->qidx_node->prev); /* this effectively deletes the dequeued node */
+        DCCLASS(dir)->count[dir->dcache_queue]--;
         queue_count--;
     }
 
     if (flags & DIDNAME_INDEX) {
-        if ((hn = hash_lookup(index_didname, dir)) == NULL) {
+        if (rhash_remove(index_didname, dir) == NULL) {
             LOG(log_error, logtype_afpd, "dircache_remove(%u,\"%s\"): not in didname index", 
                 ntohl(dir->d_did), cfrombstr(dir->d_u_name));
             dircache_dump();
             AFP_PANIC("dircache_remove");
         }
-        hash_delete_free(index_didname, hn);
     }
 
     if (flags & DIRCACHE) {
-        if ((hn = hash_lookup(dircache, dir)) == NULL) {
+        if (rhash_remove(dircache, dir) == NULL) {
             LOG(log_error, logtype_afpd, "dircache_remove(%u,\"%s\"): not in dircache", 
                 ntohl(dir->d_did), cfrombstr(dir->d_u_name));
             dircache_dump();
             AFP_PANIC("dircache_remove");
         }
-        hash_delete_free(dircache, hn);
+        dircache_unwatch(dir);
     }
 
     LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {removed}",
         ntohl(dir->d_did), cfrombstr(dir->d_u_name));
 
     dircache_stat.removed++;
-    AFP_ASSERT(queue_count == index_didname->hash_nodecount 
-               && queue_count == dircache->hash_nodecount);
+    AFP_ASSERT(queue_count == rhash_count(index_didname)
+               && queue_count == rhash_count(dircache));
+}
+
+/*!
+ * @brief Check whether a directory is known to be unchanged without stat
+ *
+ * For callers that would stat an entry they got from dircache_search_by_did() again.
+ *
+ * @returns 1 if "dircache notify" validated the entry, else 0
+ */
+int dircache_trusted(const struct vol *vol, const struct dir *dir)
+{
+    return notify_trusted(vol, dir, NULL);
+}
+
+/*!
+ * @brief Remove the inotify watch of a directory, called when it's removed or freed
+ */
+void dircache_unwatch(struct dir *dir)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    if (dir->dcache_wd > 0 && rhash_lookup(index_wd, dir) == dir) {
+        inotify_rm_watch(notify_fd, dir->dcache_wd);
+        rhash_remove(index_wd, dir);
+        notify_watches--;
+        notify_full = 0;
+    }
+#endif
+    dir->dcache_wd = 0;
+}
+
+/*!
+ * @brief Start a new AFP command, called after every AFP command
+ *
+ * Events are read again before the next lookup and entries checked with stat so far
+ * don't validate negative entries anymore.
+ */
+void dircache_next_command(void)
+{
+    command_seq = notify_seq;
+#ifdef HAVE_SYS_INOTIFY_H
+    notify_read = 0;
+#endif
 }
 
 /*!
@@ -552,42 +1229,90 @@ void dircache_remove(const struct vol *vol _U_, struct dir *dir, int flags)
  * This is called in child afpd initialisation. The maximum cache size will be
  * max(DEFAULT_MAX_DIRCACHE_SIZE, min(size, MAX_POSSIBLE_DIRCACHE_SIZE)).
  * It initializes a hashtable which we use to store a directory cache in.
- * It also initializes two indexes:
+ * It also initializes three indexes:
  * - a DID/name index on the main dircache
- * - a queue index on the dircache
+ * - the queue indexes on the dircache, for directories and files
+ * - a CNID index on the ghost queues
  *
- * @param size   (r) requested maximum size from afp.conf
+ * @param reqsize   (r) requested maximum size from afp.conf
+ * @param filepct   (r) percentage of the cache for files
+ * @param notify    (r) use inotify instead of stat to validate entries
+ * @param negsize   (r) maximum number of names cached as missing, 0 disables
  *
  * @return 0 on success, -1 on error
  */
-int dircache_init(int reqsize)
+int dircache_init(int reqsize, int filepct, int notify, int negsize)
 {
+    struct dcclass *class[2] = { &dcdirs, &dcfiles };
+    int i;
+
+    /* already done, eg in an idle process from the session pool */
+    if (dircache)
+        return 0;
+
     dircache_maxsize = DEFAULT_MAX_DIRCACHE_SIZE;
 
     /* Initialize the main dircache */
-    if (reqsize > DEFAULT_MAX_DIRCACHE_SIZE && reqsize < MAX_POSSIBLE_DIRCACHE_SIZE) {
+    if (reqsize > DEFAULT_MAX_DIRCACHE_SIZE) {
         while ((dircache_maxsize < MAX_POSSIBLE_DIRCACHE_SIZE) && (dircache_maxsize < reqsize))
                dircache_maxsize *= 2;
     }
-    if ((dircache = hash_create(dircache_maxsize, hash_comp_vid_did, hash_vid_did)) == NULL)
+    /* the hashtables start small and grow with the cache */
+    if ((dircache = rhash_create(DIRCACHE_INITIAL_SIZE, hash_comp_vid_did, hash_vid_did)) == NULL)
         return -1;
     
     LOG(log_debug, logtype_afpd, "dircache_init: done. max dircache size: %u", dircache_maxsize);
 
     /* Initialize did/name index hashtable */
-    if ((index_didname = hash_create(dircache_maxsize, hash_comp_didname, hash_didname)) == NULL)
+    if ((index_didname = rhash_create(DIRCACHE_INITIAL_SIZE, hash_comp_didname, hash_didname)) == NULL)
         return -1;
 
-    /* Initialize index queue */
-    if ((index_queue = queue_init()) == NULL)
+    /* Initialize index queues, each class gets at least some entries */
+    if (filepct < 10)
+        filepct = 10;
+    if (filepct > 90)
+        filepct = 90;
+    dcfiles.maxsize = (unsigned long)dircache_maxsize * filepct / 100;
+    dcdirs.maxsize = dircache_maxsize - dcfiles.maxsize;
+    for (i = 0; i < 2; i++) {
+        if ((class[i]->queue[DCQ_IN] = queue_init()) == NULL
+            || (class[i]->queue[DCQ_MAIN] = queue_init()) == NULL
+            || (class[i]->ghostq = queue_init()) == NULL)
+            return -1;
+    }
+    queue_count = 0;
+
+    /* Initialize the CNID index of the ghost queues */
+    if ((index_ghost = rhash_create(DIRCACHE_INITIAL_SIZE, hash_comp_ghost, hash_ghost)) == NULL)
         return -1;
-    else
-        queue_count = 0;
+    slab_init(&ghostslab, "ghost", sizeof(struct dcghost), DIRCACHE_FREE_QUANTUM);
 
     /* Initialize index queue */
     if ((invalid_dircache_entries = queue_init()) == NULL)
         return -1;
 
+    /* Initialize the negative entries */
+    if (negsize > 0) {
+        neg_maxsize = negsize;
+        if ((negq = queue_init()) == NULL
+            || (index_neg = rhash_create(DIRCACHE_INITIAL_SIZE, hash_comp_neg, hash_neg)) == NULL)
+            return -1;
+        slab_init(&negslab, "negative", sizeof(struct dcneg), DIRCACHE_FREE_QUANTUM);
+    }
+
+#ifdef HAVE_SYS_INOTIFY_H
+    /* Initialize inotify and the watch index, without it we fall back to stat */
+    if (notify) {
+        if ((notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+            LOG(log_error, logtype_afpd, "dircache_init: inotify_init1: %s", strerror(errno));
+        else if ((index_wd = rhash_create(DIRCACHE_INITIAL_SIZE, hash_comp_wd, hash_wd)) == NULL)
+            return -1;
+    }
+#else
+    if (notify)
+        LOG(log_note, logtype_afpd, "dircache_init: \"dircache notify\" not supported on this platform");
+#endif
+
     /* As long as directory.c hasn't got its own initializer call, we do it for it */
     rootParent.d_did = DIRDID_ROOT_PARENT;
     rootParent.d_fullpath = bfromcstr("ROOT_PARENT");
@@ -598,13 +1323,22 @@ int dircache_init(int reqsize)
     return 0;
 }
 
+/*!
+ * @brief Get the number of lookups and hits so far, for the master's statistics
+ */
+void dircache_counters(unsigned long long *lookups, unsigned long long *hits)
+{
+    *lookups = dircache_stat.lookups;
+    *hits = dircache_stat.hits;
+}
+
 /*!
  * Log dircache statistics
  */
 void log_dircache_stat(void)
 {
     LOG(log_info, logtype_afpd, "dircache statistics: "
-        "entries: %lu, lookups: %llu, hits: %llu, misses: %llu, added: %llu, removed: %llu, expunged: %llu, evicted: %llu",
+        "entries: %lu, lookups: %llu, hits: %llu, misses: %llu, added: %llu, removed: %llu, expunged: %llu, evicted: %llu, ghost hits: %llu",
         queue_count,
         dircache_stat.lookups,
         dircache_stat.hits,
@@ -612,7 +1346,33 @@ void log_dircache_stat(void)
         dircache_stat.added,
         dircache_stat.removed,
         dircache_stat.expunged,
-        dircache_stat.evicted);
+        dircache_stat.evicted,
+        dircache_stat.ghosthits);
+    LOG(log_info, logtype_afpd, "dircache queues: "
+        "dirs in/main/ghost: %lu/%lu/%lu of %lu, files in/main/ghost: %lu/%lu/%lu of %lu",
+        dcdirs.count[DCQ_IN], dcdirs.count[DCQ_MAIN], dcdirs.ghostcount, dcdirs.maxsize,
+        dcfiles.count[DCQ_IN], dcfiles.count[DCQ_MAIN], dcfiles.ghostcount, dcfiles.maxsize);
+    LOG(log_info, logtype_afpd, "dircache memory: "
+        "entries: %zu KB, indexes: %zu KB, ghosts: %zu KB",
+        dir_slab_size() / 1024,
+        (rhash_memsize(dircache) + rhash_memsize(index_didname) + rhash_memsize(index_ghost)) / 1024,
+        slab_size(&ghostslab) / 1024);
+    if (index_neg)
+        LOG(log_info, logtype_afpd, "dircache negative: "
+            "entries: %lu of %lu, hits: %llu, added: %llu, stale: %llu",
+            neg_count, neg_maxsize,
+            dircache_stat.neghits,
+            dircache_stat.negadded,
+            dircache_stat.negstale);
+#ifdef HAVE_SYS_INOTIFY_H
+    if (notify_fd != -1)
+        LOG(log_info, logtype_afpd, "dircache notify: "
+            "watches: %lu, events: %llu, overflows: %llu, hits without stat: %llu",
+            notify_watches,
+            dircache_stat.events,
+            dircache_stat.overflows,
+            dircache_stat.unchecked);
+#endif
 }
 
 /*!
@@ -622,11 +1382,12 @@ void dircache_dump(void)
 {
     char tmpnam[64];
     FILE *dump;
-    qnode_t *n = index_queue->next;
-    hnode_t *hn;
-    hscan_t hs;
+    qnode_t *n;
+    q_t *q;
+    struct dcclass *class;
+    uint32_t pos;
     const struct dir *dir;
-    int i;
+    int i, c;
 
     LOG(log_warning, logtype_afpd, "Dumping directory cache...");
 
@@ -637,16 +1398,16 @@ void dircache_dump(void)
     }
     setbuf(dump, NULL);
 
-    fprintf(dump, "Number of cache entries in LRU queue: %lu\n", queue_count);
-    fprintf(dump, "Configured maximum cache size: %u\n\n", dircache_maxsize);
+    fprintf(dump, "Number of cache entries in queues: %lu\n", queue_count);
+    fprintf(dump, "Configured maximum cache size: %u (dirs: %lu, files: %lu)\n\n",
+            dircache_maxsize, dcdirs.maxsize, dcfiles.maxsize);
 
     fprintf(dump, "Primary CNID index:\n");
     fprintf(dump, "       VID     DID    CNID STAT PATH\n");
     fprintf(dump, "====================================================================\n");
-    hash_scan_begin(&hs, dircache);
+    pos = 0;
     i = 1;
-    while ((hn = hash_scan_next(&hs))) {
-        dir = hnode_get(hn);
+    while ((dir = rhash_scan(dircache, &pos))) {
         fprintf(dump, "%05u: %3u  %6u  %6u %s    %s\n",
                 i++,
                 ntohs(dir->d_vid),
@@ -659,10 +1420,9 @@ void dircache_dump(void)
     fprintf(dump, "\nSecondary DID/name index:\n");
     fprintf(dump, "       VID     DID    CNID STAT PATH\n");
     fprintf(dump, "====================================================================\n");
-    hash_scan_begin(&hs, index_didname);
+    pos = 0;
     i = 1;
-    while ((hn = hash_scan_next(&hs))) {
-        dir = hnode_get(hn);
+    while ((dir = rhash_scan(index_didname, &pos))) {
         fprintf(dump, "%05u: %3u  %6u  %6u %s    %s\n",
                 i++,
                 ntohs(dir->d_vid),
@@ -672,22 +1432,23 @@ void dircache_dump(void)
                 cfrombstr(dir->d_fullpath));
     }
 
-    fprintf(dump, "\nLRU Queue:\n");
-    fprintf(dump, "       VID     DID    CNID STAT PATH\n");
-    fprintf(dump, "====================================================================\n");
-
-    for (i = 1; i <= queue_count; i++) {
-        if (n == index_queue)
-            break;
-        dir = (struct dir *)n->data;
-        fprintf(dump, "%05u: %3u  %6u  %6u %s    %s\n",
-                i,
-                ntohs(dir->d_vid),
-                ntohl(dir->d_pdid),
-                ntohl(dir->d_did),
-                dir->d_flags & DIRF_ISFILE ? "f" : "d",
-                cfrombstr(dir->d_fullpath));
-        n = n->next;
+    for (c = 0; c < 4; c++) {
+        class = (c < 2) ? &dcdirs : &dcfiles;
+        q = class->queue[c & 1 ? DCQ_MAIN : DCQ_IN];
+        fprintf(dump, "\n%s \"%s\" queue:\n", class->name, c & 1 ? "main" : "in");
+        fprintf(dump, "       VID     DID    CNID STAT PATH\n");
+        fprintf(dump, "====================================================================\n");
+
+        for (i = 1, n = q->next; n != q; i++, n = n->next) {
+            dir = (struct dir *)n->data;
+            fprintf(dump, "%05u: %3u  %6u  %6u %s    %s\n",
+                    i,
+                    ntohs(dir->d_vid),
+                    ntohl(dir->d_pdid),
+                    ntohl(dir->d_did),
+                    dir->d_flags & DIRF_ISFILE ? "f" : "d",
+                    cfrombstr(dir->d_fullpath));
+        }
     }
 
     fprintf(dump, "\n");
@@ -695,3 +1456,251 @@ void dircache_dump(void)
     fclose(dump);
     return;
 }
+
+#ifdef DIRCACHE_TEST_MAIN
+
+/*
+ * Trace replay: run synthetic directory lookup traces through the 2Q dircache and
+ * through LRU and FIFO models with the same budget and print the hit ratios. A miss
+ * adds the directory like afpd does after resolving the CNID. FIFO is how the dircache
+ * evicted before 2Q. "make check" doesn't run it, test005_dircache_2q() in test/afpd
+ * checks the queues instead.
+ */
+
+#include <stdint.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+struct dir rootParent;
+struct dir *curdir = &rootParent;
+static struct stat root_st;
+
+/* the struct dir handling of directory.c, which would pull in all of afpd */
+void dir_free(struct dir *dir)
+{
+    dircache_unwatch(dir);
+    bdestroy(dir->d_u_name);
+    bdestroy(dir->d_fullpath);
+    free(dir);
+}
+
+int dir_remove(const struct vol *vol, struct dir *dir)
+{
+    dircache_remove(vol, dir, DIRCACHE_ALL);
+    dir_free(dir);
+    return 0;
+}
+
+size_t dir_slab_size(void)
+{
+    return 0;
+}
+
+static struct dir *bench_dir(const struct vol *vol, uint32_t id)
+{
+    struct dir *dir;
+    char name[16];
+
+    if ((dir = calloc(1, sizeof(struct dir))) == NULL)
+        return NULL;
+    snprintf(name, sizeof(name), "d%u", id);
+    dir->d_u_name = bfromcstr(name);
+    dir->d_m_name = dir->d_u_name;
+    dir->d_fullpath = bfromcstr("/");
+    dir->d_vid = vol->v_vid;
+    dir->d_pdid = DIRDID_ROOT;
+    dir->d_did = htonl(CNID_START + id);
+    dir->dcache_ctime = root_st.st_ctime;
+    dir->dcache_ino = root_st.st_ino;
+    return dir;
+}
+
+/* LRU or FIFO over CNIDs 0..n-1, a list threaded through arrays, slot n is the head */
+struct model {
+    int      lru;               /* move hits to the tail */
+    uint32_t n, cap, count, hits;
+    uint32_t *prev, *next;
+    char     *cached;
+};
+
+static int model_init(struct model *m, int lru, uint32_t n, uint32_t cap)
+{
+    m->lru = lru;
+    m->n = n;
+    m->cap = cap;
+    m->count = m->hits = 0;
+    m->prev = malloc((n + 1) * sizeof(uint32_t));
+    m->next = malloc((n + 1) * sizeof(uint32_t));
+    m->cached = calloc(n, 1);
+    if (!m->prev || !m->next || !m->cached)
+        return -1;
+    m->prev[n] = m->next[n] = n;
+    return 0;
+}
+
+static void model_unlink(struct model *m, uint32_t id)
+{
+    m->next[m->prev[id]] = m->next[id];
+    m->prev[m->next[id]] = m->prev[id];
+}
+
+static void model_append(struct model *m, uint32_t id)
+{
+    m->prev[id] = m->prev[m->n];
+    m->next[id] = m->n;
+    m->next[m->prev[m->n]] = id;
+    m->prev[m->n] = id;
+}
+
+static void model_access(struct model *m, uint32_t id)
+{
+    uint32_t victim;
+
+    if (m->cached[id]) {
+        m->hits++;
+        if (m->lru) {
+            model_unlink(m, id);
+            model_append(m, id);
+        }
+        return;
+    }
+    if (m->count >= m->cap) {
+        victim = m->next[m->n];
+        model_unlink(m, victim);
+        m->cached[victim] = 0;
+        m->count--;
+    }
+    model_append(m, id);
+    m->cached[id] = 1;
+    m->count++;
+}
+
+static void model_free(struct model *m)
+{
+    free(m->prev);
+    free(m->next);
+    free(m->cached);
+}
+
+static uint32_t rnd(void)
+{
+    static uint32_t x = 2463534242U;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+#define TRACELEN 1000000
+
+/*
+ * hot:      a working set of 3/4 of the budget, looked up at random
+ * scan:     the same, every 25000 lookups interrupted by a crawl of half
+ *           the budget, each directory of the crawl looked up once
+ * bigscan:  the same with crawls of twice the budget
+ * skewed:   8 times the budget, id = n * u^3 for uniform u
+ * loop:     1.25 times the budget, looked up in order over and over
+ */
+static uint32_t trace(const char *name, uint32_t budget, uint32_t *t)
+{
+    uint32_t i = 0, hot = budget * 3 / 4, scan = hot, crawl = 0, j;
+    double u;
+
+    if (strcmp(name, "hot") == 0) {
+        while (i < TRACELEN)
+            t[i++] = rnd() % hot;
+        return hot;
+    }
+    if (strcmp(name, "scan") == 0)
+        crawl = budget / 2;
+    else if (strcmp(name, "bigscan") == 0)
+        crawl = 2 * budget;
+    if (crawl) {
+        while (i < TRACELEN) {
+            for (j = 0; j < 25000 && i < TRACELEN; j++)
+                t[i++] = rnd() % hot;
+            for (j = 0; j < crawl && i < TRACELEN; j++)
+                t[i++] = scan++;
+        }
+        return scan;
+    }
+    if (strcmp(name, "skewed") == 0) {
+        while (i < TRACELEN) {
+            u = (double)rnd() / 4294967296.0;
+            t[i++] = (uint32_t)(8.0 * budget * u * u * u);
+        }
+        return 8 * budget;
+    }
+    for (j = 0; i < TRACELEN; j = (j + 1) % (budget + budget / 4))
+        t[i++] = j;
+    return budget + budget / 4;
+}
+
+static int replay(const struct vol *vol, const char *name)
+{
+    struct model fifo, lru;
+    struct dir *dir;
+    struct timespec t0, t1;
+    uint32_t *t, n, i, hits = 0;
+    int ret = 0;
+
+    if ((t = malloc(TRACELEN * sizeof(uint32_t))) == NULL)
+        return 1;
+    n = trace(name, dcdirs.maxsize, t);
+    if (model_init(&fifo, 0, n, dcdirs.maxsize) != 0 || model_init(&lru, 1, n, dcdirs.maxsize) != 0)
+        return 1;
+    for (i = 0; i < TRACELEN; i++) {
+        model_access(&fifo, t[i]);
+        model_access(&lru, t[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < TRACELEN; i++) {
+        if (dircache_search_by_did(vol, htonl(CNID_START + t[i]))) {
+            hits++;
+            continue;
+        }
+        if ((dir = bench_dir(vol, t[i])) == NULL || dircache_add(vol, dir) != 0)
+            return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    printf("%-8s %7u dirs: FIFO %5.1f%%, LRU %5.1f%%, 2Q %5.1f%% (%.0f ns/lookup)\n",
+           name, n, 100.0 * fifo.hits / TRACELEN, 100.0 * lru.hits / TRACELEN,
+           100.0 * hits / TRACELEN,
+           ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / TRACELEN);
+    if (queue_count != rhash_count(dircache) || queue_count > dcdirs.maxsize)
+        ret = 1;
+    model_free(&fifo);
+    model_free(&lru);
+    free(t);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *traces[] = { "hot", "scan", "bigscan", "skewed", "loop", NULL };
+    static struct vol vol;
+    int i, status, ret = 0;
+    pid_t pid;
+
+    vol.v_vid = htons(1);
+    if (lstat("/", &root_st) != 0)
+        return 1;
+    if (dircache_init(argc > 1 ? atoi(argv[1]) : 0, 10, 0, 0) != 0)
+        return 1;
+    printf("dircache budget for directories: %lu\n", dcdirs.maxsize);
+
+    /* every trace starts with an empty cache */
+    for (i = 0; traces[i]; i++) {
+        fflush(stdout);
+        if ((pid = fork()) == 0)
+            exit(replay(&vol, traces[i]));
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+            ret = 1;
+    }
+    return ret;
+}
+
+#endif /* DIRCACHE_TEST_MAIN */
@@ -21,8 +21,10 @@
 #include <atalk/directory.h>
 
 /* Maximum size of the dircache hashtable */
-#define MAX_POSSIBLE_DIRCACHE_SIZE 131072
+#define MAX_POSSIBLE_DIRCACHE_SIZE 1048576
 #define DIRCACHE_FREE_QUANTUM 256
+#define DIRCACHE_INITIAL_SIZE 1024 /* initial size of the hashtables */
+#define DIRCACHE_NEG_NAMELEN 63    /* longest name that is cached as missing */
 
 /* flags for dircache_remove */
 #define DIRCACHE      (1 << 0)
@@ -30,11 +32,17 @@
 #define QUEUE_INDEX   (1 << 2)
 #define DIRCACHE_ALL  (DIRCACHE|DIDNAME_INDEX|QUEUE_INDEX)
 
-extern int        dircache_init(int reqsize);
+extern int        dircache_init(int reqsize, int filepct, int notify, int negsize);
 extern int        dircache_add(const struct vol *, struct dir *);
 extern void       dircache_remove(const struct vol *, struct dir *, int flag);
 extern struct dir *dircache_search_by_did(const struct vol *vol, cnid_t did);
 extern struct dir *dircache_search_by_name(const struct vol *, const struct dir *dir, char *name, int len);
+extern int        dircache_search_negative(const struct vol *, struct dir *dir, char *name, int len);
+extern void       dircache_add_negative(const struct vol *, struct dir *dir, char *name, int len);
+extern int        dircache_trusted(const struct vol *, const struct dir *);
+extern void       dircache_unwatch(struct dir *);
+extern void       dircache_next_command(void);
 extern void       dircache_dump(void);
 extern void       log_dircache_stat(void);
+extern void       dircache_counters(unsigned long long *lookups, unsigned long long *hits);
 #endif /* DIRCACHE_H */
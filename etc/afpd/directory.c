@@ -33,9 +33,11 @@
 #include <atalk/globals.h>
 #include <atalk/fce_api.h>
 #include <atalk/netatalk_conf.h>
+#include <atalk/slab.h>
 
 #include "directory.h"
 #include "dircache.h"
+#include "shmcache.h"
 #include "desktop.h"
 #include "volume.h"
 #include "fork.h"
@@ -64,6 +66,9 @@ struct dir rootParent  = {
     0, 0, 0, 0                       /* pdid, did, offcnt, d_vid */
 };
 struct dir  *curdir = &rootParent;
+
+/* struct dir allocator, the dircache allocates and frees lots of them */
+static slab_t dirslab;
 struct path Cur_Path = {
     0,
     "",  /* mac name */
@@ -530,7 +535,7 @@ EC_CLEANUP:
  * 1. Check for special CNIDs 0 (invalid), 1 and 2.
  * 2a. Check if the DID is in the cache.
  * 2b. Check if it's really a dir  because we cache files too.
- * 3. If it's not in the cache resolve it via the database.
+ * 3. If it's not in the cache resolve it via the shared cache or the database.
  * 4. Build complete server-side path to the dir.
  * 5. Check if it exists and is a directory.
  * 6. Create the struct dir and populate it.
@@ -553,6 +558,8 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
     int          buflen = 12 + MAXPATHLEN + 1;
     int          utf8;
     int          err = 0;
+    int          useshm = 1;
+    ino_t        shmino = 0;
 
     LOG(log_debug, logtype_afpd, "dirlookup(did: %u): START", ntohl(did));
 
@@ -577,7 +584,7 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
             ret = NULL;
             goto exit;
         }
-        if (lstat(cfrombstr(ret->d_fullpath), &st) != 0) {
+        if (!dircache_trusted(vol, ret) && lstat(cfrombstr(ret->d_fullpath), &st) != 0) {
             LOG(log_debug, logtype_afpd, "dirlookup(did: %u, path: \"%s\"): lstat: %s",
                 ntohl(did), cfrombstr(ret->d_fullpath), strerror(errno));
             switch (errno) {
@@ -604,13 +611,18 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
     utf8 = utf8_encoding(vol->v_obj);
     maxpath = (utf8) ? MAXPATHLEN - 7 : 255;
 
-    /* Get it from the database */
+    /* Get it from the shared cache or the database */
+resolve:
     cnid = did;
-    LOG(log_debug, logtype_afpd, "dirlookup(did: %u): querying CNID database", ntohl(did));
-    if ((upath = cnid_resolve(vol->v_cdb, &cnid, buffer, buflen)) == NULL) {
-        afp_errno = AFPERR_NOOBJ;
-        err = 1;
-        goto exit;
+    shmino = 0;
+    if (!useshm || (upath = shmcache_resolve(vol, &cnid, buffer, buflen, &shmino)) == NULL) {
+        cnid = did;
+        LOG(log_debug, logtype_afpd, "dirlookup(did: %u): querying CNID database", ntohl(did));
+        if ((upath = cnid_resolve(vol->v_cdb, &cnid, buffer, buflen)) == NULL) {
+            afp_errno = AFPERR_NOOBJ;
+            err = 1;
+            goto exit;
+        }
     }
     if ((upath = strdup(upath)) == NULL) { /* 3 */
         afp_errno = AFPERR_NOOBJ;
@@ -627,6 +639,8 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
     LOG(log_debug, logtype_afpd, "dirlookup(did: %u): recursion for did: %u",
         ntohl(did), ntohl(pdid));
     if ((pdir = dirlookup(vol, pdid)) == NULL) {
+        if (shmino)
+            goto shmstale;
         err = 1;
         goto exit;
     }
@@ -643,7 +657,10 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
     LOG(log_debug, logtype_afpd, "dirlookup(did: %u): stating \"%s\"",
         ntohl(did), cfrombstr(fullpath));
 
-    if (ostat(cfrombstr(fullpath), &st, vol_syml_opt(vol)) != 0) { /* 5a */
+    if (ostat(cfrombstr(fullpath), &st, vol_syml_opt(vol)) != 0
+        || (shmino && st.st_ino != shmino)) { /* 5a */
+        if (shmino)
+            goto shmstale;
         switch (errno) {
         case ENOENT:
             afp_errno = AFPERR_NOOBJ;
@@ -666,6 +683,9 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
         }
     }
 
+    if (!shmino)
+        shmcache_add(vol, &st, pdid, upath, strlen(upath), did);
+
     /* Get macname from unix name */
     if ( (mpath = utompath(vol, upath, did, utf8)) == NULL ) {
         afp_errno = AFPERR_NOOBJ;
@@ -685,6 +705,20 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
         err = 1;
         goto exit;
     }
+    goto exit;
+
+shmstale:
+    /* stale entry in the shared cache, ask the database */
+    LOG(log_debug, logtype_afpd, "dirlookup(did: %u): stale shared cache entry", ntohl(did));
+    shmcache_remove(vol, did);
+    useshm = 0;
+    free(upath);
+    upath = NULL;
+    if (fullpath) {
+        bdestroy(fullpath);
+        fullpath = NULL;
+    }
+    goto resolve;
 
 exit:
     if (upath) free(upath);
@@ -733,31 +767,62 @@ struct dir *dir_new(const char *m_name,
                     struct stat *st)
 {
     struct dir *dir;
-
-    dir = (struct dir *) calloc(1, sizeof( struct dir ));
-    if (!dir)
+    charset_t  charset = (utf8_encoding(vol->v_obj)) ? CH_UTF8_MAC : vol->v_maccharset;
+    size_t     m_len = strlen(m_name), u_len = 0, ucs2_len;
+    int        same = (m_name == u_name || !strcmp(m_name, u_name));
+    char       *buf;
+
+    if (dirslab.objsize == 0)
+        slab_init(&dirslab, "dir", sizeof(struct dir), DIRCACHE_FREE_QUANTUM);
+    if ((dir = slab_alloc(&dirslab)) == NULL)
         return NULL;
+    memset(dir, 0, sizeof(struct dir));
 
-    if ((dir->d_m_name = bfromcstr(m_name)) == NULL) {
-        free(dir);
-        return NULL;
-    }
+    /*
+     * Store names in d_namebuf if they fit: the UCS2 name has at most one character per
+     * byte of m_name, then m_name and u_name if it's different.
+     */
+    if (!same)
+        u_len = strlen(u_name) + 1;
+    ucs2_len = (m_len + 1) * sizeof(ucs2_t);
+    if (ucs2_len + m_len + 1 + u_len <= sizeof(dir->d_namebuf)
+        && convert_string(charset, CH_UCS2, m_name, -1, dir->d_namebuf, ucs2_len) != (size_t)-1) {
+        buf = (char *)dir->d_namebuf + ucs2_len;
+        memcpy(buf, m_name, m_len + 1);
+        blk2tbstr(dir->d_names[0], buf, m_len);
+        dir->d_m_name = &dir->d_names[0];
+        dir->d_m_name_ucs2 = dir->d_namebuf;
+        if (same) {
+            dir->d_u_name = dir->d_m_name;
+        } else {
+            buf += m_len + 1;
+            memcpy(buf, u_name, u_len);
+            blk2tbstr(dir->d_names[1], buf, u_len - 1);
+            dir->d_u_name = &dir->d_names[1];
+        }
+    } else {
+        if ((dir->d_m_name = bfromcstr(m_name)) == NULL) {
+            slab_free(&dirslab, dir);
+            return NULL;
+        }
 
-    if (convert_string_allocate( (utf8_encoding(vol->v_obj)) ? CH_UTF8_MAC : vol->v_maccharset,
-                                 CH_UCS2,
-                                 m_name,
-                                 -1, (char **)&dir->d_m_name_ucs2) == (size_t)-1 ) {
-        LOG(log_error, logtype_afpd, "dir_new(did: %u) {%s, %s}: couldn't set UCS2 name", ntohl(did), m_name, u_name);
-        dir->d_m_name_ucs2 = NULL;
-    }
+        if (convert_string_allocate(charset,
+                                    CH_UCS2,
+                                    m_name,
+                                    -1, (char **)&dir->d_m_name_ucs2) == (size_t)-1 ) {
+            LOG(log_error, logtype_afpd, "dir_new(did: %u) {%s, %s}: couldn't set UCS2 name", ntohl(did), m_name, u_name);
+            dir->d_m_name_ucs2 = NULL;
+        }
 
-    if (m_name == u_name || !strcmp(m_name, u_name)) {
-        dir->d_u_name = dir->d_m_name;
-    }
-    else if ((dir->d_u_name = bfromcstr(u_name)) == NULL) {
-        bdestroy(dir->d_m_name);
-        free(dir);
-        return NULL;
+        if (same) {
+            dir->d_u_name = dir->d_m_name;
+        }
+        else if ((dir->d_u_name = bfromcstr(u_name)) == NULL) {
+            bdestroy(dir->d_m_name);
+            free(dir->d_m_name_ucs2);
+            slab_free(&dirslab, dir);
+            return NULL;
+        }
     }
 
     dir->d_did = did;
@@ -779,14 +844,24 @@ struct dir *dir_new(const char *m_name,
  */
 void dir_free(struct dir *dir)
 {
-    if (dir->d_u_name != dir->d_m_name) {
+    dircache_unwatch(dir);
+    if (dir->d_u_name != dir->d_m_name && dir->d_u_name != &dir->d_names[1]) {
         bdestroy(dir->d_u_name);
     }
-    if (dir->d_m_name_ucs2)
+    if (dir->d_m_name_ucs2 && dir->d_m_name_ucs2 != dir->d_namebuf)
         free(dir->d_m_name_ucs2);
-    bdestroy(dir->d_m_name);
+    if (dir->d_m_name != &dir->d_names[0])
+        bdestroy(dir->d_m_name);
     bdestroy(dir->d_fullpath);
-    free(dir);
+    slab_free(&dirslab, dir);
+}
+
+/*!
+ * @brief Memory used for struct dir, for dircache statistics
+ */
+size_t dir_slab_size(void)
+{
+    return slab_size(&dirslab);
 }
 
 /*!
@@ -940,6 +1015,7 @@ int dir_remove(const struct vol *vol, struct dir *dir)
         ntohl(dir->d_did), cfrombstr(dir->d_u_name));
 
     dircache_remove(vol, dir, DIRCACHE | DIDNAME_INDEX | QUEUE_INDEX); /* 2 */
+    shmcache_remove(vol, dir->d_did);
     enqueue(invalid_dircache_entries, dir); /* 3 */
 
     if (curdir == dir)                      /* 4 */
@@ -1044,7 +1120,7 @@ int dir_modify(const struct vol *vol,
  * 6.   cnode name -> copy it to path.m_name
  * 7. Get unix name from mac name
  * 8. Special handling of request with did 1
- * 9. stat the cnode name
+ * 9. stat the cnode name, unless the dircache knows it is missing
  * 10. If it's not there, it's probably an afp_createfile|dir,
  *     return with curdir = dir parent, struct path = dirname
  * 11. If it's there and it's a file, it must should be the last element of the requested
@@ -1069,6 +1145,7 @@ struct path *cname(struct vol *vol, struct dir *dir, char **cpath)
     uint16_t   len16;
     int         size = 0;
     int         toUTF8 = 0;
+    int         unamelen;
 
     LOG(log_maxdebug, logtype_afpd, "came('%s'): {start}", cfrombstr(dir->d_fullpath));
 
@@ -1181,7 +1258,15 @@ struct path *cname(struct vol *vol, struct dir *dir, char **cpath)
              *   and thus call continue which should terminate the while loop because
              *   len = 0. Ok?
              */
-            if (of_stat(vol, &ret) != 0) { /* 9 */
+            unamelen = strlen(ret.u_name);
+            if (dircache_search_negative(vol, dir, ret.u_name, unamelen)) {
+                /* known to be missing, no need to stat it */
+                ret.st_valid = 1;
+                ret.st_errno = ENOENT;
+            } else if (of_stat(vol, &ret) != 0 && ret.st_errno == ENOENT) {
+                dircache_add_negative(vol, dir, ret.u_name, unamelen);
+            }
+            if (ret.st_errno != 0) { /* 9 */
                 /*
                  * ret.u_name doesn't exist, might be afp_createfile|dir
                  * that means it should have been the last part
@@ -1229,7 +1314,6 @@ struct path *cname(struct vol *vol, struct dir *dir, char **cpath)
             }
 
             /* Search the cache */
-            int unamelen = strlen(ret.u_name);
             cdir = dircache_search_by_name(vol, dir, ret.u_name, unamelen); /* 14 */
             if (cdir == NULL) {
                 /* Not in cache, create one */
@@ -13,6 +13,8 @@
 #include <errno.h>
 #include <sys/file.h>
 #include <sys/param.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <atalk/logger.h>
 #include <atalk/afp.h>
@@ -24,6 +26,7 @@
 #include <atalk/bstradd.h>
 #include <atalk/globals.h>
 #include <atalk/netatalk_conf.h>
+#include <atalk/ea.h>
 
 #include "desktop.h"
 #include "directory.h"
@@ -38,53 +41,263 @@
 /*
  * Struct to save directory reading context in. Used to prevent
  * O(n^2) searches on a directory.
+ *
+ * A few of them are kept in a LRU so that clients alternating between
+ * directories don't force a re-read on every request. sd_index holds the
+ * offset of every entry in sd_buf, so seeking to a startindex is O(1).
  */
 struct savedir {
     u_short	 sd_vid;
     uint32_t	 sd_did;
-    int		 sd_buflen;
+    time_t	 sd_mtime;      /* directory mtime and ctime when it was read */
+    time_t	 sd_ctime;
+    unsigned int sd_used;       /* LRU stamp */
+    size_t	 sd_buflen;
     char	 *sd_buf;
     char	 *sd_last;
-    unsigned int sd_sindex;
+    uint32_t	 *sd_index;     /* entry offsets into sd_buf */
+    uint32_t	 sd_count;      /* number of entries */
+    uint32_t	 sd_idxlen;     /* allocated entries in sd_index */
 };
 #define SDBUFBRK	2048
+#define SDCACHE_SIZE	4
+
+static struct savedir sdcache[SDCACHE_SIZE];
+static unsigned int sdcache_used;
+
+/*!
+ * Get the saved context for a directory
+ *
+ * Returns the entry for vid/did, if there is none the least recently used
+ * one, which is then reset and has to be filled by the caller.
+ */
+static struct savedir *savedir_get(uint16_t vid, uint32_t did)
+{
+    struct savedir *sd = &sdcache[0];
+    int i;
+
+    for (i = 0; i < SDCACHE_SIZE; i++) {
+        if (sdcache[i].sd_did == did && sdcache[i].sd_vid == vid) {
+            sd = &sdcache[i];
+            break;
+        }
+        if (sdcache[i].sd_used < sd->sd_used)
+            sd = &sdcache[i];
+    }
+
+    if (sd->sd_did != did || sd->sd_vid != vid)
+        sd->sd_did = 0;
+    sd->sd_used = ++sdcache_used;
+    return sd;
+}
 
 static int enumerate_loop(struct dirent *de, char *mname _U_, void *data)
 {
     struct savedir *sd = data; 
-    char *start, *end;
-    int  len,lenm;
-    
-    end = sd->sd_buf + sd->sd_buflen;
+    size_t len, off;
+
     len = strlen(de->d_name);
-    *(sd->sd_last)++ = len;
-    lenm = 0; /* strlen(mname);*/
-    if ( sd->sd_last + len +lenm + 4 > end ) {
+    off = sd->sd_last - sd->sd_buf;
+
+    if ( off + len + 3 > sd->sd_buflen ) {
         char *buf;
+        size_t buflen = sd->sd_buflen;
 
-        start = sd->sd_buf;
-        if (!(buf = realloc( sd->sd_buf, sd->sd_buflen +SDBUFBRK )) ) {
+        while (off + len + 3 > buflen)
+            buflen *= 2;
+        if (!(buf = realloc( sd->sd_buf, buflen )) ) {
             LOG(log_error, logtype_afpd, "afp_enumerate: realloc: %s",
                         strerror(errno) );
             errno = ENOMEM;
             return -1;
         }
         sd->sd_buf = buf;
-        sd->sd_buflen += SDBUFBRK;
-        sd->sd_last = ( sd->sd_last - start ) + sd->sd_buf;
-        end = sd->sd_buf + sd->sd_buflen;
+        sd->sd_buflen = buflen;
+        sd->sd_last = sd->sd_buf + off;
+    }
+
+    if ( sd->sd_count == sd->sd_idxlen ) {
+        uint32_t *idx;
+        uint32_t idxlen = sd->sd_idxlen ? sd->sd_idxlen * 2 : SDBUFBRK / 8;
+
+        if (!(idx = realloc( sd->sd_index, idxlen * sizeof(uint32_t) )) ) {
+            LOG(log_error, logtype_afpd, "afp_enumerate: realloc: %s",
+                        strerror(errno) );
+            errno = ENOMEM;
+            return -1;
+        }
+        sd->sd_index = idx;
+        sd->sd_idxlen = idxlen;
     }
+    sd->sd_index[sd->sd_count++] = off;
 
+    *(sd->sd_last)++ = len;
     memcpy( sd->sd_last, de->d_name, len + 1 );
     sd->sd_last += len + 1;
-#if 0
-    *(sd->sd_last)++ = lenm;
-    memcpy( sd->sd_last, mname, lenm + 1 );
-    sd->sd_last += lenm + 1;
-#endif    
     return 0;
 }
 
+/*
+ * Stat prefetching ("enumerate threads")
+ *
+ * Before the reply is packed, the entries that are about to be returned are
+ * stat'ed by a small pool of threads, so that on network filesystems the
+ * round trips overlap. On EA volumes the metadata EA is read too, which
+ * warms the client side caches for getmetadata(). Workers only touch the
+ * entries array and relative paths, the main thread waits for the batch
+ * so the cwd can't change under them.
+ */
+#define PREFETCH_MAX	64
+#define PREFETCH_MIN	4       /* not worth the thread handoff below this */
+
+struct prefetch_ent {
+    const char  *name;
+    struct stat st;
+    int         err;
+};
+
+static struct {
+    pthread_mutex_t     lock;
+    pthread_cond_t      work, done;
+    int                 nthreads;
+    int                 count, next, pending;
+    int                 stat_opt;
+    int                 ea;
+    struct prefetch_ent ent[PREFETCH_MAX];
+} pf = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void prefetch_one(struct prefetch_ent *e)
+{
+    e->err = 0;
+    if (ostat(e->name, &e->st, pf.stat_opt) < 0) {
+        e->err = errno;
+        return;
+    }
+    if (pf.ea && !S_ISLNK(e->st.st_mode))
+        (void)sys_getxattr(e->name, AD_EA_META, NULL, 0);
+}
+
+/* called with pf.lock held, returns with it held */
+static void prefetch_work(void)
+{
+    int i;
+
+    while (pf.next < pf.count) {
+        i = pf.next++;
+        pthread_mutex_unlock(&pf.lock);
+        prefetch_one(&pf.ent[i]);
+        pthread_mutex_lock(&pf.lock);
+        if (--pf.pending == 0)
+            pthread_cond_signal(&pf.done);
+    }
+}
+
+static void *prefetch_thread(void *arg _U_)
+{
+    pthread_mutex_lock(&pf.lock);
+    while (1) {
+        while (pf.next >= pf.count)
+            pthread_cond_wait(&pf.work, &pf.lock);
+        prefetch_work();
+    }
+    return NULL;
+}
+
+static int prefetch_init(int nthreads)
+{
+    static int failed;
+    pthread_t tid;
+    sigset_t sigs, oldsigs;
+
+    if (pf.nthreads || failed)
+        return pf.nthreads;
+
+    /* signals are for the main thread */
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+    while (pf.nthreads < nthreads) {
+        if (pthread_create(&tid, NULL, prefetch_thread, NULL) != 0) {
+            LOG(log_error, logtype_afpd, "enumerate: pthread_create: %s", strerror(errno));
+            break;
+        }
+        pthread_detach(tid);
+        pf.nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+    if (pf.nthreads == 0)
+        failed = 1;
+    return pf.nthreads;
+}
+
+/* look up the CNIDs of the prefetched entries with one request to the CNID backend */
+static void prefetch_cnids(struct vol *vol, struct dir *dir, int n)
+{
+    struct cnid_batch batch[PREFETCH_MAX];
+    int i, m = 0;
+
+    for (i = 0; i < n; i++) {
+        if (pf.ent[i].err)
+            continue;
+        batch[m].st = &pf.ent[i].st;
+        batch[m].name = pf.ent[i].name;
+        batch[m].len = strlen(pf.ent[i].name);
+        m++;
+    }
+    prefetch_ids(vol, dir, batch, m);
+}
+
+/*!
+ * Stat the next entries of a saved directory listing in parallel
+ *
+ * Without threads the entries are stat'ed here if the CNID backend can look
+ * up their CNIDs in one request.
+ *
+ * @returns number of entries in pf.ent, 0 if nothing was prefetched
+ */
+static int prefetch(const AFPObj *obj, struct vol *vol, struct dir *dir, const char *p, uint16_t reqcnt)
+{
+    int n = 0, len, i;
+    int batch = (vol->v_cdb != NULL && vol->v_cdb->cnid_lookup_batch != NULL);
+
+    if ((obj->options.enumthreads <= 0 && !batch) || reqcnt < PREFETCH_MIN)
+        return 0;
+
+    while (n < PREFETCH_MAX && n < reqcnt && (len = (unsigned char)*p) != 0) {
+        p++;
+        if (*p != 0)            /* stat() already failed on this one */
+            pf.ent[n++].name = p;
+        p += len + 1;
+    }
+    if (n < PREFETCH_MIN)
+        return 0;
+
+    if (obj->options.enumthreads > 0 && prefetch_init(obj->options.enumthreads) > 0) {
+        pthread_mutex_lock(&pf.lock);
+        pf.stat_opt = vol_syml_opt(vol);
+        pf.ea = (vol->v_adouble == AD_VERSION_EA);
+        pf.count = n;
+        pf.next = 0;
+        pf.pending = n;
+        pthread_cond_broadcast(&pf.work);
+        prefetch_work();
+        while (pf.pending > 0)
+            pthread_cond_wait(&pf.done, &pf.lock);
+        pthread_mutex_unlock(&pf.lock);
+    } else if (batch) {
+        pf.stat_opt = vol_syml_opt(vol);
+        pf.ea = 0;
+        for (i = 0; i < n; i++)
+            prefetch_one(&pf.ent[i]);
+    } else {
+        return 0;
+    }
+
+    if (batch)
+        prefetch_cnids(vol, dir, n);
+    return n;
+}
+
 /* ----------------------------- 
  * FIXME: 
  * Doesn't work with dangling symlink
@@ -159,12 +372,12 @@ for_each_dirent(const struct vol *vol, char *name, dir_loop fn, void *data)
 #define REPLY_PARAM_MAXLEN (4 + 104 + 1 + MACFILELEN + 4 + 2 + UTF8FILELEN_EARLY + 1)
 
 /* ----------------------------- */
-static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_, 
+static int enumerate(AFPObj *obj, char *ibuf, size_t ibuflen _U_, 
     char *rbuf, 
     size_t *rbuflen, 
     int ext)
 {
-    static struct savedir	sd = { 0, 0, 0, NULL, NULL, 0 };
+    struct savedir		*sd;
     struct vol			*vol;
     struct dir			*dir;
     int				did, ret, len, first = 1;
@@ -176,15 +389,7 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
     struct path                 *o_path;
     struct path                 s_path;
     int                         header;
-        
-    if ( sd.sd_buflen == 0 ) {
-        if (( sd.sd_buf = (char *)malloc( SDBUFBRK )) == NULL ) {
-            LOG(log_error, logtype_afpd, "afp_enumerate: malloc: %s", strerror(errno) );
-            *rbuflen = 0;
-            return AFPERR_MISC;
-        }
-        sd.sd_buflen = SDBUFBRK;
-    }
+    int                         npf, ipf = 0;
 
     ibuf += 2;
 
@@ -276,17 +481,32 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
     data = rbuf + 3 * sizeof( uint16_t );
     sz = 3 * sizeof( uint16_t );	/* fbitmap, dbitmap, reqcount */
 
+    /* if dir was in the cache we don't have the inode */
+    if ( !o_path->st_valid && ostat(".", &o_path->st, vol_syml_opt(vol)) < 0 ) {
+        LOG(log_error, logtype_afpd, "enumerate: stat: %s (%d)", strerror(errno), errno);
+        return errno == EACCES ? AFPERR_ACCESS : AFPERR_NODIR;
+    }
+
+    sd = savedir_get(vid, curdir->d_did);
+    if ( sd->sd_buflen == 0 ) {
+        if (( sd->sd_buf = (char *)malloc( SDBUFBRK )) == NULL ) {
+            LOG(log_error, logtype_afpd, "afp_enumerate: malloc: %s", strerror(errno) );
+            return AFPERR_MISC;
+        }
+        sd->sd_buflen = SDBUFBRK;
+    }
+
     /*
      * Read the directory into a pre-malloced buffer, stored
      *		len <name> \0
      * The end is indicated by a len of 0.
      */
-    if ( sindex == 1 || curdir->d_did != sd.sd_did || vid != sd.sd_vid ) {
-        sd.sd_last = sd.sd_buf;
-        /* if dir was in the cache we don't have the inode */
-        if (( !o_path->st_valid && ostat(".", &o_path->st, vol_syml_opt(vol)) < 0 ) ||
-            (ret = for_each_dirent(vol, ".", enumerate_loop, (void *)&sd)) < 0) 
-        {
+    if ( sindex == 1 || sd->sd_did == 0
+         || sd->sd_mtime != o_path->st.st_mtime || sd->sd_ctime != o_path->st.st_ctime ) {
+        sd->sd_did = 0;
+        sd->sd_last = sd->sd_buf;
+        sd->sd_count = 0;
+        if ((ret = for_each_dirent(vol, ".", enumerate_loop, (void *)sd)) < 0) {
             LOG(log_error, logtype_afpd, "enumerate: loop error: %s (%d)", strerror(errno), errno);
             switch (errno) {
             case EACCES:
@@ -300,33 +520,26 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
             }
         }
         setdiroffcnt(curdir, &o_path->st,  ret);
-        *sd.sd_last = 0;
-
-        sd.sd_last = sd.sd_buf;
-        sd.sd_sindex = 1;
+        *sd->sd_last = 0;
 
-        sd.sd_vid = vid;
-        sd.sd_did = curdir->d_did;
+        sd->sd_vid = vid;
+        sd->sd_did = curdir->d_did;
+        sd->sd_mtime = o_path->st.st_mtime;
+        sd->sd_ctime = o_path->st.st_ctime;
     }
 
     /*
      * Position sd_last as dictated by sindex.
      */
-    if ( sindex < sd.sd_sindex ) {
-        sd.sd_sindex = 1;
-        sd.sd_last = sd.sd_buf;
-    }
-    while ( sd.sd_sindex < sindex ) {
-        len = (unsigned char)*(sd.sd_last)++;
-        if ( len == 0 ) {
-            sd.sd_did = 0;	/* invalidate sd struct to force re-read */
-            return( AFPERR_NOOBJ );
-        }
-        sd.sd_last += len + 1;
-        sd.sd_sindex++;
+    if ( sindex > sd->sd_count ) {
+        sd->sd_did = 0;	/* invalidate sd struct to force re-read */
+        return( AFPERR_NOOBJ );
     }
+    sd->sd_last = sd->sd_buf + sd->sd_index[sindex - 1];
+
+    npf = prefetch(obj, vol, curdir, sd->sd_last, reqcnt);
 
-    while (( len = (unsigned char)*(sd.sd_last)) != 0 ) {
+    while (( len = (unsigned char)*(sd->sd_last)) != 0 ) {
         /*
          * If we've got all we need, send it.
          */
@@ -334,48 +547,63 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
             break;
         }
 
+        /* prefetch the next entries when the last ones are used up */
+        if (npf && ipf == npf) {
+            npf = prefetch(obj, vol, curdir, sd->sd_last, reqcnt - actcnt);
+            ipf = 0;
+        }
+
         /*
          * Save the start position, in case we exceed the buffer
          * limitation, and have to back up one.
          */
-        start = sd.sd_last;
-        sd.sd_last++;
+        start = sd->sd_last;
+        sd->sd_last++;
 
-        if (*sd.sd_last == 0) {
+        if (*sd->sd_last == 0) {
             /* stat() already failed on this one */
-            sd.sd_last += len + 1;
+            sd->sd_last += len + 1;
             continue;
         }
 
         memset(&s_path, 0, sizeof(s_path));
-        s_path.u_name = sd.sd_last;
-        if (of_stat(vol, &s_path) < 0 ) {
+        s_path.u_name = sd->sd_last;
+        if (ipf < npf && pf.ent[ipf].name == sd->sd_last) {
+            s_path.st = pf.ent[ipf].st;
+            s_path.st_errno = pf.ent[ipf].err;
+            s_path.st_valid = 1;
+            ret = s_path.st_errno ? -1 : 0;
+            ipf++;
+        } else {
+            ret = of_stat(vol, &s_path);
+        }
+        if (ret < 0) {
             /* so the next time it won't try to stat it again
              * another solution would be to invalidate the cache with 
-             * sd.sd_did = 0 but if it's not ENOENT error it will start again
+             * sd->sd_did = 0 but if it's not ENOENT error it will start again
              */
-            *sd.sd_last = 0;
-            sd.sd_last += len + 1;
+            *sd->sd_last = 0;
+            sd->sd_last += len + 1;
             curdir->d_offcnt--;		/* a little lie */
             continue;
         }
 
         /* conversions on the fly */
         const char *convname;
-        if (ad_convert(sd.sd_last, &s_path.st, vol, &convname) == 0 && convname) {
+        if (ad_convert(sd->sd_last, &s_path.st, vol, &convname) == 0 && convname) {
             s_path.u_name = (char *)convname;
         }
 
         /* Fixup CNID db if ad_convert resulted in a rename (then convname != NULL) */
         if (convname) {
-            s_path.id = cnid_lookup(vol->v_cdb, &s_path.st, curdir->d_did, sd.sd_last, strlen(sd.sd_last));
+            s_path.id = cnid_lookup(vol->v_cdb, &s_path.st, curdir->d_did, sd->sd_last, strlen(sd->sd_last));
             if (s_path.id != CNID_INVALID) {
                 if (cnid_update(vol->v_cdb, s_path.id, &s_path.st, curdir->d_did, (char *)convname, strlen(convname)) != 0)
                     LOG(log_error, logtype_afpd, "enumerate: error updating CNID of \"%s\"", fullpathname(convname));
             }
         }
 
-        sd.sd_last += len + 1;
+        sd->sd_last += len + 1;
         s_path.m_name = NULL;
 
         /*
@@ -425,7 +653,7 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
             if (first) { /* maxsz can't hold a single reply */
                 return AFPERR_PARAM;
             }
-            sd.sd_last = start;
+            sd->sd_last = start;
             break;
         }
 
@@ -452,7 +680,7 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
     }
 
     if ( actcnt == 0 ) {
-        sd.sd_did = 0;		/* invalidate sd struct to force re-read */
+        sd->sd_did = 0;		/* invalidate sd struct to force re-read */
         /*
          * in case were converting adouble stuff:
          * after enumerating the whole dir we should have converted everything
@@ -464,8 +692,6 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
 
         return( AFPERR_NOOBJ );
     }
-    sd.sd_sindex = sindex + actcnt;
-
     /*
      * All done, fill in misc junk in rbuf
      */
@@ -487,7 +713,10 @@ int afp_enumerate(AFPObj *obj, char *ibuf, size_t ibuflen,
     char *rbuf, 
     size_t *rbuflen)
 {
-    return enumerate(obj, ibuf,ibuflen ,rbuf,rbuflen , 0);
+    int ret = enumerate(obj, ibuf,ibuflen ,rbuf,rbuflen , 0);
+
+    prefetch_ids_reset();
+    return ret;
 }
 
 /* ----------------------------- */
@@ -495,7 +724,10 @@ int afp_enumerate_ext(AFPObj *obj, char *ibuf, size_t ibuflen,
     char *rbuf, 
     size_t *rbuflen)
 {
-    return enumerate(obj, ibuf,ibuflen ,rbuf,rbuflen , 1);
+    int ret = enumerate(obj, ibuf,ibuflen ,rbuf,rbuflen , 1);
+
+    prefetch_ids_reset();
+    return ret;
 }
 
 /* ----------------------------- */
@@ -503,6 +735,9 @@ int afp_enumerate_ext2(AFPObj *obj, char *ibuf, size_t ibuflen,
     char *rbuf, 
     size_t *rbuflen)
 {
-    return enumerate(obj, ibuf,ibuflen ,rbuf,rbuflen , 2);
+    int ret = enumerate(obj, ibuf,ibuflen ,rbuf,rbuflen , 2);
+
+    prefetch_ids_reset();
+    return ret;
 }
 
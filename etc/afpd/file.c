@@ -28,6 +28,7 @@
 
 #include "directory.h"
 #include "dircache.h"
+#include "shmcache.h"
 #include "desktop.h"
 #include "volume.h"
 #include "fork.h"
@@ -187,6 +188,107 @@ char *set_name(const struct vol *vol, char *data, cnid_t pid, char *name, cnid_t
 				  (1 << FILPBIT_FNUM) |\
 				  (1 << FILPBIT_UNIXPR)))
 
+/*
+ * CNIDs looked up in advance by prefetch_ids(), so that enumerate() and catsearch()
+ * need one request to the CNID backend for a few dozen objects instead of one each.
+ * Each entry is used at most once by get_id() and the table is only valid until
+ * prefetch_ids_reset() at the end of the command.
+ */
+#define PREFETCH_NAMELEN 256
+
+static struct {
+    const struct vol *vol;
+    int              count;
+    int              next;
+    struct {
+        cnid_t did;
+        dev_t  dev;
+        ino_t  ino;
+        cnid_t id;
+        char   name[PREFETCH_NAMELEN];
+    } ent[CNID_BATCH_MAX];
+} idpf;
+
+/*!
+ * @brief Look up the CNIDs of objects of a directory with one request to the CNID backend
+ *
+ * Objects that are in the dircache or the shared cache are left out, they
+ * don't need the database.
+ *
+ * @param vol    (r) volume
+ * @param dir    (r) directory of the objects
+ * @param batch  (rw) objects, st, name and len must be set
+ * @param n      (r) number of objects, at most CNID_BATCH_MAX
+ */
+void prefetch_ids(struct vol *vol, struct dir *dir, struct cnid_batch *batch, int n)
+{
+    int i, m = 0;
+
+    idpf.count = 0;
+    idpf.next = 0;
+
+    if (vol->v_cdb == NULL || vol->v_cdb->cnid_lookup_batch == NULL)
+        return;
+
+    for (i = 0; i < n; i++) {
+        if (batch[i].len >= PREFETCH_NAMELEN
+            || dircache_search_by_name(vol, dir, (char *)batch[i].name, batch[i].len) != NULL
+            || shmcache_lookup(vol, batch[i].st, dir->d_did, batch[i].name, batch[i].len) != CNID_INVALID)
+            continue;
+        batch[m] = batch[i];
+        batch[m].did = dir->d_did;
+        m++;
+    }
+    if (m < 2 || cnid_lookup_batch(vol->v_cdb, batch, m) <= 0)
+        return;
+
+    idpf.vol = vol;
+    for (i = 0; i < m; i++) {
+        if (batch[i].id == CNID_INVALID)
+            continue;
+        idpf.ent[idpf.count].did = batch[i].did;
+        idpf.ent[idpf.count].dev = batch[i].st->st_dev;
+        idpf.ent[idpf.count].ino = batch[i].st->st_ino;
+        idpf.ent[idpf.count].id = batch[i].id;
+        memcpy(idpf.ent[idpf.count].name, batch[i].name, batch[i].len);
+        idpf.ent[idpf.count].name[batch[i].len] = 0;
+        idpf.count++;
+    }
+}
+
+void prefetch_ids_reset(void)
+{
+    idpf.count = 0;
+    idpf.next = 0;
+}
+
+/* take a CNID out of the table, objects are usually asked for in the order they were prefetched */
+static cnid_t prefetched_id(const struct vol *vol, const struct stat *st, cnid_t did,
+                            const char *name, int len)
+{
+    int i, j;
+    cnid_t id;
+
+    if (idpf.count == 0 || vol != idpf.vol || len >= PREFETCH_NAMELEN)
+        return CNID_INVALID;
+
+    for (j = 0; j < idpf.count; j++) {
+        i = (idpf.next + j) % idpf.count;
+        if (idpf.ent[i].id == CNID_INVALID
+            || idpf.ent[i].did != did
+            || idpf.ent[i].ino != st->st_ino
+            || idpf.ent[i].dev != st->st_dev
+            || strncmp(idpf.ent[i].name, name, len) != 0
+            || idpf.ent[i].name[len] != 0)
+            continue;
+        id = idpf.ent[i].id;
+        idpf.ent[i].id = CNID_INVALID;
+        idpf.next = i + 1;
+        return id;
+    }
+    return CNID_INVALID;
+}
+
 /*!
  * @brief Get CNID for did/upath args both from database and adouble file
  *
@@ -219,7 +321,13 @@ restart:
            catching moved files */
         adcnid = ad_getid(adp, st->st_dev, st->st_ino, 0, vol->v_stamp); /* (1) */
 
-	    dbcnid = cnid_add(vol->v_cdb, st, did, upath, len, adcnid); /* (2) */
+        /* the shared cache only has CNIDs cnid_add() returned for the same object before */
+        if ((dbcnid = shmcache_lookup(vol, st, did, upath, len)) == CNID_INVALID) {
+            /* a CNID the database already had is what cnid_add() would return */
+            if ((dbcnid = prefetched_id(vol, st, did, upath, len)) == CNID_INVALID)
+                dbcnid = cnid_add(vol->v_cdb, st, did, upath, len, adcnid); /* (2) */
+            shmcache_add(vol, st, did, upath, len, dbcnid);
+        }
 	    /* Throw errors if cnid_add fails. */
 	    if (dbcnid == CNID_INVALID) {
             switch (errno) {
@@ -1692,23 +1800,40 @@ int afp_createid(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_, char *rbuf, si
 
 /* ------------------------------- */
 struct reenum {
-    struct vol *vol;
-    cnid_t     did;
+    struct vol        *vol;
+    cnid_t            did;
+    int               count;
+    struct cnid_batch batch[CNID_BATCH_MAX];
+    struct stat       st[CNID_BATCH_MAX];
+    char              name[CNID_BATCH_MAX][MAXNAMLEN + 1];
 };
 
+/* update or add the CNIDs of a chunk of directory entries, ignoring errors */
+static void reenumerate_flush(struct reenum *param)
+{
+    if (param->count)
+        cnid_add_batch(param->vol->v_cdb, param->batch, param->count);
+    param->count = 0;
+}
+
 static int reenumerate_loop(struct dirent *de, char *mname _U_, void *data)
 {
-    struct path   path;
     struct reenum *param = data;
     struct vol    *vol = param->vol;  
-    cnid_t        did  = param->did;
-    cnid_t	  aint;
-    
-    if (ostat(de->d_name, &path.st, vol_syml_opt(vol)) < 0)
+    int           i = param->count;
+    size_t        len = strlen(de->d_name);
+
+    if (len > MAXNAMLEN || ostat(de->d_name, &param->st[i], vol_syml_opt(vol)) < 0)
         return 0;
-    
-    /* update or add to cnid */
-    aint = cnid_add(vol->v_cdb, &path.st, did, de->d_name, strlen(de->d_name), 0); /* ignore errors */
+
+    memcpy(param->name[i], de->d_name, len + 1);
+    param->batch[i].st = &param->st[i];
+    param->batch[i].did = param->did;
+    param->batch[i].name = param->name[i];
+    param->batch[i].len = len;
+    param->batch[i].hint = 0;
+    if (++param->count == CNID_BATCH_MAX)
+        reenumerate_flush(param);
 
     return 0;
 }
@@ -1721,7 +1846,7 @@ static int
 reenumerate_id(struct vol *vol, char *name, struct dir *dir)
 {
     int             ret;
-    struct reenum   data;
+    static struct reenum data;
     struct stat     st;
     
     if (vol->v_cdb == NULL) {
@@ -1740,7 +1865,10 @@ reenumerate_id(struct vol *vol, char *name, struct dir *dir)
     
     data.vol = vol;
     data.did = dir->d_did;
-    if ((ret = for_each_dirent(vol, name, reenumerate_loop, (void *)&data)) >= 0) {
+    data.count = 0;
+    ret = for_each_dirent(vol, name, reenumerate_loop, (void *)&data);
+    reenumerate_flush(&data);
+    if (ret >= 0) {
         setdiroffcnt(curdir, &st,  ret);
         dir->d_flags |= DIRF_CNID;
     }
@@ -117,6 +117,8 @@ extern void *get_finderinfo (const struct vol *, const char *, struct adouble *,
 extern size_t mtoUTF8   (const struct vol *, const char *, size_t , char *, size_t );
 extern int  copy_path_name (const struct vol *, char *, char *i);
 
+extern void prefetch_ids (struct vol *, struct dir *, struct cnid_batch *, int);
+extern void prefetch_ids_reset (void);
 extern uint32_t get_id  (struct vol *,
                          struct adouble *,
                          const struct stat *,
@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <inttypes.h>
@@ -565,6 +566,14 @@ int afp_setforkparams(AFPObj *obj, char *ibuf, size_t ibuflen, char *rbuf _U_, s
             ad_tmplock(ofork->of_ad, eid, ADLOCK_CLR, size, st_size -size, ofork->of_refnum);
         if (err < 0)
             goto afp_setfork_err;
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+        /* the client tells us the final size, allocate it in one go, best effort */
+        if ((ofork->of_vol->v_flags & AFPVOL_PREALLOC) && size > st_size
+            && ad_data_fileno(ofork->of_ad) >= 0
+            && fallocate(ad_data_fileno(ofork->of_ad), 0, st_size, size - st_size) != 0)
+            LOG(log_debug, logtype_afpd, "afp_setforkparams(%s): fallocate: %s",
+                of_name(ofork), strerror(errno));
+#endif
     } else if (bitmap == (1<<FILPBIT_RFLEN) || bitmap == (1<<FILPBIT_EXTRFLEN)) {
         ad_refresh(NULL, ofork->of_ad );
 
@@ -719,6 +728,77 @@ int afp_bytelock_ext(AFPObj *obj, char *ibuf, size_t ibuflen, char *rbuf, size_t
 
 #undef UNLOCKBIT
 
+#ifdef HAVE_POSIX_FADVISE
+/* max number of pipelined FPRead requests read_prefetch() hints per call */
+#define READ_PREFETCH_MAX 8
+
+/*!
+ * dsi_stream_queued() callback: let the kernel start reading the range of a
+ * queued FPRead/FPReadExt on a data fork
+ */
+static int read_prefetch_cmd(void *arg, uint16_t reqid, const uint8_t *cmd, size_t len)
+{
+    int          *count = arg;
+    struct ofork *ofork;
+    char         *ibuf;
+    off_t        offset, reqcount;
+    uint16_t     ofrefnum;
+    int          is64, fd;
+
+    if (len < 1)
+        return 0;
+
+    switch (cmd[0]) {
+    case AFP_READ:
+        is64 = 0;
+        break;
+    case AFP_READ_EXT:
+        is64 = 1;
+        break;
+    default:
+        return 0;
+    }
+
+    if (len < 4 + 2 * (is64 ? 8 : 4))
+        return 0;
+
+    memcpy(&ofrefnum, cmd + 2, sizeof(ofrefnum));
+    if ((ofork = of_find(ofrefnum)) == NULL
+        || !(ofork->of_flags & AFPFORK_DATA)
+        || !(ofork->of_flags & AFPFORK_ACCRD))
+        return 0;
+
+    /* not open or a symlink */
+    if ((fd = ad_data_fileno(ofork->of_ad)) < 0)
+        return 0;
+
+    ibuf = (char *)cmd + 4;
+    offset   = get_off_t(&ibuf, is64);
+    reqcount = get_off_t(&ibuf, is64);
+    if (offset < 0 || reqcount <= 0)
+        return 0;
+
+    LOG(log_debug, logtype_afpd, "read_prefetch(id: %" PRIu16 ", fork: %" PRIu16 ", off: %jd, len: %jd)",
+        reqid, ofrefnum, (intmax_t)offset, (intmax_t)reqcount);
+
+    posix_fadvise(fd, offset, reqcount, POSIX_FADV_WILLNEED);
+
+    return ++(*count) >= READ_PREFETCH_MAX;
+}
+
+/*!
+ * Start the disk reads for FPRead requests the client has pipelined behind the
+ * current one, so they are served from the page cache by the time we get to them.
+ * Replies are still sent one at a time and in request order.
+ */
+static void read_prefetch(DSI *dsi)
+{
+    int count = 0;
+
+    dsi_stream_queued(dsi, read_prefetch_cmd, &count);
+}
+#endif /* HAVE_POSIX_FADVISE */
+
 /*!
  * Read *rbuflen bytes from fork at offset
  *
@@ -824,6 +904,10 @@ static int read_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, si
         }
     }
 
+#ifdef HAVE_POSIX_FADVISE
+    read_prefetch(dsi);
+#endif
+
 #ifdef WITH_SENDFILE
     if (!(eid == ADEID_DFORK && ad_data_fileno(ofork->of_ad) == AD_SYMLINK) &&
         !(obj->options.flags & OPTION_NOSENDFILE)) {
@@ -920,7 +1004,7 @@ int afp_flush(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_, char *rbuf _U_, s
     return( AFP_OK );
 }
 
-int afp_flushfork(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_, char *rbuf _U_, size_t *rbuflen)
+int afp_flushfork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf _U_, size_t *rbuflen)
 {
     struct ofork    *ofork;
     uint16_t       ofrefnum;
@@ -937,7 +1021,7 @@ int afp_flushfork(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_, char *rbuf _U
     LOG(log_debug, logtype_afpd, "afp_flushfork(fork: %s)",
         (ofork->of_flags & AFPFORK_DATA) ? "d" : "r");
 
-    if ( flushfork( ofork ) < 0 ) {
+    if (((obj->options.flags & OPTION_ASYNC_FLUSH) ? flushfork_async(ofork) : flushfork(ofork)) < 0) {
         LOG(log_error, logtype_afpd, "afp_flushfork(%s): %s", of_name(ofork), strerror(errno) );
     }
 
@@ -977,19 +1061,40 @@ int afp_syncfork(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_, char *rbuf _U_
     return( AFP_OK );
 }
 
+/*!
+ * Make sure all data written to a fd is on disk (wait) or that the kernel has
+ * started writing it out (!wait)
+ *
+ * Without sync_file_range(), or if the kernel doesn't support it, !wait falls
+ * back to fsync(), "async flush" then waits like a normal flush.
+ */
+static int sync_fd(int fd, int wait)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+    if (!wait) {
+        if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE) == 0 || errno == ESPIPE)
+            return 0;
+        if (errno != ENOSYS && errno != EINVAL)
+            return -1;
+    }
+#endif
+    return fsync(fd);
+}
+
 /* this is very similar to closefork */
-int flushfork(struct ofork *ofork)
+static int do_flushfork(struct ofork *ofork, int wait)
 {
     struct timeval tv;
 
     int err = 0, doflush = 0;
 
     if ( ad_data_fileno( ofork->of_ad ) != -1 &&
-         fsync( ad_data_fileno( ofork->of_ad )) < 0 ) {
+         sync_fd( ad_data_fileno( ofork->of_ad ), wait) < 0 ) {
         LOG(log_error, logtype_afpd, "flushfork(%s): dfile(%d) %s",
             of_name(ofork), ad_data_fileno(ofork->of_ad), strerror(errno) );
         err = -1;
     }
+    ofork->of_wbstart = ofork->of_wbend = 0;
 
     if ( ad_reso_fileno( ofork->of_ad ) != -1 &&  /* HF */
          (ofork->of_flags & AFPFORK_RSRC)) {
@@ -1008,7 +1113,7 @@ int flushfork(struct ofork *ofork)
         if (doflush && ad_flush(ofork->of_ad) < 0)
             err = -1;
 
-        if (fsync( ad_reso_fileno( ofork->of_ad )) < 0)
+        if (sync_fd( ad_reso_fileno( ofork->of_ad ), wait) < 0)
             err = -1;
 
         if (err < 0)
@@ -1019,6 +1124,86 @@ int flushfork(struct ofork *ofork)
     return( err );
 }
 
+/* write out the fork and wait until it's on disk */
+int flushfork(struct ofork *ofork)
+{
+    return do_flushfork(ofork, 1);
+}
+
+/* "async flush": update the header and start writeback without waiting for it */
+int flushfork_async(struct ofork *ofork)
+{
+    return do_flushfork(ofork, 0);
+}
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+/* preallocation chunk sizes for appending writes, doubled on every step */
+#define PREALLOC_MIN (1024 * 1024)
+#define PREALLOC_MAX (64 * 1024 * 1024)
+
+/*!
+ * "preallocate": a write at end of file reached end, reserve the next chunk
+ * behind it so files written by streaming appends get large contiguous extents.
+ * The file size is not changed, of_closefork() gives back what's unused behind the
+ * last append.
+ */
+static void prealloc_append(struct ofork *ofork, off_t end)
+{
+    int fd = ad_data_fileno(ofork->of_ad);
+
+    if (fd < 0 || ofork->of_prealloc < 0)
+        return;
+    ofork->of_prealloc_from = end;
+
+    /* still well inside the last chunk */
+    if (end + ofork->of_preallocsz / 2 <= ofork->of_prealloc)
+        return;
+
+    ofork->of_preallocsz = ofork->of_preallocsz ? MIN(2 * ofork->of_preallocsz, PREALLOC_MAX) : PREALLOC_MIN;
+
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, end, ofork->of_preallocsz) != 0) {
+        LOG(log_debug, logtype_afpd, "prealloc_append(%s): %s", of_name(ofork), strerror(errno));
+        /* don't try again for this fork */
+        ofork->of_prealloc = -1;
+        return;
+    }
+    ofork->of_prealloc = end + ofork->of_preallocsz;
+}
+#endif /* HAVE_FALLOCATE */
+
+#ifdef HAVE_SYNC_FILE_RANGE
+/* start writeback once this much has been written to a data fork */
+#define WRITEBEHIND_CHUNK (8 * 1024 * 1024)
+
+/*!
+ * "async flush": hand data fork writes to the kernel writeback in chunks while
+ * they come in, so a later FPSyncFork or close finds little dirty data left
+ */
+static void writebehind(struct ofork *ofork, off_t offset, off_t len)
+{
+    int fd = ad_data_fileno(ofork->of_ad);
+
+    if (fd < 0)
+        return;
+
+    if (ofork->of_wbend == ofork->of_wbstart || offset != ofork->of_wbend) {
+        /* not continuing the previous write, start a new range */
+        ofork->of_wbstart = offset;
+        ofork->of_wbend = offset;
+    }
+    ofork->of_wbend += len;
+
+    if (ofork->of_wbend - ofork->of_wbstart < WRITEBEHIND_CHUNK)
+        return;
+
+    if (sync_file_range(fd, ofork->of_wbstart, ofork->of_wbend - ofork->of_wbstart,
+                        SYNC_FILE_RANGE_WRITE) < 0)
+        LOG(log_debug, logtype_afpd, "writebehind(%s): %s", of_name(ofork), strerror(errno));
+
+    ofork->of_wbstart = ofork->of_wbend;
+}
+#endif /* HAVE_SYNC_FILE_RANGE */
+
 int afp_closefork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf _U_, size_t *rbuflen)
 {
     struct ofork    *ofork;
@@ -1045,6 +1230,23 @@ int afp_closefork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf _U_, s
 }
 
 
+/* map errno of a failed fork write to an AFP error code */
+static int write_file_err(struct ofork *ofork, const char *func)
+{
+    switch ( errno ) {
+    case EDQUOT :
+    case EFBIG :
+    case ENOSPC :
+        LOG(log_error, logtype_afpd, "write_file: DISK FULL");
+        return( AFPERR_DFULL );
+    case EACCES:
+        return AFPERR_ACCESS;
+    default :
+        LOG(log_error, logtype_afpd, "afp_write(%s): %s: %s", of_name(ofork), func, strerror(errno) );
+        return( AFPERR_PARAM );
+    }
+}
+
 static ssize_t write_file(struct ofork *ofork, int eid,
                           off_t offset, char *rbuf,
                           size_t rbuflen)
@@ -1056,18 +1258,7 @@ static ssize_t write_file(struct ofork *ofork, int eid,
 
     if (( cc = ad_write(ofork->of_ad, eid, offset, 0,
                         rbuf, rbuflen)) < 0 ) {
-        switch ( errno ) {
-        case EDQUOT :
-        case EFBIG :
-        case ENOSPC :
-            LOG(log_error, logtype_afpd, "write_file: DISK FULL");
-            return( AFPERR_DFULL );
-        case EACCES:
-            return AFPERR_ACCESS;
-        default :
-            LOG(log_error, logtype_afpd, "afp_write(%s): ad_write: %s", of_name(ofork), strerror(errno) );
-            return( AFPERR_PARAM );
-        }
+        return write_file_err(ofork, "ad_write");
     }
 
     return cc;
@@ -1088,7 +1279,7 @@ static int write_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, s
     ssize_t         cc;
     DSI             *dsi = obj->dsi;
     char            *rcvbuf = (char *)dsi->buffer;
-    size_t          rcvbuflen = dsi->dsireadbuf * dsi->server_quantum;
+    size_t          rcvbuflen = dsi->end - dsi->buffer;
 
     /* figure out parameters */
     ibuf++;
@@ -1174,6 +1365,27 @@ static int write_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, s
 
     offset += cc;
 
+#ifdef WITH_RECVFILE
+    /* data fork: splice the rest from the socket into the file */
+    if (eid == ADEID_DFORK && dsi->datasize > 0
+        && ad_data_fileno(ofork->of_ad) >= 0
+        && !(obj->options.flags & OPTION_NOSENDFILE)) {
+        if ((cc = dsi_stream_receive_file(dsi, ad_data_fileno(ofork->of_ad), offset)) < 0) {
+            cc = write_file_err(ofork, "dsi_stream_receive_file");
+            dsi_writeflush(dsi);
+            *rbuflen = 0;
+            if (obj->options.flags & OPTION_AFP_READ_LOCK)
+                ad_tmplock(ofork->of_ad, eid, ADLOCK_CLR, saveoff, reqcount,  ofork->of_refnum);
+            return cc;
+        }
+
+        LOG(log_debug, logtype_afpd, "afp_write: received: %jd, offset: %jd",
+            (intmax_t)cc, (intmax_t)offset);
+
+        offset += cc;
+    }
+#endif
+
 #if 0 /*def HAVE_SENDFILE_WRITE*/
     if ((cc = ad_writefile(ofork->of_ad, eid, dsi->socket, offset, dsi->datasize)) < 0) {
         switch (errno) {
@@ -1215,6 +1427,15 @@ static int write_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, s
         offset += cc;
     }
 
+#ifdef HAVE_SYNC_FILE_RANGE
+    if (eid == ADEID_DFORK && (obj->options.flags & OPTION_ASYNC_FLUSH))
+        writebehind(ofork, saveoff, offset - saveoff);
+#endif
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (eid == ADEID_DFORK && (ofork->of_vol->v_flags & AFPVOL_PREALLOC) && saveoff >= oldsize)
+        prealloc_append(ofork, offset);
+#endif
+
     if (obj->options.flags & OPTION_AFP_READ_LOCK)
         ad_tmplock(ofork->of_ad, eid, ADLOCK_CLR, saveoff, reqcount,  ofork->of_refnum);
     if ( ad_meta_fileno( ofork->of_ad ) != -1 ) /* META */
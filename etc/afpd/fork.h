@@ -25,6 +25,10 @@ struct ofork {
     cnid_t              of_did;
     uint16_t            of_refnum;
     int                 of_flags;
+    off_t               of_wbstart, of_wbend; /* data fork range not yet handed to writeback */
+    off_t               of_prealloc;  /* data fork preallocated up to here, -1: not supported */
+    off_t               of_preallocsz; /* size of the last preallocation */
+    off_t               of_prealloc_from; /* end of the last append, start of the range to give back */
     struct ofork        **prevp, *next;
 };
 
@@ -80,6 +84,7 @@ extern int of_fstatat(int dirfd, struct path *path);
 
 /* in fork.c */
 extern int          flushfork    (struct ofork *);
+extern int          flushfork_async (struct ofork *);
 
 /* FP functions */
 int afp_openfork (AFPObj *obj, char *ibuf, size_t ibuflen, char *rbuf,  size_t *rbuflen);
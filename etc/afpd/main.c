@@ -16,9 +16,13 @@
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include <errno.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 
 #include <atalk/logger.h>
 #include <atalk/adouble.h>
@@ -32,15 +36,19 @@
 #include <atalk/errchk.h>
 #include <atalk/globals.h>
 #include <atalk/netatalk_conf.h>
+#include <atalk/afpstats.h>
 
 #include "afp_config.h"
 #include "status.h"
 #include "fork.h"
 #include "uam_auth.h"
 #include "afp_zeroconf.h"
+#include "dircache.h"
+#include "shmcache.h"
 
 #define AFP_LISTENERS 32
 #define FDSET_SAFETY  5
+#define AFP_EPOLL_EVENTS 64
 
 unsigned char nologin = 0;
 
@@ -49,60 +57,242 @@ static server_child *server_children;
 static sig_atomic_t reloadconfig = 0;
 static sig_atomic_t gotsigchld = 0;
 
+#ifdef HAVE_SYS_EPOLL_H
+/* epoll instance, the events of the current wakeup and a fd indexed table with associated data */
+static int epollfd = -1;
+static struct epoll_event epevents[AFP_EPOLL_EVENTS];
+static int epevents_used;       /* number of events returned by epoll_wait() */
+static int epevents_cur;        /* index of the event currently being processed */
+static struct polldata *fdtable;
+static int fdtable_size;        /* current allocated size */
+#else
 /* Two pointers to dynamic allocated arrays which store pollfds and associated data */
 static struct pollfd *fdset;
 static struct polldata *polldata;
 static int fdset_size;          /* current allocated size */
+#endif
 static int fdset_used;          /* number of used elements */
 static int disasociated_ipc_fd; /* disasociated sessions uses this fd for IPC */
+static int statsfd = -1;        /* "stats socket" */
+
+/* Session pool: idle pre-forked session processes, "session pool" per listening DSI handle */
+struct pool_entry {
+    pid_t pid;                  /* idle child */
+    DSI   *dsi;                 /* listening DSI handle the child was forked for, NULL: free slot */
+};
+static struct pool_entry *pool;
+static int pool_size;
+static unsigned long long pool_hits, pool_misses;
 
 static afp_child_t *dsi_start(AFPObj *obj, DSI *dsi, server_child *server_children);
+static afp_child_t *dsi_start_idle(AFPObj *obj, DSI *dsi, server_child *server_children);
 
 static void afp_exit(int ret)
 {
     exit(ret);
 }
 
+/* ------------------
+   add a fd to the set of fds the main loop is waiting for.
+   With epoll this is O(1), the associated data is stored in a table indexed by fd.
+*/
+static void fd_add(int fd, enum fdtype fdtype, void *data)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    struct polldata *tmp;
+    int newsize;
+
+    if (fd >= fdtable_size) {
+        newsize = fdtable_size ? fdtable_size : obj.options.connections + AFP_LISTENERS + FDSET_SAFETY;
+        while (newsize <= fd)
+            newsize *= 2;
+        if ((tmp = realloc(fdtable, newsize * sizeof(struct polldata))) == NULL)
+            afp_exit(EXITERR_SYS);
+        memset(&tmp[fdtable_size], 0, (newsize - fdtable_size) * sizeof(struct polldata));
+        fdtable = tmp;
+        fdtable_size = newsize;
+        LOG(log_debug, logtype_afpd, "fd_add: fd table resized to %i entries", fdtable_size);
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        LOG(log_error, logtype_afpd, "fd_add: epoll_ctl(%i): %s", fd, strerror(errno));
+        return;
+    }
+    fdtable[fd].fdtype = fdtype;
+    fdtable[fd].data = data;
+    fdset_used++;
+#else
+    fdset_add_fd(obj.options.connections + AFP_LISTENERS + FDSET_SAFETY,
+                 &fdset,
+                 &polldata,
+                 &fdset_used,
+                 &fdset_size,
+                 fd,
+                 fdtype,
+                 data);
+#endif
+}
 
 /* ------------------
-   initialize fd set we are waiting for.
+   remove a fd from the set of fds the main loop is waiting for.
+   Must be called before the fd is closed.
 */
-static void fd_set_listening_sockets(const AFPObj *config)
+static void fd_del(int fd)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (fd < 0 || fd >= fdtable_size)
+        return;
+    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) != 0)
+        return;
+    memset(&fdtable[fd], 0, sizeof(struct polldata));
+    fdset_used--;
+
+    /* don't dispatch pending events of this wakeup for the removed fd */
+    for (int i = epevents_cur + 1; i < epevents_used; i++) {
+        if (epevents[i].data.fd == fd)
+            epevents[i].data.fd = -1;
+    }
+#else
+    fdset_del_fd(&fdset, &polldata, &fdset_used, &fdset_size, fd);
+#endif
+}
+
+
+/* ------------------
+   number of idle children in the session pool
+*/
+static int pool_idle(void)
+{
+    int idle = 0;
+
+    for (int i = 0; i < pool_size; i++) {
+        if (pool[i].dsi)
+            idle++;
+    }
+    return idle;
+}
+
+/* ------------------
+   number of children serving a client, idle children in the session pool
+   don't count against "max connections"
+*/
+static int pool_sessions(void)
+{
+    return server_children->count - pool_idle();
+}
+
+/* ------------------
+   fork idle children until every listening DSI handle has "session pool" of them
+*/
+static void pool_fill(AFPObj *config)
 {
     DSI *dsi;
+    afp_child_t *child;
+    int i, idle, ndsi = 0;
+
+    if (config->options.sessionpool == 0 || nologin)
+        return;
+
+    if (pool == NULL) {
+        for (dsi = config->dsi; dsi; dsi = dsi->next)
+            ndsi++;
+        if ((pool = calloc(ndsi * config->options.sessionpool, sizeof(struct pool_entry))) == NULL) {
+            LOG(log_error, logtype_afpd, "pool_fill: %s", strerror(errno));
+            return;
+        }
+        pool_size = ndsi * config->options.sessionpool;
+    }
 
     for (dsi = config->dsi; dsi; dsi = dsi->next) {
-        fdset_add_fd(config->options.connections + AFP_LISTENERS + FDSET_SAFETY,
-                     &fdset,
-                     &polldata,
-                     &fdset_used,
-                     &fdset_size,
-                     dsi->serversock,
-                     LISTEN_FD,
-                     dsi);
+        idle = 0;
+        for (i = 0; i < pool_size; i++) {
+            if (pool[i].dsi == dsi)
+                idle++;
+        }
+        for (i = 0; i < pool_size && idle < config->options.sessionpool; i++) {
+            if (pool[i].dsi)
+                continue;
+            if ((child = dsi_start_idle(config, dsi, server_children)) == NULL)
+                return;
+            fd_add(child->ipc_fd, IPC_FD, child);
+            pool[i].pid = child->pid;
+            pool[i].dsi = dsi;
+            idle++;
+        }
+    }
+}
+
+/* ------------------
+   take an idle child for a listening DSI handle out of the pool
+*/
+static afp_child_t *pool_get(const DSI *dsi)
+{
+    afp_child_t *child;
+
+    for (int i = 0; i < pool_size; i++) {
+        if (pool[i].dsi != dsi)
+            continue;
+        pool[i].dsi = NULL;
+        if ((child = server_child_resolve(server_children, CHILD_DSIFORK, pool[i].pid)))
+            return child;
+    }
+    return NULL;
+}
+
+/* ------------------
+   remove a terminated child from the pool
+*/
+static void pool_remove(pid_t pid)
+{
+    for (int i = 0; i < pool_size; i++) {
+        if (pool[i].dsi && pool[i].pid == pid) {
+            pool[i].dsi = NULL;
+            break;
+        }
+    }
+}
+
+/* ------------------
+   terminate all idle children, eg because the configuration is reloaded
+*/
+static void pool_purge(void)
+{
+    for (int i = 0; i < pool_size; i++) {
+        if (pool[i].dsi)
+            kill(pool[i].pid, SIGTERM);
     }
+    free(pool);
+    pool = NULL;
+    pool_size = 0;
+}
+
+/* ------------------
+   initialize fd set we are waiting for.
+*/
+static void fd_set_listening_sockets(const AFPObj *config)
+{
+    DSI *dsi;
+
+    for (dsi = config->dsi; dsi; dsi = dsi->next)
+        fd_add(dsi->serversock, LISTEN_FD, dsi);
 
     if (config->options.flags & OPTION_KEEPSESSIONS)
-        fdset_add_fd(config->options.connections + AFP_LISTENERS + FDSET_SAFETY,
-                     &fdset,
-                     &polldata,
-                     &fdset_used,
-                     &fdset_size,
-                     disasociated_ipc_fd,
-                     DISASOCIATED_IPC_FD,
-                     NULL);
+        fd_add(disasociated_ipc_fd, DISASOCIATED_IPC_FD, NULL);
 }
  
 static void fd_reset_listening_sockets(const AFPObj *config)
 {
     const DSI *dsi;
 
-    for (dsi = config->dsi; dsi; dsi = dsi->next) {
-        fdset_del_fd(&fdset, &polldata, &fdset_used, &fdset_size, dsi->serversock);
-    }
+    for (dsi = config->dsi; dsi; dsi = dsi->next)
+        fd_del(dsi->serversock);
 
     if (config->options.flags & OPTION_KEEPSESSIONS)
-        fdset_del_fd(&fdset, &polldata, &fdset_used, &fdset_size, disasociated_ipc_fd);
+        fd_del(disasociated_ipc_fd);
 }
 
 /* ------------------ */
@@ -156,6 +346,16 @@ static void afp_goaway(int sig)
     return;
 }
 
+/* process the IPC messages a child sent before it exited */
+static void ipc_drain(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    while (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN))
+        if (ipc_server_read(server_children, fd) != 0)
+            break;
+}
+
 static void child_handler(void)
 {
     int fd;
@@ -169,10 +369,15 @@ static void child_handler(void)
     while ((pid = waitpid(WAIT_ANY, &status, WNOHANG)) > 0) {
         for (i = 0; i < server_children->nforks; i++) {
             if ((fd = server_child_remove(server_children, i, pid)) != -1) {
-                fdset_del_fd(&fdset, &polldata, &fdset_used, &fdset_size, fd);        
+                /* the last statistics update of the session may still be queued */
+                if (afpstats_enabled)
+                    ipc_drain(fd);
+                fd_del(fd);
+                close(fd);
                 break;
             }
         }
+        pool_remove(pid);
 
         if (WIFEXITED(status)) {
             if (WEXITSTATUS(status))
@@ -208,6 +413,99 @@ static int setlimits(void)
     return 0;
 }
 
+/* ------------------
+   handle input on a listening socket or IPC fd
+*/
+static void fd_event(enum fdtype fdtype, void *data)
+{
+    afp_child_t *child;
+    int recon_ipc_fd, fd;
+    pid_t pid;
+    DSI *dsi;
+
+    switch (fdtype) {
+
+    case LISTEN_FD:
+        dsi = (DSI *)data;
+        if ((child = pool_get(dsi))) {
+            /* pass the connection to an idle child, then fork a new one. The child
+             * has left the pool, don't count it as one of the other sessions */
+            if (dsi_pool_dispatch(dsi, child, pool_sessions() - 1) == 0)
+                pool_hits++;
+            else
+                kill(child->pid, SIGTERM);
+        } else {
+            if (obj.options.sessionpool)
+                pool_misses++;
+            if ((child = dsi_start(&obj, dsi, server_children))) {
+                /* Add IPC fd to select fd set */
+                fd_add(child->ipc_fd, IPC_FD, child);
+            }
+        }
+        if (obj.options.sessionpool) {
+            LOG(log_debug, logtype_afpd, "main: session pool hits: %llu, misses: %llu",
+                pool_hits, pool_misses);
+            pool_fill(&obj);
+        }
+        break;
+
+    case IPC_FD:
+        child = (afp_child_t *)data;
+        if (child == NULL)
+            break;
+        LOG(log_debug, logtype_afpd, "main: IPC request from child[%u]", child->pid);
+
+        if (ipc_server_read(server_children, child->ipc_fd) != 0) {
+            fd_del(child->ipc_fd);
+            close(child->ipc_fd);
+            child->ipc_fd = -1;
+            if ((obj.options.flags & OPTION_KEEPSESSIONS) && child->disasociated) {
+                LOG(log_note, logtype_afpd, "main: removing reattached child[%u]", child->pid);
+                server_child_remove(server_children, CHILD_DSIFORK, child->pid);
+            }
+        }
+        break;
+
+    case DISASOCIATED_IPC_FD:
+        LOG(log_debug, logtype_afpd, "main: IPC reconnect request");
+        if ((recon_ipc_fd = accept(disasociated_ipc_fd, NULL, NULL)) == -1) {
+            LOG(log_error, logtype_afpd, "main: accept: %s", strerror(errno));
+            break;
+        }
+        if (readt(recon_ipc_fd, &pid, sizeof(pid_t), 0, 1) != sizeof(pid_t)) {
+            LOG(log_error, logtype_afpd, "main: readt: %s", strerror(errno));
+            close(recon_ipc_fd);
+            break;
+        }
+        LOG(log_note, logtype_afpd, "main: IPC reconnect from pid [%u]", pid);
+
+        if ((child = server_child_add(server_children, CHILD_DSIFORK, pid, recon_ipc_fd)) == NULL) {
+            LOG(log_error, logtype_afpd, "main: server_child_add");
+            close(recon_ipc_fd);
+            break;
+        }
+        child->disasociated = 1;
+        fd_add(recon_ipc_fd, IPC_FD, child);
+        break;
+
+    case STATS_FD:
+        if ((fd = accept(statsfd, NULL, NULL)) == -1) {
+            LOG(log_error, logtype_afpd, "main: accept: %s", strerror(errno));
+            break;
+        }
+        /* never wait for a client that doesn't read */
+        if (setnonblock(fd, 1) != 0
+            || afpstats_write(fd, pool_sessions(), AfpNum2name) != 0)
+            LOG(log_debug, logtype_afpd, "main: writing statistics: %s", strerror(errno));
+        close(fd);
+        break;
+
+    default:
+        LOG(log_debug, logtype_afpd, "main: IPC request for unknown type");
+        break;
+    } /* switch */
+}
+
 int main(int ac, char **av)
 {
     struct sigaction	sv;
@@ -229,6 +527,10 @@ int main(int ac, char **av)
     /* Save the user's current umask */
     obj.options.save_mask = umask(obj.options.umask);
 
+    /* Shared CNID cache, must be mapped before any session is forked */
+    if (shmcache_init(obj.options.shmcachesize) != 0)
+        afp_exit(EXITERR_SYS);
+
     /* install child handler for asp and dsi. we do this before afp_goaway
      * as afp_goaway references stuff from here. 
      * XXX: this should really be setup after the initial connections. */
@@ -356,14 +658,35 @@ int main(int ac, char **av)
         disasociated_ipc_fd = ipc_server_uds(_PATH_AFP_IPC);
     }
 
+#ifdef HAVE_SYS_EPOLL_H
+    if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        LOG(log_error, logtype_afpd, "main: epoll_create1: %s", strerror(errno));
+        afp_exit(EXITERR_SYS);
+    }
+#endif
+
+    /* sessions only record statistics if someone can read them */
+    if (obj.options.statssocket) {
+        /* only root may connect, from the moment the socket exists */
+        mode_t mask = umask(077);
+        statsfd = ipc_server_uds(obj.options.statssocket);
+        umask(mask);
+        if (statsfd == -1) {
+            LOG(log_error, logtype_afpd, "main: stats socket \"%s\" failed", obj.options.statssocket);
+        } else {
+            fd_add(statsfd, STATS_FD, NULL);
+            afpstats_enable();
+        }
+    }
+
     fd_set_listening_sockets(&obj);
 
     /* set limits */
     (void)setlimits();
 
-    afp_child_t *child;
-    int recon_ipc_fd;
-    pid_t pid;
+    /* fork idle session processes */
+    pool_fill(&obj);
+
     int saveerrno;
 
     /* wait for an appleshare connection. parent remains in the loop
@@ -375,7 +698,11 @@ int main(int ac, char **av)
     while (1) {
         LOG(log_maxdebug, logtype_afpd, "main: polling %i fds", fdset_used);
         pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+#ifdef HAVE_SYS_EPOLL_H
+        ret = epoll_wait(epollfd, epevents, AFP_EPOLL_EVENTS, -1);
+#else
         ret = poll(fdset, fdset_used, -1);
+#endif
         pthread_sigmask(SIG_BLOCK, &sigs, NULL);
         saveerrno = errno;
 
@@ -389,6 +716,10 @@ int main(int ac, char **av)
             nologin++;
 
             fd_reset_listening_sockets(&obj);
+            if (obj.options.sessionpool)
+                LOG(log_info, logtype_afpd, "session pool statistics: hits: %llu, misses: %llu",
+                    pool_hits, pool_misses);
+            pool_purge();
 
             LOG(log_info, logtype_afpd, "re-reading configuration file");
 
@@ -407,6 +738,7 @@ int main(int ac, char **av)
 
             nologin = 0;
             reloadconfig = 0;
+            pool_fill(&obj);
             errno = saveerrno;
             continue;
         }
@@ -421,74 +753,21 @@ int main(int ac, char **av)
             break;
         }
 
+#ifdef HAVE_SYS_EPOLL_H
+        epevents_used = ret;
+        for (epevents_cur = 0; epevents_cur < epevents_used; epevents_cur++) {
+            int fd = epevents[epevents_cur].data.fd;
+            if (fd == -1)
+                continue;
+            fd_event(fdtable[fd].fdtype, fdtable[fd].data);
+        }
+        epevents_used = 0;
+#else
         for (int i = 0; i < fdset_used; i++) {
-            if (fdset[i].revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) {
-                switch (polldata[i].fdtype) {
-
-                case LISTEN_FD:
-                    if ((child = dsi_start(&obj, (DSI *)polldata[i].data, server_children))) {
-                        /* Add IPC fd to select fd set */
-                        fdset_add_fd(obj.options.connections + AFP_LISTENERS + FDSET_SAFETY,
-                                     &fdset,
-                                     &polldata,
-                                     &fdset_used,
-                                     &fdset_size,
-                                     child->ipc_fd,
-                                     IPC_FD,
-                                     child);
-                    }
-                    break;
-
-                case IPC_FD:
-                    child = (afp_child_t *)polldata[i].data;
-                    LOG(log_debug, logtype_afpd, "main: IPC request from child[%u]", child->pid);
-
-                    if (ipc_server_read(server_children, child->ipc_fd) != 0) {
-                        fdset_del_fd(&fdset, &polldata, &fdset_used, &fdset_size, child->ipc_fd);
-                        close(child->ipc_fd);
-                        child->ipc_fd = -1;
-                        if ((obj.options.flags & OPTION_KEEPSESSIONS) && child->disasociated) {
-                            LOG(log_note, logtype_afpd, "main: removing reattached child[%u]", child->pid);
-                            server_child_remove(server_children, CHILD_DSIFORK, child->pid);
-                        }
-                    }
-                    break;
-
-                case DISASOCIATED_IPC_FD:
-                    LOG(log_debug, logtype_afpd, "main: IPC reconnect request");
-                    if ((recon_ipc_fd = accept(disasociated_ipc_fd, NULL, NULL)) == -1) {
-                        LOG(log_error, logtype_afpd, "main: accept: %s", strerror(errno));
-                        break;
-                    }
-                    if (readt(recon_ipc_fd, &pid, sizeof(pid_t), 0, 1) != sizeof(pid_t)) {
-                        LOG(log_error, logtype_afpd, "main: readt: %s", strerror(errno));
-                        close(recon_ipc_fd);
-                        break;
-                    }
-                    LOG(log_note, logtype_afpd, "main: IPC reconnect from pid [%u]", pid);
-
-                    if ((child = server_child_add(server_children, CHILD_DSIFORK, pid, recon_ipc_fd)) == NULL) {
-                        LOG(log_error, logtype_afpd, "main: server_child_add");
-                        close(recon_ipc_fd);
-                        break;
-                    }
-                    child->disasociated = 1;
-                    fdset_add_fd(obj.options.connections + AFP_LISTENERS + FDSET_SAFETY,
-                                 &fdset,
-                                 &polldata,
-                                 &fdset_used,
-                                 &fdset_size,
-                                 recon_ipc_fd,
-                                 IPC_FD,
-                                 child);
-                    break;
-
-                default:
-                    LOG(log_debug, logtype_afpd, "main: IPC request for unknown type");
-                    break;
-                } /* switch */
-            }  /* if */
-        } /* for (i)*/
+            if (fdset[i].revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL))
+                fd_event(polldata[i].fdtype, polldata[i].data);
+        }
+#endif
     } /* while (1) */
 
     return 0;
@@ -498,14 +777,51 @@ static afp_child_t *dsi_start(AFPObj *obj, DSI *dsi, server_child *server_childr
 {
     afp_child_t *child = NULL;
 
-    if (dsi_getsession(dsi, server_children, obj->options.tickleval, &child) != 0) {
+    if (dsi_getsession(dsi, server_children, obj->options.tickleval, pool_sessions(), &child) != 0) {
         LOG(log_error, logtype_afpd, "dsi_start: session error: %s", strerror(errno));
         return NULL;
     }
 
     /* we've forked. */
     if (child == NULL) {
+#ifdef HAVE_SYS_EPOLL_H
+        close(epollfd);
+#endif
+        if (statsfd != -1)
+            close(statsfd);
+        configfree(obj, dsi);
+        setuplog_async_child();
+        afp_over_dsi(obj); /* start a session */
+        exit (0);
+    }
+
+    return child;
+}
+
+static afp_child_t *dsi_start_idle(AFPObj *obj, DSI *dsi, server_child *server_children)
+{
+    afp_child_t *child = NULL;
+
+    if (dsi_prefork(dsi, server_children, &child) != 0) {
+        LOG(log_error, logtype_afpd, "dsi_start_idle: session error: %s", strerror(errno));
+        return NULL;
+    }
+
+    /* we've forked. */
+    if (child == NULL) {
+#ifdef HAVE_SYS_EPOLL_H
+        close(epollfd);
+#endif
+        if (statsfd != -1)
+            close(statsfd);
         configfree(obj, dsi);
+        setuplog_async_child();
+        /* do as much session initialisation as possible before we get a client */
+        if (dircache_init(obj->options.dircachesize, obj->options.dircachefiles,
+                          obj->options.flags & OPTION_DCNOTIFY, obj->options.dircacheneg) != 0)
+            exit(EXITERR_SYS);
+        if (dsi_pool_getsession(dsi, obj->options.tickleval) != 0)
+            exit(0);
         afp_over_dsi(obj); /* start a session */
         exit (0);
     }
@@ -16,6 +16,7 @@
 #include <sys/stat.h> /* works around a bug */
 #include <sys/param.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <atalk/logger.h>
 #include <atalk/util.h>
@@ -71,7 +72,8 @@ int of_flush(const struct vol *vol)
 
     for ( refnum = 0; refnum < nforks; refnum++ ) {
         if (oforks[ refnum ] != NULL && (oforks[refnum]->of_vol == vol) &&
-            flushfork( oforks[ refnum ] ) < 0 ) {
+            ((vol->v_obj->options.flags & OPTION_ASYNC_FLUSH) ?
+             flushfork_async( oforks[ refnum ] ) : flushfork( oforks[ refnum ] )) < 0 ) {
             LOG(log_error, logtype_afpd, "of_flush: %s", strerror(errno) );
         }
     }
@@ -205,6 +207,8 @@ of_alloc(struct vol *vol,
     of->of_ad = ad;
     of->of_vol = vol;
     of->of_did = dir->d_did;
+    of->of_wbstart = of->of_wbend = 0;
+    of->of_prealloc = of->of_preallocsz = of->of_prealloc_from = 0;
 
     *ofrefnum = refnum;
     of->of_refnum = refnum;
@@ -384,6 +388,41 @@ void of_dealloc(struct ofork *of)
 }
 
 /* --------------------------- */
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+/*
+ * Give back the space this fork preallocated behind its last append. The file
+ * may be shared with other sessions or with local, NFS or Samba writers, so it is
+ * never truncated. The trim is skipped if any other AFP session has the file open,
+ * and the hole is punched under a write lock on the range, starting no lower than
+ * the current end of file. Filesystems that ignore holes past EOF (ext4) keep the
+ * space until the file is truncated or deleted.
+ */
+static void of_prealloc_trim(struct ofork *ofork)
+{
+    int fd = ad_data_fileno(ofork->of_ad);
+    off_t from = ofork->of_prealloc_from, len = ofork->of_prealloc - from;
+    struct stat st;
+
+    if (ofork->of_prealloc <= 0 || !(ofork->of_flags & AFPFORK_DATA) || fd < 0 || len <= 0)
+        goto exit;
+    if (ad_openforks(ofork->of_ad, 0))
+        goto exit;
+    if (ad_tmplock(ofork->of_ad, ADEID_DFORK, ADLOCK_WR, from, len, ofork->of_refnum) < 0)
+        goto exit;
+
+    if (fstat(fd, &st) == 0 && st.st_size < ofork->of_prealloc) {
+        if (st.st_size > from)
+            from = st.st_size;
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, ofork->of_prealloc - from) != 0)
+            LOG(log_debug, logtype_afpd, "of_prealloc_trim(%s): %s", of_name(ofork), strerror(errno));
+    }
+    ad_tmplock(ofork->of_ad, ADEID_DFORK, ADLOCK_CLR, ofork->of_prealloc_from, len, ofork->of_refnum);
+
+exit:
+    ofork->of_prealloc = 0;
+}
+#endif
+
 int of_closefork(const AFPObj *obj, struct ofork *ofork)
 {
     struct timeval      tv;
@@ -415,6 +454,10 @@ int of_closefork(const AFPObj *obj, struct ofork *ofork)
 
     ad_unlock(ofork->of_ad, ofork->of_refnum, ofork->of_flags & AFPFORK_ERROR ? 0 : 1);
 
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    of_prealloc_trim(ofork);
+#endif
+
 #ifdef HAVE_FSHARE_T
     if (obj->options.flags & OPTION_SHARE_RESERV) {
         fshare_t shmd;
@@ -0,0 +1,424 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+/*!
+ * @file
+ * Open addressing hashtable with Robin Hood hashing
+ *
+ * The table is an array of slots storing the hash and a pointer to the object, so a
+ * lookup reads consecutive slots and only calls the compare function for an equal
+ * hash. Robin Hood insertion keeps the distance of entries from their home slot
+ * balanced, lookups can stop at the first entry that is closer to its home than the
+ * searched key would be, deletion shifts the following entries back instead of
+ * leaving tombstones.
+ *
+ * When the table is 7/8 full, a table of twice the size is allocated and every
+ * following insert or remove moves RHASH_MIGRATE slots of the old table, so no single
+ * operation has to rehash the whole table. Lookups search both tables meanwhile.
+ * The old table is migrated from its last slot downwards: a backward shift after a
+ * removal then never moves an entry from the unmigrated part to the migrated part.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rhash.h"
+
+#define RHASH_MINSIZE 64
+#define RHASH_MIGRATE 16        /* slots of the old table migrated per operation */
+#define RHASH_MAXLOAD(t) ((t)->mask + 1 - ((t)->mask + 1) / 8)
+
+/* distance of slot pos from the home slot of hash */
+#define DIST(t, pos, hash) (((pos) - (hash)) & (t)->mask)
+
+static int table_alloc(struct rhash_table *t, uint32_t size)
+{
+    if ((t->slots = calloc(size, sizeof(rhash_slot_t))) == NULL)
+        return -1;
+    t->mask = size - 1;
+    t->count = 0;
+    return 0;
+}
+
+static void table_put(struct rhash_table *t, uint32_t hash, void *data)
+{
+    rhash_slot_t *slot, tmp;
+    uint32_t pos = hash & t->mask;
+    uint32_t dist = 0, sdist;
+
+    for (;;) {
+        slot = &t->slots[pos];
+        if (slot->data == NULL) {
+            slot->hash = hash;
+            slot->data = data;
+            t->count++;
+            return;
+        }
+        /* take the slot from an entry that is closer to its home */
+        if ((sdist = DIST(t, pos, slot->hash)) < dist) {
+            tmp = *slot;
+            slot->hash = hash;
+            slot->data = data;
+            hash = tmp.hash;
+            data = tmp.data;
+            dist = sdist;
+        }
+        pos = (pos + 1) & t->mask;
+        dist++;
+    }
+}
+
+/* returns the slot of key or -1 */
+static long table_find(const struct rhash_table *t, uint32_t hash, const void *key, rhash_comp_t comp)
+{
+    const rhash_slot_t *slot;
+    uint32_t pos, dist;
+
+    if (t->slots == NULL)
+        return -1;
+
+    for (pos = hash & t->mask, dist = 0; ; pos = (pos + 1) & t->mask, dist++) {
+        slot = &t->slots[pos];
+        if (slot->data == NULL || DIST(t, pos, slot->hash) < dist)
+            return -1;
+        if (slot->hash == hash && comp(key, slot->data) == 0)
+            return pos;
+    }
+}
+
+static void table_del(struct rhash_table *t, uint32_t pos)
+{
+    uint32_t next = (pos + 1) & t->mask;
+
+    while (t->slots[next].data && DIST(t, next, t->slots[next].hash) != 0) {
+        t->slots[pos] = t->slots[next];
+        pos = next;
+        next = (next + 1) & t->mask;
+    }
+    t->slots[pos].data = NULL;
+    t->count--;
+}
+
+/* move up to n slots of the old table */
+static void migrate(rhash_t *h, uint32_t n)
+{
+    rhash_slot_t *slot;
+
+    while (h->old.slots && n--) {
+        if (h->old.count == 0) {
+            free(h->old.slots);
+            h->old.slots = NULL;
+            return;
+        }
+        slot = &h->old.slots[h->migrate];
+        if (slot->data) {
+            table_put(&h->tab, slot->hash, slot->data);
+            table_del(&h->old, h->migrate);
+            /* an entry that wrapped around was shifted into the slot */
+            if (slot->data)
+                continue;
+        }
+        h->migrate = (h->migrate - 1) & h->old.mask;
+    }
+}
+
+/********************************************************************************
+ * Interface
+ *******************************************************************************/
+
+/*!
+ * @brief Create a hashtable
+ *
+ * @param size     (r) expected number of entries, the table grows as needed
+ * @param comp     (r) compare function
+ * @param hash     (r) hash function
+ *
+ * @returns hashtable or NULL on error
+ */
+rhash_t *rhash_create(uint32_t size, rhash_comp_t comp, rhash_fun_t hash)
+{
+    rhash_t *h;
+    uint32_t slots = RHASH_MINSIZE;
+
+    while (slots - slots / 8 < size && slots < (1U << 31))
+        slots *= 2;
+
+    if ((h = calloc(1, sizeof(rhash_t))) == NULL)
+        return NULL;
+    if (table_alloc(&h->tab, slots) != 0) {
+        free(h);
+        return NULL;
+    }
+    h->hash = hash;
+    h->comp = comp;
+    return h;
+}
+
+void rhash_destroy(rhash_t *h)
+{
+    if (h == NULL)
+        return;
+    free(h->tab.slots);
+    free(h->old.slots);
+    free(h);
+}
+
+/*!
+ * @brief Add an object, the caller makes sure its key isn't in the table yet
+ *
+ * @returns 0 on success, -1 if out of memory
+ */
+int rhash_insert(rhash_t *h, void *data)
+{
+    struct rhash_table bigger;
+
+    migrate(h, RHASH_MIGRATE);
+
+    if (h->tab.count + 1 > RHASH_MAXLOAD(&h->tab)) {
+        /* finish a running resize before starting the next one */
+        migrate(h, UINT32_MAX);
+        if (table_alloc(&bigger, (h->tab.mask + 1) * 2) == 0) {
+            h->old = h->tab;
+            h->tab = bigger;
+            h->migrate = h->old.mask;
+            migrate(h, RHASH_MIGRATE);
+        } else if (h->tab.count == h->tab.mask) {
+            /* keep one empty slot, lookups rely on it */
+            return -1;
+        }
+    }
+
+    table_put(&h->tab, h->hash(data), data);
+    return 0;
+}
+
+/*!
+ * @brief Search an object
+ *
+ * @returns the object or NULL
+ */
+void *rhash_lookup(const rhash_t *h, const void *key)
+{
+    uint32_t hash = h->hash(key);
+    long pos;
+
+    if ((pos = table_find(&h->tab, hash, key, h->comp)) != -1)
+        return h->tab.slots[pos].data;
+    if ((pos = table_find(&h->old, hash, key, h->comp)) != -1)
+        return h->old.slots[pos].data;
+    return NULL;
+}
+
+/*!
+ * @brief Remove an object
+ *
+ * @returns the removed object or NULL if it wasn't found
+ */
+void *rhash_remove(rhash_t *h, const void *key)
+{
+    uint32_t hash = h->hash(key);
+    void *data;
+    long pos;
+
+    migrate(h, RHASH_MIGRATE);
+
+    if ((pos = table_find(&h->tab, hash, key, h->comp)) != -1) {
+        data = h->tab.slots[pos].data;
+        table_del(&h->tab, pos);
+        return data;
+    }
+    if ((pos = table_find(&h->old, hash, key, h->comp)) != -1) {
+        data = h->old.slots[pos].data;
+        table_del(&h->old, pos);
+        return data;
+    }
+    return NULL;
+}
+
+/*!
+ * @brief Iterate over all objects, the table must not be modified meanwhile
+ *
+ * @param pos     (rw) iterator, set to 0 for the first call
+ *
+ * @returns next object or NULL at the end
+ */
+void *rhash_scan(const rhash_t *h, uint32_t *pos)
+{
+    uint32_t oldsize = h->old.slots ? h->old.mask + 1 : 0;
+    const rhash_slot_t *slot;
+
+    for (; *pos < oldsize + h->tab.mask + 1; (*pos)++) {
+        if (*pos < oldsize)
+            slot = &h->old.slots[*pos];
+        else
+            slot = &h->tab.slots[*pos - oldsize];
+        if (slot->data) {
+            (*pos)++;
+            return slot->data;
+        }
+    }
+    return NULL;
+}
+
+/*!
+ * @brief Memory used by the tables in bytes
+ */
+size_t rhash_memsize(const rhash_t *h)
+{
+    size_t size = sizeof(rhash_t) + (size_t)(h->tab.mask + 1) * sizeof(rhash_slot_t);
+
+    if (h->old.slots)
+        size += (size_t)(h->old.mask + 1) * sizeof(rhash_slot_t);
+    return size;
+}
+
+#ifdef RHASH_TEST_MAIN
+
+/*
+ * Microbenchmark: insert, lookup (hits and misses) and remove n objects with rhash
+ * and the kazlib hashtable used before, with the dircache CNID hash function.
+ * Exits non-zero if a table loses or invents an object. "make check" doesn't run it,
+ * test003_rhash() in test/afpd checks rhash with a small table instead.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <atalk/hash.h>
+#include "hash.h"
+
+struct obj {
+    uint32_t id;
+    uint16_t vid;
+};
+
+static uint32_t obj_hash(const void *key)
+{
+    const struct obj *k = key;
+    uint32_t hash = 2166136261U;
+    int i;
+
+    hash ^= k->vid;
+    hash *= 16777619;
+    for (i = 24; i >= 0; i -= 8) {
+        hash ^= (k->id >> i) & 0xff;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static hash_val_t obj_hash_kazlib(const void *key)
+{
+    return obj_hash(key);
+}
+
+static int obj_comp(const void *key1, const void *key2)
+{
+    const struct obj *k1 = key1, *k2 = key2;
+    return !(k1->id == k2->id && k1->vid == k2->vid);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define NS(t0, t1, n) (((t1) - (t0)) * 1e9 / (n))
+
+static int bench(uint32_t n)
+{
+    struct obj *objs, miss;
+    rhash_t *rh;
+    hash_t *kh;
+    hnode_t *hn;
+    double t0, t1, t2, t3, t4;
+    uint32_t i, found = 0;
+    int ret = 0;
+
+    if (n == 0 || (objs = malloc(n * sizeof(struct obj))) == NULL)
+        return 1;
+    for (i = 0; i < n; i++) {
+        objs[i].id = htonl(i * 7 + 17);
+        objs[i].vid = 1;
+    }
+    miss.vid = 2;
+
+    rh = rhash_create(64, obj_comp, obj_hash);
+    t0 = now();
+    for (i = 0; i < n; i++)
+        rhash_insert(rh, &objs[i]);
+    t1 = now();
+    for (i = 0; i < n; i++)
+        found += rhash_lookup(rh, &objs[(i * 4099) % n]) != NULL;
+    t2 = now();
+    for (i = 0; i < n; i++) {
+        miss.id = objs[i].id;
+        found += rhash_lookup(rh, &miss) != NULL;
+    }
+    t3 = now();
+    for (i = 0; i < n; i++)
+        rhash_remove(rh, &objs[i]);
+    t4 = now();
+    printf("rhash  %8u: insert %6.1f ns, hit %6.1f ns, miss %6.1f ns, remove %6.1f ns (%u)\n",
+           n, NS(t0, t1, n), NS(t1, t2, n), NS(t2, t3, n), NS(t3, t4, n), found);
+    if (found != n || rhash_count(rh) != 0)
+        ret = 1;
+    rhash_destroy(rh);
+
+    found = 0;
+    kh = hash_create(HASHCOUNT_T_MAX, obj_comp, obj_hash_kazlib);
+    t0 = now();
+    for (i = 0; i < n; i++)
+        hash_alloc_insert(kh, &objs[i], &objs[i]);
+    t1 = now();
+    for (i = 0; i < n; i++)
+        found += hash_lookup(kh, &objs[(i * 4099) % n]) != NULL;
+    t2 = now();
+    for (i = 0; i < n; i++) {
+        miss.id = objs[i].id;
+        found += hash_lookup(kh, &miss) != NULL;
+    }
+    t3 = now();
+    for (i = 0; i < n; i++) {
+        if ((hn = hash_lookup(kh, &objs[i])))
+            hash_delete_free(kh, hn);
+    }
+    t4 = now();
+    printf("kazlib %8u: insert %6.1f ns, hit %6.1f ns, miss %6.1f ns, remove %6.1f ns (%u)\n",
+           n, NS(t0, t1, n), NS(t1, t2, n), NS(t2, t3, n), NS(t3, t4, n), found);
+    if (found != n || hash_count(kh) != 0)
+        ret = 1;
+    hash_destroy(kh);
+
+    free(objs);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t n;
+    int ret = 0;
+
+    if (argc > 1)
+        return bench(strtoul(argv[1], NULL, 10));
+    for (n = 10000; n <= 1000000; n *= 10)
+        ret |= bench(n);
+    return ret;
+}
+
+#endif /* RHASH_TEST_MAIN */
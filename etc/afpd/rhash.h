@@ -0,0 +1,53 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+#ifndef RHASH_H
+#define RHASH_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* hash of a key, keys are the stored objects themselves or lookup keys of the same type */
+typedef uint32_t (*rhash_fun_t)(const void *key);
+/* 0 if the keys are equal */
+typedef int (*rhash_comp_t)(const void *key1, const void *key2);
+
+typedef struct rhash_slot {
+    uint32_t hash;              /* hash of data, saves calls of the hash and compare funcs */
+    void     *data;             /* NULL for an empty slot */
+} rhash_slot_t;
+
+struct rhash_table {
+    rhash_slot_t *slots;
+    uint32_t     mask;          /* number of slots - 1 */
+    uint32_t     count;
+};
+
+typedef struct rhash {
+    struct rhash_table tab;     /* current table */
+    struct rhash_table old;     /* table that is migrated to tab after a resize */
+    uint32_t           migrate; /* next slot of old to migrate */
+    rhash_fun_t        hash;
+    rhash_comp_t       comp;
+} rhash_t;
+
+extern rhash_t  *rhash_create(uint32_t size, rhash_comp_t, rhash_fun_t);
+extern void     rhash_destroy(rhash_t *);
+extern int      rhash_insert(rhash_t *, void *data);
+extern void     *rhash_lookup(const rhash_t *, const void *key);
+extern void     *rhash_remove(rhash_t *, const void *key);
+extern void     *rhash_scan(const rhash_t *, uint32_t *pos);
+extern size_t   rhash_memsize(const rhash_t *);
+
+#define rhash_count(h) ((h)->tab.count + (h)->old.count)
+
+#endif /* RHASH_H */
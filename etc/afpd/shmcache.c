@@ -0,0 +1,366 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <atalk/util.h>
+#include <atalk/cnid.h>
+#include <atalk/logger.h>
+#include <atalk/volume.h>
+
+#include "shmcache.h"
+
+/*
+ * Shared CNID cache
+ * =================
+ *
+ * Every afpd session has its own dircache, so many users browsing the same tree all
+ * ask the CNID database for the same CNIDs. The shared cache ("shared dircache") is a
+ * mapping set up by the master before any session is forked, which sessions consult
+ * before asking the CNID backend:
+ *
+ * - the name index maps volume/parent DID/name to a CNID, used by get_id(). Entries
+ *   store device, inode and ctime of the object and only match a fresh stat with the
+ *   same values, just like the dircache.
+ * - the DID index maps volume/CNID to parent DID/name, used by dirlookup(). Entries
+ *   store the inode, the caller must stat the resulting path and drop the entry with
+ *   shmcache_remove() if the inode differs.
+ *
+ * Both are 4-way set associative hashtables of fixed size slots. Every slot is protected
+ * by a sequence counter: writers take a slot by making the counter odd, or skip the update
+ * if another process holds it; readers copy the slot and treat it as a miss if the counter
+ * was odd or changed meanwhile. A session that dies while writing a slot leaves it
+ * unusable, which costs one slot.
+ *
+ * Volumes are identified by a hash of their path, because volume ids are per session.
+ * Only volumes with a CNID database shared by all sessions ("dbd", "cdb") use the cache.
+ */
+
+#define SHMCACHE_WAYS 4
+
+struct shmslot {
+    volatile uint32_t seq;      /* odd while a writer updates the slot */
+    uint32_t          volkey;
+    cnid_t            did;      /* parent DID */
+    cnid_t            id;       /* CNID */
+    dev_t             dev;
+    ino_t             ino;
+    time_t            ctime;
+    uint8_t           namelen;  /* 0 for an empty slot */
+    char              name[SHMCACHE_NAMELEN];
+};
+
+static struct shmslot *shm_byname, *shm_bydid;
+static uint32_t shm_mask;       /* number of sets - 1 */
+
+static struct shmcache_stat {
+    unsigned long long lookups;
+    unsigned long long hits;
+    unsigned long long stale;
+    unsigned long long added;
+    unsigned long long busy;
+} shmcache_stat;
+
+/* FNV 1a */
+static uint32_t hash_add(uint32_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/* only backends with a database shared by all sessions */
+static int usable(const struct vol *vol)
+{
+    return shm_byname && vol->v_cdb
+        && (strcmp(vol->v_cnidscheme, "dbd") == 0 || strcmp(vol->v_cnidscheme, "cdb") == 0);
+}
+
+static uint32_t volkey(const struct vol *vol)
+{
+    return hash_add(2166136261U, vol->v_path, strlen(vol->v_path));
+}
+
+static struct shmslot *set_byname(uint32_t key, cnid_t did, const char *name, size_t len)
+{
+    uint32_t hash = hash_add(key, &did, sizeof(did));
+    hash = hash_add(hash, name, len);
+    return &shm_byname[(hash & shm_mask) * SHMCACHE_WAYS];
+}
+
+static struct shmslot *set_bydid(uint32_t key, cnid_t id)
+{
+    uint32_t hash = hash_add(key, &id, sizeof(id));
+    return &shm_bydid[(hash & shm_mask) * SHMCACHE_WAYS];
+}
+
+/*!
+ * @brief Copy a slot consistently
+ *
+ * @returns 0 if the copy is valid
+ */
+static int slot_read(const struct shmslot *slot, struct shmslot *copy)
+{
+    uint32_t seq = slot->seq;
+
+    if (seq & 1)
+        return -1;
+    __sync_synchronize();
+    memcpy(copy, (const void *)slot, sizeof(*copy));
+    __sync_synchronize();
+    if (slot->seq != seq || copy->namelen == 0)
+        return -1;
+    return 0;
+}
+
+/*!
+ * @brief Overwrite a slot unless some other session is writing it
+ */
+static void slot_write(struct shmslot *slot, const struct shmslot *new)
+{
+    uint32_t seq = slot->seq;
+
+    if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1)) {
+        shmcache_stat.busy++;
+        return;
+    }
+    __sync_synchronize();
+    memcpy((char *)slot + sizeof(slot->seq), (const char *)new + sizeof(new->seq),
+           sizeof(*slot) - sizeof(slot->seq));
+    __sync_synchronize();
+    slot->seq = seq + 2;
+}
+
+/*!
+ * @brief Store an entry in a set, replacing an entry for the same key or some other one
+ */
+static void set_store(struct shmslot *set, const struct shmslot *new, int byname)
+{
+    static unsigned int victim;
+    struct shmslot copy;
+    int i;
+
+    for (i = 0; i < SHMCACHE_WAYS; i++) {
+        if (slot_read(&set[i], &copy) != 0)
+            continue;
+        if (copy.volkey != new->volkey)
+            continue;
+        if (byname) {
+            if (copy.did == new->did && copy.namelen == new->namelen
+                && memcmp(copy.name, new->name, new->namelen) == 0)
+                break;
+        } else if (copy.id == new->id) {
+            break;
+        }
+    }
+    if (i == SHMCACHE_WAYS) {
+        for (i = 0; i < SHMCACHE_WAYS; i++)
+            if (set[i].namelen == 0)
+                break;
+    }
+    if (i == SHMCACHE_WAYS)
+        i = victim++ % SHMCACHE_WAYS;
+
+    slot_write(&set[i], new);
+    shmcache_stat.added++;
+}
+
+/********************************************************
+ * Interface
+ ********************************************************/
+
+/*!
+ * @brief Map the shared cache, called in the master before sessions are forked
+ *
+ * @param entries   (r) requested number of entries per index, rounded up to a power of 2
+ *
+ * @returns 0 on success or if disabled, -1 on error
+ */
+int shmcache_init(int entries)
+{
+    size_t size;
+    uint32_t sets = 1;
+
+    if (entries <= 0 || shm_byname)
+        return 0;
+
+    while (sets * SHMCACHE_WAYS < entries && sets < (1 << 22))
+        sets *= 2;
+    size = (size_t)sets * SHMCACHE_WAYS * sizeof(struct shmslot);
+
+    if ((shm_byname = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        LOG(log_error, logtype_afpd, "shmcache_init: mmap: %s", strerror(errno));
+        shm_byname = NULL;
+        return -1;
+    }
+    shm_bydid = (struct shmslot *)((char *)shm_byname + size);
+    shm_mask = sets - 1;
+
+    LOG(log_debug, logtype_afpd, "shmcache_init: %u entries, %zu KB",
+        sets * SHMCACHE_WAYS, 2 * size / 1024);
+    return 0;
+}
+
+/*!
+ * @brief Search the name index
+ *
+ * @param vol      (r) volume
+ * @param st       (r) fresh stat of the object
+ * @param did      (r) parent CNID
+ * @param name     (r) name of the object
+ * @param len      (r) strlen of name
+ *
+ * @returns CNID or CNID_INVALID if not found
+ */
+cnid_t shmcache_lookup(const struct vol *vol, const struct stat *st, cnid_t did, const char *name, size_t len)
+{
+    struct shmslot *set, copy;
+    uint32_t key;
+    int i;
+
+    if (!usable(vol) || len > SHMCACHE_NAMELEN)
+        return CNID_INVALID;
+
+    shmcache_stat.lookups++;
+    key = volkey(vol);
+    set = set_byname(key, did, name, len);
+    for (i = 0; i < SHMCACHE_WAYS; i++) {
+        if (slot_read(&set[i], &copy) != 0)
+            continue;
+        if (copy.volkey != key || copy.did != did || copy.namelen != len
+            || memcmp(copy.name, name, len) != 0)
+            continue;
+        if (copy.dev != st->st_dev || copy.ino != st->st_ino || copy.ctime != st->st_ctime) {
+            shmcache_stat.stale++;
+            return CNID_INVALID;
+        }
+        shmcache_stat.hits++;
+        return copy.id;
+    }
+    return CNID_INVALID;
+}
+
+/*!
+ * @brief Add the CNID of an object to both indexes
+ */
+void shmcache_add(const struct vol *vol, const struct stat *st, cnid_t did, const char *name, size_t len, cnid_t id)
+{
+    struct shmslot new;
+
+    if (!usable(vol) || len > SHMCACHE_NAMELEN || len == 0 || id == CNID_INVALID)
+        return;
+
+    memset(&new, 0, sizeof(new));
+    new.volkey = volkey(vol);
+    new.did = did;
+    new.id = id;
+    new.dev = st->st_dev;
+    new.ino = st->st_ino;
+    new.ctime = st->st_ctime;
+    new.namelen = len;
+    memcpy(new.name, name, len);
+
+    set_store(set_byname(new.volkey, did, name, len), &new, 1);
+    set_store(set_bydid(new.volkey, id), &new, 0);
+}
+
+/*!
+ * @brief Search the DID index, like cnid_resolve()
+ *
+ * @param vol      (r)  volume
+ * @param id       (rw) CNID to resolve, on success its parent CNID
+ * @param buf      (w)  buffer for the name
+ * @param len      (r)  size of buf
+ * @param ino      (w)  inode the caller must check
+ *
+ * @returns pointer to the name in buf, NULL if not found
+ */
+char *shmcache_resolve(const struct vol *vol, cnid_t *id, char *buf, size_t len, ino_t *ino)
+{
+    struct shmslot *set, copy;
+    uint32_t key;
+    int i;
+
+    if (!usable(vol))
+        return NULL;
+
+    shmcache_stat.lookups++;
+    key = volkey(vol);
+    set = set_bydid(key, *id);
+    for (i = 0; i < SHMCACHE_WAYS; i++) {
+        if (slot_read(&set[i], &copy) != 0)
+            continue;
+        if (copy.volkey != key || copy.id != *id || copy.namelen >= len)
+            continue;
+        memcpy(buf, copy.name, copy.namelen);
+        buf[copy.namelen] = 0;
+        *id = copy.did;
+        *ino = copy.ino;
+        shmcache_stat.hits++;
+        return buf;
+    }
+    return NULL;
+}
+
+/*!
+ * @brief Remove a CNID from the DID index
+ */
+void shmcache_remove(const struct vol *vol, cnid_t id)
+{
+    struct shmslot *set, copy, empty;
+    uint32_t key;
+    int i;
+
+    if (!usable(vol))
+        return;
+
+    key = volkey(vol);
+    set = set_bydid(key, id);
+    for (i = 0; i < SHMCACHE_WAYS; i++) {
+        if (slot_read(&set[i], &copy) != 0)
+            continue;
+        if (copy.volkey == key && copy.id == id) {
+            memset(&empty, 0, sizeof(empty));
+            slot_write(&set[i], &empty);
+            shmcache_stat.stale++;
+        }
+    }
+}
+
+/*!
+ * Log shared cache statistics of this session
+ */
+void log_shmcache_stat(void)
+{
+    if (!shm_byname)
+        return;
+
+    LOG(log_info, logtype_afpd, "shared dircache statistics: "
+        "lookups: %llu, hits: %llu, stale: %llu, added: %llu, busy: %llu",
+        shmcache_stat.lookups,
+        shmcache_stat.hits,
+        shmcache_stat.stale,
+        shmcache_stat.added,
+        shmcache_stat.busy);
+}
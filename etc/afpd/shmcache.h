@@ -0,0 +1,32 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+#ifndef SHMCACHE_H
+#define SHMCACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <atalk/volume.h>
+#include <atalk/cnid.h>
+
+/* longest name that is cached */
+#define SHMCACHE_NAMELEN 119
+
+extern int    shmcache_init(int entries);
+extern cnid_t shmcache_lookup(const struct vol *, const struct stat *, cnid_t did, const char *name, size_t len);
+extern void   shmcache_add(const struct vol *, const struct stat *, cnid_t did, const char *name, size_t len, cnid_t id);
+extern char   *shmcache_resolve(const struct vol *, cnid_t *id, char *buf, size_t len, ino_t *ino);
+extern void   shmcache_remove(const struct vol *, cnid_t id);
+extern void   log_shmcache_stat(void);
+
+#endif /* SHMCACHE_H */
@@ -22,6 +22,10 @@
 #include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include <assert.h>
 #include <time.h>
 
@@ -40,133 +44,411 @@
 #endif
 
 
+/*
+ * A connection from an afpd process. fd_table is indexed by the descriptor and
+ * grows as needed. Requests are read into a per connection buffer as they
+ * arrive, a connection with a complete request in its buffer is on the ready
+ * list, one that has to be looked at again after its current request was
+ * answered is on the pending list.
+ */
 struct connection {
     time_t tm;                    /* When respawned last */
-    int    fd;
+    int    fd;                    /* -1: unused slot */
+    int    busy;                  /* A reader thread owns the request */
+    int    dead;                  /* EOF or error while busy, closed once it's back */
+    int    more;                  /* Stopped reading with a full buffer */
+    int    on[2];                 /* On the READY/PENDING list */
+    int    next[2];               /* Next descriptor on the READY/PENDING list */
+    char   *buf;                  /* Received data, the next request starts at buf + start */
+    size_t bufsize;
+    size_t start;
+    size_t end;
 };
 
+#define READY   0
+#define PENDING 1
+
+/* Initial and maximum size of a connection buffer */
+#define CONN_BUFSIZ   (sizeof(struct cnid_dbd_rqst) + MAXPATHLEN + 1)
+#define CONN_BUFMAX   (sizeof(struct cnid_dbd_rqst) + CNID_DBD_BATCH_BUFSIZ)
+
+#define COMM_EPOLL_EVENTS 64
+
 static int   control_fd;
+static int   wakeup_fd = -1;
 static int   cur_fd;
 static struct connection *fd_table;
-static int  fd_table_size;
+static int  fd_table_alloc;       /* allocated slots */
+static int  fd_table_size;        /* without epoll: max number of connections */
 static int  fds_in_use = 0;
+static int  list_head[2] = { -1, -1 };
+static int  list_tail[2] = { -1, -1 };
+#ifdef HAVE_SYS_EPOLL_H
+static int  epollfd = -1;
+#endif
 
+static void list_push(int l, int fd)
+{
+    struct connection *c = &fd_table[fd];
 
-static void invalidate_fd(int fd)
+    if (c->on[l])
+        return;
+    c->on[l] = 1;
+    c->next[l] = -1;
+    if (list_tail[l] == -1)
+        list_head[l] = fd;
+    else
+        fd_table[list_tail[l]].next[l] = fd;
+    list_tail[l] = fd;
+}
+
+static int list_pop(int l)
 {
-    int i;
+    int fd;
 
-    if (fd == control_fd)
+    if ((fd = list_head[l]) == -1)
+        return -1;
+    if ((list_head[l] = fd_table[fd].next[l]) == -1)
+        list_tail[l] = -1;
+    fd_table[fd].on[l] = 0;
+    return fd;
+}
+
+static void list_del(int l, int fd)
+{
+    int i, prev = -1;
+
+    if (!fd_table[fd].on[l])
         return;
-    for (i = 0; i != fds_in_use; i++)
-        if (fd_table[i].fd == fd)
-            break;
+    for (i = list_head[l]; i != fd; i = fd_table[i].next[l])
+        prev = i;
+    if (prev == -1)
+        list_head[l] = fd_table[fd].next[l];
+    else
+        fd_table[prev].next[l] = fd_table[fd].next[l];
+    if (list_tail[l] == fd)
+        list_tail[l] = prev;
+    fd_table[fd].on[l] = 0;
+}
 
-    assert(i < fds_in_use);
+static void conn_close(int fd)
+{
+    struct connection *c = &fd_table[fd];
 
-    fds_in_use--;
-    fd_table[i] = fd_table[fds_in_use];
-    fd_table[fds_in_use].fd = -1;
+    list_del(READY, fd);
+    list_del(PENDING, fd);
+#ifdef HAVE_SYS_EPOLL_H
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
     close(fd);
+    free(c->buf);
+    memset(c, 0, sizeof(struct connection));
+    c->fd = -1;
+    fds_in_use--;
+}
+
+static void invalidate_fd(int fd)
+{
+    if (fd == control_fd)
+        return;
+
+    assert(fd >= 0 && fd < fd_table_alloc && fd_table[fd].fd == fd);
+
+    conn_close(fd);
     return;
 }
 
+/*
+ * Add a new client descriptor. With epoll there's no limit but the number of
+ * open files. Without it we keep up to fd_table_size open descriptors, if the
+ * table is full we close the oldest one to make space. The affected client
+ * will automatically reconnect.
+ */
+static int conn_add(int fd, time_t t)
+{
+    struct connection *tmp;
+    int i, newsize;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+#else
+    time_t older;
+    int l;
+#endif
+
+    if (fd >= fd_table_alloc) {
+        newsize = fd_table_alloc ? fd_table_alloc : fd_table_size;
+        while (newsize <= fd)
+            newsize *= 2;
+        if ((tmp = realloc(fd_table, newsize * sizeof(struct connection))) == NULL) {
+            LOG(log_error, logtype_cnid, "conn_add: out of memory");
+            close(fd);
+            return -1;
+        }
+        memset(&tmp[fd_table_alloc], 0, (newsize - fd_table_alloc) * sizeof(struct connection));
+        for (i = fd_table_alloc; i != newsize; i++)
+            tmp[i].fd = -1;
+        fd_table = tmp;
+        fd_table_alloc = newsize;
+        LOG(log_debug, logtype_cnid, "conn_add: fd table resized to %d entries", fd_table_alloc);
+    }
+
+#ifndef HAVE_SYS_EPOLL_H
+    if (fd >= FD_SETSIZE) {
+        LOG(log_error, logtype_cnid, "conn_add: descriptor %d exceeds FD_SETSIZE", fd);
+        close(fd);
+        return 0;
+    }
+    if (fds_in_use >= fd_table_size) {
+        older = t;
+        l = -1;
+        for (i = 0; i != fd_table_alloc; i++) {
+            if (fd_table[i].fd != -1 && !fd_table[i].busy && older >= fd_table[i].tm) {
+                older = fd_table[i].tm;
+                l = i;
+            }
+        }
+        if (l == -1) {
+            /* every connection waits for a reader thread */
+            close(fd);
+            return 0;
+        }
+        conn_close(l);
+    }
+#endif
+
+    if (setnonblock(fd, 1) != 0) {
+        LOG(log_error, logtype_cnid, "conn_add: setnonblock: %s", strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    /* a request that arrived before we got the descriptor is reported right away */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        LOG(log_error, logtype_cnid, "conn_add: epoll_ctl(%d): %s", fd, strerror(errno));
+        close(fd);
+        return 0;
+    }
+#endif
+
+    fd_table[fd].fd = fd;
+    fd_table[fd].tm = t;
+    fds_in_use++;
+    return 0;
+}
+
+/*
+ * Length of the complete request at the start of the buffer, 0 if it isn't
+ * complete yet, -1 if it is invalid
+ */
+static ssize_t conn_request(const struct connection *c)
+{
+    struct cnid_dbd_rqst rqst;
+    size_t len = c->end - c->start;
+
+    if (len < sizeof(struct cnid_dbd_rqst))
+        return 0;
+    memcpy(&rqst, c->buf + c->start, sizeof(struct cnid_dbd_rqst));
+    if (rqst.namelen > CNID_DBD_BATCH_BUFSIZ)
+        return -1;
+    if (len < sizeof(struct cnid_dbd_rqst) + rqst.namelen)
+        return 0;
+    return sizeof(struct cnid_dbd_rqst) + rqst.namelen;
+}
 
 /*
- *  Check for client requests. We keep up to fd_table_size open descriptors in
- *  fd_table. If the table is full and we get a new descriptor via
- *  control_fd, we close a random decriptor in the table to make space. The
- *  affected client will automatically reconnect. For an EOF (descriptor is
- *  closed by the client, so a read here returns 0) comm_rcv will take care of
- *  things and clean up fd_table. The same happens for any read/write errors.
+ * Read what the client sent until the socket is drained. The buffer grows up
+ * to the size of the request at its start, once it's full with a complete
+ * request we stop and read the rest after that request was taken.
+ * Returns -1 on EOF or error, 0 otherwise.
  */
+static int conn_fill(struct connection *c)
+{
+    ssize_t len;
+    size_t newsize;
+    char *tmp;
+
+    c->more = 0;
+
+    while (1) {
+        if (c->end == c->bufsize && c->start) {
+            memmove(c->buf, c->buf + c->start, c->end - c->start);
+            c->end -= c->start;
+            c->start = 0;
+        }
+        if (c->end == c->bufsize) {
+            if (conn_request(c) != 0) {
+                c->more = 1;
+                return 0;
+            }
+            newsize = c->bufsize ? MIN(2 * c->bufsize, CONN_BUFMAX) : CONN_BUFSIZ;
+            if ((tmp = realloc(c->buf, newsize)) == NULL) {
+                LOG(log_error, logtype_cnid, "conn_fill: out of memory");
+                return -1;
+            }
+            c->buf = tmp;
+            c->bufsize = newsize;
+        }
 
-static int check_fd(time_t timeout, const sigset_t *sigmask, time_t *now)
+        len = read(c->fd, c->buf + c->end, c->bufsize - c->end);
+        if (len > 0) {
+            c->end += len;
+            continue;
+        }
+        if (len == 0)
+            return -1;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        LOG(log_error, logtype_cnid, "error reading message: %s", strerror(errno));
+        return -1;
+    }
+}
+
+/* Put a connection with a complete request on the ready list */
+static void conn_ready(int fd)
+{
+    struct connection *c = &fd_table[fd];
+
+    if (!c->busy && !c->dead && conn_request(c) != 0)
+        list_push(READY, fd);
+}
+
+/* Data or EOF on a client descriptor */
+static void conn_event(int fd)
+{
+    struct connection *c = &fd_table[fd];
+
+    if (c->fd != fd)
+        return;
+
+    if (conn_fill(c) != 0) {
+        if (c->busy)
+            c->dead = 1;
+        else
+            conn_close(fd);
+        return;
+    }
+    conn_ready(fd);
+}
+
+/* New client descriptor from cnid_metad */
+static int conn_accept(time_t t)
 {
     int fd;
+
+    if ((fd = recv_fd(control_fd, 0)) < 0)
+        return -1;
+    return conn_add(fd, t);
+}
+
+/*
+ *  Wait for client requests. Descriptors with data are read into their buffers
+ *  and the ones with a complete request put on the ready list. For an EOF
+ *  (descriptor is closed by the client, so a read here returns 0) or a read
+ *  error the connection is closed, unless a reader thread owns its request, then
+ *  that happens once the request is back. A reader finishing a request wakes us
+ *  up via wakeup_fd.
+ */
+#ifdef HAVE_SYS_EPOLL_H
+static int conn_wait(time_t timeout, const sigset_t *sigmask, time_t *now)
+{
+    struct epoll_event events[COMM_EPOLL_EVENTS];
+    int ret;
+    int i;
+    int fd;
+
+    ret = epoll_pwait(epollfd, events, COMM_EPOLL_EVENTS, timeout * 1000, sigmask);
+    time(now);
+
+    if (ret < 0) {
+        if (errno == EINTR)
+            return 0;
+        LOG(log_error, logtype_cnid, "error in epoll_wait: %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i != ret; i++) {
+        fd = events[i].data.fd;
+        if (fd == wakeup_fd)
+            continue;           /* drained by readers_reap */
+        if (fd == control_fd) {
+            if (conn_accept(*now) < 0)
+                return -1;
+            continue;
+        }
+        conn_event(fd);
+    }
+    return 0;
+}
+#else
+static int conn_wait(time_t timeout, const sigset_t *sigmask, time_t *now)
+{
     fd_set readfds;
     struct timespec tv;
     int ret;
-    int i;
+    int fd;
     int maxfd = control_fd;
-    time_t t;
 
     FD_ZERO(&readfds);
     FD_SET(control_fd, &readfds);
 
-    for (i = 0; i != fds_in_use; i++) {
-        FD_SET(fd_table[i].fd, &readfds);
-        if (maxfd < fd_table[i].fd)
-            maxfd = fd_table[i].fd;
+    if (wakeup_fd != -1) {
+        FD_SET(wakeup_fd, &readfds);
+        if (maxfd < wakeup_fd)
+            maxfd = wakeup_fd;
+    }
+
+    for (fd = 0; fd != fd_table_alloc; fd++) {
+        if (fd_table[fd].fd == -1 || fd_table[fd].busy)
+            continue;
+        FD_SET(fd, &readfds);
+        if (maxfd < fd)
+            maxfd = fd;
     }
 
     tv.tv_nsec = 0;
     tv.tv_sec  = timeout;
-    if ((ret = pselect(maxfd + 1, &readfds, NULL, NULL, &tv, sigmask)) < 0) {
+    ret = pselect(maxfd + 1, &readfds, NULL, NULL, &tv, sigmask);
+    time(now);
+
+    if (ret < 0) {
         if (errno == EINTR)
             return 0;
         LOG(log_error, logtype_cnid, "error in select: %s",strerror(errno));
         return -1;
     }
 
-    time(&t);
-    if (now)
-        *now = t;
-
     if (!ret)
         return 0;
 
-
-    if (FD_ISSET(control_fd, &readfds)) {
-        int    l = 0;
-
-        fd = recv_fd(control_fd, 0);
-        if (fd < 0) {
-            return -1;
-        }
-        if (fds_in_use < fd_table_size) {
-            fd_table[fds_in_use].fd = fd;
-            fd_table[fds_in_use].tm = t;
-            fds_in_use++;
-        } else {
-            time_t older = t;
-
-            for (i = 0; i != fds_in_use; i++) {
-                if (older <= fd_table[i].tm) {
-                    older = fd_table[i].tm;
-                    l = i;
-                }
-            }
-            close(fd_table[l].fd);
-            fd_table[l].fd = fd;
-            fd_table[l].tm = t;
+    for (fd = 0; fd <= maxfd; fd++) {
+        if (!FD_ISSET(fd, &readfds) || fd == wakeup_fd)
+            continue;
+        if (fd == control_fd) {
+            if (conn_accept(*now) < 0)
+                return -1;
+            continue;
         }
-        return 0;
+        conn_event(fd);
     }
-
-    for (i = 0; i != fds_in_use; i++) {
-        if (FD_ISSET(fd_table[i].fd, &readfds)) {
-            fd_table[i].tm = t;
-            return fd_table[i].fd;
-        }
-    }
-    /* We should never get here */
     return 0;
 }
+#endif /* HAVE_SYS_EPOLL_H */
 
 int comm_init(struct db_param *dbp, int ctrlfd, int clntfd)
 {
-    int i;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+#endif
 
     fds_in_use = 0;
     fd_table_size = dbp->fd_table_size;
 
-    if ((fd_table = malloc(fd_table_size * sizeof(struct connection))) == NULL) {
-        LOG(log_error, logtype_cnid, "Out of memory");
-        return -1;
-    }
-    for (i = 0; i != fd_table_size; i++)
-        fd_table[i].fd = -1;
     /* from dup2 */
     control_fd = ctrlfd;
 #if 0
@@ -177,11 +459,74 @@ int comm_init(struct db_param *dbp, int ctrlfd, int clntfd)
         return -1;
     }
 #endif
+
+#ifdef HAVE_SYS_EPOLL_H
+    if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        LOG(log_error, logtype_cnid, "comm_init: epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = control_fd;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, control_fd, &ev) != 0) {
+        LOG(log_error, logtype_cnid, "comm_init: epoll_ctl: %s", strerror(errno));
+        return -1;
+    }
+#endif
+
     /* push the first client fd */
-    fd_table[fds_in_use].fd = clntfd;
-    fds_in_use++;
+    return conn_add(clntfd, time(NULL));
+}
 
-    return 0;
+/*!
+ * Register the descriptor reader threads write to when they finished a request
+ */
+void comm_wakeup(int fd)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+
+    if (wakeup_fd != -1)
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, wakeup_fd, NULL);
+    if (fd != -1) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            LOG(log_error, logtype_cnid, "comm_wakeup: epoll_ctl: %s", strerror(errno));
+    }
+#endif
+    wakeup_fd = fd;
+}
+
+/*!
+ * Hand the current request over to a reader thread
+ *
+ * The descriptor isn't closed and its next request isn't returned by comm_rcv
+ * until comm_resume gives it back.
+ *
+ * @returns the descriptor the reader thread replies to
+ */
+int comm_busy(void)
+{
+    fd_table[cur_fd].busy = 1;
+    return cur_fd;
+}
+
+/*!
+ * Take back a descriptor from a reader thread and make it the current one
+ *
+ * @param fd     (r) descriptor from comm_busy
+ * @param ok     (r) 0 if the reader failed to reply, the connection is closed
+ */
+void comm_resume(int fd, int ok)
+{
+    fd_table[fd].busy = 0;
+    cur_fd = fd;
+    if (!ok)
+        invalidate_fd(fd);
+    else
+        list_push(PENDING, fd);
 }
 
 /* ------------
@@ -195,90 +540,138 @@ int comm_nbe(void)
 /* ------------ */
 int comm_rcv(struct cnid_dbd_rqst *rqst, time_t timeout, const sigset_t *sigmask, time_t *now)
 {
+    struct connection *c;
     char *nametmp;
-    int b;
+    ssize_t len;
+    time_t t;
+    int fd;
 
-    if ((cur_fd = check_fd(timeout, sigmask, now)) < 0)
-        return -1;
+    /* Connections of the previous requests: read what's left, close the dead ones */
+    while ((fd = list_pop(PENDING)) != -1) {
+        c = &fd_table[fd];
+        if (c->busy)
+            continue;           /* comm_resume puts it back */
+        if (c->dead || (c->more && conn_fill(c) != 0)) {
+            conn_close(fd);
+            continue;
+        }
+        conn_ready(fd);
+    }
 
-    if (!cur_fd)
+    if (list_head[READY] == -1) {
+        if (conn_wait(timeout, sigmask, &t) < 0)
+            return -1;
+    } else {
+        time(&t);
+    }
+    if (now)
+        *now = t;
+
+    if ((cur_fd = list_pop(READY)) == -1)
         return 0;
 
     LOG(log_maxdebug, logtype_cnid, "comm_rcv: got data on fd %u", cur_fd);
 
-    if (setnonblock(cur_fd, 1) != 0) {
-        LOG(log_error, logtype_cnid, "comm_rcv: setnonblock: %s", strerror(errno));
-        return -1;
-    }
+    c = &fd_table[cur_fd];
+    c->tm = t;
+    list_push(PENDING, cur_fd);
 
-    nametmp = (char *)rqst->name;
-    if ((b = readt(cur_fd, rqst, sizeof(struct cnid_dbd_rqst), 1, CNID_DBD_TIMEOUT))
-        != sizeof(struct cnid_dbd_rqst)) {
-        if (b)
-            LOG(log_error, logtype_cnid, "error reading message header: %s", strerror(errno));
+    if ((len = conn_request(c)) < 0) {
+        LOG(log_error, logtype_cnid, "error reading message name: too long");
         invalidate_fd(cur_fd);
-        rqst->name = nametmp;
         return 0;
     }
+
+    nametmp = (char *)rqst->name;
+    memcpy(rqst, c->buf + c->start, sizeof(struct cnid_dbd_rqst));
     rqst->name = nametmp;
-    if (rqst->namelen && readt(cur_fd, (char *)rqst->name, rqst->namelen, 1, CNID_DBD_TIMEOUT)
-        != rqst->namelen) {
-        LOG(log_error, logtype_cnid, "error reading message name: %s", strerror(errno));
-        invalidate_fd(cur_fd);
-        return 0;
-    }
+    memcpy(nametmp, c->buf + c->start + sizeof(struct cnid_dbd_rqst), rqst->namelen);
     /* We set this to make life easier for logging. None of the other stuff
        needs zero terminated strings. */
-    ((char *)(rqst->name))[rqst->namelen] = '\0';
+    nametmp[rqst->namelen] = '\0';
 
-    LOG(log_maxdebug, logtype_cnid, "comm_rcv: got %u bytes", b + rqst->namelen);
+    c->start += len;
+    if (c->start == c->end)
+        c->start = c->end = 0;
+
+    LOG(log_maxdebug, logtype_cnid, "comm_rcv: got %zd bytes", len);
 
     return 1;
 }
 
-/* ------------ */
-#define USE_WRITEV
-int comm_snd(struct cnid_dbd_rply *rply)
+/* Seconds a reply waits for a client that doesn't read */
+#define COMM_SND_TIMEOUT 30
+
+/*
+ * Write all of iov to the non-blocking descriptor. A large reply (batch, search)
+ * may not fit into the socket buffer, wait for the client to read the rest.
+ * Returns 0 on success, -1 on error or timeout.
+ */
+static int comm_writev(int fd, struct iovec *iov, int iovcnt)
 {
-#ifdef USE_WRITEV
-    struct iovec iov[2];
-    size_t towrite;
-#endif
+    struct pollfd pfd;
+    ssize_t len;
+    int ret;
 
-    if (!rply->namelen) {
-        if (write(cur_fd, rply, sizeof(struct cnid_dbd_rply)) != sizeof(struct cnid_dbd_rply)) {
-            LOG(log_error, logtype_cnid, "error writing message header: %s", strerror(errno));
-            invalidate_fd(cur_fd);
-            return 0;
+    while (iovcnt > 0) {
+        if ((len = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            while ((ret = poll(&pfd, 1, COMM_SND_TIMEOUT * 1000)) < 0 && errno == EINTR)
+                ;
+            if (ret == 0)
+                errno = ETIMEDOUT;
+            if (ret <= 0)
+                return -1;
+            continue;
+        }
+        while (iovcnt > 0 && (size_t)len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= len;
         }
-        return 1;
     }
-#ifdef USE_WRITEV
+    return 0;
+}
+
+/*!
+ * Send a reply to fd
+ *
+ * Only writes to fd and leaves the descriptor table alone, so reader threads
+ * may call it for the descriptor they got from comm_busy.
+ *
+ * @returns 1 on success, 0 on error
+ */
+int comm_snd_fd(int fd, struct cnid_dbd_rply *rply)
+{
+    struct iovec iov[2];
 
     iov[0].iov_base = rply;
     iov[0].iov_len = sizeof(struct cnid_dbd_rply);
     iov[1].iov_base = rply->name;
     iov[1].iov_len = rply->namelen;
-    towrite = sizeof(struct cnid_dbd_rply) +rply->namelen;
 
-    if (writev(cur_fd, iov, 2) != towrite) {
+    if (comm_writev(fd, iov, rply->namelen ? 2 : 1) != 0) {
         LOG(log_error, logtype_cnid, "error writing message : %s", strerror(errno));
-        invalidate_fd(cur_fd);
         return 0;
     }
-#else
-    if (write(cur_fd, rply, sizeof(struct cnid_dbd_rply)) != sizeof(struct cnid_dbd_rply)) {
-        LOG(log_error, logtype_cnid, "error writing message header: %s", strerror(errno));
-        invalidate_fd(cur_fd);
-        return 0;
-    }
-    if (write(cur_fd, rply->name, rply->namelen) != rply->namelen) {
-        LOG(log_error, logtype_cnid, "error writing message name: %s", strerror(errno));
+    return 1;
+}
+
+/* ------------ */
+int comm_snd(struct cnid_dbd_rply *rply)
+{
+    if (!comm_snd_fd(cur_fd, rply)) {
         invalidate_fd(cur_fd);
         return 0;
     }
-#endif
     return 1;
 }
-
-
@@ -15,7 +15,11 @@
 extern int      comm_init  (struct db_param *, int, int);
 extern int      comm_rcv  (struct cnid_dbd_rqst *,  time_t, const sigset_t *, time_t *);
 extern int      comm_snd  (struct cnid_dbd_rply *);
+extern int      comm_snd_fd (int, struct cnid_dbd_rply *);
 extern int      comm_nbe  (void);
+extern void     comm_wakeup (int);
+extern int      comm_busy (void);
+extern void     comm_resume (int, int);
 
 #endif /* CNID_DBD_COMM_H */
 
@@ -69,6 +69,12 @@ static void default_params(struct db_param *dbp, char *dir)
     if ( dbp->fd_table_size > FD_SETSIZE -1)
         dbp->fd_table_size = FD_SETSIZE -1;
     dbp->idle_timeout        = DEFAULT_IDLE_TIMEOUT;
+    dbp->reader_threads      = DEFAULT_READER_THREADS;
+    dbp->durability          = DEFAULT_DURABILITY;
+    dbp->group_commit_size   = DEFAULT_GROUP_COMMIT_SIZE;
+    dbp->group_commit_interval = DEFAULT_GROUP_COMMIT_INTERVAL;
+    dbp->backend             = DEFAULT_BACKEND;
+    dbp->lmdb_mapsize        = DEFAULT_LMDB_MAPSIZE;
 
     return;
 }
@@ -162,6 +168,40 @@ struct db_param *db_param_read(char *dir)
         } else if (! strcmp(key, "idle_timeout")) {
             params.idle_timeout = parse_int(val);
             LOG(log_info, logtype_cnid, "db_param: setting idle timeout to %d", params.idle_timeout);
+        } else if (! strcmp(key, "reader_threads")) {
+            params.reader_threads = parse_int(val);
+            LOG(log_info, logtype_cnid, "db_param: setting reader_threads to %d", params.reader_threads);
+        } else if (! strcmp(key, "durability")) {
+            if (! strcmp(val, "sync")) {
+                params.durability = DBP_DURABILITY_SYNC;
+            } else if (! strcmp(val, "group")) {
+                params.durability = DBP_DURABILITY_GROUP;
+            } else if (! strcmp(val, "nosync")) {
+                params.durability = DBP_DURABILITY_NOSYNC;
+            } else {
+                LOG(log_error, logtype_cnid, "db_param: invalid durability %s", val);
+                parse_err++;
+            }
+            LOG(log_info, logtype_cnid, "db_param: setting durability to %s", val);
+        } else if (! strcmp(key, "group_commit_size")) {
+            params.group_commit_size = parse_int(val);
+            LOG(log_info, logtype_cnid, "db_param: setting group_commit_size to %d", params.group_commit_size);
+        } else if (! strcmp(key, "group_commit_interval")) {
+            params.group_commit_interval = parse_int(val);
+            LOG(log_info, logtype_cnid, "db_param: setting group_commit_interval to %d", params.group_commit_interval);
+        } else if (! strcmp(key, "backend")) {
+            if (! strcmp(val, "bdb")) {
+                params.backend = DBP_BACKEND_BDB;
+            } else if (! strcmp(val, "lmdb")) {
+                params.backend = DBP_BACKEND_LMDB;
+            } else {
+                LOG(log_error, logtype_cnid, "db_param: invalid backend %s", val);
+                parse_err++;
+            }
+            LOG(log_info, logtype_cnid, "db_param: setting backend to %s", val);
+        } else if (! strcmp(key, "lmdb_mapsize")) {
+            params.lmdb_mapsize = parse_int(val);
+            LOG(log_info, logtype_cnid, "db_param: setting lmdb_mapsize to %d", params.lmdb_mapsize);
         }
 
         if (parse_err)
@@ -188,6 +228,20 @@ struct db_param *db_param_read(char *dir)
         if (params.idle_timeout <= 0)
             params.idle_timeout = 86400;
 
+        if (params.reader_threads < 0)
+            params.reader_threads = 0;
+        if (params.reader_threads > MAX_READER_THREADS)
+            params.reader_threads = MAX_READER_THREADS;
+
+        if (params.group_commit_size <= 0)
+            params.group_commit_size = DEFAULT_GROUP_COMMIT_SIZE;
+
+        if (params.group_commit_interval < 0)
+            params.group_commit_interval = DEFAULT_GROUP_COMMIT_INTERVAL;
+
+        if (params.lmdb_mapsize <= 0)
+            params.lmdb_mapsize = DEFAULT_LMDB_MAPSIZE;
+
         return &params;
     }
     else
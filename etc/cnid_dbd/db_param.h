@@ -18,6 +18,22 @@
 #define DEFAULT_USOCK_FILE         "usock"
 #define DEFAULT_FD_TABLE_SIZE      512
 #define DEFAULT_IDLE_TIMEOUT       (10 * 60)
+#define DEFAULT_READER_THREADS     0
+#define MAX_READER_THREADS         64
+#define DEFAULT_DURABILITY         DBP_DURABILITY_SYNC
+#define DEFAULT_GROUP_COMMIT_SIZE  64
+#define DEFAULT_GROUP_COMMIT_INTERVAL 10 /* ms */
+#define DEFAULT_BACKEND            DBP_BACKEND_BDB
+#define DEFAULT_LMDB_MAPSIZE       1024 /* MB */
+
+/* db_param durability */
+#define DBP_DURABILITY_SYNC        0 /* every write is committed to disk before the next request */
+#define DBP_DURABILITY_GROUP       1 /* writes are committed together, replies wait for the commit */
+#define DBP_DURABILITY_NOSYNC      2 /* DB_TXN_WRITE_NOSYNC */
+
+/* db_param backend */
+#define DBP_BACKEND_BDB            0 /* BerkeleyDB, cnid2.db */
+#define DBP_BACKEND_LMDB           1 /* LMDB, cnid2.lmdb */
 
 struct db_param {
     char *dir;
@@ -30,6 +46,12 @@ struct db_param {
     char usock_file[MAXPATHLEN + 1];    
     int fd_table_size;
     int idle_timeout;
+    int reader_threads;         /* 0: serve everything from the main thread */
+    int durability;             /* DBP_DURABILITY_* */
+    int group_commit_size;      /* max requests in a group */
+    int group_commit_interval;  /* max age of a group in ms */
+    int backend;                /* DBP_BACKEND_* */
+    int lmdb_mapsize;           /* in MB */
     int max_vols;
 };
 
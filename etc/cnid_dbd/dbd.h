@@ -11,6 +11,9 @@
 
 #include <atalk/cnid_dbd_private.h>
 
+/* dbd_lookup through a reader view: fixing up the database needs the writer */
+#define DBD_NEED_WRITER 2
+
 extern int add_cnid(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply);
 extern int get_cnid(DBD *dbd, struct cnid_dbd_rply *rply);
 
@@ -23,6 +26,7 @@ extern int dbd_delete(DBD *dbd, struct cnid_dbd_rqst *, struct cnid_dbd_rply *,
 extern int dbd_getstamp(DBD *dbd, struct cnid_dbd_rqst *, struct cnid_dbd_rply *);
 extern int dbd_rebuild_add(DBD *dbd, struct cnid_dbd_rqst *, struct cnid_dbd_rply *);
 extern int dbd_search(DBD *dbd, struct cnid_dbd_rqst *, struct cnid_dbd_rply *);
+extern int dbd_batch(DBD *dbd, struct cnid_dbd_rqst *, struct cnid_dbd_rply *, int *count);
 extern int dbd_check_indexes(DBD *dbd, char *);
 
 #endif /* CNID_DBD_DBD_H */
@@ -0,0 +1,91 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <string.h>
+#include <sys/param.h>
+
+#include <atalk/logger.h>
+#include <atalk/cnid_dbd_private.h>
+
+#include "dbif.h"
+#include "dbd.h"
+
+/*
+ * Process the lookup and add requests of a CNID_DBD_OP_BATCH request,
+ * each in its own transaction like a single request.
+ */
+int dbd_batch(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply, int *count)
+{
+    static struct cnid_dbd_rply res[CNID_BATCH_MAX];
+    static char namebuf[MAXPATHLEN + 1];
+    struct cnid_dbd_rqst item;
+    const char *p = rqst->name, *end = rqst->name + rqst->namelen;
+    int i, ret;
+
+    if (rqst->cnid > CNID_BATCH_MAX)
+        goto malformed;
+
+    for (i = 0; i < rqst->cnid; i++) {
+        if (end - p < sizeof(item))
+            goto malformed;
+        memcpy(&item, p, sizeof(item));
+        p += sizeof(item);
+        if (item.namelen > MAXPATHLEN || end - p < item.namelen)
+            goto malformed;
+        memcpy(namebuf, p, item.namelen);
+        namebuf[item.namelen] = '\0';
+        p += item.namelen;
+        item.name = namebuf;
+
+        memset(&res[i], 0, sizeof(res[i]));
+        switch (item.op) {
+        case CNID_DBD_OP_ADD:
+            ret = dbd_add(dbd, &item, &res[i]);
+            break;
+        case CNID_DBD_OP_LOOKUP:
+            ret = dbd_lookup(dbd, &item, &res[i]);
+            break;
+        default:
+            goto malformed;
+        }
+        res[i].name = NULL;
+        res[i].namelen = 0;
+
+        if (ret < 0)
+            return -1;
+        if (ret == 0) {
+            if (dbif_txn_abort(dbd) < 0)
+                return -1;
+        } else {
+            if ((ret = dbif_txn_commit(dbd)) < 0)
+                return -1;
+            if (ret > 0)
+                (*count)++;
+        }
+    }
+
+    rply->result = CNID_DBD_RES_OK;
+    rply->cnid = rqst->cnid;
+    rply->name = (char *)res;
+    rply->namelen = rqst->cnid * sizeof(struct cnid_dbd_rply);
+    return 1;
+
+malformed:
+    LOG(log_error, logtype_cnid, "dbd_batch: malformed request");
+    rply->result = CNID_DBD_RES_ERR_DB;
+    rply->namelen = 0;
+    return 1;
+}
@@ -132,11 +132,11 @@ to be safe we must assign new CNIDs to both files.
 
 int dbd_lookup(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply)
 {
-    unsigned char *buf;
+    unsigned char start[PACK_CNID_DATA_LEN], *buf;
     DBT key, devdata, diddata;
     int devino = 1, didname = 1; 
     int rc;
-    cnid_t id_devino, id_didname;
+    cnid_t id_devino = 0, id_didname = 0;
     u_int32_t type_devino  = (unsigned)-1;
     u_int32_t type_didname = (unsigned)-1;
     int update = 0;
@@ -150,7 +150,7 @@ int dbd_lookup(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply)
 
     LOG(log_maxdebug, logtype_cnid, "dbd_lookup(): START");
     
-    buf = pack_cnid_data(rqst); 
+    buf = pack_cnid_data_r(rqst, start);
 
     /* Look for a CNID.  We have two options: dev/ino or did/name.  If we
        only get a match in one of them, that means a file has moved. */
@@ -202,6 +202,12 @@ int dbd_lookup(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply)
         return 1;
     }
 
+    /* Anything but a clean hit below fixes up the database, leave that to the writer */
+    if (dbd->db_rdonly
+        && !(devino && didname && id_devino == id_didname
+             && type_devino == rqst->type && type_didname == rqst->type))
+        return DBD_NEED_WRITER;
+
     /* Check for type (file/dir) mismatch */
     if ((devino && (type_devino != rqst->type)) || (didname && (type_didname != rqst->type))) {
 
@@ -22,7 +22,7 @@ int dbd_search(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply)
 {
     DBT key;
     int results;
-    static char resbuf[DBD_MAX_SRCH_RSLTS * sizeof(cnid_t)];
+    char *resbuf = dbd->db_srchbuf;
 
     LOG(log_debug, logtype_cnid, "dbd_search(\"%s\"):", rqst->name);
 
@@ -26,12 +26,13 @@
 
 #include "db_param.h"
 #include "dbif.h"
+#include "dbif_lmdb.h"
 #include "pack.h"
 
 #define DB_ERRLOGFILE "db_errlog"
 
 /*!
- * Get the db stamp which is the st_ctime of the file "cnid2.db" and store it in buffer
+ * Get the db stamp which is the st_ctime of the database file and store it in buffer
  */
 static int dbif_stamp(DBD *dbd, void *buffer, int size)
 {
@@ -54,8 +55,8 @@ static int dbif_stamp(DBD *dbd, void *buffer, int size)
         EC_FAIL;
     }
 
-    if (stat(dbd->db_table[DBIF_CNID].name, &st) < 0) {
-        LOG(log_error, logtype_cnid, "error stating database %s: %s", dbd->db_table[DBIF_CNID].name, db_strerror(errno));
+    if (stat(dbd->db_filename, &st) < 0) {
+        LOG(log_error, logtype_cnid, "error stating database %s: %s", dbd->db_filename, strerror(errno));
         EC_FAIL;
     }
 
@@ -389,6 +390,16 @@ int dbif_env_open(DBD *dbd, struct db_param *dbp, uint32_t dbenv_oflags)
 {
     int ret;
 
+    if (dbp->backend == DBP_BACKEND_LMDB) {
+#ifdef HAVE_LMDB
+        dbd->db_param = *dbp;
+        return lmdb_env_open(dbd);
+#else
+        LOG(log_error, logtype_cnid, "db_param backend lmdb: cnid_dbd was built without LMDB");
+        return -1;
+#endif
+    }
+
     if ((ret = db_env_create(&dbd->db_env, 0))) {
         LOG(log_error, logtype_cnid, "error creating DB environment: %s",
             db_strerror(ret));
@@ -440,6 +451,18 @@ int dbif_env_open(DBD *dbd, struct db_param *dbp, uint32_t dbenv_oflags)
         LOG(log_debug, logtype_cnid, "Finished recovery.");
     }
 
+    if (dbp->reader_threads) {
+        /* Reader threads hold no write locks, make them the deadlock victims */
+        if ((ret = dbd->db_env->set_lk_detect(dbd->db_env, DB_LOCK_MINWRITE))) {
+            LOG(log_error, logtype_cnid, "error setting DB environment deadlock detection: %s",
+                db_strerror(ret));
+            dbd->db_env->close(dbd->db_env, 0);
+            dbd->db_env = NULL;
+            return -1;
+        }
+        dbenv_oflags |= DB_THREAD;
+    }
+
     if ((ret = dbd->db_env->set_cachesize(dbd->db_env, 0, 1024 * dbp->cachesize, 0))) {
         LOG(log_error, logtype_cnid, "error setting DB environment cachesize to %i: %s",
             dbp->cachesize, db_strerror(ret));
@@ -480,6 +503,17 @@ int dbif_env_open(DBD *dbd, struct db_param *dbp, uint32_t dbenv_oflags)
         return -1;
     }
 
+    if (dbp->durability == DBP_DURABILITY_NOSYNC) {
+        /* Commits only write the log to the OS, a crash of the machine may lose them */
+        if ((ret = dbd->db_env->set_flags(dbd->db_env, DB_TXN_WRITE_NOSYNC, 1))) {
+            LOG(log_error, logtype_cnid, "error setting DB_TXN_WRITE_NOSYNC flag: %s",
+                db_strerror(ret));
+            dbd->db_env->close(dbd->db_env, 0);
+            dbd->db_env = NULL;
+            return -1;
+        }
+    }
+
     if (dbp->logfile_autoremove) {
         if ((dbif_logautorem(dbd)) != 0)
             return -1;
@@ -514,6 +548,20 @@ int dbif_open(DBD *dbd, struct db_param *dbp, int reindex)
     struct stat st;
     DB *upgrade_db;
 
+#ifdef HAVE_LMDB
+    if (dbd->db_lmdb) {
+        if (lmdb_open(dbd, reindex) != 0)
+            return -1;
+        if (dbif_upgrade(dbd) != 0 || dbif_txn_commit(dbd) < 0) {
+            LOG(log_error, logtype_cnid, "Error upgrading CNID database to version %d", CNID_VERSION);
+            return -1;
+        }
+        if (dbd->db_param.durability == DBP_DURABILITY_GROUP)
+            dbd->db_grouping = 1;
+        return 0;
+    }
+#endif
+
     /* Try to upgrade if it's a normal on-disk database */
     if (dbd->db_envhome) {
         /* Remember cwd */
@@ -555,6 +603,13 @@ int dbif_open(DBD *dbd, struct db_param *dbp, int reindex)
         }
     }
 
+    /* Reader threads share the handles */
+    if (dbd->db_env && dbd->db_param.reader_threads) {
+        dbd->db_thread = 1;
+        for (i = 0; i != DBIF_DB_CNT; i++)
+            dbd->db_table[i].openflags |= DB_THREAD;
+    }
+
     /* Now open databases ... */
     for (i = 0; i != DBIF_DB_CNT; i++) {
         if ((ret = db_create(&dbd->db_table[i].db, dbd->db_env, 0))) {
@@ -667,6 +722,10 @@ int dbif_open(DBD *dbd, struct db_param *dbp, int reindex)
         LOG(log_error, logtype_cnid, "Error upgrading CNID database to version %d", CNID_VERSION);
         return -1;
     }
+
+    /* Only group the writes of requests, not those of opening the database */
+    if (dbd->db_env && dbd->db_param.durability == DBP_DURABILITY_GROUP)
+        dbd->db_grouping = 1;
     
     return 0;
 }
@@ -695,6 +754,11 @@ int dbif_close(DBD *dbd)
     int ret;
     int err = 0;
 
+#ifdef HAVE_LMDB
+    if (dbd->db_lmdb && lmdb_close(dbd))
+        err++;
+#endif
+
     if (dbif_closedb(dbd))
         err++;
 
@@ -708,7 +772,7 @@ int dbif_close(DBD *dbd)
     }
 
     free(dbd->db_filename);
-    free(dbd);
+    dbif_view_free(dbd);
     dbd = NULL;
 
     if (err)
@@ -716,6 +780,62 @@ int dbif_close(DBD *dbd)
     return 0;
 }
 
+/*!
+ * Get a handle for a reader thread
+ *
+ * The view shares the environment and database handles of dbd, which must have
+ * been opened with reader_threads, but has its own result buffers and never
+ * starts a transaction, so it can't write.
+ *
+ * @returns view for dbif_get, dbif_pget and dbif_search, NULL on error
+ */
+DBD *dbif_view(const DBD *dbd)
+{
+    DBD *view;
+
+    if ((view = malloc(sizeof(DBD))) == NULL)
+        return NULL;
+
+    *view = *dbd;
+    view->db_txn = NULL;
+    view->db_group = NULL;
+    view->db_grouping = 0;
+    view->db_cur = NULL;
+    view->db_rdonly = 1;
+    memset(view->db_buf, 0, sizeof(view->db_buf));
+
+#ifdef HAVE_LMDB
+    if (dbd->db_lmdb && lmdb_view(view, dbd) != 0) {
+        free(view);
+        return NULL;
+    }
+#endif
+
+    return view;
+}
+
+/*!
+ * Free a view from dbif_view, the handles it shares are left alone
+ */
+void dbif_view_free(DBD *view)
+{
+    int i;
+
+    if (view == NULL)
+        return;
+
+#ifdef HAVE_LMDB
+    if (view->db_lmdb)
+        lmdb_close(view);
+#endif
+
+    for (i = 0; i != DBIF_DB_CNT; i++) {
+        free(view->db_buf[i][0]);
+        free(view->db_buf[i][1]);
+    }
+    free(view);
+}
+
 /* 
    In order to support silent database upgrades:
    destroy env at cnid_dbd shutdown.
@@ -795,15 +915,43 @@ int dbif_env_remove(const char *path)
  *  functions are not expected and therefore error conditions.
  */
 
+/*
+ * DB_THREAD handles don't return data in memory owned by the handle, let them
+ * realloc one buffer per table and DBT instead. The data is valid until the
+ * next get from the same table through the same DBD.
+ */
+static void dbt_realloc_begin(DBD *dbd, const int dbi, int i, DBT *dbt)
+{
+    if (!dbd->db_thread || dbt->flags)
+        return;
+    dbt->data = dbd->db_buf[dbi][i];
+    dbt->flags = DB_DBT_REALLOC;
+}
+
+static void dbt_realloc_end(DBD *dbd, const int dbi, int i, DBT *dbt)
+{
+    if (dbd->db_thread && dbt->flags == DB_DBT_REALLOC)
+        dbd->db_buf[dbi][i] = dbt->data;
+}
+
 int dbif_get(DBD *dbd, const int dbi, DBT *key, DBT *val, u_int32_t flags)
 {
     int ret;
 
-    ret = dbd->db_table[dbi].db->get(dbd->db_table[dbi].db,
-                                     dbd->db_txn,
-                                     key,
-                                     val,
-                                     flags);
+    LMDB_CALL(dbd, lmdb_get(dbd, dbi, key, val));
+
+    dbt_realloc_begin(dbd, dbi, 0, val);
+
+    /* A deadlocked read outside of a txn holds nothing, simply retry it */
+    do {
+        ret = dbd->db_table[dbi].db->get(dbd->db_table[dbi].db,
+                                         dbd->db_txn ? dbd->db_txn : dbd->db_group,
+                                         key,
+                                         val,
+                                         flags);
+    } while (ret == DB_LOCK_DEADLOCK && dbd->db_txn == NULL && dbd->db_group == NULL);
+
+    dbt_realloc_end(dbd, dbi, 0, val);
 
     if (ret == DB_NOTFOUND)
         return 0;
@@ -820,12 +968,22 @@ int dbif_pget(DBD *dbd, const int dbi, DBT *key, DBT *pkey, DBT *val, u_int32_t
 {
     int ret;
 
-    ret = dbd->db_table[dbi].db->pget(dbd->db_table[dbi].db,
-                                      dbd->db_txn,
-                                      key,
-                                      pkey,
-                                      val,
-                                      flags);
+    LMDB_CALL(dbd, lmdb_pget(dbd, dbi, key, pkey, val));
+
+    dbt_realloc_begin(dbd, dbi, 0, val);
+    dbt_realloc_begin(dbd, dbi, 1, pkey);
+
+    do {
+        ret = dbd->db_table[dbi].db->pget(dbd->db_table[dbi].db,
+                                          dbd->db_txn ? dbd->db_txn : dbd->db_group,
+                                          key,
+                                          pkey,
+                                          val,
+                                          flags);
+    } while (ret == DB_LOCK_DEADLOCK && dbd->db_txn == NULL && dbd->db_group == NULL);
+
+    dbt_realloc_end(dbd, dbi, 0, val);
+    dbt_realloc_end(dbd, dbi, 1, pkey);
 
     if (ret == DB_NOTFOUND || ret == DB_SECONDARY_BAD) {
         return 0;
@@ -843,6 +1001,8 @@ int dbif_put(DBD *dbd, const int dbi, DBT *key, DBT *val, u_int32_t flags)
 {
     int ret;
 
+    LMDB_CALL(dbd, lmdb_put(dbd, dbi, key, val, flags));
+
     if (dbif_txn_begin(dbd) < 0) {
         LOG(log_error, logtype_cnid, "error setting key/value in %s", dbd->db_table[dbi].name);
         return -1;
@@ -871,6 +1031,8 @@ int dbif_del(DBD *dbd, const int dbi, DBT *key, u_int32_t flags)
 {
     int ret;
 
+    LMDB_CALL(dbd, lmdb_del(dbd, dbi, key));
+
     /* For cooperation with the dbd utility and its usage of a cursor */
     if (dbd->db_cur) {
         dbd->db_cur->close(dbd->db_cur);
@@ -917,10 +1079,28 @@ int dbif_search(DBD *dbd, DBT *key, char *resbuf)
     cnid_t cnid;
     char *namebkp = key->data;
     int namelenbkp = key->size;
+    char keybuf[MAXPATHLEN + 2];
+    int restarts = 0;
 
+    LMDB_CALL(dbd, lmdb_search(dbd, key, resbuf));
+
+again:
     memset(&pkey, 0, sizeof(DBT));
     memset(&data, 0, sizeof(DBT));
 
+    if (dbd->db_thread) {
+        /* DB_SET_RANGE returns the key it found, that needs memory of our own */
+        if (namelenbkp > sizeof(keybuf))
+            return -1;
+        memcpy(keybuf, namebkp, namelenbkp);
+        key->data = keybuf;
+        key->size = namelenbkp;
+        key->ulen = sizeof(keybuf);
+        key->flags = DB_DBT_USERMEM;
+        dbt_realloc_begin(dbd, DBIF_IDX_NAME, 0, &data);
+        dbt_realloc_begin(dbd, DBIF_IDX_NAME, 1, &pkey);
+    }
+
     /* Get a cursor */
     ret = dbd->db_table[DBIF_IDX_NAME].db->cursor(dbd->db_table[DBIF_IDX_NAME].db,
                                                   NULL,
@@ -933,7 +1113,7 @@ int dbif_search(DBD *dbd, DBT *key, char *resbuf)
     }
 
     ret = cursorp->pget(cursorp, key, &pkey, &data, DB_SET_RANGE);
-    while (count < DBD_MAX_SRCH_RSLTS && ret != DB_NOTFOUND) {
+    while (count < DBD_MAX_SRCH_RSLTS && ret == 0) {
         if (!((namelenbkp <= key->size) && (strncmp(namebkp, key->data, namelenbkp) == 0)))
             break;
         count++;
@@ -945,9 +1125,22 @@ int dbif_search(DBD *dbd, DBT *key, char *resbuf)
         ret = cursorp->pget(cursorp, key, &pkey, &data, DB_NEXT);
     }
 
+    if (ret == DB_LOCK_DEADLOCK && restarts++ < 3) {
+        /* The cursor doesn't use a txn, start over */
+        dbt_realloc_end(dbd, DBIF_IDX_NAME, 0, &data);
+        dbt_realloc_end(dbd, DBIF_IDX_NAME, 1, &pkey);
+        cursorp->close(cursorp);
+        cursorp = NULL;
+        count = 0;
+        cnids = resbuf;
+        goto again;
+    }
+
     ret = count;
 
 exit:
+    dbt_realloc_end(dbd, DBIF_IDX_NAME, 0, &data);
+    dbt_realloc_end(dbd, DBIF_IDX_NAME, 1, &pkey);
     if (cursorp != NULL)
         cursorp->close(cursorp);
     return ret;
@@ -961,11 +1154,26 @@ int dbif_txn_begin(DBD *dbd)
     if (dbd->db_txn)
         return 0;
 
+    if (dbd->db_rdonly) {
+        LOG(log_error, logtype_cnid, "dbif_txn_begin: write through a reader view");
+        return -1;
+    }
+
+    LMDB_CALL(dbd, lmdb_txn_begin(dbd));
+
     /* If our DBD has no env, just return (-> in memory db) */
     if (dbd->db_env == NULL)
         return 0;
 
-    ret = dbd->db_env->txn_begin(dbd->db_env, NULL, &dbd->db_txn, 0);
+    if (dbd->db_grouping && dbd->db_group == NULL) {
+        if ((ret = dbd->db_env->txn_begin(dbd->db_env, NULL, &dbd->db_group, 0))) {
+            LOG(log_error, logtype_cnid, "error starting group transaction: %s", db_strerror(ret));
+            dbd->db_group = NULL;
+            return -1;
+        }
+    }
+
+    ret = dbd->db_env->txn_begin(dbd->db_env, dbd->db_group, &dbd->db_txn, 0);
 
     if (ret) {
         LOG(log_error, logtype_cnid, "error starting transaction: %s", db_strerror(ret));
@@ -978,6 +1186,8 @@ int dbif_txn_commit(DBD *dbd)
 {
     int ret;
 
+    LMDB_CALL(dbd, lmdb_txn_commit(dbd));
+
     if (! dbd->db_txn)
         return 0;
 
@@ -999,6 +1209,8 @@ int dbif_txn_abort(DBD *dbd)
 {
     int ret;
 
+    LMDB_CALL(dbd, lmdb_txn_abort(dbd));
+
     if (! dbd->db_txn)
         return 0;
 
@@ -1016,6 +1228,69 @@ int dbif_txn_abort(DBD *dbd)
         return 0;
 }
 
+/*!
+ * Is there a group txn, the replies to the requests in it have to wait for its commit
+ */
+int dbif_group_pending(DBD *dbd)
+{
+    LMDB_CALL(dbd, lmdb_group_pending(dbd));
+    return dbd->db_group != NULL;
+}
+
+/*!
+ * Commit the group txn, the first write to disk of the requests in it
+ *
+ * @returns 1 if there was a group, 0 if not, -1 on error
+ */
+int dbif_group_commit(DBD *dbd)
+{
+    int ret;
+
+    LMDB_CALL(dbd, lmdb_group_commit(dbd));
+
+    if (dbd->db_group == NULL)
+        return 0;
+
+    if (dbd->db_txn && dbif_txn_abort(dbd) < 0)
+        return -1;
+
+    ret = dbd->db_group->commit(dbd->db_group, 0);
+    dbd->db_group = NULL;
+
+    if (ret) {
+        LOG(log_error, logtype_cnid, "error committing group transaction: %s", db_strerror(ret));
+        return -1;
+    }
+    return 1;
+}
+
+/*!
+ * Abort the group txn and with it every request in it
+ *
+ * @returns 0 on success, -1 on error
+ */
+int dbif_group_abort(DBD *dbd)
+{
+    int ret;
+
+    LMDB_CALL(dbd, lmdb_group_abort(dbd));
+
+    if (dbd->db_group == NULL)
+        return 0;
+
+    if (dbd->db_txn && dbif_txn_abort(dbd) < 0)
+        return -1;
+
+    ret = dbd->db_group->abort(dbd->db_group);
+    dbd->db_group = NULL;
+
+    if (ret) {
+        LOG(log_error, logtype_cnid, "error aborting group transaction: %s", db_strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
 /* 
    ret = 1 -> commit txn if db_param.txn_frequency
    ret = 0 -> abort txn db_param.txn_frequency -> exit!
@@ -1046,6 +1321,8 @@ int dbif_txn_close(DBD *dbd, int ret)
 int dbif_txn_checkpoint(DBD *dbd, u_int32_t kbyte, u_int32_t min, u_int32_t flags)
 {
     int ret;
+
+    LMDB_CALL(dbd, lmdb_checkpoint(dbd));
     ret = dbd->db_env->txn_checkpoint(dbd->db_env, kbyte, min, flags);
     if (ret) {
         LOG(log_error, logtype_cnid, "error checkpointing transaction susystem: %s", db_strerror(ret));
@@ -1060,6 +1337,8 @@ int dbif_count(DBD *dbd, const int dbi, u_int32_t *count)
     DB_BTREE_STAT *sp;
     DB *db = dbd->db_table[dbi].db;
 
+    LMDB_CALL(dbd, lmdb_count(dbd, dbi, count));
+
     ret = db->stat(db, NULL, &sp, 0);
 
     if (ret) {
@@ -1113,6 +1392,11 @@ int dbif_dump(DBD *dbd, int dumpindexes)
     char *typestring[2] = {"f", "d"};
     char timebuf[64];
 
+    if (dbd->db_lmdb) {
+        LOG(log_error, logtype_cnid, "dbif_dump: not supported with the LMDB backend");
+        return -1;
+    }
+
     printf("CNID database dump:\n");
 
     rc = db->cursor(db, NULL, &cur, 0);
@@ -1284,6 +1568,8 @@ int dbif_idwalk(DBD *dbd, cnid_t *cnid, int close)
     static DBT key = { 0 }, data = { 0 };
     DB *db = dbd->db_table[DBIF_CNID].db;
 
+    LMDB_CALL(dbd, lmdb_idwalk(dbd, cnid, close));
+
     if (close) {
         if (dbd->db_cur) {
             dbd->db_cur->close(dbd->db_cur);
@@ -33,6 +33,29 @@
   dbif_put or dbif_del.
   Thus you shouldn't call dbif_txn_[begin|abort|commit], they're used internally.
 
+  Group commit
+  ------------
+  With db_param durability "group" the txn of every write is started as a child
+  of a group txn, which is opened by the first write and stays open until the
+  caller calls dbif_group_commit. Committing or aborting the child only affects
+  that request, only committing the group writes the log to disk. Reads use the
+  group txn while it's open. With durability "nosync" the environment is set to
+  DB_TXN_WRITE_NOSYNC instead.
+
+  Reader threads
+  --------------
+  With db_param reader_threads set the environment and databases are opened
+  with DB_THREAD. Every reader thread then gets its own handle from dbif_view,
+  sharing the BDB handles but with its own result buffers and without a txn.
+  Views only read, dbif_put and dbif_del refuse to write through them.
+
+  LMDB backend
+  ------------
+  With db_param backend "lmdb" dbif_env_open opens the LMDB environment
+  db_filename instead and every dbif_* function hands the DBD over to its lmdb_*
+  counterpart in dbif_lmdb.c, which maintains the indexes itself. Only there if
+  cnid_dbd was configured with LMDB (HAVE_LMDB).
+
   Checkpoiting
   ------------
   Call dbif_txn_checkpoint.
@@ -55,6 +78,7 @@
 
 #include <db.h>
 #include <atalk/adouble.h>
+#include <atalk/cnid_dbd_private.h>
 #include "db_param.h"
 
 #define DBIF_DB_CNT 4
@@ -65,12 +89,15 @@
 #define DBIF_IDX_NAME      3
 
 #define LOCKFILENAME  "lock"
+#define LMDB_FILENAME "cnid2.lmdb"
 #define LOCK_FREE          0
 #define LOCK_UNLOCK        1
 #define LOCK_EXCL          2
 #define LOCK_SHRD          3
 
 /* Structures */
+struct lmdb_dbd;
+
 typedef struct {
     char     *name;
     DB       *db;
@@ -83,17 +110,26 @@ typedef struct {
     DB_ENV   *db_env;
     struct db_param db_param;
     DB_TXN   *db_txn;
+    DB_TXN   *db_group;            /* group commit: parent of db_txn */
+    int      db_grouping;          /* db_param durability is "group" */
     DBC      *db_cur;              /* for dbif_walk */
     char     *db_envhome;
     char     *db_filename;
     FILE     *db_errlog;
     db_table db_table[DBIF_DB_CNT];
+    int      db_thread;            /* handles are opened with DB_THREAD */
+    int      db_rdonly;            /* reader view from dbif_view */
+    void     *db_buf[DBIF_DB_CNT][2]; /* DB_DBT_REALLOC buffers for get and pget */
+    char     db_srchbuf[DBD_MAX_SRCH_RSLTS * sizeof(cnid_t)]; /* dbd_search results */
+    struct lmdb_dbd *db_lmdb;      /* backend "lmdb": the handle of dbif_lmdb.c */
 } DBD;
 
 extern DBD *dbif_init(const char *envhome, const char *dbname);
 extern int dbif_env_open(DBD *dbd, struct db_param *dbp, uint32_t dbenv_oflags);
 extern int dbif_open(DBD *dbd, struct db_param *dbp, int reindex);
 extern int dbif_close(DBD *dbd);
+extern DBD *dbif_view(const DBD *dbd);
+extern void dbif_view_free(DBD *view);
 extern int dbif_env_remove(const char *path);
 
 extern int dbif_get(DBD *, const int, DBT *, DBT *, u_int32_t);
@@ -107,6 +143,9 @@ extern int dbif_txn_begin(DBD *);
 extern int dbif_txn_commit(DBD *);
 extern int dbif_txn_abort(DBD *);
 extern int dbif_txn_close(DBD *dbd, int ret); /* Switch between commit+abort */
+extern int dbif_group_pending(DBD *);
+extern int dbif_group_commit(DBD *);
+extern int dbif_group_abort(DBD *);
 extern int dbif_txn_checkpoint(DBD *, u_int32_t, u_int32_t, u_int32_t);
 
 extern int dbif_dump(DBD *dbd, int dumpindexes);
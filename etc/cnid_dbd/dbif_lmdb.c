@@ -0,0 +1,890 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+/*!
+ * @file
+ * LMDB storage for cnid_dbd
+ *
+ * With db_param backend "lmdb" the dbif_* functions keep the CNID database in the
+ * LMDB environment cnid2.lmdb instead of BerkeleyDB. The four tables are named
+ * databases of the environment. LMDB has no associated secondaries, so the
+ * indexes are maintained here: every put and del of a CNID record updates
+ * devino, didname and name in the same txn, with the keys from the callbacks
+ * in pack.c that BerkeleyDB uses.
+ *
+ * LMDB readers neither block nor deadlock. A read outside of a write txn runs in
+ * the read txn of its DBD, which is renewed for the read and reset afterwards,
+ * so it sees the last commit. The views of the reader threads get read txns of
+ * their own, the environment is opened with MDB_NOTLS for that.
+ *
+ * Writes start a txn like with BerkeleyDB, with durability "group" it's a nested
+ * txn of the group txn. There's no log: committing a top level txn syncs the
+ * data file, with "nosync" the environment is opened with MDB_NOSYNC and
+ * dbif_txn_checkpoint syncs it. There's no recovery either, the data file is
+ * consistent after a crash.
+ *
+ * LMDB limits keys to mdb_env_get_maxkeysize() bytes, 511 by default, which a
+ * long UTF-8 name can exceed. Longer did/name keys are cut and end in a hash of
+ * the whole key, longer name index keys are only cut, that index allows
+ * duplicates anyway.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include <lmdb.h>
+
+#include <atalk/logger.h>
+#include <atalk/util.h>
+#include <atalk/cnid.h>
+
+#include "db_param.h"
+#include "dbif.h"
+#include "dbif_lmdb.h"
+#include "pack.h"
+
+/* The environment, shared by a DBD and its views */
+struct lmdb_env {
+    MDB_env  *env;
+    MDB_dbi  dbi[DBIF_DB_CNT];
+    size_t   maxkey;            /* mdb_env_get_maxkeysize */
+    int      refs;              /* DBD and views, the last one closes env */
+};
+
+/* db_lmdb of a DBD or view */
+struct lmdb_dbd {
+    struct lmdb_env *e;
+    MDB_txn  *rtxn;             /* reset read txn for reads outside of a write txn */
+    MDB_txn  *txn;              /* write txn of the current request */
+    MDB_txn  *group;            /* group commit: parent of txn */
+    int      walk;              /* dbif_idwalk: cursor position is after the last CNID */
+};
+
+/* The index entries of a CNID record, [DBIF_CNID] is unused */
+struct index_keys {
+    MDB_val  key[DBIF_DB_CNT];
+    char     buf[DBIF_DB_CNT][PACK_CNID_DATA_LEN];
+};
+
+/* The callbacks BerkeleyDB associates the indexes with */
+static int (*const index_cb[DBIF_DB_CNT])(DB *, const DBT *, const DBT *, DBT *) = {
+    NULL, devino, didname, idxname
+};
+
+static int index_dup(const DBD *dbd, const int dbi)
+{
+    return (dbd->db_table[dbi].flags & DB_DUPSORT) != 0;
+}
+
+/*!
+ * Copy key into buf, cut to what LMDB takes
+ *
+ * A cut did/name key ends in a hash of the whole key, so that different long
+ * names in one directory still get different keys.
+ */
+static void key_fit(const struct lmdb_env *e, const int dbi, const void *data, size_t size,
+                    MDB_val *key, char *buf)
+{
+    const unsigned char *p = data;
+    uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+    size_t len = size;
+    size_t i;
+
+    if (len > e->maxkey)
+        len = e->maxkey;
+    if (len > PACK_CNID_DATA_LEN)
+        len = PACK_CNID_DATA_LEN;
+    memcpy(buf, data, len);
+
+    if (len < size && dbi == DBIF_IDX_DIDNAME) {
+        for (i = 0; i < size; i++) {
+            hash ^= p[i];
+            hash *= 1099511628211ULL;
+        }
+        memcpy(buf + len - sizeof(hash), &hash, sizeof(hash));
+    }
+
+    key->mv_data = buf;
+    key->mv_size = len;
+}
+
+/*!
+ * Compute the index entries of the CNID record pkey/data
+ */
+static void index_keys(DBD *dbd, const MDB_val *pkey, const MDB_val *data, struct index_keys *ik)
+{
+    DBT pk, pd, sk;
+    int dbi;
+
+    memset(&pk, 0, sizeof(pk));
+    memset(&pd, 0, sizeof(pd));
+    pk.data = pkey->mv_data;
+    pk.size = pkey->mv_size;
+    pd.data = data->mv_data;
+    pd.size = data->mv_size;
+
+    for (dbi = DBIF_IDX_DEVINO; dbi < DBIF_DB_CNT; dbi++) {
+        index_cb[dbi](NULL, &pk, &pd, &sk);
+        key_fit(dbd->db_lmdb->e, dbi, sk.data, sk.size, &ik->key[dbi], ik->buf[dbi]);
+    }
+}
+
+static int key_equal(const MDB_val *a, const MDB_val *b)
+{
+    return a->mv_size == b->mv_size && memcmp(a->mv_data, b->mv_data, a->mv_size) == 0;
+}
+
+/*!
+ * Check that the record pkey can get the entries nk in the unique indexes
+ *
+ * @returns 0, MDB_KEYEXIST if another record has one of them or an LMDB error
+ */
+static int index_check(DBD *dbd, const MDB_val *pkey, const struct index_keys *ok,
+                       const struct index_keys *nk)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    MDB_val key, val;
+    int dbi, rc;
+
+    for (dbi = DBIF_IDX_DEVINO; dbi < DBIF_DB_CNT; dbi++) {
+        if (index_dup(dbd, dbi) || nk->key[dbi].mv_size == 0
+            || (ok && key_equal(&ok->key[dbi], &nk->key[dbi])))
+            continue;
+        key = nk->key[dbi];
+        rc = mdb_get(l->txn, l->e->dbi[dbi], &key, &val);
+        if (rc == MDB_NOTFOUND)
+            continue;
+        if (rc)
+            return rc;
+        if (!key_equal(&val, pkey))
+            return MDB_KEYEXIST;
+    }
+    return 0;
+}
+
+/*!
+ * Replace the index entries ok of the record pkey with nk, either may be NULL
+ *
+ * Entries that stay the same are left alone, like those of the rootinfo record
+ * which is rewritten by every add.
+ *
+ * @returns 0 or an LMDB error
+ */
+static int index_update(DBD *dbd, const MDB_val *pkey, const struct index_keys *ok,
+                        const struct index_keys *nk)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    MDB_val key, val;
+    int dbi, dup, rc;
+
+    for (dbi = DBIF_IDX_DEVINO; dbi < DBIF_DB_CNT; dbi++) {
+        if (ok && nk && key_equal(&ok->key[dbi], &nk->key[dbi]))
+            continue;
+        dup = index_dup(dbd, dbi);
+        /* LMDB has no empty keys, such a record isn't in that index */
+        if (ok && ok->key[dbi].mv_size) {
+            key = ok->key[dbi];
+            val = *pkey;
+            rc = mdb_del(l->txn, l->e->dbi[dbi], &key, dup ? &val : NULL);
+            if (rc && rc != MDB_NOTFOUND)
+                return rc;
+        }
+        if (nk && nk->key[dbi].mv_size) {
+            key = nk->key[dbi];
+            val = *pkey;
+            rc = mdb_put(l->txn, l->e->dbi[dbi], &key, &val, dup ? MDB_NODUPDATA : 0);
+            if (rc && !(dup && rc == MDB_KEYEXIST))
+                return rc;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * Get the primary key and the CNID record for key of an index
+ *
+ * @returns 0 or an LMDB error, MDB_NOTFOUND if there's no record
+ */
+static int index_get(DBD *dbd, MDB_txn *txn, const int dbi, const DBT *key,
+                     MDB_val *pkey, MDB_val *data)
+{
+    struct lmdb_env *e = dbd->db_lmdb->e;
+    char buf[PACK_CNID_DATA_LEN];
+    MDB_val skey;
+    DBT pk, pd, sk;
+    int rc;
+
+    key_fit(e, dbi, key->data, key->size, &skey, buf);
+    if (skey.mv_size == 0)
+        return MDB_NOTFOUND;
+    if ((rc = mdb_get(txn, e->dbi[dbi], &skey, pkey)))
+        return rc;
+    /* An entry without a record, like DB_SECONDARY_BAD is NOTFOUND */
+    if ((rc = mdb_get(txn, e->dbi[DBIF_CNID], pkey, data)))
+        return rc;
+
+    if (skey.mv_size < key->size && dbi == DBIF_IDX_DIDNAME) {
+        /* Cut key, make sure the record has the whole one */
+        memset(&pk, 0, sizeof(pk));
+        memset(&pd, 0, sizeof(pd));
+        pk.data = pkey->mv_data;
+        pk.size = pkey->mv_size;
+        pd.data = data->mv_data;
+        pd.size = data->mv_size;
+        didname(NULL, &pk, &pd, &sk);
+        if (sk.size != key->size || memcmp(sk.data, key->data, key->size) != 0)
+            return MDB_NOTFOUND;
+    }
+    return 0;
+}
+
+/*!
+ * The txn for a read: the write txn if there's one, else the renewed read txn
+ */
+static int read_begin(struct lmdb_dbd *l, MDB_txn **txn)
+{
+    int rc;
+
+    if (l->txn || l->group) {
+        *txn = l->txn ? l->txn : l->group;
+        return 0;
+    }
+    if ((rc = mdb_txn_renew(l->rtxn)))
+        return rc;
+    *txn = l->rtxn;
+    return 0;
+}
+
+static void read_end(struct lmdb_dbd *l, MDB_txn *txn)
+{
+    if (txn == l->rtxn)
+        mdb_txn_reset(l->rtxn);
+}
+
+/*
+ * Data from LMDB is only valid until the txn ends or writes, copy it to the
+ * buffer of the DBD for the table. It's valid until the next read from the
+ * same table through the same DBD, like with DB_DBT_REALLOC.
+ */
+static int dbt_copy(DBD *dbd, const int dbi, int i, DBT *dbt, const MDB_val *val)
+{
+    void *p;
+
+    if ((p = realloc(dbd->db_buf[dbi][i], val->mv_size ? val->mv_size : 1)) == NULL)
+        return ENOMEM;
+    memcpy(p, val->mv_data, val->mv_size);
+    dbd->db_buf[dbi][i] = p;
+    dbt->data = p;
+    dbt->size = val->mv_size;
+    return 0;
+}
+
+/* Drop the handle of a DBD or view, the last one closes the environment */
+static void lmdb_release(struct lmdb_dbd *l)
+{
+    struct lmdb_env *e = l->e;
+
+    if (l->txn)
+        mdb_txn_abort(l->txn);
+    if (l->group)
+        mdb_txn_abort(l->group);
+    if (l->rtxn)
+        mdb_txn_abort(l->rtxn);
+    free(l);
+
+    if (--e->refs == 0) {
+        if (e->env)
+            mdb_env_close(e->env);
+        free(e);
+    }
+}
+
+/* A reset read txn for l */
+static int lmdb_rtxn(struct lmdb_dbd *l)
+{
+    int rc;
+
+    if ((rc = mdb_txn_begin(l->e->env, NULL, MDB_RDONLY, &l->rtxn))) {
+        LOG(log_error, logtype_cnid, "error starting LMDB read transaction: %s", mdb_strerror(rc));
+        l->rtxn = NULL;
+        return -1;
+    }
+    mdb_txn_reset(l->rtxn);
+    return 0;
+}
+
+/*!
+ * Open the LMDB environment db_filename in db_envhome
+ *
+ * @returns 0 on success, -1 on error
+ */
+int lmdb_env_open(DBD *dbd)
+{
+    struct lmdb_dbd *l;
+    struct lmdb_env *e;
+    struct stat st;
+    char path[MAXPATHLEN + 1];
+    size_t mapsize;
+    unsigned int flags = MDB_NOSUBDIR | MDB_NOTLS;
+    int rc, dead;
+
+    if (dbd->db_envhome == NULL) {
+        LOG(log_error, logtype_cnid, "LMDB backend: no in-memory databases");
+        return -1;
+    }
+
+    if ((l = calloc(1, sizeof(*l))) == NULL || (e = calloc(1, sizeof(*e))) == NULL) {
+        LOG(log_error, logtype_cnid, "lmdb_env_open: out of memory");
+        free(l);
+        return -1;
+    }
+    e->refs = 1;
+    l->e = e;
+    dbd->db_lmdb = l;
+
+    if ((rc = mdb_env_create(&e->env))) {
+        LOG(log_error, logtype_cnid, "error creating LMDB environment: %s", mdb_strerror(rc));
+        e->env = NULL;
+        return -1;
+    }
+
+    if ((rc = mdb_env_set_maxdbs(e->env, DBIF_DB_CNT))) {
+        LOG(log_error, logtype_cnid, "error setting LMDB maxdbs: %s", mdb_strerror(rc));
+        return -1;
+    }
+
+    /* MB, mind 32 bit size_t */
+    if ((size_t)dbd->db_param.lmdb_mapsize > (SIZE_MAX >> 20))
+        mapsize = (SIZE_MAX >> 20) << 20;
+    else
+        mapsize = (size_t)dbd->db_param.lmdb_mapsize << 20;
+    if ((rc = mdb_env_set_mapsize(e->env, mapsize))) {
+        LOG(log_error, logtype_cnid, "error setting LMDB mapsize to %d MB: %s",
+            dbd->db_param.lmdb_mapsize, mdb_strerror(rc));
+        return -1;
+    }
+
+    if (dbd->db_param.durability == DBP_DURABILITY_NOSYNC)
+        /* Commits only write to the OS, dbif_txn_checkpoint syncs */
+        flags |= MDB_NOSYNC;
+
+    snprintf(path, sizeof(path), "%s/cnid2.db", dbd->db_envhome);
+    if (stat(path, &st) == 0)
+        LOG(log_warning, logtype_cnid, "BerkeleyDB database \"%s\" isn't used by the LMDB backend", path);
+
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", dbd->db_envhome, dbd->db_filename) >= sizeof(path)) {
+        LOG(log_error, logtype_cnid, "LMDB environment path too long");
+        return -1;
+    }
+
+    if ((rc = mdb_env_open(e->env, path, flags, 0664))) {
+        LOG(log_error, logtype_cnid, "error opening LMDB environment \"%s\": %s", path, mdb_strerror(rc));
+        return -1;
+    }
+
+    /* Reader slots of a cnid_dbd that died */
+    if ((rc = mdb_reader_check(e->env, &dead)))
+        LOG(log_warning, logtype_cnid, "error checking LMDB readers: %s", mdb_strerror(rc));
+    else if (dead)
+        LOG(log_info, logtype_cnid, "Cleared %d stale LMDB readers", dead);
+
+    e->maxkey = mdb_env_get_maxkeysize(e->env);
+
+    return 0;
+}
+
+/*!
+ * Open the tables, with reindex rebuild the indexes from the CNID table
+ *
+ * @returns 0 on success, -1 on error
+ */
+int lmdb_open(DBD *dbd, int reindex)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    struct lmdb_env *e = l->e;
+    static struct index_keys nk;
+    MDB_cursor *cur;
+    MDB_val key, data;
+    unsigned int flags;
+    int i, rc;
+
+    if (lmdb_txn_begin(dbd) < 0)
+        return -1;
+
+    for (i = 0; i != DBIF_DB_CNT; i++) {
+        flags = MDB_CREATE;
+        if (index_dup(dbd, i))
+            flags |= MDB_DUPSORT;
+        if ((rc = mdb_dbi_open(l->txn, dbd->db_table[i].name, flags, &e->dbi[i]))) {
+            LOG(log_error, logtype_cnid, "error opening LMDB database %s: %s",
+                dbd->db_table[i].name, mdb_strerror(rc));
+            lmdb_txn_abort(dbd);
+            return -1;
+        }
+    }
+
+    if (reindex) {
+        LOG(log_info, logtype_cnid, "Reindexing CNID database...");
+        for (i = DBIF_IDX_DEVINO; i != DBIF_DB_CNT; i++) {
+            if ((rc = mdb_drop(l->txn, e->dbi[i], 0))) {
+                LOG(log_error, logtype_cnid, "error truncating LMDB database %s: %s",
+                    dbd->db_table[i].name, mdb_strerror(rc));
+                lmdb_txn_abort(dbd);
+                return -1;
+            }
+        }
+        if ((rc = mdb_cursor_open(l->txn, e->dbi[DBIF_CNID], &cur)) == 0) {
+            rc = mdb_cursor_get(cur, &key, &data, MDB_FIRST);
+            while (rc == 0) {
+                index_keys(dbd, &key, &data, &nk);
+                if ((rc = index_update(dbd, &key, NULL, &nk)))
+                    break;
+                rc = mdb_cursor_get(cur, &key, &data, MDB_NEXT);
+            }
+            mdb_cursor_close(cur);
+        }
+        if (rc != MDB_NOTFOUND) {
+            LOG(log_error, logtype_cnid, "error reindexing CNID database: %s", mdb_strerror(rc));
+            lmdb_txn_abort(dbd);
+            return -1;
+        }
+        LOG(log_info, logtype_cnid, "... done.");
+    }
+
+    if (lmdb_txn_commit(dbd) < 0)
+        return -1;
+
+    return lmdb_rtxn(l);
+}
+
+/*!
+ * Close the handle of a DBD or view
+ */
+int lmdb_close(DBD *dbd)
+{
+    lmdb_release(dbd->db_lmdb);
+    dbd->db_lmdb = NULL;
+    return 0;
+}
+
+/*!
+ * Give view its own read txn in the environment of dbd
+ *
+ * @returns 0 on success, -1 on error
+ */
+int lmdb_view(DBD *view, const DBD *dbd)
+{
+    struct lmdb_dbd *l;
+
+    if ((l = calloc(1, sizeof(*l))) == NULL)
+        return -1;
+    l->e = dbd->db_lmdb->e;
+    if (lmdb_rtxn(l) != 0) {
+        free(l);
+        return -1;
+    }
+    l->e->refs++;
+    view->db_lmdb = l;
+    return 0;
+}
+
+int lmdb_get(DBD *dbd, const int dbi, DBT *key, DBT *val)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    MDB_txn *txn;
+    MDB_val k, pk, v;
+    int rc;
+
+    if ((rc = read_begin(l, &txn)) == 0) {
+        if (dbi == DBIF_CNID) {
+            k.mv_data = key->data;
+            k.mv_size = key->size;
+            rc = mdb_get(txn, l->e->dbi[DBIF_CNID], &k, &v);
+        } else {
+            rc = index_get(dbd, txn, dbi, key, &pk, &v);
+        }
+        if (rc == 0)
+            rc = dbt_copy(dbd, dbi, 0, val, &v);
+        read_end(l, txn);
+    }
+
+    if (rc == MDB_NOTFOUND)
+        return 0;
+    if (rc) {
+        LOG(log_error, logtype_cnid, "error retrieving value from %s: %s",
+            dbd->db_table[dbi].name, mdb_strerror(rc));
+        return -1;
+    }
+    return 1;
+}
+
+/* search by secondary return primary */
+int lmdb_pget(DBD *dbd, const int dbi, DBT *key, DBT *pkey, DBT *val)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    MDB_txn *txn;
+    MDB_val pk, v;
+    int rc;
+
+    if ((rc = read_begin(l, &txn)) == 0) {
+        rc = index_get(dbd, txn, dbi, key, &pk, &v);
+        if (rc == 0 && (rc = dbt_copy(dbd, dbi, 0, val, &v)) == 0)
+            rc = dbt_copy(dbd, dbi, 1, pkey, &pk);
+        read_end(l, txn);
+    }
+
+    if (rc == MDB_NOTFOUND)
+        return 0;
+    if (rc) {
+        LOG(log_error, logtype_cnid, "error retrieving value from %s: %s",
+            dbd->db_table[dbi].name, mdb_strerror(rc));
+        return -1;
+    }
+    return 1;
+}
+
+/*!
+ * Put a CNID record and its index entries
+ *
+ * Nothing is written when a unique index already has an entry of the record
+ * for another one, that's DB_KEYEXIST like with associated BerkeleyDB indexes.
+ */
+int lmdb_put(DBD *dbd, const int dbi, DBT *key, DBT *val, u_int32_t flags)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    static struct index_keys ok, nk;
+    MDB_val k, v, old;
+    int rc, found;
+
+    if (dbi != DBIF_CNID) {
+        LOG(log_error, logtype_cnid, "error setting key/value in %s: not a table", dbd->db_table[dbi].name);
+        return -1;
+    }
+
+    if (dbif_txn_begin(dbd) < 0) {
+        LOG(log_error, logtype_cnid, "error setting key/value in %s", dbd->db_table[dbi].name);
+        return -1;
+    }
+
+    k.mv_data = key->data;
+    k.mv_size = key->size;
+    v.mv_data = val->data;
+    v.mv_size = val->size;
+
+    rc = mdb_get(l->txn, l->e->dbi[DBIF_CNID], &k, &old);
+    found = (rc == 0);
+    if (found && (flags & DB_NOOVERWRITE))
+        return 1;
+
+    if (rc == 0 || rc == MDB_NOTFOUND) {
+        if (found)
+            index_keys(dbd, &k, &old, &ok);
+        index_keys(dbd, &k, &v, &nk);
+        if ((rc = index_check(dbd, &k, found ? &ok : NULL, &nk)) == 0
+            && (rc = mdb_put(l->txn, l->e->dbi[DBIF_CNID], &k, &v, 0)) == 0)
+            rc = index_update(dbd, &k, found ? &ok : NULL, &nk);
+    }
+
+    if (rc == MDB_KEYEXIST && (flags & DB_NOOVERWRITE))
+        return 1;
+    if (rc) {
+        LOG(log_error, logtype_cnid, "error setting key/value in %s: %s",
+            dbd->db_table[dbi].name, mdb_strerror(rc));
+        if (rc == MDB_MAP_FULL)
+            LOG(log_error, logtype_cnid, "LMDB map full, raise lmdb_mapsize in db_param");
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * Delete the CNID record for key of table dbi and its index entries
+ */
+int lmdb_del(DBD *dbd, const int dbi, DBT *key)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    static struct index_keys ok;
+    MDB_val k, v;
+    cnid_t cnid;
+    int rc;
+
+    l->walk = 0;
+
+    if (dbif_txn_begin(dbd) < 0) {
+        LOG(log_error, logtype_cnid, "error deleting key/value from %s", dbd->db_table[dbi].name);
+        return -1;
+    }
+
+    if (dbi == DBIF_CNID) {
+        k.mv_data = key->data;
+        k.mv_size = key->size;
+        rc = mdb_get(l->txn, l->e->dbi[DBIF_CNID], &k, &v);
+    } else {
+        rc = index_get(dbd, l->txn, dbi, key, &k, &v);
+    }
+
+    if (rc == 0 && k.mv_size != sizeof(cnid))
+        rc = MDB_CORRUPTED;
+    if (rc == 0) {
+        /* k and v point into the map, they're gone after the first write */
+        memcpy(&cnid, k.mv_data, sizeof(cnid));
+        k.mv_data = &cnid;
+        index_keys(dbd, &k, &v, &ok);
+        if ((rc = mdb_del(l->txn, l->e->dbi[DBIF_CNID], &k, NULL)) == 0)
+            rc = index_update(dbd, &k, &ok, NULL);
+    }
+
+    if (rc == MDB_NOTFOUND) {
+        LOG(log_debug, logtype_cnid, "key not found");
+        return 0;
+    }
+    if (rc) {
+        LOG(log_error, logtype_cnid, "error deleting key/value from %s: %s",
+            dbd->db_table[dbi].name, mdb_strerror(rc));
+        return -1;
+    }
+    return 1;
+}
+
+int lmdb_count(DBD *dbd, const int dbi, u_int32_t *count)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    MDB_txn *txn;
+    MDB_stat st;
+    int rc;
+
+    if ((rc = read_begin(l, &txn)) == 0) {
+        rc = mdb_stat(txn, l->e->dbi[dbi], &st);
+        read_end(l, txn);
+    }
+
+    if (rc) {
+        LOG(log_error, logtype_cnid, "error getting stat infotmation on database: %s", mdb_strerror(rc));
+        return -1;
+    }
+
+    *count = st.ms_entries;
+    return 0;
+}
+
+/*!
+ * Search the name index for names starting with key
+ *
+ * @returns -1 on error, 0 when nothing found, else the number of matches
+ */
+int lmdb_search(DBD *dbd, DBT *key, char *resbuf)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    char buf[PACK_CNID_DATA_LEN];
+    MDB_cursor *cur;
+    MDB_txn *txn;
+    MDB_val prefix, k, v;
+    cnid_t cnid;
+    char *cnids = resbuf;
+    int count = 0;
+    int rc;
+
+    key_fit(l->e, DBIF_IDX_NAME, key->data, key->size, &prefix, buf);
+
+    if ((rc = read_begin(l, &txn)) == 0) {
+        if ((rc = mdb_cursor_open(txn, l->e->dbi[DBIF_IDX_NAME], &cur)) == 0) {
+            k = prefix;
+            rc = mdb_cursor_get(cur, &k, &v, k.mv_size ? MDB_SET_RANGE : MDB_FIRST);
+            while (count < DBD_MAX_SRCH_RSLTS && rc == 0) {
+                if (k.mv_size < prefix.mv_size || memcmp(k.mv_data, prefix.mv_data, prefix.mv_size) != 0)
+                    break;
+                count++;
+                memcpy(cnids, v.mv_data, sizeof(cnid_t));
+                memcpy(&cnid, v.mv_data, sizeof(cnid_t));
+                cnids += sizeof(cnid_t);
+                LOG(log_debug, logtype_cnid, "match: CNID %" PRIu32, ntohl(cnid));
+
+                rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT);
+            }
+            mdb_cursor_close(cur);
+        }
+        read_end(l, txn);
+    }
+
+    if (rc && rc != MDB_NOTFOUND) {
+        LOG(log_error, logtype_cnid, "error searching %s: %s",
+            dbd->db_table[DBIF_IDX_NAME].name, mdb_strerror(rc));
+        return -1;
+    }
+    return count;
+}
+
+/*
+ * dbif_idwalk without a cursor that outlives the txn: the first call seeks to
+ * cnid, the following ones to the CNID after the one they returned.
+ */
+int lmdb_idwalk(DBD *dbd, cnid_t *cnid, int close)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    MDB_cursor *cur;
+    MDB_txn *txn;
+    MDB_val k, v;
+    cnid_t id;
+    int rc;
+
+    if (close || (l->walk && *cnid == UINT32_MAX)) {
+        l->walk = 0;
+        return 0;
+    }
+
+    id = htonl(l->walk ? *cnid + 1 : *cnid);
+    k.mv_data = &id;
+    k.mv_size = sizeof(id);
+
+    if ((rc = read_begin(l, &txn)) == 0) {
+        if ((rc = mdb_cursor_open(txn, l->e->dbi[DBIF_CNID], &cur)) == 0) {
+            if ((rc = mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE)) == 0) {
+                memcpy(cnid, k.mv_data, sizeof(cnid_t));
+                *cnid = ntohl(*cnid);
+            }
+            mdb_cursor_close(cur);
+        }
+        read_end(l, txn);
+    }
+
+    if (rc == 0) {
+        l->walk = 1;
+        return 1;
+    }
+
+    l->walk = 0;
+    if (rc != MDB_NOTFOUND) {
+        LOG(log_error, logtype_cnid, "Error iterating over btree: %s", mdb_strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+int lmdb_txn_begin(DBD *dbd)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    int rc;
+
+    if (l->txn)
+        return 0;
+
+    if (dbd->db_grouping && l->group == NULL) {
+        if ((rc = mdb_txn_begin(l->e->env, NULL, 0, &l->group))) {
+            LOG(log_error, logtype_cnid, "error starting group transaction: %s", mdb_strerror(rc));
+            l->group = NULL;
+            return -1;
+        }
+    }
+
+    if ((rc = mdb_txn_begin(l->e->env, l->group, 0, &l->txn))) {
+        LOG(log_error, logtype_cnid, "error starting transaction: %s", mdb_strerror(rc));
+        l->txn = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int lmdb_txn_commit(DBD *dbd)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    int rc;
+
+    if (l->txn == NULL)
+        return 0;
+
+    rc = mdb_txn_commit(l->txn);
+    l->txn = NULL;
+
+    if (rc) {
+        LOG(log_error, logtype_cnid, "error committing transaction: %s", mdb_strerror(rc));
+        return -1;
+    }
+    return 1;
+}
+
+int lmdb_txn_abort(DBD *dbd)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+
+    if (l->txn == NULL)
+        return 0;
+
+    mdb_txn_abort(l->txn);
+    l->txn = NULL;
+    return 0;
+}
+
+int lmdb_group_pending(DBD *dbd)
+{
+    return dbd->db_lmdb->group != NULL;
+}
+
+int lmdb_group_commit(DBD *dbd)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+    int rc;
+
+    if (l->group == NULL)
+        return 0;
+
+    lmdb_txn_abort(dbd);
+    rc = mdb_txn_commit(l->group);
+    l->group = NULL;
+
+    if (rc) {
+        LOG(log_error, logtype_cnid, "error committing group transaction: %s", mdb_strerror(rc));
+        return -1;
+    }
+    return 1;
+}
+
+int lmdb_group_abort(DBD *dbd)
+{
+    struct lmdb_dbd *l = dbd->db_lmdb;
+
+    if (l->group == NULL)
+        return 0;
+
+    lmdb_txn_abort(dbd);
+    mdb_txn_abort(l->group);
+    l->group = NULL;
+    return 0;
+}
+
+/*!
+ * With durability "nosync" write the commits since the last call to disk,
+ * otherwise they're there already
+ */
+int lmdb_checkpoint(DBD *dbd)
+{
+    int rc;
+
+    if (dbd->db_param.durability != DBP_DURABILITY_NOSYNC)
+        return 0;
+
+    if ((rc = mdb_env_sync(dbd->db_lmdb->e->env, 1))) {
+        LOG(log_error, logtype_cnid, "error syncing LMDB environment: %s", mdb_strerror(rc));
+        return -1;
+    }
+    return 0;
+}
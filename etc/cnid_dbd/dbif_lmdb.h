@@ -0,0 +1,49 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+#ifndef CNID_DBD_DBIF_LMDB_H
+#define CNID_DBD_DBIF_LMDB_H 1
+
+#include "dbif.h"
+
+/*
+ * The dbif_* functions hand a DBD opened with db_param backend "lmdb" over to
+ * their lmdb_* counterpart with LMDB_CALL, without LMDB support it's a no-op.
+ */
+#ifdef HAVE_LMDB
+#define LMDB_CALL(dbd, call) do { if ((dbd)->db_lmdb) return (call); } while (0)
+#else
+#define LMDB_CALL(dbd, call) do { } while (0)
+#endif
+
+extern int  lmdb_env_open(DBD *dbd);
+extern int  lmdb_open(DBD *dbd, int reindex);
+extern int  lmdb_close(DBD *dbd);
+extern int  lmdb_view(DBD *view, const DBD *dbd);
+
+extern int  lmdb_get(DBD *dbd, const int dbi, DBT *key, DBT *val);
+extern int  lmdb_pget(DBD *dbd, const int dbi, DBT *key, DBT *pkey, DBT *val);
+extern int  lmdb_put(DBD *dbd, const int dbi, DBT *key, DBT *val, u_int32_t flags);
+extern int  lmdb_del(DBD *dbd, const int dbi, DBT *key);
+extern int  lmdb_count(DBD *dbd, const int dbi, u_int32_t *count);
+extern int  lmdb_search(DBD *dbd, DBT *key, char *resbuf);
+extern int  lmdb_idwalk(DBD *dbd, cnid_t *cnid, int close);
+
+extern int  lmdb_txn_begin(DBD *dbd);
+extern int  lmdb_txn_commit(DBD *dbd);
+extern int  lmdb_txn_abort(DBD *dbd);
+extern int  lmdb_group_pending(DBD *dbd);
+extern int  lmdb_group_commit(DBD *dbd);
+extern int  lmdb_group_abort(DBD *dbd);
+extern int  lmdb_checkpoint(DBD *dbd);
+
+#endif /* CNID_DBD_DBIF_LMDB_H */
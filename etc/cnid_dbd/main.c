@@ -19,6 +19,7 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <sys/time.h>
 #include <sys/file.h>
 #include <arpa/inet.h>
 
@@ -35,6 +36,7 @@
 #include "dbd.h"
 #include "comm.h"
 #include "pack.h"
+#include "readers.h"
 
 /* 
    Note: DB_INIT_LOCK is here so we can run the db_* utilities while netatalk is running.
@@ -49,6 +51,18 @@ static bstring dbpath;
 static struct db_param *dbp;
 static struct vol *vol;
 
+/*
+ * Group commit: the replies to the requests in the open group txn, they are sent
+ * once it's committed
+ */
+struct deferred_rply {
+    int                  fd;        /* from comm_busy */
+    struct cnid_dbd_rply rply;
+};
+static struct deferred_rply *deferred;
+static int ndeferred;
+static struct timeval group_start;
+
 static void sig_exit(int signo)
 {
     exit_sig = signo;
@@ -185,7 +199,7 @@ static int open_db(void)
         EC_FAIL;
     }
 
-    if (NULL == (dbd = dbif_init(bdata(dbpath), "cnid2.db")))
+    if (NULL == (dbd = dbif_init(bdata(dbpath), dbp->backend == DBP_BACKEND_LMDB ? LMDB_FILENAME : "cnid2.db")))
         EC_FAIL;
 
     /* Only recover if we got the lock */
@@ -218,14 +232,19 @@ static int delete_db(void)
     EC_ZERO( get_lock(LOCK_FREE, bdata(dbpath)) );
     EC_NEG1( cwd = open(".", O_RDONLY) );
     chdir(cfrombstr(dbpath));
-    system("rm -f cnid2.db lock log.* __db.*");
+    /* only the files of the configured backend, the other one is the way back */
+    if (dbp->backend == DBP_BACKEND_LMDB)
+        system("rm -f " LMDB_FILENAME " " LMDB_FILENAME "-lock");
+    else
+        system("rm -f cnid2.db lock log.* __db.*");
 
     if ((db_locked = get_lock(LOCK_EXCL, bdata(dbpath))) != LOCK_EXCL) {
         LOG(log_error, logtype_cnid, "main: fatal db lock error");
         EC_FAIL;
     }
 
-    LOG(log_warning, logtype_cnid, "Recreated CNID BerkeleyDB databases of volume \"%s\"", vol->v_localname);
+    LOG(log_warning, logtype_cnid, "Recreated CNID %s databases of volume \"%s\"",
+        dbp->backend == DBP_BACKEND_LMDB ? "LMDB" : "BerkeleyDB", vol->v_localname);
 
 EC_CLEANUP:
     if (cwd != -1)
@@ -245,6 +264,10 @@ static int reinit_db(void)
     EC_INIT;
     DBT key, data;
     bool copyRootInfo = false;
+    char rootinfo[ROOTINFO_DATALEN];
+
+    /* The readers must be done with the handles we are about to close */
+    readers_drain();
 
     if (dbd) {
         memset(&key, 0, sizeof(key));
@@ -253,17 +276,22 @@ static int reinit_db(void)
         key.data = ROOTINFO_KEY;
         key.size = ROOTINFO_KEYLEN;
 
-        if (dbif_get(dbd, DBIF_CNID, &key, &data, 0) <= 0) {
+        if (dbif_get(dbd, DBIF_CNID, &key, &data, 0) <= 0 || data.size > sizeof(rootinfo)) {
             LOG(log_error, logtype_cnid, "dbif_copy_rootinfokey: Error getting rootinfo record");
             copyRootInfo = false;
         } else {
+            /* data belongs to dbd, which is gone after dbif_close */
+            memcpy(rootinfo, data.data, data.size);
+            data.data = rootinfo;
             copyRootInfo = true;
         }
         (void)dbif_close(dbd);
+        dbd = NULL;
     }
 
     EC_ZERO_LOG( delete_db() );
     EC_ZERO_LOG( open_db() );
+    EC_ZERO_LOG( readers_sync(dbd) );
 
     if (copyRootInfo == true) {
         memset(&key, 0, sizeof(key));
@@ -280,16 +308,214 @@ EC_CLEANUP:
     EC_EXIT;
 }
 
+/*
+ * Hold back the reply to the current request until the group is committed.
+ * Returns -1 on fatal errors, 0 otherwise.
+ */
+static int group_defer(struct cnid_dbd_rply *rply)
+{
+    struct deferred_rply *d;
+
+    if (deferred == NULL
+        && (deferred = calloc(dbp->group_commit_size, sizeof(struct deferred_rply))) == NULL) {
+        LOG(log_error, logtype_cnid, "group_defer: out of memory");
+        return -1;
+    }
+
+    d = &deferred[ndeferred];
+    d->rply = *rply;
+    d->rply.name = NULL;
+    if (rply->namelen) {
+        /* the name may be in a static buffer of the dbd_* function */
+        if ((d->rply.name = malloc(rply->namelen)) == NULL) {
+            LOG(log_error, logtype_cnid, "group_defer: out of memory");
+            return -1;
+        }
+        memcpy(d->rply.name, rply->name, rply->namelen);
+    }
+    d->fd = comm_busy();
+
+    if (ndeferred++ == 0)
+        gettimeofday(&group_start, NULL);
+    return 0;
+}
+
+/*
+ * Commit the group txn and send the replies to its requests.
+ * Returns -1 on fatal errors, 0 otherwise.
+ */
+static int group_commit(void)
+{
+    int i, sent;
+
+    if (dbif_group_commit(dbd) < 0) {
+        LOG(log_error, logtype_cnid, "Fatal error committing group transaction. Exiting!");
+        return -1;
+    }
+
+    for (i = 0; i < ndeferred; i++) {
+        sent = comm_snd_fd(deferred[i].fd, &deferred[i].rply);
+        comm_resume(deferred[i].fd, sent);
+        free(deferred[i].rply.name);
+    }
+    ndeferred = 0;
+    return 0;
+}
+
+/* Has the group reached group_commit_size or group_commit_interval */
+static int group_due(void)
+{
+    struct timeval now;
+    long ms;
+
+    if (ndeferred >= dbp->group_commit_size)
+        return 1;
+
+    gettimeofday(&now, NULL);
+    ms = (now.tv_sec - group_start.tv_sec) * 1000 + (now.tv_usec - group_start.tv_usec) / 1000;
+    return ms >= dbp->group_commit_interval;
+}
+
+/*
+ * Run a request in the main thread, send the reply to the current descriptor of
+ * comm and commit or abort.
+ * Returns -1 on fatal errors, 0 otherwise.
+ */
+static int process(struct cnid_dbd_rqst *rqst, int *count)
+{
+    struct cnid_dbd_rply rply;
+    int ret, cret;
+
+    /* dbif_search reads without a txn and reinit_db closes the database */
+    if (ndeferred && (rqst->op == CNID_DBD_OP_SEARCH || rqst->op == CNID_DBD_OP_WIPE)) {
+        if (group_commit() < 0)
+            return -1;
+    }
+
+    memset(&rply, 0, sizeof(rply));
+    switch(rqst->op) {
+        /* ret gets set here */
+    case CNID_DBD_OP_OPEN:
+    case CNID_DBD_OP_CLOSE:
+        /* open/close are noops for now. */
+        rply.namelen = 0;
+        ret = 1;
+        break;
+    case CNID_DBD_OP_ADD:
+        ret = dbd_add(dbd, rqst, &rply);
+        break;
+    case CNID_DBD_OP_GET:
+        ret = dbd_get(dbd, rqst, &rply);
+        break;
+    case CNID_DBD_OP_RESOLVE:
+        ret = dbd_resolve(dbd, rqst, &rply);
+        break;
+    case CNID_DBD_OP_LOOKUP:
+        ret = dbd_lookup(dbd, rqst, &rply);
+        break;
+    case CNID_DBD_OP_UPDATE:
+        ret = dbd_update(dbd, rqst, &rply);
+        break;
+    case CNID_DBD_OP_DELETE:
+        ret = dbd_delete(dbd, rqst, &rply, DBIF_CNID);
+        break;
+    case CNID_DBD_OP_GETSTAMP:
+        ret = dbd_getstamp(dbd, rqst, &rply);
+        break;
+    case CNID_DBD_OP_REBUILD_ADD:
+        ret = dbd_rebuild_add(dbd, rqst, &rply);
+        break;
+    case CNID_DBD_OP_SEARCH:
+        ret = dbd_search(dbd, rqst, &rply);
+        break;
+    case CNID_DBD_OP_WIPE:
+        ret = reinit_db();
+        break;
+    case CNID_DBD_OP_BATCH:
+        ret = dbd_batch(dbd, rqst, &rply, count);
+        break;
+    default:
+        LOG(log_error, logtype_cnid, "loop: unknown op %d", rqst->op);
+        ret = -1;
+        break;
+    }
+
+    if (dbif_group_pending(dbd)) {
+        /* Group commit: commit the request into the group, reply once that's on disk */
+        if (ret < 0) {
+            dbif_txn_abort(dbd);
+            return -1;
+        }
+        if (ret == 0) {
+            if (dbif_txn_abort(dbd) < 0)
+                return -1;
+        } else {
+            if ((ret = dbif_txn_commit(dbd)) < 0)
+                return -1;
+            if (ret > 0)
+                (*count)++;
+        }
+        if (group_defer(&rply) < 0)
+            return -1;
+        if (ndeferred >= dbp->group_commit_size)
+            return group_commit();
+        return 0;
+    }
+
+    if ((cret = comm_snd(&rply)) < 0 || ret < 0) {
+        dbif_txn_abort(dbd);
+        return -1;
+    }
+
+    if (ret == 0 || cret == 0) {
+        if (dbif_txn_abort(dbd) < 0)
+            return -1;
+    } else {
+        ret = dbif_txn_commit(dbd);
+        if (  ret < 0)
+            return -1;
+        else if ( ret > 0 )
+            /* We had a designated txn because we wrote to the db */
+            (*count)++;
+    }
+    return 0;
+}
+
+/*
+ * Give the descriptors of the requests the reader threads finished back to comm
+ * and run the lookups that need to fix up the database.
+ * Returns -1 on fatal errors, 0 otherwise.
+ */
+static int reap_readers(int *count)
+{
+    struct reader_job *job, *next;
+    int ret = 0;
+
+    for (job = readers_reap(); job != NULL; job = next) {
+        next = job->next;
+        if (job->ret == DBD_NEED_WRITER) {
+            comm_resume(job->fd, 1);
+            if (ret == 0 && process(&job->rqst, count) < 0)
+                ret = -1;
+        } else {
+            comm_resume(job->fd, job->sent);
+            if (job->ret < 0)
+                ret = -1;
+        }
+        free(job);
+    }
+    return ret;
+}
+
 static int loop(struct db_param *dbp)
 {
     struct cnid_dbd_rqst rqst;
-    struct cnid_dbd_rply rply;
     time_t timeout;
-    int ret, cret;
+    int cret;
     int count;
     time_t now, time_next_flush, time_last_rqst;
     char timebuf[64];
-    static char namebuf[MAXPATHLEN + 1];
+    static char namebuf[CNID_DBD_BATCH_BUFSIZ + 1];
     sigset_t set;
 
     sigemptyset(&set);
@@ -315,11 +541,21 @@ static int loop(struct db_param *dbp)
         else
             timeout = 1;
 
+        /* before comm_rcv, this changes the current descriptor */
+        if (reap_readers(&count) < 0)
+            return -1;
+
+        /* Don't wait with an open group, commit it once no request is ready */
+        if (ndeferred)
+            timeout = 0;
+
         if ((cret = comm_rcv(&rqst, timeout, &set, &now)) < 0)
             return -1;
 
         if (cret == 0) {
             /* comm_rcv returned from select without receiving anything. */
+            if (ndeferred && group_commit() < 0)
+                return -1;
             if (exit_sig) {
                 /* Received signal (TERM|INT) */
                 return 0;
@@ -334,69 +570,16 @@ static int loop(struct db_param *dbp)
             /* We got a request */
             time_last_rqst = now;
 
-            memset(&rply, 0, sizeof(rply));
-            switch(rqst.op) {
-                /* ret gets set here */
-            case CNID_DBD_OP_OPEN:
-            case CNID_DBD_OP_CLOSE:
-                /* open/close are noops for now. */
-                rply.namelen = 0;
-                ret = 1;
-                break;
-            case CNID_DBD_OP_ADD:
-                ret = dbd_add(dbd, &rqst, &rply);
-                break;
-            case CNID_DBD_OP_GET:
-                ret = dbd_get(dbd, &rqst, &rply);
-                break;
-            case CNID_DBD_OP_RESOLVE:
-                ret = dbd_resolve(dbd, &rqst, &rply);
-                break;
-            case CNID_DBD_OP_LOOKUP:
-                ret = dbd_lookup(dbd, &rqst, &rply);
-                break;
-            case CNID_DBD_OP_UPDATE:
-                ret = dbd_update(dbd, &rqst, &rply);
-                break;
-            case CNID_DBD_OP_DELETE:
-                ret = dbd_delete(dbd, &rqst, &rply, DBIF_CNID);
-                break;
-            case CNID_DBD_OP_GETSTAMP:
-                ret = dbd_getstamp(dbd, &rqst, &rply);
-                break;
-            case CNID_DBD_OP_REBUILD_ADD:
-                ret = dbd_rebuild_add(dbd, &rqst, &rply);
-                break;
-            case CNID_DBD_OP_SEARCH:
-                ret = dbd_search(dbd, &rqst, &rply);
-                break;
-            case CNID_DBD_OP_WIPE:
-                ret = reinit_db();
-                break;
-            default:
-                LOG(log_error, logtype_cnid, "loop: unknown op %d", rqst.op);
-                ret = -1;
-                break;
-            }
-
-            if ((cret = comm_snd(&rply)) < 0 || ret < 0) {
-                dbif_txn_abort(dbd);
+            if (readers_op(&rqst) && readers_submit(&rqst) == 0) {
+                /* a reader thread answers it */
+            } else if (process(&rqst, &count) < 0) {
                 return -1;
             }
-            
-            if (ret == 0 || cret == 0) {
-                if (dbif_txn_abort(dbd) < 0)
-                    return -1;
-            } else {
-                ret = dbif_txn_commit(dbd);
-                if (  ret < 0)
-                    return -1;
-                else if ( ret > 0 )
-                    /* We had a designated txn because we wrote to the db */
-                    count++;
-            }
         } /* got a request */
 
+        if (ndeferred && group_due() && group_commit() < 0)
+            return -1;
+
         /*
           Shall we checkpoint bdb ?
           "flush_interval" seconds passed ?
@@ -544,16 +727,26 @@ int main(int argc, char *argv[])
         goto close_db;
     }
 
+    if (readers_init(dbd, dbp->reader_threads) < 0) {
+        ret = -1;
+        goto close_db;
+    }
+
     if (loop(dbp) < 0) {
         ret = -1;
         goto close_db;
     }
 
 close_db:
+    /* readers could be waiting for the locks of the group */
+    if (dbd)
+        (void)dbif_group_abort(dbd);
+    readers_stop();
+
     if (dbif_close(dbd) < 0)
         ret = -1;
 
-    if (dbif_env_remove(bdata(dbpath)) < 0)
+    if (dbp->backend == DBP_BACKEND_BDB && dbif_env_remove(bdata(dbpath)) < 0)
         ret = -1;
 
 EC_CLEANUP:
@@ -107,7 +107,14 @@ void pack_setvol(const struct vol *vol)
 
 unsigned char *pack_cnid_data(struct cnid_dbd_rqst *rqst)
 {
-    static unsigned char start[CNID_HEADER_LEN + MAXPATHLEN + 1];
+    static unsigned char start[PACK_CNID_DATA_LEN];
+
+    return pack_cnid_data_r(rqst, start);
+}
+
+/* Re-entrant pack_cnid_data for reader threads, start holds PACK_CNID_DATA_LEN bytes */
+unsigned char *pack_cnid_data_r(struct cnid_dbd_rqst *rqst, unsigned char *start)
+{
     unsigned char *buf = start +CNID_LEN;
     u_int32_t i;
 
@@ -10,7 +10,10 @@
 #include <db.h>
 #include <atalk/cnid_dbd_private.h>
 
+#define PACK_CNID_DATA_LEN (CNID_HEADER_LEN + MAXPATHLEN + 1)
+
 extern unsigned char *pack_cnid_data(struct cnid_dbd_rqst *);
+extern unsigned char *pack_cnid_data_r(struct cnid_dbd_rqst *, unsigned char *);
 extern int didname(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
 extern int devino(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
 extern int idxname(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
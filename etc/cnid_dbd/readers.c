@@ -0,0 +1,313 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+/*!
+ * @file
+ * Reader threads for cnid_dbd
+ *
+ * The main thread receives all requests. Read-only requests are queued for a pool
+ * of threads which answer them concurrently through their own dbif_view of the
+ * DB_THREAD handles, everything that writes stays in the main thread, so writes
+ * are serialised as before. While a request is with the readers its descriptor
+ * isn't polled, a client never has more than one request in flight anyway.
+ *
+ * A reader sends the reply itself and puts the job on the done list, the main
+ * thread is woken up through a pipe, reaps the job and gives the descriptor back
+ * to comm. A lookup that would have to fix up the database comes back unanswered
+ * with DBD_NEED_WRITER and is run again by the main thread.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <atalk/logger.h>
+#include <atalk/util.h>
+#include <atalk/cnid_dbd_private.h>
+
+#include "dbif.h"
+#include "dbd.h"
+#include "comm.h"
+#include "readers.h"
+
+struct reader {
+    pthread_t tid;
+    DBD       *view;
+};
+
+static struct reader *readers;
+static int nreaders;
+static int wakeup[2] = { -1, -1 };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work = PTHREAD_COND_INITIALIZER;  /* queue not empty or stop */
+static pthread_cond_t  idle = PTHREAD_COND_INITIALIZER;  /* inflight dropped to 0 */
+static struct reader_job *queue, **queue_tail = &queue;
+static struct reader_job *done;
+static int inflight;                                     /* queued or running */
+static int stop;
+
+static void run_job(DBD *view, struct reader_job *job)
+{
+    struct cnid_dbd_rply rply;
+
+    memset(&rply, 0, sizeof(rply));
+
+    switch (job->rqst.op) {
+    case CNID_DBD_OP_GET:
+        job->ret = dbd_get(view, &job->rqst, &rply);
+        break;
+    case CNID_DBD_OP_RESOLVE:
+        job->ret = dbd_resolve(view, &job->rqst, &rply);
+        break;
+    case CNID_DBD_OP_LOOKUP:
+        job->ret = dbd_lookup(view, &job->rqst, &rply);
+        break;
+    case CNID_DBD_OP_GETSTAMP:
+        job->ret = dbd_getstamp(view, &job->rqst, &rply);
+        break;
+    case CNID_DBD_OP_SEARCH:
+        job->ret = dbd_search(view, &job->rqst, &rply);
+        break;
+    default:
+        job->ret = DBD_NEED_WRITER;
+        break;
+    }
+
+    if (job->ret != DBD_NEED_WRITER)
+        job->sent = comm_snd_fd(job->fd, &rply);
+}
+
+static void *reader_thread(void *arg)
+{
+    struct reader *r = arg;
+    struct reader_job *job;
+    char c = 0;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (!stop && queue == NULL)
+            pthread_cond_wait(&work, &lock);
+        if (queue == NULL)
+            break;
+
+        job = queue;
+        if ((queue = job->next) == NULL)
+            queue_tail = &queue;
+        pthread_mutex_unlock(&lock);
+
+        run_job(r->view, job);
+
+        pthread_mutex_lock(&lock);
+        job->next = done;
+        done = job;
+        if (--inflight == 0)
+            pthread_cond_broadcast(&idle);
+        /* a full pipe already wakes up the main thread */
+        (void)write(wakeup[1], &c, 1);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+/*!
+ * Start the reader threads
+ *
+ * @param dbd       (r) main handle, opened with reader_threads
+ * @param nthreads  (r) number of threads, 0 starts none
+ *
+ * @returns 0 on success, -1 on error
+ */
+int readers_init(DBD *dbd, int nthreads)
+{
+    int i;
+
+    if (nthreads <= 0)
+        return 0;
+
+    if (pipe(wakeup) != 0) {
+        LOG(log_error, logtype_cnid, "readers_init: pipe: %s", strerror(errno));
+        return -1;
+    }
+    setnonblock(wakeup[0], 1);
+    setnonblock(wakeup[1], 1);
+
+    if ((readers = calloc(nthreads, sizeof(struct reader))) == NULL) {
+        LOG(log_error, logtype_cnid, "readers_init: out of memory");
+        readers_stop();
+        return -1;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        if ((readers[i].view = dbif_view(dbd)) == NULL) {
+            LOG(log_error, logtype_cnid, "readers_init: out of memory");
+            readers_stop();
+            return -1;
+        }
+        if ((errno = pthread_create(&readers[i].tid, NULL, reader_thread, &readers[i])) != 0) {
+            LOG(log_error, logtype_cnid, "readers_init: pthread_create: %s", strerror(errno));
+            dbif_view_free(readers[i].view);
+            readers_stop();
+            return -1;
+        }
+        nreaders++;
+    }
+
+    comm_wakeup(wakeup[0]);
+    LOG(log_info, logtype_cnid, "Started %d reader threads", nreaders);
+    return 0;
+}
+
+/*!
+ * Can a reader thread answer rqst
+ */
+int readers_op(const struct cnid_dbd_rqst *rqst)
+{
+    if (nreaders == 0 || rqst->namelen > MAXPATHLEN)
+        return 0;
+
+    switch (rqst->op) {
+    case CNID_DBD_OP_GET:
+    case CNID_DBD_OP_RESOLVE:
+    case CNID_DBD_OP_LOOKUP:
+    case CNID_DBD_OP_GETSTAMP:
+    case CNID_DBD_OP_SEARCH:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*!
+ * Queue the current request of comm for the reader threads
+ *
+ * @returns 0 on success, -1 on error
+ */
+int readers_submit(const struct cnid_dbd_rqst *rqst)
+{
+    struct reader_job *job;
+
+    if ((job = malloc(sizeof(struct reader_job))) == NULL)
+        return -1;
+
+    job->next = NULL;
+    job->fd = comm_busy();
+    job->ret = 0;
+    job->sent = 0;
+    job->rqst = *rqst;
+    memcpy(job->name, rqst->name, rqst->namelen);
+    job->name[rqst->namelen] = '\0';
+    job->rqst.name = job->name;
+
+    pthread_mutex_lock(&lock);
+    *queue_tail = job;
+    queue_tail = &job->next;
+    inflight++;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+/*!
+ * Take the finished jobs
+ *
+ * @returns list of jobs linked by next, the caller frees them
+ */
+struct reader_job *readers_reap(void)
+{
+    struct reader_job *list;
+    char buf[64];
+
+    if (nreaders == 0)
+        return NULL;
+
+    while (read(wakeup[0], buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&lock);
+    list = done;
+    done = NULL;
+    pthread_mutex_unlock(&lock);
+
+    return list;
+}
+
+/*!
+ * Wait until the readers finished every queued job
+ */
+void readers_drain(void)
+{
+    pthread_mutex_lock(&lock);
+    while (inflight > 0)
+        pthread_cond_wait(&idle, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+/*!
+ * Give the readers views of a reopened database, call readers_drain before
+ * closing the old one
+ *
+ * @returns 0 on success, -1 on error
+ */
+int readers_sync(DBD *dbd)
+{
+    DBD *view;
+    int i;
+
+    for (i = 0; i < nreaders; i++) {
+        if ((view = dbif_view(dbd)) == NULL) {
+            LOG(log_error, logtype_cnid, "readers_sync: out of memory");
+            return -1;
+        }
+        pthread_mutex_lock(&lock);
+        dbif_view_free(readers[i].view);
+        readers[i].view = view;
+        pthread_mutex_unlock(&lock);
+    }
+    return 0;
+}
+
+/*!
+ * Finish the queued jobs and stop the reader threads
+ */
+void readers_stop(void)
+{
+    int i;
+
+    pthread_mutex_lock(&lock);
+    stop = 1;
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < nreaders; i++) {
+        pthread_join(readers[i].tid, NULL);
+        dbif_view_free(readers[i].view);
+    }
+    nreaders = 0;
+    free(readers);
+    readers = NULL;
+
+    if (wakeup[0] != -1) {
+        comm_wakeup(-1);
+        close(wakeup[0]);
+        close(wakeup[1]);
+        wakeup[0] = wakeup[1] = -1;
+    }
+}
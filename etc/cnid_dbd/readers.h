@@ -0,0 +1,39 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+#ifndef CNID_DBD_READERS_H
+#define CNID_DBD_READERS_H 1
+
+#include <sys/param.h>
+#include <atalk/cnid_dbd_private.h>
+
+#include "dbif.h"
+
+/* A request handed to the reader threads */
+struct reader_job {
+    struct reader_job    *next;
+    int                  fd;        /* from comm_busy */
+    int                  ret;       /* of the dbd_* function, DBD_NEED_WRITER: not answered */
+    int                  sent;      /* reply was sent */
+    struct cnid_dbd_rqst rqst;
+    char                 name[MAXPATHLEN + 1];
+};
+
+extern int  readers_init(DBD *dbd, int nthreads);
+extern int  readers_op(const struct cnid_dbd_rqst *rqst);
+extern int  readers_submit(const struct cnid_dbd_rqst *rqst);
+extern struct reader_job *readers_reap(void);
+extern void readers_drain(void);
+extern int  readers_sync(DBD *dbd);
+extern void readers_stop(void);
+
+#endif /* CNID_DBD_READERS_H */
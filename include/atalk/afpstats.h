@@ -0,0 +1,59 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#ifndef ATALK_AFPSTATS_H
+#define ATALK_AFPSTATS_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+/* log-linear histogram of microseconds, 4 buckets per power of 2 up to 2^28 us */
+#define AFPSTATS_SUBBITS  2
+#define AFPSTATS_MAXBITS  28
+#define AFPSTATS_BUCKETS  ((AFPSTATS_MAXBITS - AFPSTATS_SUBBITS + 1) << AFPSTATS_SUBBITS)
+
+/* histograms 0-255 are AFP commands */
+#define AFPSTATS_CNID     256       /* requests to the CNID database daemon */
+#define AFPSTATS_HISTS    257
+
+#define AFPSTATS_INTERVAL 10        /* seconds between updates sent by sessions */
+
+enum afpstats_counter {
+    AFPSTATS_RECEIVED,              /* DSI bytes received from clients */
+    AFPSTATS_SENT,                  /* DSI bytes sent to clients */
+    AFPSTATS_DC_LOOKUPS,            /* dircache lookups */
+    AFPSTATS_DC_HITS,               /* dircache hits */
+    AFPSTATS_COUNTERS
+};
+
+struct afpstats_hist {
+    uint64_t count;
+    uint64_t sum;                   /* microseconds */
+    uint64_t bucket[AFPSTATS_BUCKETS];
+};
+
+extern int afpstats_enabled;
+
+/* sessions */
+extern void afpstats_enable(void);
+extern void afpstats_start(struct timespec *start);
+extern void afpstats_record(int hist, const struct timespec *start);
+extern void afpstats_count(enum afpstats_counter counter, uint64_t n);
+extern int  afpstats_due(void);
+extern int  afpstats_send(int ipc_fd);
+
+/* master */
+extern int  afpstats_merge(const void *msg, size_t len);
+extern int  afpstats_write(int fd, int sessions, const char *(*cmdname)(int));
+
+#endif /* ATALK_AFPSTATS_H */
@@ -45,6 +45,21 @@
 #define CNID_ERR_CLOSE 0x80000004   /* the db was not open */
 #define CNID_ERR_MAX   0x80000005
 
+/* max number of requests in a cnid_lookup_batch() or cnid_add_batch() call */
+#define CNID_BATCH_MAX 64
+
+/*
+ * One request of cnid_lookup_batch() or cnid_add_batch()
+ */
+struct cnid_batch {
+    const struct stat *st;
+    cnid_t            did;
+    const char        *name;
+    size_t            len;
+    cnid_t            hint;         /* cnid_add_batch() only */
+    cnid_t            id;           /* result, CNID_INVALID if not found or on error */
+};
+
 /*
  * This is instance of CNID database object.
  */
@@ -70,6 +85,8 @@ struct _cnid_db {
     int    (*cnid_find)        (struct _cnid_db *cdb, const char *name, size_t namelen,
                                 void *buffer, size_t buflen);
     int    (*cnid_wipe)        (struct _cnid_db *cdb);
+    int    (*cnid_lookup_batch)(struct _cnid_db *cdb, struct cnid_batch *batch, int n);
+    int    (*cnid_add_batch)   (struct _cnid_db *cdb, struct cnid_batch *batch, int n);
 };
 typedef struct _cnid_db cnid_db;
 
@@ -125,6 +142,8 @@ cnid_t cnid_rebuild_add(struct _cnid_db *cdb, const struct stat *st, const cnid_
 int    cnid_find       (struct _cnid_db *cdb, const char *name, size_t namelen,
                         void *buffer, size_t buflen);
 int    cnid_wipe       (struct _cnid_db *cdb);
+int    cnid_lookup_batch(struct _cnid_db *cdb, struct cnid_batch *batch, int n);
+int    cnid_add_batch  (struct _cnid_db *cdb, struct cnid_batch *batch, int n);
 void   cnid_close      (struct _cnid_db *db);
 
 #endif
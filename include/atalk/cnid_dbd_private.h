@@ -10,6 +10,7 @@
 #include <atalk/adouble.h>
 #include <sys/param.h>
 
+#include <atalk/cnid.h>
 #include <atalk/cnid_private.h>
 
 #define CNID_DBD_OP_OPEN        0x01
@@ -26,6 +27,7 @@
 #define CNID_DBD_OP_REBUILD_ADD 0x0c
 #define CNID_DBD_OP_SEARCH      0x0d
 #define CNID_DBD_OP_WIPE        0x0e
+#define CNID_DBD_OP_BATCH       0x0f
 
 #define CNID_DBD_RES_OK            0x00
 #define CNID_DBD_RES_NOTFOUND      0x01
@@ -56,6 +58,14 @@ struct cnid_dbd_rply {
     size_t  namelen;
 };
 
+/*
+ * CNID_DBD_OP_BATCH: the name of the request is a sequence of up to CNID_BATCH_MAX
+ * CNID_DBD_OP_LOOKUP or CNID_DBD_OP_ADD requests, each a struct cnid_dbd_rqst
+ * followed by its name, rqst.cnid is their number. The name of the reply is the
+ * array of their struct cnid_dbd_rply, without names.
+ */
+#define CNID_DBD_BATCH_BUFSIZ (CNID_BATCH_MAX * (sizeof(struct cnid_dbd_rqst) + MAXPATHLEN))
+
 typedef struct CNID_private {
     uint32_t magic;
     char      db_dir[MAXPATHLEN + 1]; /* Database directory without /.AppleDB appended */
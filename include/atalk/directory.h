@@ -56,6 +56,9 @@
 #define DIRF_OFFCNT    (1<<4) /* offsprings count is valid */
 #define DIRF_CNID	   (1<<5) /* renumerate id */
 
+/* size of the inline name storage in struct dir, in UCS2 characters */
+#define DIR_NAMEBUF 48
+
 struct dir {
     bstring     d_fullpath;          /* complete unix path to dir (or file) */
     bstring     d_m_name;            /* mac name */
@@ -77,6 +80,14 @@ struct dir {
     /* Stuff used in the dircache */
     time_t      dcache_ctime;         /* inode ctime, used and modified by dircache */
     ino_t       dcache_ino;           /* inode number, used to detect changes in the dircache */
+    int         dcache_queue;         /* dircache queue qidx_node is in */
+    int         dcache_wd;            /* "dircache notify": inotify watch, 0 none yet, -1 none possible */
+    unsigned long dcache_wseq;        /* "dircache notify": when the watch was added */
+    unsigned long dcache_seq;         /* "dircache notify": when the entry was validated, 0 if invalid */
+
+    /* Short names are stored inline instead of in separately allocated buffers */
+    struct tagbstring d_names[2];     /* d_m_name and d_u_name if stored in d_namebuf */
+    ucs2_t      d_namebuf[DIR_NAMEBUF]; /* UCS2 mac name, mac name, unix name */
 };
 
 struct path {
@@ -85,6 +85,11 @@ typedef struct DSI {
     char     *start;            /* current buffer head */
     char     *eof;              /* end of currently used buffer */
     char     *end;
+    /* adaptive readahead buffer ("adaptive dsireadbuf"), bufsize_min is 0 if disabled */
+    size_t   bufsize_min;       /* initial and smallest size */
+    time_t   buf_used;          /* last bulk transfer or resize */
+    uint32_t buf_grown, buf_shrunk; /* resize events */
+    int      buf_full;          /* dsi_peek() found the buffer full, grow before the next command */
 
 #ifdef USE_ZEROCONF
     char *bonjourname;      /* server name as UTF8 maxlen MAXINSTANCENAMELEN */
@@ -96,6 +101,10 @@ typedef struct DSI {
      * write/read just write/read data */
     pid_t  (*proto_open)(struct DSI *);
     void   (*proto_close)(struct DSI *);
+    /* used by the session pool: the master accepts and passes the socket
+     * to a pre-forked child which then reads the first DSI command */
+    int    (*proto_accept)(struct DSI *);
+    void   (*proto_handshake)(struct DSI *);
 } DSI;
 
 /* DSI flags */
@@ -162,7 +171,10 @@ extern int dsi_tcp_init(DSI *dsi, const char *hostname, const char *address, con
 extern void dsi_free(DSI *dsi);
 
 /* in dsi_getsess.c */
-extern int dsi_getsession (DSI *, server_child *, const int, afp_child_t **);
+extern int dsi_getsession (DSI *, server_child *, const int, int, afp_child_t **);
+extern int dsi_prefork (DSI *, server_child *, afp_child_t **);
+extern int dsi_pool_getsession (DSI *, const int);
+extern int dsi_pool_dispatch (DSI *, afp_child_t *, int);
 extern void dsi_kill (int);
 
 
@@ -182,12 +194,18 @@ extern ssize_t dsi_stream_write (DSI *, void *, const size_t, const int mode);
 extern size_t dsi_stream_read (DSI *, void *, const size_t);
 extern int dsi_stream_send (DSI *, void *, size_t);
 extern int dsi_stream_receive (DSI *);
+extern int dsi_stream_queued (DSI *, int (*)(void *, uint16_t, const uint8_t *, size_t), void *);
+extern void dsi_buffer_dump(const DSI *);
 extern int dsi_disconnect(DSI *dsi);
 
 #ifdef WITH_SENDFILE
 extern ssize_t dsi_stream_read_file(DSI *, int, off_t off, const size_t len, const int err);
 #endif
 
+#ifdef WITH_RECVFILE
+extern ssize_t dsi_stream_receive_file(DSI *, const int, off_t);
+#endif
+
 /* client writes -- dsi_write.c */
 extern size_t dsi_writeinit (DSI *, void *, const size_t);
 extern size_t dsi_write (DSI *, void *, const size_t);
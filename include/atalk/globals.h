@@ -43,6 +43,9 @@
 #define OPTION_NOZEROCONF    (1 << 9)
 #define OPTION_KEEPSESSIONS  (1 << 10) /* preserve sessions across master afpd restart with SIGQUIT */
 #define OPTION_SHARE_RESERV  (1 << 11) /* whether to use Solaris fcntl F_SHARE locks */
+#define OPTION_DSIREADBUF_ADAPT (1 << 12) /* size the DSI readahead buffer by session load */
+#define OPTION_ASYNC_FLUSH   (1 << 13) /* FPFlush/FPFlushFork only start writeback */
+#define OPTION_DCNOTIFY      (1 << 14) /* validate dircache entries with inotify instead of stat */
 
 #define PASSWD_NONE     0
 #define PASSWD_SET     (1 << 0)
@@ -68,10 +71,15 @@ struct afp_volume_name {
 
 struct afp_options {
     int connections;            /* Maximum number of possible AFP connections */
+    int sessionpool;            /* Number of idle pre-forked session processes per listener */
     int tickleval;
     int timeout;
     int flags;
     int dircachesize;
+    int dircachefiles;          /* percentage of the dircache for files */
+    int dircacheneg;            /* names cached as missing, 0 disables */
+    int shmcachesize;           /* entries of the shared CNID cache, 0 disables */
+    int enumthreads;            /* stat prefetch threads for FPEnumerate, 0 disables */
     int sleep;                  /* Maximum time allowed to sleep (in tickles) */
     int disconnected;           /* Maximum time in disconnected state (in tickles) */
     int fce_fmodwait;           /* number of seconds FCE file mod events are put on hold */
@@ -103,6 +111,7 @@ struct afp_options {
     char *logfile;
     char *mimicmodel;
     char *adminauthuser;
+    char *statssocket;          /* UNIX socket for statistics, NULL disables */
     struct afp_volume_name volfile;
 };
 
@@ -130,6 +130,8 @@ typedef struct {
     bool           inited;                 /* file log config initialized ? */
     bool           syslog_opened;          /* syslog opened ? */
     bool           console;                /* if logging to console from a cli util */
+    bool           async;                  /* queue file log messages for a writer thread */
+    int            rate;                   /* max messages per second per source line if async */
     char           processname[16];
     int            syslog_facility;
     int            syslog_display_options;
@@ -161,6 +163,8 @@ extern UAM_MODULE_EXPORT logtype_conf_t type_configs[logtype_end_of_list_marker]
 
 void setuplog(const char *loglevel, const char *logfile);
 void set_processname(const char *processname);
+void setuplog_async(bool async, int rate);
+void setuplog_async_child(void);
 
 /* LOG macro func no.1: log the message to file */
 UAM_MODULE_EXPORT  void make_log_entry(enum loglevels loglevel, enum logtypes logtype, const char *file, int line, char *message, ...);
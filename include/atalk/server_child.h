@@ -38,6 +38,7 @@ typedef struct server_child_data {
 /* server_child.c */
 extern server_child *server_child_alloc (const int, const int);
 extern afp_child_t *server_child_add (server_child *, int, pid_t, int ipc_fd);
+extern afp_child_t *server_child_resolve (server_child *, int, pid_t);
 extern int  server_child_remove (server_child *, const int, const pid_t);
 extern void server_child_free (server_child *);
 
@@ -6,6 +6,7 @@
 
 #define IPC_DISCOLDSESSION   0
 #define IPC_GETSESSION       1
+#define IPC_STATS            2   /* statistics update, cf afpstats.c */
 
 extern int ipc_server_uds(const char *name);
 extern int ipc_client_uds(const char *name);
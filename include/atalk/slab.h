@@ -0,0 +1,35 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#ifndef ATALK_SLAB_H
+#define ATALK_SLAB_H
+
+#include <sys/types.h>
+
+/* allocator for many objects of one size, not thread safe */
+typedef struct slab {
+    const char    *name;
+    size_t        objsize;
+    unsigned int  perchunk;
+    void          *freelist;        /* free objects, linked through their first word */
+    void          *chunks;          /* chunks, linked through their first word */
+    unsigned long nchunks;
+    unsigned long inuse;
+} slab_t;
+
+extern void   slab_init(slab_t *slab, const char *name, size_t objsize, unsigned int perchunk);
+extern void   *slab_alloc(slab_t *slab);
+extern void   slab_free(slab_t *slab, void *obj);
+extern void   slab_destroy(slab_t *slab);
+extern size_t slab_size(const slab_t *slab);
+
+#endif /* ATALK_SLAB_H */
@@ -350,3 +350,65 @@ int cnid_wipe(struct _cnid_db *cdb)
     unblock_signal(cdb->flags);
     return ret;
 }
+
+/* --------------- 
+ * Look up the CNIDs of up to CNID_BATCH_MAX objects, with one request to the
+ * backend if it supports it, otherwise one after the other.
+ * Returns the number of objects found or -1 on error.
+ */
+int cnid_lookup_batch(struct _cnid_db *cdb, struct cnid_batch *batch, int n)
+{
+    int i, ret = 0;
+
+    if (n <= 0 || n > CNID_BATCH_MAX)
+        return -1;
+
+    block_signal(cdb->flags);
+    if (cdb->cnid_lookup_batch) {
+        ret = cdb->cnid_lookup_batch(cdb, batch, n);
+    } else {
+        for (i = 0; i < n; i++)
+            batch[i].id = cdb->cnid_lookup(cdb, batch[i].st, batch[i].did,
+                                           (char *)batch[i].name, batch[i].len);
+    }
+    unblock_signal(cdb->flags);
+
+    if (ret == -1)
+        return -1;
+    for (i = 0, ret = 0; i < n; i++) {
+        batch[i].id = valide(batch[i].id);
+        if (batch[i].id != CNID_INVALID)
+            ret++;
+    }
+    return ret;
+}
+
+/* --------------- 
+ * Same for cnid_add(): returns the number of CNIDs added or found or -1 on error.
+ */
+int cnid_add_batch(struct _cnid_db *cdb, struct cnid_batch *batch, int n)
+{
+    int i, ret = 0;
+
+    if (n <= 0 || n > CNID_BATCH_MAX)
+        return -1;
+
+    block_signal(cdb->flags);
+    if (cdb->cnid_add_batch) {
+        ret = cdb->cnid_add_batch(cdb, batch, n);
+    } else {
+        for (i = 0; i < n; i++)
+            batch[i].id = batch[i].len ? cdb->cnid_add(cdb, batch[i].st, batch[i].did, batch[i].name,
+                                                       batch[i].len, batch[i].hint) : CNID_INVALID;
+    }
+    unblock_signal(cdb->flags);
+
+    if (ret == -1)
+        return -1;
+    for (i = 0, ret = 0; i < n; i++) {
+        batch[i].id = valide(batch[i].id);
+        if (batch[i].id != CNID_INVALID)
+            ret++;
+    }
+    return ret;
+}
@@ -33,6 +33,7 @@
 #include <atalk/cnid.h>
 #include <atalk/cnid_dbd_private.h>
 #include <atalk/util.h>
+#include <atalk/afpstats.h>
 
 #include "cnid_dbd.h"
 
@@ -355,6 +356,10 @@ static int transmit(CNID_private *db, struct cnid_dbd_rqst *rqst, struct cnid_db
 {
     time_t orig, t;
     int clean = 1; /* no errors so far - to prevent sleep on first try */
+    struct timespec start;
+
+    if (afpstats_enabled)
+        afpstats_start(&start);
 
     while (1) {
         if (db->fd == -1) {
@@ -371,6 +376,8 @@ static int transmit(CNID_private *db, struct cnid_dbd_rqst *rqst, struct cnid_db
         }
         if (!dbd_rpc(db, rqst, rply)) {
             LOG(log_maxdebug, logtype_cnid, "transmit: {done}");
+            if (afpstats_enabled)
+                afpstats_record(AFPSTATS_CNID, &start);
             return 0;
         }
     transmit_fail:
@@ -428,6 +435,8 @@ static struct _cnid_db *cnid_dbd_new(const char *volpath)
     cdb->cnid_rebuild_add = cnid_dbd_rebuild_add;
     cdb->cnid_close = cnid_dbd_close;
     cdb->cnid_wipe = cnid_dbd_wipe;
+    cdb->cnid_lookup_batch = cnid_dbd_lookup_batch;
+    cdb->cnid_add_batch = cnid_dbd_add_batch;
     return cdb;
 }
 
@@ -783,6 +792,106 @@ cnid_t cnid_dbd_lookup(struct _cnid_db *cdb, const struct stat *st, cnid_t did,
     return id;
 }
 
+/* ----------------------
+ * Send the lookup or add requests of a batch to cnid_dbd in one CNID_DBD_OP_BATCH
+ * request, returns the number of CNIDs found or -1 on error
+ */
+static int dbd_batch(struct _cnid_db *cdb, struct cnid_batch *batch, int n, int op)
+{
+    CNID_private *db;
+    struct cnid_dbd_rqst rqst, item;
+    struct cnid_dbd_rply rply;
+    static char buf[CNID_DBD_BATCH_BUFSIZ];
+    static struct cnid_dbd_rply res[CNID_BATCH_MAX];
+    int idx[CNID_BATCH_MAX];
+    size_t len = 0;
+    int i, sent = 0, found = 0;
+
+    if (!cdb || !(db = cdb->_private) || !batch || n > CNID_BATCH_MAX) {
+        LOG(log_error, logtype_cnid, "dbd_batch: Parameter error");
+        errno = CNID_ERR_PARAM;
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        batch[i].id = CNID_INVALID;
+        if (!batch[i].st || !batch[i].name || !batch[i].len || batch[i].len > MAXPATHLEN)
+            continue;
+
+        RQST_RESET(&item);
+        item.op = op;
+        if (!(cdb->flags & CNID_FLAG_NODEV))
+            item.dev = batch[i].st->st_dev;
+        item.ino = batch[i].st->st_ino;
+        item.type = S_ISDIR(batch[i].st->st_mode)?1:0;
+        if (op == CNID_DBD_OP_ADD)
+            item.cnid = batch[i].hint;
+        item.did = batch[i].did;
+        item.namelen = batch[i].len;
+
+        memcpy(buf + len, &item, sizeof(item));
+        len += sizeof(item);
+        memcpy(buf + len, batch[i].name, batch[i].len);
+        len += batch[i].len;
+        idx[sent++] = i;
+    }
+
+    if (sent == 0)
+        return 0;
+
+    LOG(log_debug, logtype_cnid, "dbd_batch: %d %s requests",
+        sent, op == CNID_DBD_OP_ADD ? "add" : "lookup");
+
+    RQST_RESET(&rqst);
+    rqst.op = CNID_DBD_OP_BATCH;
+    rqst.cnid = sent;
+    rqst.name = buf;
+    rqst.namelen = len;
+
+    rply.name = (char *)res;
+    rply.namelen = sizeof(res);
+    if (transmit(db, &rqst, &rply) < 0) {
+        errno = CNID_ERR_DB;
+        return -1;
+    }
+
+    if (rply.result != CNID_DBD_RES_OK || rply.namelen != sent * sizeof(struct cnid_dbd_rply)) {
+        LOG(log_error, logtype_cnid, "dbd_batch: bad reply (result: %d, length: %u)",
+            rply.result, rply.namelen);
+        errno = CNID_ERR_DB;
+        return -1;
+    }
+
+    for (i = 0; i < sent; i++) {
+        switch (res[i].result) {
+        case CNID_DBD_RES_OK:
+            batch[idx[i]].id = res[i].cnid;
+            found++;
+            break;
+        case CNID_DBD_RES_NOTFOUND:
+            break;
+        case CNID_DBD_RES_ERR_MAX:
+            errno = CNID_ERR_MAX;
+            break;
+        default:
+            errno = CNID_ERR_DB;
+            break;
+        }
+    }
+
+    return found;
+}
+
+int cnid_dbd_lookup_batch(struct _cnid_db *cdb, struct cnid_batch *batch, int n)
+{
+    return dbd_batch(cdb, batch, n, CNID_DBD_OP_LOOKUP);
+}
+
+int cnid_dbd_add_batch(struct _cnid_db *cdb, struct cnid_batch *batch, int n)
+{
+    return dbd_batch(cdb, batch, n, CNID_DBD_OP_ADD);
+}
+
 /* ---------------------- */
 int cnid_dbd_find(struct _cnid_db *cdb, const char *name, size_t namelen, void *buffer, size_t buflen)
 {
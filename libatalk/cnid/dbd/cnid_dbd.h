@@ -33,6 +33,8 @@ extern int    cnid_dbd_delete     (struct _cnid_db *, const cnid_t);
 extern cnid_t cnid_dbd_rebuild_add(struct _cnid_db *, const struct stat *,
                                    cnid_t, const char *, size_t, cnid_t);
 extern int    cnid_dbd_wipe       (struct _cnid_db *cdb);
+extern int    cnid_dbd_lookup_batch(struct _cnid_db *, struct cnid_batch *, int);
+extern int    cnid_dbd_add_batch  (struct _cnid_db *, struct cnid_batch *, int);
 /* FIXME: These functions could be static in cnid_dbd.c */
 
 #endif /* include/atalk/cnid_dbd.h */
@@ -20,23 +20,81 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/poll.h>
 #include <atalk/logger.h>
 #include <atalk/util.h>
+#include <atalk/errchk.h>
 
 #include <atalk/dsi.h>
 #include <atalk/server_child.h>
 
+/*!
+ * Child: check number of open connections and dispatch on the first DSI command
+ *
+ * @param sessions  (r) number of other sessions, this is one off the actual count
+ * @returns             0 for DSIOpenSession, doesn't return for anything else
+ */
+static int dsi_start_session(DSI *dsi, int sessions, int maxsessions, int tickleval)
+{
+  if ((sessions >= maxsessions) &&
+      (dsi->header.dsi_command == DSIFUNC_OPEN)) {
+    LOG(log_info, logtype_dsi, "dsi_getsess: too many connections");
+    dsi->header.dsi_flags = DSIFL_REPLY;
+    dsi->header.dsi_code = DSIERR_TOOMANY;
+    dsi_send(dsi);
+    exit(EXITERR_CLNT);
+  }
+
+  switch (dsi->header.dsi_command) {
+  case DSIFUNC_STAT: /* send off status and return */
+    {
+      /* OpenTransport 1.1.2 bug workaround: 
+       *
+       * OT code doesn't currently handle close sockets well. urk.
+       * the workaround: wait for the client to close its
+       * side. timeouts prevent indefinite resource use. 
+       */
+      
+      static struct timeval timeout = {120, 0};
+      fd_set readfds;
+      
+      dsi_getstatus(dsi);
+
+      FD_ZERO(&readfds);
+      FD_SET(dsi->socket, &readfds);
+      free(dsi);
+      select(FD_SETSIZE, &readfds, NULL, NULL, &timeout);    
+      exit(0);
+    }
+    break;
+    
+  case DSIFUNC_OPEN: /* setup session */
+    /* set up the tickle timer */
+    dsi->timer.it_interval.tv_sec = dsi->timer.it_value.tv_sec = tickleval;
+    dsi->timer.it_interval.tv_usec = dsi->timer.it_value.tv_usec = 0;
+    dsi_opensession(dsi);
+    return 0;
+
+  default: /* just close */
+    LOG(log_info, logtype_dsi, "DSIUnknown %d", dsi->header.dsi_command);
+    dsi->proto_close(dsi);
+    exit(EXITERR_CLNT);
+  }
+}
+
 /*!
  * Start a DSI session, fork an afpd process
  *
+ * @param sessions  (r) number of other sessions for the connection limit check
  * @param childp    (w) after fork: parent return pointer to child, child returns NULL
  * @returns             0 on sucess, any other value denotes failure
  */
-int dsi_getsession(DSI *dsi, server_child *serv_children, int tickleval, afp_child_t **childp)
+int dsi_getsession(DSI *dsi, server_child *serv_children, int tickleval, int sessions, afp_child_t **childp)
 {
   pid_t pid;
   int ipc_fds[2];  
   afp_child_t *child;
+  int maxsessions;
 
   if (socketpair(PF_UNIX, SOCK_STREAM, 0, ipc_fds) < 0) {
       LOG(log_error, logtype_dsi, "dsi_getsess: %s", strerror(errno));
@@ -75,16 +133,8 @@ int dsi_getsession(DSI *dsi, server_child *serv_children, int tickleval, afp_chi
     return 0;
   }
   
-  /* child: check number of open connections. this is one off the
-   * actual count. */
-  if ((serv_children->count >= serv_children->nsessions) &&
-      (dsi->header.dsi_command == DSIFUNC_OPEN)) {
-    LOG(log_info, logtype_dsi, "dsi_getsess: too many connections");
-    dsi->header.dsi_flags = DSIFL_REPLY;
-    dsi->header.dsi_code = DSIERR_TOOMANY;
-    dsi_send(dsi);
-    exit(EXITERR_CLNT);
-  }
+  /* child */
+  maxsessions = serv_children->nsessions;
 
   /* get rid of some stuff */
   dsi->AFPobj->ipc_fd = ipc_fds[1];
@@ -93,40 +143,147 @@ int dsi_getsession(DSI *dsi, server_child *serv_children, int tickleval, afp_chi
   dsi->serversock = -1;
   server_child_free(serv_children); 
 
-  switch (dsi->header.dsi_command) {
-  case DSIFUNC_STAT: /* send off status and return */
-    {
-      /* OpenTransport 1.1.2 bug workaround: 
-       *
-       * OT code doesn't currently handle close sockets well. urk.
-       * the workaround: wait for the client to close its
-       * side. timeouts prevent indefinite resource use. 
-       */
-      
-      static struct timeval timeout = {120, 0};
-      fd_set readfds;
-      
-      dsi_getstatus(dsi);
+  dsi_start_session(dsi, sessions, maxsessions, tickleval);
+  *childp = NULL;
+  return 0;
+}
 
-      FD_ZERO(&readfds);
-      FD_SET(dsi->socket, &readfds);
-      free(dsi);
-      select(FD_SETSIZE, &readfds, NULL, NULL, &timeout);    
-      exit(0);
-    }
+/*!
+ * Fork an idle afpd process for the session pool
+ *
+ * The child gets its client socket later from the master with dsi_pool_dispatch(),
+ * after some more initialisation it must call dsi_pool_getsession() to wait for it.
+ *
+ * @param childp    (w) after fork: parent return pointer to child, child returns NULL
+ * @returns             0 on sucess, any other value denotes failure
+ */
+int dsi_prefork(DSI *dsi, server_child *serv_children, afp_child_t **childp)
+{
+  pid_t pid;
+  int ipc_fds[2];
+  afp_child_t *child;
+  struct sigaction sv;
+
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, ipc_fds) < 0) {
+      LOG(log_error, logtype_dsi, "dsi_prefork: %s", strerror(errno));
+      return -1;
+  }
+
+  if (setnonblock(ipc_fds[0], 1) != 0 || setnonblock(ipc_fds[1], 1) != 0) {
+      LOG(log_error, logtype_dsi, "dsi_prefork: setnonblock: %s", strerror(errno));
+      close(ipc_fds[0]);
+      close(ipc_fds[1]);
+      return -1;
+  }
+
+  switch (pid = fork()) {
+  case -1:
+    LOG(log_error, logtype_dsi, "dsi_prefork: fork: %s", strerror(errno));
+    close(ipc_fds[0]);
+    close(ipc_fds[1]);
+    return -1;
+
+  case 0: /* child */
     break;
-    
-  case DSIFUNC_OPEN: /* setup session */
-    /* set up the tickle timer */
-    dsi->timer.it_interval.tv_sec = dsi->timer.it_value.tv_sec = tickleval;
-    dsi->timer.it_interval.tv_usec = dsi->timer.it_value.tv_usec = 0;
-    dsi_opensession(dsi);
-    *childp = NULL;
+
+  default: /* parent */
+    close(ipc_fds[1]);
+    if ((child = server_child_add(serv_children, CHILD_DSIFORK, pid, ipc_fds[0])) ==  NULL) {
+      LOG(log_error, logtype_dsi, "dsi_prefork: %s", strerror(errno));
+      close(ipc_fds[0]);
+      kill(pid, SIGKILL);
+      return -1;
+    }
+    *childp = child;
     return 0;
+  }
 
-  default: /* just close */
-    LOG(log_info, logtype_dsi, "DSIUnknown %d", dsi->header.dsi_command);
-    dsi->proto_close(dsi);
-    exit(EXITERR_CLNT);
+  /* child */
+  server_reset_signal();
+
+  /* the master sends SIGQUIT to all children with "keep sessions", idle children
+   * notice the master is gone when their IPC socket is closed */
+  memset(&sv, 0, sizeof(sv));
+  sv.sa_handler = SIG_IGN;
+  sigemptyset(&sv.sa_mask);
+  sigaction(SIGQUIT, &sv, NULL);
+
+  dsi->AFPobj->ipc_fd = ipc_fds[1];
+  close(ipc_fds[0]);
+  close(dsi->serversock);
+  dsi->serversock = -1;
+  server_child_free(serv_children);
+
+  *childp = NULL;
+  return 0;
+}
+
+/*!
+ * Idle child from the session pool: wait for a client socket from the master
+ *
+ * The master passes the number of other sessions and the socket with
+ * dsi_pool_dispatch(), then we continue like a child from dsi_getsession().
+ *
+ * @returns 0 for DSIOpenSession, any other value denotes failure
+ */
+int dsi_pool_getsession(DSI *dsi, int tickleval)
+{
+  struct pollfd pfd;
+  socklen_t len;
+  int sessions;
+  int maxsessions = dsi->AFPobj->options.connections;
+  int ret;
+
+  pfd.fd = dsi->AFPobj->ipc_fd;
+  pfd.events = POLLIN;
+
+  do {
+    ret = poll(&pfd, 1, -1);
+  } while (ret == -1 && errno == EINTR);
+
+  if (ret != 1 || readt(dsi->AFPobj->ipc_fd, &sessions, sizeof(sessions), 0, 2) != sizeof(sessions)) {
+    /* master is gone or killed us off the pool */
+    return -1;
   }
+  if ((dsi->socket = recv_fd(dsi->AFPobj->ipc_fd, 1)) == -1) {
+    LOG(log_error, logtype_dsi, "dsi_pool_getsession: recv_fd: %s", strerror(errno));
+    return -1;
+  }
+
+  len = sizeof(dsi->client);
+  if (getpeername(dsi->socket, (struct sockaddr *)&dsi->client, &len) != 0) {
+    LOG(log_error, logtype_dsi, "dsi_pool_getsession: getpeername: %s", strerror(errno));
+    return -1;
+  }
+
+  dsi->proto_handshake(dsi); /* in libatalk/dsi/dsi_tcp.c */
+
+  return dsi_start_session(dsi, sessions, maxsessions, tickleval);
+}
+
+/*!
+ * Master: accept a connection and pass it to an idle child from the session pool
+ *
+ * @param child     (r) idle child forked with dsi_prefork()
+ * @param sessions  (r) number of other sessions for the connection limit check
+ * @returns             0 on sucess, any other value denotes failure
+ */
+int dsi_pool_dispatch(DSI *dsi, afp_child_t *child, int sessions)
+{
+  EC_INIT;
+
+  if (dsi->proto_accept(dsi) != 0) { /* in libatalk/dsi/dsi_tcp.c */
+    LOG(log_error, logtype_dsi, "dsi_pool_dispatch: %s", strerror(errno));
+    return -1;
+  }
+
+  if (writet(child->ipc_fd, &sessions, sizeof(sessions), 0, 2) != sizeof(sessions)) {
+    LOG(log_error, logtype_dsi, "dsi_pool_dispatch: error sending to child[%u]", child->pid);
+    EC_FAIL;
+  }
+  EC_ZERO_LOG( send_fd(child->ipc_fd, dsi->socket) );
+
+EC_CLEANUP:
+  dsi->proto_close(dsi);
+  EC_EXIT;
 }
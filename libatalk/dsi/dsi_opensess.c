@@ -11,6 +11,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <atalk/dsi.h>
 #include <atalk/util.h>
@@ -19,13 +20,22 @@
 static void dsi_init_buffer(DSI *dsi)
 {
     /* default is 12 * 300k = 3,6 MB (Apr 2011) */
-    if ((dsi->buffer = malloc(dsi->dsireadbuf * dsi->server_quantum)) == NULL) {
+    size_t size = dsi->dsireadbuf * dsi->server_quantum;
+
+    if (dsi->AFPobj->options.flags & OPTION_DSIREADBUF_ADAPT) {
+        /* start with one quantum, dsi_stream.c grows it up to the configured size */
+        dsi->bufsize_min = dsi->server_quantum;
+        dsi->buf_used = time(NULL);
+        size = dsi->bufsize_min;
+    }
+
+    if ((dsi->buffer = malloc(size)) == NULL) {
         LOG(log_error, logtype_dsi, "dsi_init_buffer: OOM");
         AFP_PANIC("OOM in dsi_init_buffer");
     }
     dsi->start = dsi->buffer;
     dsi->eof = dsi->buffer;
-    dsi->end = dsi->buffer + (dsi->dsireadbuf * dsi->server_quantum);
+    dsi->end = dsi->buffer + size;
 }
 
 /* OpenSession. set up the connection */
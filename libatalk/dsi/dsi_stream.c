@@ -8,6 +8,8 @@
  * dsi_stream_read:     just read a bunch of bytes.
  * dsi_stream_send:     send a DSI header + data.
  * dsi_stream_receive:  read a DSI header + data.
+ * dsi_stream_receive_file: receive FPWrite data into a file.
+ * dsi_stream_queued:   look at pipelined requests in the readahead buffer.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -19,10 +21,16 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 
+#ifdef WITH_RECVFILE
+#include <fcntl.h>
+#include <poll.h>
+#endif
+
 #ifdef HAVE_SENDFILEV
 #include <sys/sendfile.h>
 #endif
@@ -39,6 +47,9 @@
 #define MSG_DONTWAIT 0x40
 #endif
 
+/* seconds without bulk traffic after which an adaptive readahead buffer is halved */
+#define DSI_BUF_IDLE 60
+
 /* Pack a DSI header in wire format */
 static void dsi_header_pack_reply(const DSI *dsi, char *buf)
 {
@@ -50,6 +61,89 @@ static void dsi_header_pack_reply(const DSI *dsi, char *buf)
     memcpy(buf + 12, &dsi->header.dsi_reserved, sizeof(dsi->header.dsi_reserved));
 }
 
+/*
+ * Resize the readahead buffer keeping unread data
+ */
+static int dsi_buffer_resize(DSI *dsi, size_t size)
+{
+    char   *buf;
+    size_t start = dsi->start - dsi->buffer;
+    size_t eof = dsi->eof - dsi->buffer;
+
+    if (start == eof)
+        start = eof = 0;
+    if (eof > size)
+        return -1;
+
+    if ((buf = realloc(dsi->buffer, size)) == NULL) {
+        LOG(log_warning, logtype_dsi, "dsi_buffer_resize(%zu): %s", size, strerror(errno));
+        return -1;
+    }
+
+    LOG(log_debug, logtype_dsi, "dsi_buffer_resize: %zu -> %zu bytes",
+        (size_t)(dsi->end - dsi->buffer), size);
+
+    dsi->buffer = buf;
+    dsi->start = buf + start;
+    dsi->eof = buf + eof;
+    dsi->end = buf + size;
+    return 0;
+}
+
+/*
+ * Adaptive readahead buffer: bulk traffic, double the buffer up to dsireadbuf * server quantum
+ */
+static void dsi_buffer_grow(DSI *dsi)
+{
+    size_t size = dsi->end - dsi->buffer;
+    size_t max = dsi->dsireadbuf * dsi->server_quantum;
+
+    if (dsi->bufsize_min == 0)
+        return;
+
+    dsi->buf_used = time(NULL);
+    if (size < max && dsi_buffer_resize(dsi, MIN(2 * size, max)) == 0)
+        dsi->buf_grown++;
+}
+
+/*
+ * Adaptive readahead buffer: halve an empty buffer every DSI_BUF_IDLE seconds
+ * without bulk traffic, down to the initial size
+ */
+static void dsi_buffer_shrink(DSI *dsi)
+{
+    size_t size = dsi->end - dsi->buffer;
+    time_t now;
+
+    if (dsi->bufsize_min == 0 || size <= dsi->bufsize_min || dsi->start != dsi->eof)
+        return;
+
+    now = time(NULL);
+    if (now - dsi->buf_used < DSI_BUF_IDLE)
+        return;
+
+    dsi->buf_used = now;
+    if (dsi_buffer_resize(dsi, MAX(size / 2, dsi->bufsize_min)) == 0)
+        dsi->buf_shrunk++;
+}
+
+/*
+ * Log readahead buffer size and usage, part of the SIGINT debug dump
+ */
+void dsi_buffer_dump(const DSI *dsi)
+{
+    if (dsi->buffer == NULL)
+        return;
+
+    LOG(log_note, logtype_dsi, "DSI readahead buffer: size: %zu, unread: %zu, %s",
+        (size_t)(dsi->end - dsi->buffer), (size_t)(dsi->eof - dsi->start),
+        dsi->bufsize_min ? "adaptive" : "fixed");
+    if (dsi->bufsize_min)
+        LOG(log_note, logtype_dsi, "DSI readahead buffer: min: %zu, max: %zu, grown: %u, shrunk: %u",
+            dsi->bufsize_min, (size_t)(dsi->dsireadbuf * dsi->server_quantum),
+            dsi->buf_grown, dsi->buf_shrunk);
+}
+
 /*
  * afpd is sleeping too much while trying to send something.
  * May be there's no reader or the reader is also sleeping in write,
@@ -77,6 +171,13 @@ static int dsi_peek(DSI *dsi)
         FD_ZERO(&readfds);
         FD_ZERO(&writefds);
 
+        if (dsi->eof == dsi->end)
+            /* the client keeps sending while we're writing. We may be called from
+             * the tickle signal handler or in the middle of write_fork() holding
+             * a pointer into the buffer, so only note it, dsi_stream_receive()
+             * grows the buffer before the next command */
+            dsi->buf_full = 1;
+
         if (dsi->eof < dsi->end) {
             /* space in read buffer */
             FD_SET( dsi->socket, &readfds);
@@ -429,6 +530,15 @@ ssize_t dsi_stream_read_file(DSI *dsi, const int fromfd, off_t offset, const siz
 #endif  /* HAVE_SENDFILEV */
         LOG(log_maxdebug, logtype_dsi, "dsi_stream_read_file: wrote: %zd", len);
         written += len;
+
+        if (len > 0 && written < total) {
+            /* short write, the socket buffer is full: wait until it drains instead
+             * of calling sendfile again just to get EAGAIN */
+            if (dsi_peek(dsi) != 0) {
+                ret = -1;
+                goto exit;
+            }
+        }
     }
 #ifdef HAVE_SENDFILEV
     written -= DSI_BLOCKSIZ;
@@ -445,6 +555,120 @@ exit:
 #endif
 
 
+#ifdef WITH_RECVFILE
+/* pipe splice() moves FPWrite data through, kept open for the session */
+static int recvpipe[2] = {-1, -1};
+
+/*!
+ * Receive the remaining data of a DSI write request directly into a file
+ *
+ * Data already in the readahead buffer is written out with pwrite(), the rest is
+ * moved from the socket to the file with splice() through a pipe, without being
+ * copied to userspace.
+ *
+ * @param  dsi     (rw) DSI handle, dsi_writeinit() must have been called
+ * @param  fd      (r)  file to write to
+ * @param  offset  (r)  file offset
+ *
+ * @return bytes written to fd, -1 on error with errno from the failing call.
+ *         Data received but not written has been discarded, dsi_writeflush()
+ *         drops what's left of the request.
+ */
+ssize_t dsi_stream_receive_file(DSI *dsi, const int fd, off_t offset)
+{
+    ssize_t written = 0;
+    ssize_t len, cc;
+    loff_t  off = offset;
+    struct pollfd pfd;
+    int     saveerrno;
+
+    LOG(log_maxdebug, logtype_dsi, "dsi_stream_receive_file(off: %jd, len: %zu)",
+        (intmax_t)offset, dsi->datasize);
+
+    if (dsi->flags & DSI_DISCONNECTED)
+        return -1;
+
+    /* 1. what we've already got in the readahead buffer */
+    while (dsi->datasize > 0 && dsi->eof > dsi->start) {
+        len = MIN(dsi->datasize, (size_t)(dsi->eof - dsi->start));
+        if ((cc = pwrite(fd, dsi->start, len, off)) < 0)
+            return -1;
+        dsi->start += cc;
+        if (dsi->start == dsi->eof)
+            dsi->start = dsi->eof = dsi->buffer;
+        dsi->datasize -= cc;
+        dsi->read_count += cc;
+        off += cc;
+        written += cc;
+    }
+
+    if (dsi->datasize == 0)
+        return written;
+
+    if (recvpipe[0] == -1) {
+        if (pipe(recvpipe) != 0) {
+            LOG(log_error, logtype_dsi, "dsi_stream_receive_file: pipe: %s", strerror(errno));
+            /* the caller reads the rest the normal way */
+            return written;
+        }
+#ifdef F_SETPIPE_SZ
+        fcntl(recvpipe[1], F_SETPIPE_SZ, dsi->server_quantum);
+#endif
+    }
+
+    /* 2. socket -> pipe -> file */
+    while (dsi->datasize > 0) {
+        len = splice(dsi->socket, NULL, recvpipe[1], NULL, dsi->datasize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (len == 0) {
+            LOG(log_error, logtype_dsi, "dsi_stream_receive_file: unexpected EOF");
+            errno = EPIPE;
+            return -1;
+        }
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                if (dsi->flags & DSI_DISCONNECTED) {
+                    errno = ENOTCONN;
+                    return -1;
+                }
+                pfd.fd = dsi->socket;
+                pfd.events = POLLIN;
+                if (poll(&pfd, 1, 1000) < 0 && errno != EINTR) {
+                    LOG(log_error, logtype_dsi, "dsi_stream_receive_file: poll: %s", strerror(errno));
+                    return -1;
+                }
+                continue;
+            }
+            LOG(log_error, logtype_dsi, "dsi_stream_receive_file: splice: %s", strerror(errno));
+            return -1;
+        }
+
+        dsi->datasize -= len;
+        dsi->read_count += len;
+
+        while (len > 0) {
+            if ((cc = splice(recvpipe[0], NULL, fd, &off, len, SPLICE_F_MOVE)) < 0 && errno == EINTR)
+                continue;
+            if (cc <= 0) {
+                /* drain the pipe so the next request starts on a clean stream */
+                saveerrno = cc < 0 ? errno : EIO;
+                while (len > 0 && (cc = read(recvpipe[0], dsi->data, MIN((size_t)len, sizeof(dsi->data)))) > 0)
+                    len -= cc;
+                errno = saveerrno;
+                return -1;
+            }
+            len -= cc;
+            written += cc;
+        }
+    }
+
+    LOG(log_maxdebug, logtype_dsi, "dsi_stream_receive_file: written: %zd", written);
+    return written;
+}
+#endif /* WITH_RECVFILE */
+
+
 /*
  * Essentially a loop around buf_read() to ensure "length" bytes are read
  * from dsi->buffer and/or the socket.
@@ -594,7 +818,16 @@ int dsi_stream_receive(DSI *dsi)
   memcpy(&dsi->header.dsi_len, block + 8, sizeof(dsi->header.dsi_len));
   memcpy(&dsi->header.dsi_reserved, block + 12, sizeof(dsi->header.dsi_reserved));
   dsi->clientID = ntohs(dsi->header.dsi_requestID);
-  
+
+  if (dsi->buf_full
+      || (dsi->header.dsi_command == DSIFUNC_WRITE
+          && ntohl(dsi->header.dsi_len) >= dsi->server_quantum / 2)) {
+      dsi->buf_full = 0;
+      dsi_buffer_grow(dsi);
+  } else {
+      dsi_buffer_shrink(dsi);
+  }
+
   /* make sure we don't over-write our buffers. */
   dsi->cmdlen = MIN(ntohl(dsi->header.dsi_len), DSI_CMDSIZ);
   if (dsi_stream_read(dsi, dsi->commands, dsi->cmdlen) != dsi->cmdlen) 
@@ -604,3 +837,52 @@ int dsi_stream_receive(DSI *dsi)
 
   return block[1];
 }
+
+/*!
+ * Walk the DSI commands the client has already pipelined behind the current one
+ *
+ * Pulls what is waiting on the socket into the readahead buffer without blocking,
+ * then calls fn for every complete DSICommand found in the buffer, in the order
+ * the client sent them. Nothing is consumed, dsi_stream_receive() still returns
+ * the requests one by one.
+ *
+ * @param  dsi   (rw) DSI handle
+ * @param  fn    (r)  callback, gets the request ID and the AFP command block,
+ *                    a nonzero return value stops the walk
+ * @param  arg   (r)  passed through to fn
+ *
+ * @return number of commands passed to fn
+ */
+int dsi_stream_queued(DSI *dsi, int (*fn)(void *, uint16_t, const uint8_t *, size_t), void *arg)
+{
+  char *p;
+  uint32_t len;
+  uint16_t id;
+  ssize_t ret;
+  int count = 0;
+
+  if (dsi->buffer == NULL || (dsi->flags & DSI_DISCONNECTED))
+      return 0;
+
+  if (dsi->eof < dsi->end) {
+      if ((ret = recv(dsi->socket, dsi->eof, dsi->end - dsi->eof, MSG_DONTWAIT)) > 0)
+          dsi->eof += ret;
+  }
+
+  for (p = dsi->start; dsi->eof - p >= DSI_BLOCKSIZ; p += DSI_BLOCKSIZ + len) {
+      memcpy(&len, p + 8, sizeof(len));
+      len = ntohl(len);
+      if ((size_t)(dsi->eof - p - DSI_BLOCKSIZ) < len)
+          /* request not completely in the buffer yet */
+          break;
+      if (p[0] != DSIFL_REQUEST || p[1] != DSIFUNC_CMD)
+          continue;
+      memcpy(&id, p + 2, sizeof(id));
+      count++;
+      if (fn(arg, ntohs(id), (uint8_t *)p + DSI_BLOCKSIZ, len) != 0)
+          break;
+  }
+
+  LOG(log_debug, logtype_dsi, "dsi_stream_queued: %d queued commands", count);
+  return count;
+}
@@ -0,0 +1,299 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+/*!
+ * @file
+ * Netatalk utility functions: AFP statistics ("stats socket")
+ *
+ * Sessions record the latency of every AFP command and CNID database request in
+ * log-linear histograms (like HdrHistogram: 4 buckets per power of 2, so values are
+ * accurate to 25%) plus a few counters. Every AFPSTATS_INTERVAL seconds and when the
+ * session ends they send what they recorded since the last update to the master over
+ * the IPC socket and start again from zero. The master adds the updates up and writes
+ * them to clients of the statistics socket in the Prometheus text format.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atalk/afpstats.h>
+#include <atalk/server_ipc.h>
+#include <atalk/bstrlib.h>
+#include <atalk/logger.h>
+#include <atalk/util.h>
+
+#define AFPSTATS_MSG_COUNTERS 0xffff    /* message id of the counters */
+
+int afpstats_enabled;
+
+static struct afpstats_hist *hist[AFPSTATS_HISTS];
+static uint64_t counter[AFPSTATS_COUNTERS];
+static time_t last_sent;
+
+static const char *counter_name[AFPSTATS_COUNTERS] = {
+    "afpd_dsi_received_bytes_total",
+    "afpd_dsi_sent_bytes_total",
+    "afpd_dircache_lookups_total",
+    "afpd_dircache_hits_total"
+};
+
+static unsigned int bucket_index(uint64_t us)
+{
+    int e;
+
+    if (us >= (1ULL << AFPSTATS_MAXBITS))
+        us = (1ULL << AFPSTATS_MAXBITS) - 1;
+    if (us < (1 << AFPSTATS_SUBBITS))
+        return us;
+    e = 63 - __builtin_clzll(us);
+    return ((e - AFPSTATS_SUBBITS + 1) << AFPSTATS_SUBBITS)
+        + ((us >> (e - AFPSTATS_SUBBITS)) & ((1 << AFPSTATS_SUBBITS) - 1));
+}
+
+/* smallest value in microseconds that is larger than all values in a bucket */
+static uint64_t bucket_limit(unsigned int idx)
+{
+    unsigned int e, sub;
+
+    if (idx < (1 << AFPSTATS_SUBBITS))
+        return idx + 1;
+    e = (idx >> AFPSTATS_SUBBITS) + AFPSTATS_SUBBITS - 1;
+    sub = idx & ((1 << AFPSTATS_SUBBITS) - 1);
+    return (uint64_t)((1 << AFPSTATS_SUBBITS) + sub + 1) << (e - AFPSTATS_SUBBITS);
+}
+
+static struct afpstats_hist *get_hist(int id)
+{
+    if (hist[id] == NULL)
+        hist[id] = calloc(1, sizeof(struct afpstats_hist));
+    return hist[id];
+}
+
+/* Prometheus histogram, only with the bucket limits that are powers of 2 */
+static void write_hist(bstring b, const char *name, const char *label, const struct afpstats_hist *h)
+{
+    const char *sep = *label ? "," : "";
+    const char *open = *label ? "{" : "";
+    const char *close = *label ? "}" : "";
+    uint64_t cumulative = 0, limit;
+    unsigned int i;
+
+    for (i = 0; i < AFPSTATS_BUCKETS; i++) {
+        cumulative += h->bucket[i];
+        limit = bucket_limit(i);
+        if (limit & (limit - 1))
+            continue;
+        bformata(b, "%s_bucket{%s%sle=\"%g\"} %llu\n",
+                 name, label, sep, limit / 1e6, (unsigned long long)cumulative);
+    }
+    bformata(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+             name, label, sep, (unsigned long long)h->count);
+    bformata(b, "%s_sum%s%s%s %g\n", name, open, label, close, h->sum / 1e6);
+    bformata(b, "%s_count%s%s%s %llu\n", name, open, label, close, (unsigned long long)h->count);
+}
+
+/********************************************************************************
+ * Interface
+ *******************************************************************************/
+
+/*!
+ * @brief Enable recording, called by the master before it forks sessions
+ */
+void afpstats_enable(void)
+{
+    afpstats_enabled = 1;
+    last_sent = time(NULL);
+}
+
+/*!
+ * @brief Take the start time of an operation
+ */
+void afpstats_start(struct timespec *start)
+{
+    clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/*!
+ * @brief Record the time since start in a histogram
+ *
+ * @param id      (r) AFP command or AFPSTATS_CNID
+ * @param start   (r) time from afpstats_start()
+ */
+void afpstats_record(int id, const struct timespec *start)
+{
+    struct afpstats_hist *h;
+    struct timespec now;
+    int64_t us;
+
+    if ((h = get_hist(id)) == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+    if (us < 0)
+        us = 0;
+    h->count++;
+    h->sum += us;
+    h->bucket[bucket_index(us)]++;
+}
+
+void afpstats_count(enum afpstats_counter c, uint64_t n)
+{
+    counter[c] += n;
+}
+
+/*!
+ * @brief Check whether it's time to send an update to the master
+ */
+int afpstats_due(void)
+{
+    return time(NULL) - last_sent >= AFPSTATS_INTERVAL;
+}
+
+/*!
+ * @brief Send everything recorded since the last update to the master and reset it
+ *
+ * @param ipc_fd  (r) IPC socket of the session
+ *
+ * @returns 0 on success, -1 on error
+ */
+int afpstats_send(int ipc_fd)
+{
+    char msg[sizeof(uint16_t) + sizeof(struct afpstats_hist)];
+    uint16_t id;
+    int i, ret = 0;
+
+    last_sent = time(NULL);
+
+    for (i = 0; i < AFPSTATS_HISTS; i++) {
+        if (hist[i] == NULL || hist[i]->count == 0)
+            continue;
+        id = i;
+        memcpy(msg, &id, sizeof(id));
+        memcpy(msg + sizeof(id), hist[i], sizeof(struct afpstats_hist));
+        if (ipc_child_write(ipc_fd, IPC_STATS, sizeof(msg), msg) != 0)
+            ret = -1;
+        memset(hist[i], 0, sizeof(struct afpstats_hist));
+    }
+
+    id = AFPSTATS_MSG_COUNTERS;
+    memcpy(msg, &id, sizeof(id));
+    memcpy(msg + sizeof(id), counter, sizeof(counter));
+    if (ipc_child_write(ipc_fd, IPC_STATS, sizeof(id) + sizeof(counter), msg) != 0)
+        ret = -1;
+    memset(counter, 0, sizeof(counter));
+
+    if (ret != 0)
+        LOG(log_debug, logtype_afpd, "afpstats_send: %s", strerror(errno));
+    return ret;
+}
+
+/*!
+ * @brief Add an update from a session to the totals, called in the master
+ *
+ * @returns 0 on success, -1 if the message is malformed
+ */
+int afpstats_merge(const void *msg, size_t len)
+{
+    struct afpstats_hist update, *h;
+    uint64_t counters[AFPSTATS_COUNTERS];
+    uint16_t id;
+    int i;
+
+    if (len < sizeof(id))
+        return -1;
+    memcpy(&id, msg, sizeof(id));
+    msg = (const char *)msg + sizeof(id);
+    len -= sizeof(id);
+
+    if (id == AFPSTATS_MSG_COUNTERS) {
+        if (len != sizeof(counters))
+            return -1;
+        memcpy(counters, msg, sizeof(counters));
+        for (i = 0; i < AFPSTATS_COUNTERS; i++)
+            counter[i] += counters[i];
+        return 0;
+    }
+
+    if (id >= AFPSTATS_HISTS || len != sizeof(update))
+        return -1;
+    if ((h = get_hist(id)) == NULL)
+        return 0;
+    memcpy(&update, msg, sizeof(update));
+    h->count += update.count;
+    h->sum += update.sum;
+    for (i = 0; i < AFPSTATS_BUCKETS; i++)
+        h->bucket[i] += update.bucket[i];
+    return 0;
+}
+
+/*!
+ * @brief Write the totals in the Prometheus text format, called in the master
+ *
+ * The master must not block on a client, fd should be non-blocking. If the
+ * output doesn't fit into the socket buffer the client is given up on.
+ *
+ * @param fd        (r) connected socket of a client
+ * @param sessions  (r) number of sessions, without idle session pool processes
+ * @param cmdname   (r) function returning the name of an AFP command
+ *
+ * @returns 0 on success, -1 on error
+ */
+int afpstats_write(int fd, int sessions, const char *(*cmdname)(int))
+{
+    bstring b;
+    char label[64];
+    int i, ret = 0;
+    ssize_t n;
+    size_t off;
+
+    if ((b = bfromcstralloc(16384, "")) == NULL)
+        return -1;
+
+    bformata(b, "# TYPE afpd_sessions gauge\nafpd_sessions %d\n", sessions);
+    for (i = 0; i < AFPSTATS_COUNTERS; i++)
+        bformata(b, "# TYPE %s counter\n%s %llu\n",
+                 counter_name[i], counter_name[i], (unsigned long long)counter[i]);
+
+    bformata(b, "# TYPE afpd_command_duration_seconds histogram\n");
+    for (i = 0; i < 256; i++) {
+        if (hist[i] == NULL || hist[i]->count == 0)
+            continue;
+        snprintf(label, sizeof(label), "command=\"%s\"", cmdname(i));
+        write_hist(b, "afpd_command_duration_seconds", label, hist[i]);
+    }
+
+    bformata(b, "# TYPE afpd_cnid_request_duration_seconds histogram\n");
+    if (hist[AFPSTATS_CNID])
+        write_hist(b, "afpd_cnid_request_duration_seconds", "", hist[AFPSTATS_CNID]);
+
+    for (off = 0; off < (size_t)blength(b); off += n) {
+        if ((n = write(fd, b->data + off, blength(b) - off)) == -1 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0) {
+            /* EAGAIN included: drop the client */
+            ret = -1;
+            break;
+        }
+    }
+    bdestroy(b);
+    return ret;
+}
@@ -29,6 +29,10 @@ Netatalk 2001 (c)
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <atalk/util.h>
 #include <atalk/logger.h>
@@ -107,10 +111,6 @@ struct log_flood_entry {
 static struct log_flood_entry log_flood_array[LOG_FLOODING_ARRAY_SIZE];
 static int log_flood_entries;
 
-/* These are used by the LOG macro to store __FILE__ and __LINE__ */
-static const char *log_src_filename;
-static int  log_src_linenumber;
-
 /* Array to store text to list given a log type */
 static const char *arr_logtype_strings[] =  LOGTYPE_STRING_IDENTIFIERS;
 static const unsigned int num_logtype_strings = COUNT_ARRAY(arr_logtype_strings);
@@ -143,19 +143,21 @@ static unsigned int hash_message(const char *message)
 static void generate_message_details(char *message_details_buffer,
                                      int message_details_buffer_length,
                                      int display_options,
-                                     enum loglevels loglevel, enum logtypes logtype)
+                                     enum loglevels loglevel, enum logtypes logtype,
+                                     const char *file, int line)
 {
     char   *ptr = message_details_buffer;
     int    templen;
     int    len = message_details_buffer_length;
     struct timeval tv;
+    struct tm tm;
     pid_t  pid;
 
     *ptr = 0;
 
     /* Print time */
     gettimeofday(&tv, NULL);
-    strftime(ptr, len, "%b %d %H:%M:%S.", localtime(&tv.tv_sec));
+    strftime(ptr, len, "%b %d %H:%M:%S.", localtime_r(&tv.tv_sec, &tm));
     templen = strlen(ptr);
     len -= templen;
     ptr += templen;
@@ -177,11 +179,11 @@ static void generate_message_details(char *message_details_buffer,
 
     /* Source info ? */
     if ( ! (display_options & logoption_nsrcinfo)) {
-        char *basename = strrchr(log_src_filename, '/');
+        char *basename = strrchr(file, '/');
         if (basename)
-            templen = snprintf(ptr, len, " {%s:%d}", basename + 1, log_src_linenumber);
+            templen = snprintf(ptr, len, " {%s:%d}", basename + 1, line);
         else
-            templen = snprintf(ptr, len, " {%s:%d}", log_src_filename, log_src_linenumber);
+            templen = snprintf(ptr, len, " {%s:%d}", file, line);
         if (templen == -1 || templen >= len)
             return;
         len -= templen;
@@ -246,6 +248,299 @@ static void make_syslog_entry(enum loglevels loglevel, enum logtypes logtype _U_
     syslog(get_syslog_equivalent(loglevel), "%s", message);
 }
 
+/* -------------------------------------------------------------------------
+   Asynchronous file logging ("log async")
+
+   Callers format their message into a slot of a per process ring buffer
+   and return, a writer thread writes the slots in batches with writev().
+   The ring is a bounded multi producer queue: a producer reserves the
+   slot at head with a CAS, fills it and publishes it by setting the slot's
+   sequence number to its position + 1, the writer gives it back to
+   producers by setting it to position + LOG_RING_SLOTS once written.
+   If the ring is full the message is dropped and counted. The writer
+   sleeps in poll() on a pipe, producers only write to the pipe when the
+   writer announced that it's going to sleep, write() is safe in signal
+   handlers unlike condition variables.
+
+   The thread is started by setuplog_async() and doesn't survive fork(),
+   the child discards entries the parent still has to write and starts its
+   own thread with setuplog_async_child(). Until a thread is running the
+   messages are written at once: LOG() is used in signal handlers, so the
+   logging path itself never allocates, creates pipes or starts threads.
+   At exit() the ring is drained.
+   ------------------------------------------------------------------------- */
+
+#define LOG_RING_SLOTS 1024         /* power of 2 */
+#define LOG_RING_MASK  (LOG_RING_SLOTS - 1)
+#define LOG_BATCH      64           /* max entries per writev() */
+#define LOG_LINGER_NS  1000000      /* writer delay after a wakeup */
+#define LOG_RATE_SITES 256          /* call sites tracked for "log rate" */
+#define LOG_FLUSH_MS   1000         /* max wait for the writer in log_ring_flush() */
+
+struct log_slot {
+    volatile unsigned int seq;
+    int                   fd;
+    unsigned int          len;
+    char                  buf[2 * MAXLOGSIZE];
+};
+
+static struct {
+    struct log_slot       *slot;
+    volatile unsigned int head;      /* next position producers reserve */
+    unsigned int          tail;      /* next position the writer writes */
+    volatile int          waiting;   /* writer is about to sleep */
+    volatile int          stop;
+    bool                  running;
+    int                   wakefd[2];
+    pthread_t             thread;
+    volatile unsigned long dropped;  /* ring full */
+    volatile unsigned long limited;  /* "log rate" exceeded */
+} ring = { .wakefd = {-1, -1} };
+
+static struct {
+    const char *file;
+    int         line;
+    time_t      sec;
+    int         count;
+} rate_sites[LOG_RATE_SITES];
+
+/* Report dropped and rate limited messages at most once a second, called by the writer */
+static void log_ring_report(bool force)
+{
+    static unsigned long dropped, limited;
+    static time_t last;
+    char buf[2 * MAXLOGSIZE];
+    time_t now;
+    int fd, len;
+
+    if (ring.dropped == dropped && ring.limited == limited)
+        return;
+    now = time(NULL);
+    if (now == last && !force)
+        return;
+    last = now;
+    if ((fd = type_configs[logtype_logger].set ?
+         type_configs[logtype_logger].fd : type_configs[logtype_default].fd) < 0)
+        return;
+
+    generate_message_details(buf, MAXLOGSIZE, type_configs[logtype_default].display_options,
+                             log_warning, logtype_logger, __FILE__, __LINE__);
+    len = strlen(buf);
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    "async logging: %lu messages dropped (buffer full), %lu over \"log rate\"\n",
+                    ring.dropped - dropped, ring.limited - limited);
+    dropped = ring.dropped;
+    limited = ring.limited;
+    write(fd, buf, len);
+}
+
+static void *log_ring_writer(void *arg _U_)
+{
+    struct iovec iov[LOG_BATCH];
+    struct log_slot *slot;
+    struct pollfd pfd;
+    struct timespec linger = { 0, LOG_LINGER_NS };
+    char drain[64];
+    unsigned int pos, n, i;
+    int fd = -1;
+
+    for (;;) {
+        pos = ring.tail;
+        for (n = 0; n < LOG_BATCH; n++) {
+            slot = &ring.slot[(pos + n) & LOG_RING_MASK];
+            if (slot->seq != pos + n + 1)
+                break;
+            __sync_synchronize();
+            if (n > 0 && slot->fd != fd)
+                break;
+            fd = slot->fd;
+            iov[n].iov_base = slot->buf;
+            iov[n].iov_len = slot->len;
+        }
+
+        if (n > 0) {
+            writev(fd, iov, n);
+            __sync_synchronize();
+            for (i = 0; i < n; i++)
+                ring.slot[(pos + i) & LOG_RING_MASK].seq = pos + i + LOG_RING_SLOTS;
+            ring.tail = pos + n;
+            continue;
+        }
+
+        log_ring_report(ring.stop);
+        if (ring.stop)
+            break;
+
+        /* announce that we sleep, then check again for a producer that missed it */
+        ring.waiting = 1;
+        __sync_synchronize();
+        if (ring.slot[pos & LOG_RING_MASK].seq == pos + 1) {
+            ring.waiting = 0;
+            continue;
+        }
+        pfd.fd = ring.wakefd[0];
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) == 1) {
+            /* let a batch build up instead of waking up for every message */
+            while (read(ring.wakefd[0], drain, sizeof(drain)) > 0)
+                ;
+            if (!ring.stop)
+                nanosleep(&linger, NULL);
+        }
+        ring.waiting = 0;
+    }
+    return NULL;
+}
+
+/* Drain the ring and stop the writer, registered with atexit() */
+static void log_ring_stop(void)
+{
+    if (!ring.running)
+        return;
+    ring.stop = 1;
+    write(ring.wakefd[1], "", 1);
+    pthread_join(ring.thread, NULL);
+    ring.running = false;
+}
+
+/* Forget the entries of the parent and its writer thread, pthread_atfork() child handler */
+static void log_ring_atfork_child(void)
+{
+    unsigned int pos;
+
+    if (!ring.running)
+        return;
+    for (pos = ring.tail; pos != ring.head; pos++)
+        ring.slot[pos & LOG_RING_MASK].seq = pos + LOG_RING_SLOTS;
+    ring.tail = ring.head;
+    ring.waiting = 0;
+    close(ring.wakefd[0]);
+    close(ring.wakefd[1]);
+    ring.wakefd[0] = ring.wakefd[1] = -1;
+    ring.running = false;
+}
+
+static int log_ring_start(void)
+{
+    static bool registered;
+    sigset_t sigs, oldsigs;
+    unsigned int i;
+    int ret;
+
+    if (ring.stop)
+        return -1;
+
+    if (ring.slot == NULL) {
+        if ((ring.slot = malloc(LOG_RING_SLOTS * sizeof(struct log_slot))) == NULL)
+            return -1;
+        for (i = 0; i < LOG_RING_SLOTS; i++)
+            ring.slot[i].seq = i;
+    }
+    if (!registered) {
+        pthread_atfork(NULL, NULL, log_ring_atfork_child);
+        atexit(log_ring_stop);
+        registered = true;
+    }
+
+    if (pipe(ring.wakefd) != 0)
+        return -1;
+    for (i = 0; i < 2; i++) {
+        fcntl(ring.wakefd[i], F_SETFL, O_NONBLOCK);
+        fcntl(ring.wakefd[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    /* signals must be handled by the threads that log, not by the writer */
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+    ret = pthread_create(&ring.thread, NULL, log_ring_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+    if (ret != 0) {
+        close(ring.wakefd[0]);
+        close(ring.wakefd[1]);
+        ring.wakefd[0] = ring.wakefd[1] = -1;
+        return -1;
+    }
+    ring.running = true;
+    return 0;
+}
+
+/*
+ * Wait until the writer has written what's queued, but at most LOG_FLUSH_MS
+ * milliseconds, so a log file on a stalled disk delays a reconfiguration
+ * by that much
+ */
+static void log_ring_flush(void)
+{
+    int i;
+
+    for (i = 0; ring.running && ring.tail != ring.head && i < LOG_FLUSH_MS; i++) {
+        if (ring.waiting && __sync_bool_compare_and_swap(&ring.waiting, 1, 0))
+            write(ring.wakefd[1], "", 1);
+        usleep(1000);
+    }
+}
+
+/* Check "log rate", the number of messages per second from one source line */
+static bool log_rate_exceeded(const char *file, int line)
+{
+    unsigned int idx = ((uintptr_t)file / 8 + (unsigned int)line * 31) % LOG_RATE_SITES;
+    time_t now = time(NULL);
+
+    if (rate_sites[idx].file != file || rate_sites[idx].line != line || rate_sites[idx].sec != now) {
+        rate_sites[idx].file = file;
+        rate_sites[idx].line = line;
+        rate_sites[idx].sec = now;
+        rate_sites[idx].count = 0;
+    }
+    if (++rate_sites[idx].count <= log_config.rate)
+        return false;
+    __sync_fetch_and_add(&ring.limited, 1);
+    return true;
+}
+
+/*!
+ * Queue a message for the writer thread
+ *
+ * @returns 0 if the message was queued or dropped, -1 if the caller must write it
+ */
+static int log_ring_put(int fd, const char *details, const char *message)
+{
+    struct log_slot *slot;
+    unsigned int pos, seq;
+    size_t dlen, mlen;
+
+    if (!ring.running)
+        return -1;
+
+    pos = ring.head;
+    for (;;) {
+        slot = &ring.slot[pos & LOG_RING_MASK];
+        seq = slot->seq;
+        if (seq == pos) {
+            if (__sync_bool_compare_and_swap(&ring.head, pos, pos + 1))
+                break;
+        } else if ((int)(seq - pos) < 0) {
+            __sync_fetch_and_add(&ring.dropped, 1);
+            return 0;
+        }
+        pos = ring.head;
+    }
+
+    dlen = strlen(details);
+    mlen = strlen(message);
+    memcpy(slot->buf, details, dlen);
+    memcpy(slot->buf + dlen, message, mlen);
+    slot->len = dlen + mlen;
+    slot->fd = fd;
+    __sync_synchronize();
+    slot->seq = pos + 1;
+
+    if (ring.waiting && __sync_bool_compare_and_swap(&ring.waiting, 1, 0))
+        write(ring.wakefd[1], "", 1);
+    return 0;
+}
+
 static void log_init(void)
 {
     syslog_setup(log_info,
@@ -256,6 +551,9 @@ static void log_init(void)
 
 static void log_setup(const char *filename, enum loglevels loglevel, enum logtypes logtype)
 {
+    /* queued messages must go to the files they were logged to, may wait up to LOG_FLUSH_MS */
+    log_ring_flush();
+
     if (loglevel == 0) {
         /* Disable */
         if (type_configs[logtype].set) {
@@ -452,6 +750,35 @@ void set_processname(const char *processname)
     log_config.processname[15] = 0;
 }
 
+/*!
+ * Enable or disable asynchronous file logging
+ *
+ * @param async  (r) queue messages for a writer thread instead of writing them
+ * @param rate   (r) max number of messages per second from one source line in
+ *                   async mode, 0 for no limit
+ */
+void setuplog_async(bool async, int rate)
+{
+    if (!async)
+        log_ring_flush();
+    else if (!ring.running)
+        log_ring_start();
+    log_config.async = async;
+    log_config.rate = rate;
+}
+
+/*!
+ * Start the writer thread of asynchronous logging in a forked child
+ *
+ * The thread of the parent doesn't survive fork(), until this is called the
+ * child writes its messages itself.
+ */
+void setuplog_async_child(void)
+{
+    if (log_config.async && !ring.running)
+        log_ring_start();
+}
+
 /* -------------------------------------------------------------------------
    make_log_entry has 1 main flaws:
    The message in its entirity, must fit into the tempbuffer.
@@ -494,9 +821,6 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
 
     /* logging to a file */
 
-    log_src_filename = file;
-    log_src_linenumber = line;
-
     /* Check if requested logtype is setup */
     if (type_configs[logtype].set)
         /* Yes */
@@ -510,6 +834,10 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
         goto exit;
     }
 
+    if (log_config.async && log_config.rate > 0 && loglevel > log_error
+        && log_rate_exceeded(file, line))
+        goto exit;
+
     /* Initialise the Messages */
     va_start(args, message);
     len = vsnprintf(temp_buffer, MAXLOGSIZE -1, message, args);
@@ -530,7 +858,7 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
         goto log; /* bypass flooding checks */
 
     /* Prevent flooding: hash the message and check if we got the same one recently */
-    int hash = hash_message(temp_buffer) + log_src_linenumber;
+    int hash = hash_message(temp_buffer) + line;
 
     /* Search for the same message by hash */
     for (int i = log_flood_entries - 1; i >= 0; i--) {
@@ -591,7 +919,12 @@ log:
                                  type_configs[logtype].set ?
                                      type_configs[logtype].display_options :
                                      type_configs[logtype_default].display_options,
-                                 loglevel, logtype);
+                                 loglevel, logtype, file, line);
+
+        /* errors are written at once, so they are not lost if the process dies */
+        if (log_config.async && loglevel > log_error
+            && log_ring_put(fd, log_details_buffer, temp_buffer) == 0)
+            goto exit;
 
         /* If default wasnt setup its fd is -1 */
         iov[0].iov_base = log_details_buffer;
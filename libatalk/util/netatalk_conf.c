@@ -772,6 +772,8 @@ static struct vol *creatvol(AFPObj *obj,
         volume->v_flags |= AFPVOL_NOV2TOEACONV;
     if (getoption_bool(obj->iniconfig, section, "follow symlinks", preset, 0))
         volume->v_flags |= AFPVOL_FOLLOWSYM;
+    if (getoption_bool(obj->iniconfig, section, "preallocate", preset, 0))
+        volume->v_flags |= AFPVOL_PREALLOC;
 
     if (getoption_bool(obj->iniconfig, section, "preexec close", preset, 0))
         volume->v_preexec_close = 1;
@@ -1633,6 +1635,8 @@ int afp_config_parse(AFPObj *AFPObj, char *processname)
     options->logfile   = iniparser_getstrdup(config, INISEC_GLOBAL, "log file",  NULL);
 
     setuplog(options->logconfig, options->logfile);
+    setuplog_async(iniparser_getboolean(config, INISEC_GLOBAL, "log async", 0),
+                   iniparser_getint(config, INISEC_GLOBAL, "log rate", 0));
 
     /* "server options" boolean options */
     if (!iniparser_getboolean(config, INISEC_GLOBAL, "zeroconf", 1))
@@ -1653,6 +1657,16 @@ int afp_config_parse(AFPObj *AFPObj, char *processname)
         options->flags |= OPTION_SHARE_RESERV;
     if (iniparser_getboolean(config, INISEC_GLOBAL, "afp read locks", 0))
         options->flags |= OPTION_AFP_READ_LOCK;
+    if (iniparser_getboolean(config, INISEC_GLOBAL, "adaptive dsireadbuf", 0))
+        options->flags |= OPTION_DSIREADBUF_ADAPT;
+    if (iniparser_getboolean(config, INISEC_GLOBAL, "async flush", 0)) {
+        options->flags |= OPTION_ASYNC_FLUSH;
+#ifndef HAVE_SYNC_FILE_RANGE
+        LOG(log_note, logtype_afpd, "async flush: no sync_file_range() on this system, flushes wait for the disk");
+#endif
+    }
+    if (iniparser_getboolean(config, INISEC_GLOBAL, "dircache notify", 0))
+        options->flags |= OPTION_DCNOTIFY;
     if (!iniparser_getboolean(config, INISEC_GLOBAL, "save password", 1))
         options->passwdbits |= PASSWD_NOSAVE;
     if (iniparser_getboolean(config, INISEC_GLOBAL, "set password", 0))
@@ -1675,7 +1689,9 @@ int afp_config_parse(AFPObj *AFPObj, char *processname)
     options->ntseparator    = iniparser_getstrdup(config, INISEC_GLOBAL, "nt separator",   NULL);
     options->mimicmodel     = iniparser_getstrdup(config, INISEC_GLOBAL, "mimic model",    NULL);
     options->adminauthuser  = iniparser_getstrdup(config, INISEC_GLOBAL, "admin auth user",NULL);
+    options->statssocket    = iniparser_getstrdup(config, INISEC_GLOBAL, "stats socket",   NULL);
     options->connections    = iniparser_getint   (config, INISEC_GLOBAL, "max connections",200);
+    options->sessionpool    = iniparser_getint   (config, INISEC_GLOBAL, "session pool",   0);
     options->passwdminlen   = iniparser_getint   (config, INISEC_GLOBAL, "passwd minlen",  0);
     options->tickleval      = iniparser_getint   (config, INISEC_GLOBAL, "tickleval",      30);
     options->timeout        = iniparser_getint   (config, INISEC_GLOBAL, "timeout",        4);
@@ -1683,6 +1699,10 @@ int afp_config_parse(AFPObj *AFPObj, char *processname)
     options->server_quantum = iniparser_getint   (config, INISEC_GLOBAL, "server quantum", DSI_SERVQUANT_DEF);
     options->volnamelen     = iniparser_getint   (config, INISEC_GLOBAL, "volnamelen",     80);
     options->dircachesize   = iniparser_getint   (config, INISEC_GLOBAL, "dircachesize",   DEFAULT_MAX_DIRCACHE_SIZE);
+    options->dircachefiles  = iniparser_getint   (config, INISEC_GLOBAL, "dircache files", 50);
+    options->dircacheneg    = iniparser_getint   (config, INISEC_GLOBAL, "dircache negative", 1024);
+    options->shmcachesize   = iniparser_getint   (config, INISEC_GLOBAL, "shared dircache", 0);
+    options->enumthreads    = iniparser_getint   (config, INISEC_GLOBAL, "enumerate threads", 0);
     options->tcp_sndbuf     = iniparser_getint   (config, INISEC_GLOBAL, "tcpsndbuf",      0);
     options->tcp_rcvbuf     = iniparser_getint   (config, INISEC_GLOBAL, "tcprcvbuf",      0);
     options->fce_fmodwait   = iniparser_getint   (config, INISEC_GLOBAL, "fce holdfmod",   60);
@@ -1810,6 +1830,14 @@ int afp_config_parse(AFPObj *AFPObj, char *processname)
         options->disconnected = options->sleep = 4;
     if (options->dsireadbuf < 6)
         options->dsireadbuf = 6;
+    if (options->enumthreads < 0)
+        options->enumthreads = 0;
+    if (options->enumthreads > 16)
+        options->enumthreads = 16;
+    if (options->sessionpool < 0)
+        options->sessionpool = 0;
+    if (options->sessionpool > options->connections)
+        options->sessionpool = options->connections;
     if (options->volnamelen < 8)
         options->volnamelen = 8; /* max mangled volname "???#FFFF" */
     if (options->volnamelen > 255)
@@ -1869,6 +1897,8 @@ void afp_config_free(AFPObj *obj)
         CONFIG_ARG_FREE(obj->options.mimicmodel);
     if (obj->options.adminauthuser)
         CONFIG_ARG_FREE(obj->options.adminauthuser);
+    if (obj->options.statssocket)
+        CONFIG_ARG_FREE(obj->options.statssocket);
     if (obj->options.hostname)
         CONFIG_ARG_FREE(obj->options.hostname);
     if (obj->options.k5keytab)
@@ -154,7 +154,16 @@ exit:
     return child;
 }
 
-/* remove a child and free it */
+/* find a child by pid */
+afp_child_t *server_child_resolve(server_child *children, int forkid, pid_t pid)
+{
+    server_child_fork *fork;
+
+    fork = (server_child_fork *) children->fork + forkid;
+    return resolve_child(fork->table, pid);
+}
+
+/* remove a child and free it, returns the IPC fd which the caller must close */
 int server_child_remove(server_child *children, const int forkid, pid_t pid)
 {
     int fd;
@@ -171,10 +180,9 @@ int server_child_remove(server_child *children, const int forkid, pid_t pid)
         child->clientid = NULL;
     }
 
-    /* In main:child_handler() we need the fd in order to remove it from the pollfd set */
+    /* In main:child_handler() we need the fd in order to remove it from the pollfd set,
+     * the caller closes it after that, as with epoll it must be removed before it's closed */
     fd = child->ipc_fd;
-    if (fd != -1)
-        close(fd);
 
     free(child);
     children->count--;
@@ -27,9 +27,10 @@
 #include <atalk/paths.h>
 #include <atalk/globals.h>
 #include <atalk/dsi.h>
+#include <atalk/afpstats.h>
 
 #define IPC_HEADERLEN 14
-#define IPC_MAXMSGSIZE 90
+#define IPC_MAXMSGSIZE 1024
 
 typedef struct ipc_header {
 	uint16_t command;
@@ -42,7 +43,8 @@ typedef struct ipc_header {
 } ipc_header_t;
 
 static char *ipc_cmd_str[] = { "IPC_DISCOLDSESSION",
-                               "IPC_GETSESSION"};
+                               "IPC_GETSESSION",
+                               "IPC_STATS"};
 
 /*
  * Pass afp_socket to old disconnected session if one has a matching token (token = pid)
@@ -294,6 +296,11 @@ int ipc_server_read(server_child *children, int fd)
             return -1;
         break;
 
+    case IPC_STATS:
+        if (afpstats_merge(ipc.msg, ipc.len) != 0)
+            LOG(log_info, logtype_afpd, "ipc_read: malformed statistics from child[%u]", ipc.child_pid);
+        break;
+
 	default:
 		LOG (log_info, logtype_afpd, "ipc_read: unknown command: %d", ipc.command);
 		return -1;
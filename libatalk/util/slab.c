@@ -0,0 +1,128 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+/*!
+ * @file
+ * Netatalk utility functions: slab allocator
+ *
+ * Objects of one size are carved from chunks of perchunk objects and freed objects
+ * are kept on a free list for reuse, chunks are only given back by slab_destroy().
+ * Long lived processes that allocate and free lots of small objects, like the
+ * dircache of afpd, thus don't fragment the heap and save the malloc overhead.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+
+#include <atalk/slab.h>
+
+/* alignment of objects, enough for pointers, off_t and time_t */
+#define SLAB_ALIGN 8
+
+/* chunks start with a pointer to the next chunk, the objects follow it aligned */
+#define SLAB_HDRSIZE ((sizeof(void *) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+/********************************************************************************
+ * Interface
+ *******************************************************************************/
+
+/*!
+ * @brief Initialize a slab, doesn't allocate memory yet
+ *
+ * @param slab      (w) slab to initialize
+ * @param name      (r) name for statistics
+ * @param objsize   (r) size of the objects
+ * @param perchunk  (r) number of objects allocated at once
+ */
+void slab_init(slab_t *slab, const char *name, size_t objsize, unsigned int perchunk)
+{
+    if (objsize < sizeof(void *))
+        objsize = sizeof(void *);
+    slab->name = name;
+    slab->objsize = (objsize + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    slab->perchunk = perchunk ? perchunk : 1;
+    slab->freelist = NULL;
+    slab->chunks = NULL;
+    slab->nchunks = 0;
+    slab->inuse = 0;
+}
+
+/*!
+ * @brief Get an object, the contents are undefined
+ *
+ * @returns pointer to the object or NULL if out of memory
+ */
+void *slab_alloc(slab_t *slab)
+{
+    char *chunk, *obj;
+    unsigned int i;
+
+    if (slab->freelist == NULL) {
+        if ((chunk = malloc(SLAB_HDRSIZE + slab->objsize * slab->perchunk)) == NULL)
+            return NULL;
+        *(void **)chunk = slab->chunks;
+        slab->chunks = chunk;
+        slab->nchunks++;
+
+        /* put all objects of the chunk on the free list, the first one at its head */
+        obj = chunk + SLAB_HDRSIZE + slab->objsize * slab->perchunk;
+        for (i = 0; i < slab->perchunk; i++) {
+            obj -= slab->objsize;
+            *(void **)obj = slab->freelist;
+            slab->freelist = obj;
+        }
+    }
+
+    obj = slab->freelist;
+    slab->freelist = *(void **)obj;
+    slab->inuse++;
+    return obj;
+}
+
+/*!
+ * @brief Return an object to the slab
+ */
+void slab_free(slab_t *slab, void *obj)
+{
+    if (obj == NULL)
+        return;
+    *(void **)obj = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+}
+
+/*!
+ * @brief Free all chunks, all objects of the slab become invalid
+ */
+void slab_destroy(slab_t *slab)
+{
+    void *chunk;
+
+    while ((chunk = slab->chunks) != NULL) {
+        slab->chunks = *(void **)chunk;
+        free(chunk);
+    }
+    slab->freelist = NULL;
+    slab->nchunks = 0;
+    slab->inuse = 0;
+}
+
+/*!
+ * @brief Memory used by the slab in bytes
+ */
+size_t slab_size(const slab_t *slab)
+{
+    return slab->nchunks * (SLAB_HDRSIZE + slab->objsize * slab->perchunk);
+}
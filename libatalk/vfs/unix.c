@@ -13,7 +13,11 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <string.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 
 #include <atalk/afp.h>
 #include <atalk/util.h>
@@ -126,15 +130,99 @@ int netatalk_unlink(const char *name)
  * *at semnatics support functions (like openat, renameat standard funcs)
  **************************************************************************/
 
-/* Copy all file data from one file fd to another */
+/*!
+ * Try to reflink sfd into dfd
+ *
+ * Only possible when dfd is a new, empty file and both files are positioned at
+ * offset 0, as FICLONE always shares the complete source file.
+ *
+ * @returns 0 on success, 1 if the caller should copy the data instead
+ */
+static int copy_file_clone(int sfd, int dfd)
+{
+#ifdef FICLONE
+    struct stat st;
+
+    if (lseek(sfd, 0, SEEK_CUR) != 0 || lseek(dfd, 0, SEEK_CUR) != 0)
+        return 1;
+    if (fstat(dfd, &st) != 0 || st.st_size != 0)
+        return 1;
+    if (ioctl(dfd, FICLONE, sfd) != 0)
+        return 1;
+
+    /* leave both offsets at EOF, like the copy loops below */
+    lseek(sfd, 0, SEEK_END);
+    lseek(dfd, 0, SEEK_END);
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+/*!
+ * Let the kernel copy from the current offset of sfd to dfd
+ *
+ * @returns 0 on success, 1 if the caller should fall back to read/write,
+ *          -1 on error
+ */
+static int copy_file_kernel(int sfd, int dfd)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    ssize_t cc;
+
+    while ((cc = copy_file_range(sfd, NULL, dfd, NULL, NETATALK_DIOSZ_HEAP * 64, 0))) {
+        if (cc < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EXDEV:
+            case EINVAL:
+            case ENOSYS:
+            case EOPNOTSUPP:
+                /* offsets were advanced by what has been copied so far */
+                return 1;
+            default:
+                LOG(log_error, logtype_afpd, "copy_file_fd: %s", strerror(errno));
+                return -1;
+            }
+        }
+    }
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+/*!
+ * Copy all file data from one file fd to another
+ *
+ * Copies from the current offset of sfd to the current offset of dfd. Uses a
+ * reflink if the filesystem supports it, then copy_file_range(), and finally a
+ * read/write loop.
+ */
 int copy_file_fd(int sfd, int dfd)
 {
     EC_INIT;
     ssize_t cc;
-    size_t  buflen;
-    char   filebuf[NETATALK_DIOSZ_STACK];
+    size_t  buflen, bufsize, written;
+    char    stackbuf[NETATALK_DIOSZ_STACK];
+    char   *filebuf, *heapbuf = NULL;
+
+    if (copy_file_clone(sfd, dfd) == 0)
+        EC_EXIT_STATUS(0);
+    if ((ret = copy_file_kernel(sfd, dfd)) != 1)
+        goto EC_CLEANUP;
+    ret = 0;
+
+    if ((heapbuf = malloc(NETATALK_DIOSZ_HEAP))) {
+        filebuf = heapbuf;
+        bufsize = NETATALK_DIOSZ_HEAP;
+    } else {
+        filebuf = stackbuf;
+        bufsize = sizeof(stackbuf);
+    }
 
-    while ((cc = read(sfd, filebuf, sizeof(filebuf)))) {
+    while ((cc = read(sfd, filebuf, bufsize))) {
         if (cc < 0) {
             if (errno == EINTR)
                 continue;
@@ -143,18 +231,20 @@ int copy_file_fd(int sfd, int dfd)
         }
 
         buflen = cc;
-        while (buflen > 0) {
-            if ((cc = write(dfd, filebuf, buflen)) < 0) {
+        written = 0;
+        while (written < buflen) {
+            if ((cc = write(dfd, filebuf + written, buflen - written)) < 0) {
                 if (errno == EINTR)
                     continue;
                 LOG(log_error, logtype_afpd, "copy_file_fd: %s", strerror(errno));
                 EC_FAIL;
             }
-            buflen -= cc;
+            written += cc;
         }
     }
 
 EC_CLEANUP:
+    free(heapbuf);
     EC_EXIT;
 }
 
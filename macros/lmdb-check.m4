@@ -0,0 +1,65 @@
+dnl Autoconf macro to check for the LMDB library, an alternative storage
+dnl backend for cnid_dbd
+
+AC_DEFUN([AC_NETATALK_PATH_LMDB], [
+	AC_ARG_WITH(lmdb,
+		[  --with-lmdb[[=PATH]]      build cnid_dbd with the LMDB backend [[auto]]],
+		[
+			if test "x$withval" = "xno"; then
+				trylmdb=no
+			elif test "x$withval" = "xyes"; then
+				trylmdb=yes
+				trylmdbdir=
+			else
+				trylmdb=yes
+				trylmdbdir="$withval"
+			fi
+		], [trylmdb=auto]
+	)
+
+	LMDB_CFLAGS=""
+	LMDB_LIBS=""
+	netatalk_cv_lmdb=no
+
+	if test "x$use_dbd_backend" = "xyes" -a "x$trylmdb" != "xno"; then
+		saved_CFLAGS=$CFLAGS
+		saved_LIBS=$LIBS
+		AC_MSG_CHECKING([for LMDB])
+		for lmdbdir in $trylmdbdir "" /usr/local /usr/pkg /opt/local ; do
+			if test "x$lmdbdir" = "x" ; then
+				LMDB_CFLAGS=""
+				LMDB_LIBS="-llmdb"
+			elif test -f "$lmdbdir/include/lmdb.h" ; then
+				LMDB_CFLAGS="-I$lmdbdir/include"
+				LMDB_LIBS="-L$lmdbdir/$atalk_libname -L$lmdbdir/lib -llmdb"
+			else
+				continue
+			fi
+			CFLAGS="$saved_CFLAGS $LMDB_CFLAGS"
+			LIBS="$saved_LIBS $LMDB_LIBS"
+			AC_TRY_LINK([#include <lmdb.h>],
+				[MDB_env *env; mdb_env_create(&env);],
+				[netatalk_cv_lmdb=yes])
+			if test "x$netatalk_cv_lmdb" = "xyes" ; then
+				break
+			fi
+		done
+		CFLAGS=$saved_CFLAGS
+		LIBS=$saved_LIBS
+		AC_MSG_RESULT([$netatalk_cv_lmdb])
+
+		if test "x$netatalk_cv_lmdb" = "xyes" ; then
+			AC_DEFINE(HAVE_LMDB, 1, [Define if cnid_dbd should be built with the LMDB backend])
+		elif test "x$trylmdb" = "xyes" ; then
+			AC_MSG_ERROR([LMDB requested but not found])
+		fi
+	fi
+
+	if test "x$netatalk_cv_lmdb" != "xyes" ; then
+		LMDB_CFLAGS=""
+		LMDB_LIBS=""
+	fi
+
+	AC_SUBST(LMDB_CFLAGS)
+	AC_SUBST(LMDB_LIBS)
+])
@@ -954,6 +954,7 @@ if test x"$netatalk_cv_search_sendfile" = x"yes"; then
    *linux*)
         AC_DEFINE(SENDFILE_FLAVOR_LINUX,1,[Whether linux sendfile() API is available])
         AC_CHECK_FUNC([sendfile], [netatalk_cv_HAVE_SENDFILE=yes])
+        AC_CHECK_FUNC([splice], [netatalk_cv_HAVE_SPLICE=yes])
         ;;
 
     *solaris*)
@@ -975,6 +976,9 @@ if test x"$netatalk_cv_search_sendfile" = x"yes"; then
 
     if test x"$netatalk_cv_HAVE_SENDFILE" = x"yes"; then
         AC_DEFINE(WITH_SENDFILE,1,[Whether sendfile() should be used])
+        if test x"$netatalk_cv_HAVE_SPLICE" = x"yes"; then
+            AC_DEFINE(WITH_RECVFILE,1,[Whether splice() should be used to receive FPWrite data])
+        fi
     fi
 fi
 ])
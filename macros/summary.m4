@@ -99,6 +99,11 @@ AC_DEFUN([AC_NETATALK_LIBS_SUMMARY], [
 		AC_MSG_RESULT([        LIBS   = $BDB_LIBS])
 		AC_MSG_RESULT([        CFLAGS = $BDB_CFLAGS])
 	fi
+	if test x"$netatalk_cv_lmdb" = x"yes"; then
+		AC_MSG_RESULT([    LMDB:])
+		AC_MSG_RESULT([        LIBS   = $LMDB_LIBS])
+		AC_MSG_RESULT([        CFLAGS = $LMDB_CFLAGS])
+	fi
 	if test x"$netatalk_cv_build_krb5_uam" = x"yes"; then
 		AC_MSG_RESULT([    GSSAPI:])
 		AC_MSG_RESULT([        LIBS   = $GSSAPI_LIBS])
@@ -20,6 +20,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 #include <atalk/util.h>
 #include <atalk/cnid.h>
@@ -35,6 +39,9 @@
 #include "hash.h"
 #include "afp_config.h"
 #include "volume.h"
+#include "rhash.h"
+#include "shmcache.h"
+#include <atalk/slab.h>
 
 #include "test.h"
 #include "subtests.h"
@@ -44,10 +51,15 @@ static int reti;                /* for the TEST_int macro */
 int test001_add_x_dirs(const struct vol *vol, cnid_t start, cnid_t end)
 {
     struct dir *dir;
+    struct stat st;
     char dirname[20];
+
+    /* all entries point to the volume root, so lookups validate them */
+    if (lstat(vol->v_path, &st) != 0)
+        return -1;
     while (start++ < end) {
         sprintf(dirname, "dir%04u", start);
-        dir = dir_new(dirname, dirname, vol, DIRDID_ROOT, htonl(start), bfromcstr(vol->v_path), 0);
+        dir = dir_new(dirname, dirname, vol, DIRDID_ROOT, htonl(start), bfromcstr(vol->v_path), &st);
         if (dir == NULL)
             return -1;
         if (dircache_add(vol, dir) != 0)
@@ -68,3 +80,293 @@ int test002_rem_x_dirs(const struct vol *vol, cnid_t start, cnid_t end)
 
     return 0;
 }
+
+/* object for the hashtable tests */
+struct tobj {
+    uint32_t id;
+};
+
+static uint32_t tobj_hash(const void *key)
+{
+    /* four entries share every hash, so they collide and get shifted around */
+    return (((const struct tobj *)key)->id / 4) * 2654435761U;
+}
+
+static int tobj_comp(const void *key1, const void *key2)
+{
+    return ((const struct tobj *)key1)->id != ((const struct tobj *)key2)->id;
+}
+
+/*!
+ * Insert, lookup and remove entries while the table grows and migrates
+ */
+int test003_rhash(uint32_t n)
+{
+    struct tobj *objs, key;
+    rhash_t *h;
+    uint32_t i, pos, found;
+    int ret = -1;
+
+    if ((objs = calloc(n, sizeof(struct tobj))) == NULL)
+        return -1;
+    if ((h = rhash_create(1, tobj_comp, tobj_hash)) == NULL)
+        goto exit;
+
+    for (i = 0; i < n; i++) {
+        objs[i].id = i;
+        if (rhash_insert(h, &objs[i]) != 0)
+            goto exit;
+        /* remove every third entry right away, in the middle of a migration */
+        if (i % 3 == 1 && rhash_remove(h, &objs[i]) != &objs[i])
+            goto exit;
+    }
+    if (rhash_count(h) != n - (n + 1) / 3)
+        goto exit;
+
+    for (i = 0; i < n; i++) {
+        key.id = i;
+        if ((rhash_lookup(h, &key) != NULL) != (i % 3 != 1))
+            goto exit;
+    }
+    key.id = n;
+    if (rhash_lookup(h, &key) || rhash_remove(h, &key))
+        goto exit;
+
+    for (pos = 0, found = 0; rhash_scan(h, &pos); found++)
+        ;
+    if (found != rhash_count(h))
+        goto exit;
+
+    for (i = 0; i < n; i++) {
+        if (i % 3 != 1 && rhash_remove(h, &objs[i]) != &objs[i])
+            goto exit;
+    }
+    if (rhash_count(h) != 0)
+        goto exit;
+    ret = 0;
+
+exit:
+    rhash_destroy(h);
+    free(objs);
+    return ret;
+}
+
+/*!
+ * Objects are aligned, reused LIFO and counted
+ */
+int test004_slab(void)
+{
+    slab_t slab;
+    void *objs[10], *obj;
+    int i;
+
+    slab_init(&slab, "test", 13, 4);
+    if (slab.objsize != 16)
+        return -1;
+
+    for (i = 0; i < 10; i++) {
+        if ((objs[i] = slab_alloc(&slab)) == NULL || ((uintptr_t)objs[i] & 7))
+            return -1;
+        memset(objs[i], 0xff, 13);
+    }
+    if (slab.inuse != 10 || slab.nchunks != 3 || slab_size(&slab) < 12 * 16)
+        return -1;
+
+    slab_free(&slab, objs[3]);
+    slab_free(&slab, objs[7]);
+    if (slab.inuse != 8)
+        return -1;
+    if ((obj = slab_alloc(&slab)) != objs[7] || (obj = slab_alloc(&slab)) != objs[3])
+        return -1;
+    /* the last two objects of the third chunk */
+    if (slab_alloc(&slab) == NULL || slab_alloc(&slab) == NULL || slab.nchunks != 3)
+        return -1;
+    if (slab_alloc(&slab) == NULL || slab.nchunks != 4)
+        return -1;
+
+    slab_destroy(&slab);
+    if (slab.inuse != 0 || slab.nchunks != 0 || slab_size(&slab) != 0)
+        return -1;
+    return 0;
+}
+
+/*!
+ * 2Q: entries evicted from the "in" queue and added again go to the "main" queue,
+ * which a scan of entries that are only seen once doesn't evict
+ *
+ * @param cachesize  (r) dircache size the test binary initialized the cache with
+ */
+int test005_dircache_2q(const struct vol *vol, cnid_t start, unsigned int cachesize)
+{
+    const cnid_t hot = 100;
+    unsigned int budget = cachesize / 2;  /* dirs share of the cache with "dircache files" 50% */
+    cnid_t filler = start + hot, scan = filler + budget, id;
+
+    if (test001_add_x_dirs(vol, start - 1, start + hot - 1) != 0)
+        return -1;
+    /* fill the cache, the next add evicts the hot entries from the "in" queue */
+    if (test001_add_x_dirs(vol, filler - 1, filler + budget - hot) != 0)
+        return -1;
+    if (dircache_search_by_did(vol, htonl(start)) != NULL)
+        return -1;
+
+    /* the ghosts send them to the "main" queue */
+    if (test001_add_x_dirs(vol, start - 1, start + hot - 1) != 0)
+        return -1;
+
+    /* a scan of four times the budget passes through the "in" queue */
+    if (test001_add_x_dirs(vol, scan - 1, scan + 4 * budget) != 0)
+        return -1;
+    for (id = start; id < start + hot; id++) {
+        if (dircache_search_by_did(vol, htonl(id)) == NULL)
+            return -1;
+    }
+    if (dircache_search_by_did(vol, htonl(scan)) != NULL)
+        return -1;
+    return 0;
+}
+
+/*!
+ * Names cached as missing are valid while their parent has been checked in the same
+ * AFP command and its ctime is unchanged, and are forgotten when the name is added
+ *
+ * @param negsize   (r) "dircache negative" size the test binary initialized the cache with
+ */
+int test006_dircache_negative(const struct vol *vol, cnid_t did, int negsize)
+{
+    struct dir *dir, *file;
+    struct stat st;
+    char path[MAXPATHLEN], name[20];
+    int i, ret = -1;
+
+    snprintf(path, sizeof(path), "%s/negdir", vol->v_path);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+        return -1;
+    /* ctimes in the current second aren't stored */
+    sleep(2);
+    if (lstat(path, &st) != 0)
+        return -1;
+    if ((dir = dir_new("negdir", "negdir", vol, DIRDID_ROOT, htonl(did), bfromcstr(path), &st)) == NULL
+        || dircache_add(vol, dir) != 0)
+        return -1;
+
+    dircache_add_negative(vol, dir, "missing", 7);
+    if (dircache_search_negative(vol, dir, "missing", 7) != 1)
+        goto exit;
+
+    /* the next AFP command must check the parent first */
+    dircache_next_command();
+    if (dircache_search_negative(vol, dir, "missing", 7) != 0)
+        goto exit;
+    if (dircache_search_by_did(vol, dir->d_did) != dir)
+        goto exit;
+    if (dircache_search_negative(vol, dir, "missing", 7) != 1)
+        goto exit;
+
+    /* adding the name to the dircache forgets it */
+    st.st_mode = S_IFREG;
+    if ((file = dir_new("missing", "missing", vol, dir->d_did, htonl(did + 1),
+                        bformat("%s/missing", path), &st)) == NULL
+        || dircache_add(vol, file) != 0)
+        goto exit;
+    if (dircache_search_negative(vol, dir, "missing", 7) != 0)
+        goto exit;
+
+    /* a changed parent ctime invalidates the entry, which is removed */
+    dircache_add_negative(vol, dir, "other", 5);
+    if (dircache_search_negative(vol, dir, "other", 5) != 1)
+        goto exit;
+    dir->dcache_ctime--;
+    if (dircache_search_negative(vol, dir, "other", 5) != 0)
+        goto exit;
+    dir->dcache_ctime++;
+    if (dircache_search_negative(vol, dir, "other", 5) != 0)
+        goto exit;
+
+    /* the oldest entries are dropped */
+    for (i = 0; i < negsize + 10; i++) {
+        sprintf(name, "neg%04d", i);
+        dircache_add_negative(vol, dir, name, strlen(name));
+    }
+    if (dircache_search_negative(vol, dir, "neg0000", 7) != 0
+        || dircache_search_negative(vol, dir, name, strlen(name)) != 1)
+        goto exit;
+    ret = 0;
+
+exit:
+    rmdir(path);
+    return ret;
+}
+
+/*!
+ * Shared CNID cache: hits need a matching stat, removed entries are gone, and readers
+ * never see a slot that a concurrent writer has only half updated
+ */
+int test007_shmcache(const struct vol *vol)
+{
+    struct vol shvol = *vol;
+    struct stat sta, stb;
+    char buf[SHMCACHE_NAMELEN + 1];
+    cnid_t id, did = htonl(1000), cnid = htonl(1001);
+    ino_t ino;
+    pid_t pid;
+    int i, status, hits = 0;
+
+    /* only used for volumes with a shared database */
+    shvol.v_cnidscheme = "dbd";
+    if (shvol.v_cdb == NULL || shmcache_init(64) != 0)
+        return -1;
+
+    memset(&sta, 0, sizeof(sta));
+    sta.st_ino = 1;
+    sta.st_ctime = 1;
+    stb = sta;
+    stb.st_ino = 2;
+
+    shmcache_add(&shvol, &sta, did, "alpha", 5, cnid);
+    if (shmcache_lookup(&shvol, &sta, did, "alpha", 5) != cnid
+        || shmcache_lookup(&shvol, &stb, did, "alpha", 5) != CNID_INVALID
+        || shmcache_lookup(vol, &sta, did, "alpha", 5) != CNID_INVALID)
+        return -1;
+    id = cnid;
+    if (shmcache_resolve(&shvol, &id, buf, sizeof(buf), &ino) == NULL
+        || id != did || ino != 1 || strcmp(buf, "alpha") != 0)
+        return -1;
+    shmcache_remove(&shvol, cnid);
+    id = cnid;
+    if (shmcache_resolve(&shvol, &id, buf, sizeof(buf), &ino) != NULL)
+        return -1;
+
+    /* a writer alternates between two entries for the same CNID, long enough to be
+       preempted in the middle of some updates on a single CPU */
+    if ((pid = fork()) == -1)
+        return -1;
+    if (pid == 0) {
+        for (i = 0; i < 5000000; i++) {
+            if (i & 1)
+                shmcache_add(&shvol, &stb, did, "bravo", 5, cnid);
+            else
+                shmcache_add(&shvol, &sta, did, "alpha", 5, cnid);
+        }
+        _exit(0);
+    }
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        id = cnid;
+        if (shmcache_resolve(&shvol, &id, buf, sizeof(buf), &ino) == NULL)
+            continue;
+        if (id != did
+            || !((ino == 1 && strcmp(buf, "alpha") == 0) || (ino == 2 && strcmp(buf, "bravo") == 0))) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            return -1;
+        }
+        hits++;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    id = cnid;
+    if (shmcache_resolve(&shvol, &id, buf, sizeof(buf), &ino) == NULL
+        || ino != 2 || strcmp(buf, "bravo") != 0)
+        return -1;
+    return 0;
+}
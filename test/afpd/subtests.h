@@ -41,4 +41,9 @@
 
 extern int test001_add_x_dirs(const struct vol *vol, cnid_t start, cnid_t end);
 extern int test002_rem_x_dirs(const struct vol *vol, cnid_t start, cnid_t end);
+extern int test003_rhash(uint32_t n);
+extern int test004_slab(void);
+extern int test005_dircache_2q(const struct vol *vol, cnid_t start, unsigned int cachesize);
+extern int test006_dircache_negative(const struct vol *vol, cnid_t did, int negsize);
+extern int test007_shmcache(const struct vol *vol);
 #endif  /* SUBTESTS_H */
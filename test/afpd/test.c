@@ -48,6 +48,8 @@ unsigned char nologin = 0;
 static AFPObj obj;
 #define ARGNUM 3
 static char *args[] = {"test", "-F", "test.conf"};
+#define CACHESIZE 8192
+#define NEGSIZE 64
 /* Static variables */
 
 int main(int argc, char **argv)
@@ -68,7 +70,7 @@ int main(int argc, char **argv)
     TEST_int( configinit(&obj), 0);
     TEST( cnid_init() );
     TEST( load_volumes(&obj) );
-    TEST_int( dircache_init(8192), 0);
+    TEST_int( dircache_init(CACHESIZE, 50, 0, NEGSIZE), 0);
     obj.afp_version = 32;
 
     printf("\n");
@@ -113,4 +115,13 @@ int main(int argc, char **argv)
 
     /* test enumerate.c stuff */
     TEST_int(enumerate(&obj, vid, DIRDID_ROOT), 0);
+
+    /* test the dircache and its building blocks */
+    TEST_int(test003_rhash(20000), 0);
+    TEST_int(test004_slab(), 0);
+    TEST_int(test005_dircache_2q(vol, 100000, CACHESIZE), 0);
+    TEST_int(test006_dircache_negative(vol, 200000, NEGSIZE), 0);
+    TEST_int(test007_shmcache(vol), 0);
+
+    return 0;
 }
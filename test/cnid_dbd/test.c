@@ -0,0 +1,350 @@
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+*/
+
+/*
+ * Runs the cnid_dbd request handlers against a database in a temporary directory,
+ * with the BerkeleyDB backend and, if configured, with LMDB: long names that
+ * exceed the LMDB key size, equal names in different directories, and
+ * CNID_DBD_OP_BATCH requests. Also sends a reply that doesn't fit into the socket
+ * buffer of a non-blocking connection.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include <atalk/logger.h>
+#include <atalk/util.h>
+#include <atalk/cnid_dbd_private.h>
+#include <atalk/volume.h>
+#include <atalk/unicode.h>
+#include <atalk/netatalk_conf.h>
+
+#include "db_param.h"
+#include "comm.h"
+#include "dbif.h"
+#include "dbd.h"
+#include "pack.h"
+
+#define DBOPTIONS (DB_CREATE | DB_INIT_LOG | DB_INIT_MPOOL | DB_INIT_LOCK | DB_INIT_TXN)
+
+/* length of the long names, LMDB keys are at most 511 bytes */
+#define LONGNAME 700
+
+#define TEST(name, cond) do {                                   \
+        printf("Testing: %-60s ", (name));                      \
+        if (cond) {                                             \
+            printf("[ok]\n");                                   \
+        } else {                                                \
+            printf("[error]\n");                                \
+            failed++;                                           \
+        }                                                       \
+    } while (0)
+
+static DBD *dbd;
+static struct cnid_dbd_rply rply;
+static int failed;
+
+/* run a request like cnid_dbd does, returns the result code or -1 on a db error */
+static int request(int op, cnid_t cnid, ino_t ino, cnid_t did, const char *name, size_t len)
+{
+    struct cnid_dbd_rqst rqst;
+    int ret, count = 0;
+
+    memset(&rqst, 0, sizeof(rqst));
+    memset(&rply, 0, sizeof(rply));
+    rqst.op = op;
+    rqst.cnid = cnid;
+    rqst.dev = 42;
+    rqst.ino = ino;
+    rqst.did = htonl(did);
+    rqst.name = name;
+    rqst.namelen = len;
+
+    switch (op) {
+    case CNID_DBD_OP_ADD:
+        ret = dbd_add(dbd, &rqst, &rply);
+        break;
+    case CNID_DBD_OP_GET:
+        ret = dbd_get(dbd, &rqst, &rply);
+        break;
+    case CNID_DBD_OP_RESOLVE:
+        ret = dbd_resolve(dbd, &rqst, &rply);
+        break;
+    case CNID_DBD_OP_LOOKUP:
+        ret = dbd_lookup(dbd, &rqst, &rply);
+        break;
+    case CNID_DBD_OP_UPDATE:
+        ret = dbd_update(dbd, &rqst, &rply);
+        break;
+    case CNID_DBD_OP_DELETE:
+        ret = dbd_delete(dbd, &rqst, &rply, DBIF_CNID);
+        break;
+    case CNID_DBD_OP_SEARCH:
+        ret = dbd_search(dbd, &rqst, &rply);
+        break;
+    case CNID_DBD_OP_BATCH:
+        ret = dbd_batch(dbd, &rqst, &rply, &count);
+        break;
+    default:
+        return -1;
+    }
+
+    if (ret < 0) {
+        dbif_txn_abort(dbd);
+        return -1;
+    }
+    if (ret == 0) {
+        if (dbif_txn_abort(dbd) < 0)
+            return -1;
+    } else if (dbif_txn_commit(dbd) < 0) {
+        return -1;
+    }
+    return rply.result;
+}
+
+/* a name of len bytes, only the last 10 bytes differ between tags */
+static char *longname(char *buf, size_t len, const char *tag)
+{
+    memset(buf, 'a', len);
+    snprintf(buf + len - 10, 11, "tail-%5s", tag);
+    return buf;
+}
+
+static void test_longnames(void)
+{
+    char a[LONGNAME + 1], b[LONGNAME + 1], c[LONGNAME + 1];
+    cnid_t ca, cb;
+
+    longname(a, LONGNAME, "AAAAA");
+    longname(b, LONGNAME, "BBBBB");
+    longname(c, LONGNAME, "CCCCC");
+
+    TEST("add long name A", request(CNID_DBD_OP_ADD, 0, 5001, 2, a, LONGNAME) == 0 && rply.cnid);
+    ca = rply.cnid;
+    TEST("add long name B with the same prefix",
+         request(CNID_DBD_OP_ADD, 0, 5002, 2, b, LONGNAME) == 0 && rply.cnid && rply.cnid != ca);
+    cb = rply.cnid;
+    TEST("add A again", request(CNID_DBD_OP_ADD, 0, 5001, 2, a, LONGNAME) == 0 && rply.cnid == ca);
+    TEST("lookup B", request(CNID_DBD_OP_LOOKUP, 0, 5002, 2, b, LONGNAME) == 0 && rply.cnid == cb);
+    TEST("get A", request(CNID_DBD_OP_GET, 0, 0, 2, a, LONGNAME) == 0 && rply.cnid == ca);
+    TEST("get B", request(CNID_DBD_OP_GET, 0, 0, 2, b, LONGNAME) == 0 && rply.cnid == cb);
+    TEST("get C", request(CNID_DBD_OP_GET, 0, 0, 2, c, LONGNAME) == CNID_DBD_RES_NOTFOUND);
+    TEST("resolve B", request(CNID_DBD_OP_RESOLVE, cb, 0, 0, NULL, 0) == 0
+         && rply.namelen == CNID_NAME_OFS + LONGNAME + 1
+         && memcmp(rply.name + CNID_NAME_OFS, b, LONGNAME + 1) == 0);
+
+    TEST("delete A", request(CNID_DBD_OP_DELETE, ca, 0, 0, NULL, 0) == 0);
+    TEST("get deleted A", request(CNID_DBD_OP_GET, 0, 0, 2, a, LONGNAME) == CNID_DBD_RES_NOTFOUND);
+    TEST("get B after deleting A", request(CNID_DBD_OP_GET, 0, 0, 2, b, LONGNAME) == 0 && rply.cnid == cb);
+    TEST("delete A again", request(CNID_DBD_OP_DELETE, ca, 0, 0, NULL, 0) == CNID_DBD_RES_NOTFOUND);
+
+    TEST("update B to a short name", request(CNID_DBD_OP_UPDATE, cb, 5002, 2, "shortname", 9) == 0);
+    TEST("get the new name", request(CNID_DBD_OP_GET, 0, 0, 2, "shortname", 9) == 0 && rply.cnid == cb);
+    TEST("get the old name", request(CNID_DBD_OP_GET, 0, 0, 2, b, LONGNAME) == CNID_DBD_RES_NOTFOUND);
+    TEST("update back to the long name", request(CNID_DBD_OP_UPDATE, cb, 5002, 2, b, LONGNAME) == 0);
+    TEST("get the long name", request(CNID_DBD_OP_GET, 0, 0, 2, b, LONGNAME) == 0 && rply.cnid == cb);
+}
+
+static void test_duplicates(void)
+{
+    char d[LONGNAME + 1];
+    cnid_t c2, c3;
+
+    longname(d, LONGNAME, "DDDDD");
+    memcpy(d, "Searchme", 8);
+
+    TEST("add long name D in DID 2", request(CNID_DBD_OP_ADD, 0, 6002, 2, d, LONGNAME) == 0 && rply.cnid);
+    c2 = rply.cnid;
+    TEST("add long name D in DID 3",
+         request(CNID_DBD_OP_ADD, 0, 6003, 3, d, LONGNAME) == 0 && rply.cnid && rply.cnid != c2);
+    c3 = rply.cnid;
+    TEST("add short name in DID 2", request(CNID_DBD_OP_ADD, 0, 6004, 2, "searchme", 8) == 0);
+    TEST("add short name in DID 3", request(CNID_DBD_OP_ADD, 0, 6005, 3, "searchme", 8) == 0);
+
+    TEST("get D in DID 2", request(CNID_DBD_OP_GET, 0, 0, 2, d, LONGNAME) == 0 && rply.cnid == c2);
+    TEST("get D in DID 3", request(CNID_DBD_OP_GET, 0, 0, 3, d, LONGNAME) == 0 && rply.cnid == c3);
+    TEST("search finds all four",
+         request(CNID_DBD_OP_SEARCH, 0, 0, 0, "searchme", 8) == 0 && rply.namelen == 4 * sizeof(cnid_t));
+
+    TEST("delete D in DID 2", request(CNID_DBD_OP_DELETE, c2, 0, 0, NULL, 0) == 0);
+    TEST("get D in DID 3 after the delete",
+         request(CNID_DBD_OP_GET, 0, 0, 3, d, LONGNAME) == 0 && rply.cnid == c3);
+    TEST("search finds the other three",
+         request(CNID_DBD_OP_SEARCH, 0, 0, 0, "searchme", 8) == 0 && rply.namelen == 3 * sizeof(cnid_t));
+}
+
+/* append a batch item like the client in libatalk/cnid/dbd does */
+static size_t batch_item(char *buf, size_t off, int op, ino_t ino, cnid_t did, const char *name, size_t len)
+{
+    struct cnid_dbd_rqst item;
+
+    memset(&item, 0, sizeof(item));
+    item.op = op;
+    item.dev = 42;
+    item.ino = ino;
+    item.did = htonl(did);
+    item.namelen = len;
+    memcpy(buf + off, &item, sizeof(item));
+    memcpy(buf + off + sizeof(item), name, len);
+    return off + sizeof(item) + len;
+}
+
+static void test_batch(void)
+{
+    static char buf[CNID_DBD_BATCH_BUFSIZ];
+    struct cnid_dbd_rply res[4];
+    char e[LONGNAME + 1];
+    cnid_t c0;
+    size_t len = 0;
+
+    longname(e, LONGNAME, "EEEEE");
+    TEST("add a name for the batch", request(CNID_DBD_OP_ADD, 0, 7000, 2, "batch0", 6) == 0 && rply.cnid);
+    c0 = rply.cnid;
+
+    len = batch_item(buf, len, CNID_DBD_OP_LOOKUP, 7000, 2, "batch0", 6);
+    len = batch_item(buf, len, CNID_DBD_OP_ADD, 7001, 2, "batch1", 6);
+    len = batch_item(buf, len, CNID_DBD_OP_LOOKUP, 7002, 2, "missing", 7);
+    len = batch_item(buf, len, CNID_DBD_OP_ADD, 7003, 2, e, LONGNAME);
+
+    TEST("batch of 4", request(CNID_DBD_OP_BATCH, 4, 0, 0, buf, len) == 0
+         && rply.cnid == 4 && rply.namelen == sizeof(res));
+    memcpy(res, rply.name, sizeof(res));
+    TEST("batch lookup of an existing name", res[0].result == 0 && res[0].cnid == c0);
+    TEST("batch add", res[1].result == 0 && res[1].cnid);
+    TEST("batch lookup of a missing name", res[2].result == CNID_DBD_RES_NOTFOUND);
+    TEST("batch add of a long name", res[3].result == 0 && res[3].cnid);
+    TEST("get the batch added name",
+         request(CNID_DBD_OP_GET, 0, 0, 2, "batch1", 6) == 0 && rply.cnid == res[1].cnid);
+    TEST("get the batch added long name",
+         request(CNID_DBD_OP_GET, 0, 0, 2, e, LONGNAME) == 0 && rply.cnid == res[3].cnid);
+
+    TEST("batch with too many items",
+         request(CNID_DBD_OP_BATCH, CNID_BATCH_MAX + 1, 0, 0, buf, len) == CNID_DBD_RES_ERR_DB);
+    TEST("truncated batch", request(CNID_DBD_OP_BATCH, 4, 0, 0, buf, len - 1) == CNID_DBD_RES_ERR_DB);
+    len = batch_item(buf, 0, CNID_DBD_OP_DELETE, 7001, 2, "batch1", 6);
+    TEST("batch with a delete", request(CNID_DBD_OP_BATCH, 1, 0, 0, buf, len) == CNID_DBD_RES_ERR_DB);
+    TEST("the delete was not run",
+         request(CNID_DBD_OP_GET, 0, 0, 2, "batch1", 6) == 0 && rply.cnid == res[1].cnid);
+}
+
+/* the client reads the reply slowly, comm_snd_fd() has to wait for it */
+static void test_send(void)
+{
+    static char name[256 * 1024], got[sizeof(name)];
+    struct cnid_dbd_rply r;
+    size_t n, i;
+    ssize_t len;
+    int sv[2], sndbuf = 4096, status;
+    pid_t pid;
+
+    for (i = 0; i < sizeof(name); i++)
+        name[i] = i % 251;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0
+        || setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) != 0
+        || setnonblock(sv[0], 1) != 0
+        || (pid = fork()) < 0) {
+        TEST("setting up a connection", 0);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        usleep(100000);
+        for (n = 0; n < sizeof(r); n += len)
+            if ((len = read(sv[1], (char *)&r + n, sizeof(r) - n)) <= 0)
+                _exit(1);
+        for (n = 0; n < sizeof(got); n += len)
+            if ((len = read(sv[1], got + n, sizeof(got) - n)) <= 0)
+                _exit(1);
+        _exit(r.namelen == sizeof(name) && memcmp(got, name, sizeof(name)) == 0 ? 0 : 1);
+    }
+    close(sv[1]);
+
+    memset(&r, 0, sizeof(r));
+    r.result = CNID_DBD_RES_OK;
+    r.name = name;
+    r.namelen = sizeof(name);
+    TEST("a reply larger than the socket buffer is sent", comm_snd_fd(sv[0], &r) == 1);
+    close(sv[0]);
+    TEST("the client got all of it",
+         waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static int run(const char *backend)
+{
+    char dir[] = "/tmp/cnid_dbd_test.XXXXXX", path[MAXPATHLEN];
+    struct db_param *dbp;
+    FILE *fp;
+
+    printf("\nBackend %s\n============\n", backend);
+
+    if (mkdtemp(dir) == NULL)
+        return -1;
+    snprintf(path, sizeof(path), "%s/db_param", dir);
+    if ((fp = fopen(path, "w")) == NULL)
+        return -1;
+    fprintf(fp, "backend %s\n", backend);
+    fclose(fp);
+
+    if ((dbp = db_param_read(dir)) == NULL
+        || (dbd = dbif_init(dir, dbp->backend == DBP_BACKEND_LMDB ? LMDB_FILENAME : "cnid2.db")) == NULL
+        || dbif_env_open(dbd, dbp, DBOPTIONS | DB_RECOVER) < 0
+        || dbif_open(dbd, dbp, 0) < 0) {
+        printf("Opening the %s database in %s failed\n", backend, dir);
+        return -1;
+    }
+
+    test_longnames();
+    test_duplicates();
+    test_batch();
+
+    dbif_close(dbd);
+    snprintf(path, sizeof(path), "rm -rf %s", dir);
+    system(path);
+    return 0;
+}
+
+int main(void)
+{
+    static struct vol vol;
+
+    setuplog("default:error", "/dev/stderr");
+
+    /* the name index folds case with the volume charsets, cf afp_config_parse() */
+    set_charset_name(CH_UNIX, "UTF8");
+    set_charset_name(CH_MAC, "MAC_ROMAN");
+    vol.v_volcodepage = "UTF8";
+    vol.v_maccodepage = "MAC_ROMAN";
+    if (load_charset(&vol) != 0)
+        return 1;
+    pack_setvol(&vol);
+
+    test_send();
+
+    if (run("bdb") != 0)
+        return 1;
+#ifdef HAVE_LMDB
+    if (run("lmdb") != 0)
+        return 1;
+#endif
+
+    return failed ? 1 : 0;
+}